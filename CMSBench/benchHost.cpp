@@ -0,0 +1,880 @@
+#include "benchHost.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+namespace CMSBench {
+
+static thread_local unsigned int tls_threadIndex = 0;
+static thread_local bool tls_spawnedThread = false;
+
+////////////////////////////////////////////////////////////////////////////////
+// Thread pool
+
+BenchThreadPool::BenchThreadPool(unsigned int nThreads) : _nThreads(std::max(1u, nThreads))
+{
+    for (unsigned int i = 1; i < _nThreads; ++i){
+        _workers.emplace_back(&BenchThreadPool::workerLoop, this);
+    }
+}
+
+BenchThreadPool::~BenchThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _quit = true;
+    }
+    _wake.notify_all();
+    for (std::thread& t : _workers){
+        t.join();
+    }
+}
+
+unsigned int BenchThreadPool::threadIndex()
+{
+    return tls_threadIndex;
+}
+
+bool BenchThreadPool::isSpawnedThread()
+{
+    return tls_spawnedThread;
+}
+
+void BenchThreadPool::workerLoop()
+{
+    tls_spawnedThread = true;
+    unsigned long seen = 0;
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;){
+        _wake.wait(lock, [&]{ return _quit || _generation != seen; });
+        if (_quit){
+            return;
+        }
+        seen = _generation;
+        ++_pending;
+        lock.unlock();
+
+        // The job description is stable until every index has been claimed
+        // and _pending dropped back to zero.
+        for (unsigned int i; (i = _next++) < _jobThreads; ){
+            tls_threadIndex = i;
+            _func(i, _jobThreads, _arg);
+        }
+
+        lock.lock();
+        if (--_pending == 0){
+            _done.notify_all();
+        }
+    }
+}
+
+OfxStatus BenchThreadPool::run(OfxThreadFunctionV1 func, unsigned int nThreads, void* customArg)
+{
+    if (!func){
+        return kOfxStatFailed;
+    }
+    if (nThreads == 0){
+        nThreads = _nThreads;
+    }
+
+    const unsigned int savedIndex = tls_threadIndex;
+    if (nThreads == 1 || _workers.empty() || tls_spawnedThread){
+        // Nested calls (or a single CPU) are run serially on the calling thread
+        for (unsigned int i = 0; i < nThreads; ++i){
+            tls_threadIndex = i;
+            func(i, nThreads, customArg);
+        }
+        tls_threadIndex = savedIndex;
+        return kOfxStatOK;
+    }
+
+    // Frames rendered concurrently do not wait for each other: if the pool
+    // is already busy the job runs on the calling thread.
+    std::unique_lock<std::mutex> runLock(_runMutex, std::try_to_lock);
+    if (!runLock.owns_lock()){
+        for (unsigned int i = 0; i < nThreads; ++i){
+            tls_threadIndex = i;
+            func(i, nThreads, customArg);
+        }
+        tls_threadIndex = savedIndex;
+        return kOfxStatOK;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _func = func;
+        _arg = customArg;
+        _jobThreads = nThreads;
+        _next = 0;
+        ++_generation;
+    }
+    _wake.notify_all();
+
+    tls_spawnedThread = true;
+    for (unsigned int i; (i = _next++) < nThreads; ){
+        tls_threadIndex = i;
+        func(i, nThreads, customArg);
+    }
+    tls_spawnedThread = false;
+    tls_threadIndex = savedIndex;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _done.wait(lock, [&]{ return _pending == 0; });
+    return kOfxStatOK;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Host
+
+BenchHost::BenchHost(const BenchProject& project, unsigned int nThreads) : _project(project), _pool(nThreads)
+{
+    _properties.setIntProperty(kOfxPropAPIVersion, 1, 0);
+    _properties.setIntProperty(kOfxPropAPIVersion, 4, 1);
+    _properties.setStringProperty(kOfxPropName, "net.sf.openfx.CMSBench");
+    _properties.setStringProperty(kOfxPropLabel, "CMS Bench");
+    _properties.setIntProperty(kOfxPropVersion, 1, 0);
+    _properties.setIntProperty(kOfxPropVersion, 0, 1);
+    _properties.setStringProperty(kOfxPropVersionLabel, "1.0");
+    _properties.setIntProperty(kOfxImageEffectHostPropIsBackground, 1);
+    _properties.setIntProperty(kOfxImageEffectPropSupportsOverlays, 0);
+    _properties.setIntProperty(kOfxImageEffectPropSupportsMultiResolution, 1);
+    _properties.setIntProperty(kOfxImageEffectPropSupportsTiles, 1);
+    _properties.setIntProperty(kOfxImageEffectPropTemporalClipAccess, 1);
+    _properties.setStringProperty(kOfxImageEffectPropSupportedComponents, kOfxImageComponentRGBA, 0);
+    _properties.setStringProperty(kOfxImageEffectPropSupportedContexts, kOfxImageEffectContextGenerator, 0);
+    _properties.setStringProperty(kOfxImageEffectPropSupportedContexts, kOfxImageEffectContextFilter, 1);
+    _properties.setStringProperty(kOfxImageEffectPropSupportedContexts, kOfxImageEffectContextGeneral, 2);
+    _properties.setStringProperty(kOfxImageEffectPropSupportedContexts, kOfxImageEffectContextReader, 3);
+    _properties.setStringProperty(kOfxImageEffectPropSupportedPixelDepths, kOfxBitDepthFloat, 0);
+    _properties.setIntProperty(kOfxImageEffectPropSupportsMultipleClipDepths, 0);
+    _properties.setIntProperty(kOfxImageEffectPropSupportsMultipleClipPARs, 0);
+    _properties.setIntProperty(kOfxImageEffectPropSetableFrameRate, 0);
+    _properties.setIntProperty(kOfxImageEffectPropSetableFielding, 0);
+    _properties.setIntProperty(kOfxParamHostPropSupportsCustomInteract, 0);
+    _properties.setIntProperty(kOfxParamHostPropSupportsStringAnimation, 0);
+    _properties.setIntProperty(kOfxParamHostPropSupportsChoiceAnimation, 0);
+    _properties.setIntProperty(kOfxParamHostPropSupportsBooleanAnimation, 0);
+    _properties.setIntProperty(kOfxParamHostPropSupportsCustomAnimation, 0);
+    _properties.setIntProperty(kOfxParamHostPropMaxParameters, -1);
+    _properties.setIntProperty(kOfxParamHostPropMaxPages, 0);
+    _properties.setIntProperty(kOfxParamHostPropPageRowColumnCount, 0, 0);
+    _properties.setIntProperty(kOfxParamHostPropPageRowColumnCount, 0, 1);
+}
+
+OFX::Host::ImageEffect::Instance* BenchHost::newInstance(void* /*clientData*/,
+                                                         OFX::Host::ImageEffect::ImageEffectPlugin* plugin,
+                                                         OFX::Host::ImageEffect::Descriptor& desc,
+                                                         const std::string& context)
+{
+    return new BenchEffectInstance(this, plugin, desc, context);
+}
+
+OFX::Host::ImageEffect::Descriptor* BenchHost::makeDescriptor(OFX::Host::ImageEffect::ImageEffectPlugin* plugin)
+{
+    return new OFX::Host::ImageEffect::Descriptor(plugin);
+}
+
+OFX::Host::ImageEffect::Descriptor* BenchHost::makeDescriptor(const OFX::Host::ImageEffect::Descriptor& rootContext,
+                                                              OFX::Host::ImageEffect::ImageEffectPlugin* plugin)
+{
+    return new OFX::Host::ImageEffect::Descriptor(rootContext, plugin);
+}
+
+OFX::Host::ImageEffect::Descriptor* BenchHost::makeDescriptor(const std::string& bundlePath,
+                                                              OFX::Host::ImageEffect::ImageEffectPlugin* plugin)
+{
+    return new OFX::Host::ImageEffect::Descriptor(bundlePath, plugin);
+}
+
+static OfxStatus printMessage(const char* type, const char* id, const char* format, va_list args)
+{
+    fprintf(stderr, "[%s] %s: ", type ? type : "", id ? id : "");
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    if (type && strcmp(type, kOfxMessageQuestion) == 0){
+        return kOfxStatReplyYes;
+    }
+    return kOfxStatOK;
+}
+
+OfxStatus BenchHost::vmessage(const char* type, const char* id, const char* format, va_list args)
+{
+    return printMessage(type, id, format, args);
+}
+
+OfxStatus BenchHost::setPersistentMessage(const char* type, const char* id, const char* format, va_list args)
+{
+    return printMessage(type, id, format, args);
+}
+
+OfxStatus BenchHost::clearPersistentMessage()
+{
+    return kOfxStatOK;
+}
+
+OfxStatus BenchHost::multiThread(OfxThreadFunctionV1 func, unsigned int nThreads, void* customArg)
+{
+    return _pool.run(func, nThreads, customArg);
+}
+
+OfxStatus BenchHost::multiThreadNumCPUS(unsigned int* nCPUs) const
+{
+    *nCPUs = _pool.size();
+    return kOfxStatOK;
+}
+
+OfxStatus BenchHost::multiThreadIndex(unsigned int* threadIndex) const
+{
+    *threadIndex = BenchThreadPool::threadIndex();
+    return kOfxStatOK;
+}
+
+int BenchHost::multiThreadIsSpawnedThread() const
+{
+    return BenchThreadPool::isSpawnedThread();
+}
+
+OfxStatus BenchHost::mutexCreate(OfxMutexHandle* mutex, int lockCount)
+{
+    std::recursive_mutex* m = new std::recursive_mutex;
+    for (int i = 0; i < lockCount; ++i){
+        m->lock();
+    }
+    *mutex = reinterpret_cast<OfxMutexHandle>(m);
+    return kOfxStatOK;
+}
+
+OfxStatus BenchHost::mutexDestroy(const OfxMutexHandle mutex)
+{
+    delete reinterpret_cast<std::recursive_mutex*>(mutex);
+    return kOfxStatOK;
+}
+
+OfxStatus BenchHost::mutexLock(const OfxMutexHandle mutex)
+{
+    reinterpret_cast<std::recursive_mutex*>(mutex)->lock();
+    return kOfxStatOK;
+}
+
+OfxStatus BenchHost::mutexUnLock(const OfxMutexHandle mutex)
+{
+    reinterpret_cast<std::recursive_mutex*>(mutex)->unlock();
+    return kOfxStatOK;
+}
+
+OfxStatus BenchHost::mutexTryLock(const OfxMutexHandle mutex)
+{
+    return reinterpret_cast<std::recursive_mutex*>(mutex)->try_lock() ? kOfxStatOK : kOfxStatFailed;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Parameters
+//
+// Values live in the instance, initialised from the descriptor defaults.
+// Animation is not supported: the time variants return the static value.
+
+namespace {
+
+template <class T> T defaultValue(const OFX::Host::Property::Set& props, int index);
+
+template <> int defaultValue<int>(const OFX::Host::Property::Set& props, int index)
+{
+    return props.getIntProperty(kOfxParamPropDefault, index);
+}
+
+template <> bool defaultValue<bool>(const OFX::Host::Property::Set& props, int index)
+{
+    return props.getIntProperty(kOfxParamPropDefault, index) != 0;
+}
+
+template <> double defaultValue<double>(const OFX::Host::Property::Set& props, int index)
+{
+    return props.getDoubleProperty(kOfxParamPropDefault, index);
+}
+
+template <class Base, class T, int N>
+class BenchParam : public Base
+{
+public:
+    BenchParam(OFX::Host::Param::Descriptor& descriptor, OFX::Host::Param::SetInstance* instance)
+        : Base(descriptor, instance)
+    {
+        for (int i = 0; i < N; ++i){
+            _v[i] = defaultValue<T>(this->getProperties(), i);
+        }
+    }
+
+protected:
+    T _v[N];
+};
+
+class BenchIntegerParam : public BenchParam<OFX::Host::Param::IntegerInstance, int, 1>
+{
+public:
+    using BenchParam::BenchParam;
+    OfxStatus get(int& v) { v = _v[0]; return kOfxStatOK; }
+    OfxStatus get(OfxTime, int& v) { return get(v); }
+    OfxStatus set(int v) { _v[0] = v; return kOfxStatOK; }
+    OfxStatus set(OfxTime, int v) { return set(v); }
+};
+
+class BenchChoiceParam : public BenchParam<OFX::Host::Param::ChoiceInstance, int, 1>
+{
+public:
+    using BenchParam::BenchParam;
+    OfxStatus get(int& v) { v = _v[0]; return kOfxStatOK; }
+    OfxStatus get(OfxTime, int& v) { return get(v); }
+    OfxStatus set(int v) { _v[0] = v; return kOfxStatOK; }
+    OfxStatus set(OfxTime, int v) { return set(v); }
+};
+
+class BenchBooleanParam : public BenchParam<OFX::Host::Param::BooleanInstance, bool, 1>
+{
+public:
+    using BenchParam::BenchParam;
+    OfxStatus get(bool& v) { v = _v[0]; return kOfxStatOK; }
+    OfxStatus get(OfxTime, bool& v) { return get(v); }
+    OfxStatus set(bool v) { _v[0] = v; return kOfxStatOK; }
+    OfxStatus set(OfxTime, bool v) { return set(v); }
+};
+
+class BenchDoubleParam : public BenchParam<OFX::Host::Param::DoubleInstance, double, 1>
+{
+public:
+    using BenchParam::BenchParam;
+    OfxStatus get(double& v) { v = _v[0]; return kOfxStatOK; }
+    OfxStatus get(OfxTime, double& v) { return get(v); }
+    OfxStatus set(double v) { _v[0] = v; return kOfxStatOK; }
+    OfxStatus set(OfxTime, double v) { return set(v); }
+    OfxStatus derive(OfxTime, double& v) { v = 0.; return kOfxStatOK; }
+    OfxStatus integrate(OfxTime t1, OfxTime t2, double& v) { v = _v[0] * (t2 - t1); return kOfxStatOK; }
+};
+
+class BenchRGBAParam : public BenchParam<OFX::Host::Param::RGBAInstance, double, 4>
+{
+public:
+    using BenchParam::BenchParam;
+    OfxStatus get(double& r, double& g, double& b, double& a) { r = _v[0]; g = _v[1]; b = _v[2]; a = _v[3]; return kOfxStatOK; }
+    OfxStatus get(OfxTime, double& r, double& g, double& b, double& a) { return get(r, g, b, a); }
+    OfxStatus set(double r, double g, double b, double a) { _v[0] = r; _v[1] = g; _v[2] = b; _v[3] = a; return kOfxStatOK; }
+    OfxStatus set(OfxTime, double r, double g, double b, double a) { return set(r, g, b, a); }
+};
+
+class BenchRGBParam : public BenchParam<OFX::Host::Param::RGBInstance, double, 3>
+{
+public:
+    using BenchParam::BenchParam;
+    OfxStatus get(double& r, double& g, double& b) { r = _v[0]; g = _v[1]; b = _v[2]; return kOfxStatOK; }
+    OfxStatus get(OfxTime, double& r, double& g, double& b) { return get(r, g, b); }
+    OfxStatus set(double r, double g, double b) { _v[0] = r; _v[1] = g; _v[2] = b; return kOfxStatOK; }
+    OfxStatus set(OfxTime, double r, double g, double b) { return set(r, g, b); }
+};
+
+class BenchDouble2DParam : public BenchParam<OFX::Host::Param::Double2DInstance, double, 2>
+{
+public:
+    using BenchParam::BenchParam;
+    OfxStatus get(double& x, double& y) { x = _v[0]; y = _v[1]; return kOfxStatOK; }
+    OfxStatus get(OfxTime, double& x, double& y) { return get(x, y); }
+    OfxStatus set(double x, double y) { _v[0] = x; _v[1] = y; return kOfxStatOK; }
+    OfxStatus set(OfxTime, double x, double y) { return set(x, y); }
+};
+
+class BenchInteger2DParam : public BenchParam<OFX::Host::Param::Integer2DInstance, int, 2>
+{
+public:
+    using BenchParam::BenchParam;
+    OfxStatus get(int& x, int& y) { x = _v[0]; y = _v[1]; return kOfxStatOK; }
+    OfxStatus get(OfxTime, int& x, int& y) { return get(x, y); }
+    OfxStatus set(int x, int y) { _v[0] = x; _v[1] = y; return kOfxStatOK; }
+    OfxStatus set(OfxTime, int x, int y) { return set(x, y); }
+};
+
+class BenchDouble3DParam : public BenchParam<OFX::Host::Param::Double3DInstance, double, 3>
+{
+public:
+    using BenchParam::BenchParam;
+    OfxStatus get(double& x, double& y, double& z) { x = _v[0]; y = _v[1]; z = _v[2]; return kOfxStatOK; }
+    OfxStatus get(OfxTime, double& x, double& y, double& z) { return get(x, y, z); }
+    OfxStatus set(double x, double y, double z) { _v[0] = x; _v[1] = y; _v[2] = z; return kOfxStatOK; }
+    OfxStatus set(OfxTime, double x, double y, double z) { return set(x, y, z); }
+};
+
+class BenchInteger3DParam : public BenchParam<OFX::Host::Param::Integer3DInstance, int, 3>
+{
+public:
+    using BenchParam::BenchParam;
+    OfxStatus get(int& x, int& y, int& z) { x = _v[0]; y = _v[1]; z = _v[2]; return kOfxStatOK; }
+    OfxStatus get(OfxTime, int& x, int& y, int& z) { return get(x, y, z); }
+    OfxStatus set(int x, int y, int z) { _v[0] = x; _v[1] = y; _v[2] = z; return kOfxStatOK; }
+    OfxStatus set(OfxTime, int x, int y, int z) { return set(x, y, z); }
+};
+
+template <class Base>
+class BenchStringParamT : public Base
+{
+public:
+    BenchStringParamT(OFX::Host::Param::Descriptor& descriptor, OFX::Host::Param::SetInstance* instance)
+        : Base(descriptor, instance), _v(this->getProperties().getStringProperty(kOfxParamPropDefault))
+    {}
+    OfxStatus get(std::string& v) { v = _v; return kOfxStatOK; }
+    OfxStatus get(OfxTime, std::string& v) { return get(v); }
+    OfxStatus set(const char* v) { _v = v ? v : ""; return kOfxStatOK; }
+    OfxStatus set(OfxTime, const char* v) { return set(v); }
+
+private:
+    std::string _v;
+};
+
+typedef BenchStringParamT<OFX::Host::Param::StringInstance> BenchStringParam;
+typedef BenchStringParamT<OFX::Host::Param::CustomInstance> BenchCustomParam;
+
+bool parseBool(const std::string& s)
+{
+    if (s == "true" || s == "on" || s == "yes"){
+        return true;
+    }
+    if (s == "false" || s == "off" || s == "no"){
+        return false;
+    }
+    return std::stoi(s) != 0;
+}
+
+} // anonymous namespace
+
+bool setParamFromStrings(OFX::Host::Param::Instance* param, const std::vector<std::string>& v)
+{
+    using namespace OFX::Host::Param;
+    if (!param || v.empty()){
+        return false;
+    }
+
+    try {
+        if (IntegerInstance* p = dynamic_cast<IntegerInstance*>(param)){
+            return p->set(std::stoi(v[0])) == kOfxStatOK;
+        }
+        if (DoubleInstance* p = dynamic_cast<DoubleInstance*>(param)){
+            return p->set(std::stod(v[0])) == kOfxStatOK;
+        }
+        if (BooleanInstance* p = dynamic_cast<BooleanInstance*>(param)){
+            return p->set(parseBool(v[0])) == kOfxStatOK;
+        }
+        if (ChoiceInstance* p = dynamic_cast<ChoiceInstance*>(param)){
+            // Accept the option index, its label or its enum identifier
+            const OFX::Host::Property::Set& props = param->getProperties();
+            const char* names[] = {kOfxParamPropChoiceOption, kOfxParamPropChoiceEnum};
+            for (const char* name : names){
+                int n = props.getDimension(name);
+                for (int i = 0; i < n; ++i){
+                    if (props.getStringProperty(name, i) == v[0]){
+                        return p->set(i) == kOfxStatOK;
+                    }
+                }
+            }
+            return p->set(std::stoi(v[0])) == kOfxStatOK;
+        }
+        if (StringInstance* p = dynamic_cast<StringInstance*>(param)){
+            return p->set(v[0].c_str()) == kOfxStatOK;
+        }
+        if (RGBAInstance* p = dynamic_cast<RGBAInstance*>(param)){
+            if (v.size() < 3){
+                return false;
+            }
+            return p->set(std::stod(v[0]), std::stod(v[1]), std::stod(v[2]), v.size() > 3 ? std::stod(v[3]) : 1.) == kOfxStatOK;
+        }
+        if (RGBInstance* p = dynamic_cast<RGBInstance*>(param)){
+            return v.size() >= 3 && p->set(std::stod(v[0]), std::stod(v[1]), std::stod(v[2])) == kOfxStatOK;
+        }
+        if (Double2DInstance* p = dynamic_cast<Double2DInstance*>(param)){
+            return v.size() >= 2 && p->set(std::stod(v[0]), std::stod(v[1])) == kOfxStatOK;
+        }
+        if (Integer2DInstance* p = dynamic_cast<Integer2DInstance*>(param)){
+            return v.size() >= 2 && p->set(std::stoi(v[0]), std::stoi(v[1])) == kOfxStatOK;
+        }
+        if (Double3DInstance* p = dynamic_cast<Double3DInstance*>(param)){
+            return v.size() >= 3 && p->set(std::stod(v[0]), std::stod(v[1]), std::stod(v[2])) == kOfxStatOK;
+        }
+        if (Integer3DInstance* p = dynamic_cast<Integer3DInstance*>(param)){
+            return v.size() >= 3 && p->set(std::stoi(v[0]), std::stoi(v[1]), std::stoi(v[2])) == kOfxStatOK;
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Effect instance
+
+BenchEffectInstance::BenchEffectInstance(BenchHost* host,
+                                         OFX::Host::ImageEffect::ImageEffectPlugin* plugin,
+                                         OFX::Host::ImageEffect::Descriptor& desc,
+                                         const std::string& context)
+    : OFX::Host::ImageEffect::Instance(plugin, desc, context, false)
+    , _host(host)
+{
+    _outputRoD.x1 = _outputRoD.y1 = 0.;
+    _outputRoD.x2 = host->project().width;
+    _outputRoD.y2 = host->project().height;
+    _time = host->project().firstFrame;
+}
+
+const BenchImage* BenchEffectInstance::lastOutputImage() const
+{
+    BenchClipInstance* clip = dynamic_cast<BenchClipInstance*>(getClip(kOfxImageEffectOutputClipName));
+    return clip ? clip->threadImage() : NULL;
+}
+
+OFX::Host::ImageEffect::ClipInstance* BenchEffectInstance::newClipInstance(OFX::Host::ImageEffect::Instance* /*plugin*/,
+                                                                           OFX::Host::ImageEffect::ClipDescriptor* descriptor,
+                                                                           int /*index*/)
+{
+    return new BenchClipInstance(this, descriptor);
+}
+
+const std::string& BenchEffectInstance::getDefaultOutputFielding() const
+{
+    static const std::string v(kOfxImageFieldNone);
+    return v;
+}
+
+OfxStatus BenchEffectInstance::vmessage(const char* type, const char* id, const char* format, va_list args)
+{
+    return printMessage(type, id, format, args);
+}
+
+OfxStatus BenchEffectInstance::setPersistentMessage(const char* type, const char* id, const char* format, va_list args)
+{
+    return printMessage(type, id, format, args);
+}
+
+OfxStatus BenchEffectInstance::clearPersistentMessage()
+{
+    return kOfxStatOK;
+}
+
+void BenchEffectInstance::getProjectSize(double& xSize, double& ySize) const
+{
+    xSize = project().width;
+    ySize = project().height;
+}
+
+void BenchEffectInstance::getProjectOffset(double& xOffset, double& yOffset) const
+{
+    xOffset = yOffset = 0.;
+}
+
+void BenchEffectInstance::getProjectExtent(double& xSize, double& ySize) const
+{
+    getProjectSize(xSize, ySize);
+}
+
+double BenchEffectInstance::getProjectPixelAspectRatio() const
+{
+    return 1.;
+}
+
+double BenchEffectInstance::getEffectDuration() const
+{
+    return project().lastFrame - project().firstFrame + 1.;
+}
+
+double BenchEffectInstance::getFrameRate() const
+{
+    return project().fps;
+}
+
+double BenchEffectInstance::getFrameRecursive() const
+{
+    return _time;
+}
+
+void BenchEffectInstance::getRenderScaleRecursive(double& x, double& y) const
+{
+    x = y = project().renderScale;
+}
+
+OFX::Host::Param::Instance* BenchEffectInstance::newParam(const std::string& /*name*/, OFX::Host::Param::Descriptor& descriptor)
+{
+    const std::string& type = descriptor.getType();
+    if (type == kOfxParamTypeInteger)
+        return new BenchIntegerParam(descriptor, this);
+    if (type == kOfxParamTypeDouble)
+        return new BenchDoubleParam(descriptor, this);
+    if (type == kOfxParamTypeBoolean)
+        return new BenchBooleanParam(descriptor, this);
+    if (type == kOfxParamTypeChoice)
+        return new BenchChoiceParam(descriptor, this);
+    if (type == kOfxParamTypeRGBA)
+        return new BenchRGBAParam(descriptor, this);
+    if (type == kOfxParamTypeRGB)
+        return new BenchRGBParam(descriptor, this);
+    if (type == kOfxParamTypeDouble2D)
+        return new BenchDouble2DParam(descriptor, this);
+    if (type == kOfxParamTypeInteger2D)
+        return new BenchInteger2DParam(descriptor, this);
+    if (type == kOfxParamTypeDouble3D)
+        return new BenchDouble3DParam(descriptor, this);
+    if (type == kOfxParamTypeInteger3D)
+        return new BenchInteger3DParam(descriptor, this);
+    if (type == kOfxParamTypeString)
+        return new BenchStringParam(descriptor, this);
+    if (type == kOfxParamTypeCustom)
+        return new BenchCustomParam(descriptor, this);
+    if (type == kOfxParamTypePushButton)
+        return new OFX::Host::Param::PushbuttonInstance(descriptor, this);
+    if (type == kOfxParamTypeGroup)
+        return new OFX::Host::Param::GroupInstance(descriptor, this);
+    if (type == kOfxParamTypePage)
+        return new OFX::Host::Param::PageInstance(descriptor, this);
+    return NULL;
+}
+
+OfxStatus BenchEffectInstance::editBegin(const std::string& /*name*/)
+{
+    return kOfxStatOK;
+}
+
+OfxStatus BenchEffectInstance::editEnd()
+{
+    return kOfxStatOK;
+}
+
+void BenchEffectInstance::progressStart(const std::string& /*message*/, const std::string& /*messageid*/)
+{
+}
+
+void BenchEffectInstance::progressEnd()
+{
+}
+
+bool BenchEffectInstance::progressUpdate(double /*t*/)
+{
+    return true;
+}
+
+double BenchEffectInstance::timeLineGetTime()
+{
+    return _time;
+}
+
+void BenchEffectInstance::timeLineGotoTime(double t)
+{
+    _time = t;
+}
+
+void BenchEffectInstance::timeLineGetBounds(double& t1, double& t2)
+{
+    t1 = project().firstFrame;
+    t2 = project().lastFrame;
+}
+
+#ifdef OFX_EXTENSIONS_NUKE
+OfxStatus BenchEffectInstance::getViewCount(int* nViews) const
+{
+    *nViews = 1;
+    return kOfxStatOK;
+}
+
+OfxStatus BenchEffectInstance::getViewName(int /*viewIndex*/, const char** name) const
+{
+    *name = "main";
+    return kOfxStatOK;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Clips and images
+
+BenchImage::BenchImage(BenchClipInstance& clip, const OfxRectI& bounds, double renderScale, bool fill)
+    : OFX::Host::ImageEffect::Image(clip)
+    , _bounds(bounds)
+{
+    const int width = bounds.x2 - bounds.x1;
+    const int height = bounds.y2 - bounds.y1;
+    _data.resize((size_t)width * height * 4);
+
+    if (fill){
+        // Smooth gradient so that every channel carries a different, non constant value
+        for (int y = 0; y < height; ++y){
+            float* row = &_data[(size_t)y * width * 4];
+            const float fy = height > 1 ? (float)y / (height - 1) : 0.f;
+            for (int x = 0; x < width; ++x){
+                const float fx = width > 1 ? (float)x / (width - 1) : 0.f;
+                row[x * 4 + 0] = fx;
+                row[x * 4 + 1] = fy;
+                row[x * 4 + 2] = 1.f - 0.5f * (fx + fy);
+                row[x * 4 + 3] = 1.f;
+            }
+        }
+    }
+
+    setDoubleProperty(kOfxImageEffectPropRenderScale, renderScale, 0);
+    setDoubleProperty(kOfxImageEffectPropRenderScale, renderScale, 1);
+    setPointerProperty(kOfxImagePropData, _data.data());
+    setIntPropertyN(kOfxImagePropBounds, &bounds.x1, 4);
+    setIntPropertyN(kOfxImagePropRegionOfDefinition, &bounds.x1, 4);
+    setIntProperty(kOfxImagePropRowBytes, width * 4 * (int)sizeof(float));
+}
+
+BenchClipInstance::BenchClipInstance(BenchEffectInstance* effect, OFX::Host::ImageEffect::ClipDescriptor* desc)
+    : OFX::Host::ImageEffect::ClipInstance(effect, *desc)
+    , _effect(effect)
+    , _name(desc->getName())
+{
+}
+
+BenchClipInstance::~BenchClipInstance()
+{
+    for (auto& it : _images){
+        it.second->releaseReference();
+    }
+}
+
+const BenchImage* BenchClipInstance::threadImage() const
+{
+    std::lock_guard<std::mutex> lock(_imagesMutex);
+    auto it = _images.find(std::this_thread::get_id());
+    return it == _images.end() ? NULL : it->second;
+}
+
+const std::string& BenchClipInstance::getUnmappedBitDepth() const
+{
+    static const std::string v(kOfxBitDepthFloat);
+    return v;
+}
+
+const std::string& BenchClipInstance::getUnmappedComponents() const
+{
+    static const std::string v(kOfxImageComponentRGBA);
+    return v;
+}
+
+const std::string& BenchClipInstance::getPremult() const
+{
+    static const std::string v(kOfxImageUnPreMultiplied);
+    return v;
+}
+
+double BenchClipInstance::getAspectRatio() const
+{
+    return 1.;
+}
+
+double BenchClipInstance::getFrameRate() const
+{
+    return _effect->project().fps;
+}
+
+void BenchClipInstance::getFrameRange(double& startFrame, double& endFrame) const
+{
+    startFrame = _effect->project().firstFrame;
+    endFrame = _effect->project().lastFrame;
+}
+
+const std::string& BenchClipInstance::getFieldOrder() const
+{
+    static const std::string v(kOfxImageFieldNone);
+    return v;
+}
+
+bool BenchClipInstance::getConnected() const
+{
+    return true;
+}
+
+double BenchClipInstance::getUnmappedFrameRate() const
+{
+    return getFrameRate();
+}
+
+void BenchClipInstance::getUnmappedFrameRange(double& unmappedStartFrame, double& unmappedEndFrame) const
+{
+    getFrameRange(unmappedStartFrame, unmappedEndFrame);
+}
+
+bool BenchClipInstance::getContinuousSamples() const
+{
+    return false;
+}
+
+OfxRectD BenchClipInstance::getRegionOfDefinition(OfxTime /*time*/) const
+{
+    if (isOutput()){
+        return _effect->outputRoD();
+    }
+    OfxRectD rod;
+    rod.x1 = rod.y1 = 0.;
+    rod.x2 = _effect->project().width;
+    rod.y2 = _effect->project().height;
+    return rod;
+}
+
+#ifdef OFX_EXTENSIONS_NATRON
+OfxRectI BenchClipInstance::getFormat() const
+{
+    OfxRectI format;
+    format.x1 = format.y1 = 0;
+    format.x2 = _effect->project().width;
+    format.y2 = _effect->project().height;
+    return format;
+}
+#endif
+
+OFX::Host::ImageEffect::Image* BenchClipInstance::getImage(OfxTime time, const OfxRectD* /*optionalBounds*/)
+{
+    // Images always cover the whole region of definition at the project render scale
+    const double scale = _effect->project().renderScale;
+    const OfxRectD rod = getRegionOfDefinition(time);
+    OfxRectI bounds;
+    bounds.x1 = (int)std::floor(rod.x1 * scale);
+    bounds.y1 = (int)std::floor(rod.y1 * scale);
+    bounds.x2 = (int)std::ceil(rod.x2 * scale);
+    bounds.y2 = (int)std::ceil(rod.y2 * scale);
+    if (bounds.x2 <= bounds.x1 || bounds.y2 <= bounds.y1){
+        return NULL;
+    }
+
+    std::lock_guard<std::mutex> lock(_imagesMutex);
+    BenchImage*& image = _images[std::this_thread::get_id()];
+    if (image){
+        const OfxRectI& b = image->bounds();
+        if (b.x1 != bounds.x1 || b.y1 != bounds.y1 || b.x2 != bounds.x2 || b.y2 != bounds.y2){
+            image->releaseReference();
+            image = NULL;
+        }
+    }
+    if (!image){
+        image = new BenchImage(*this, bounds, scale, !isOutput());
+    }
+    // Keep our own reference so the plugin's release never frees the buffer
+    image->addReference();
+    return image;
+}
+
+#ifdef OFX_EXTENSIONS_NUKE
+OFX::Host::ImageEffect::Image* BenchClipInstance::getImagePlane(OfxTime time, int /*view*/, const std::string& plane, const OfxRectD* optionalBounds)
+{
+    if (plane != kFnOfxImagePlaneColour){
+        return NULL;
+    }
+    return getImage(time, optionalBounds);
+}
+
+OfxRectD BenchClipInstance::getRegionOfDefinition(OfxTime time, int /*view*/) const
+{
+    return getRegionOfDefinition(time);
+}
+#endif
+
+#ifdef OFX_EXTENSIONS_VEGAS
+OFX::Host::ImageEffect::Image* BenchClipInstance::getStereoscopicImage(OfxTime time, int /*view*/, const OfxRectD* optionalBounds)
+{
+    return getImage(time, optionalBounds);
+}
+#endif
+
+} // namespace CMSBench
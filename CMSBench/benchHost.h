@@ -0,0 +1,246 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ofxCore.h"
+#include "ofxImageEffect.h"
+#include "ofxPixels.h"
+
+#ifdef OFX_EXTENSIONS_NUKE
+#include "nuke/fnOfxExtensions.h"
+#endif
+
+#include "ofxhBinary.h"
+#include "ofxhPropertySuite.h"
+#include "ofxhClip.h"
+#include "ofxhParam.h"
+#include "ofxhMemory.h"
+#include "ofxhImageEffect.h"
+#include "ofxhPluginAPICache.h"
+#include "ofxhPluginCache.h"
+#include "ofxhHost.h"
+#include "ofxhImageEffectAPI.h"
+
+namespace CMSBench {
+
+/** @brief Project description shared by the host, the effect and its clips */
+struct BenchProject
+{
+    int width = 1920;          // synthetic input size, in pixels
+    int height = 1080;
+    double fps = 24.;
+    double firstFrame = 0.;    // frame range advertised by the input clips
+    double lastFrame = 0.;
+    double renderScale = 1.;
+};
+
+/** @brief Thread pool backing the OFX multithread suite
+ *
+ * Workers are spawned once and reused for every multiThread() call, like a
+ * real host does, so that thread creation does not show up in frame timings.
+ * Nested calls from a spawned thread run serially on that thread.
+ */
+class BenchThreadPool
+{
+public:
+    explicit BenchThreadPool(unsigned int nThreads);
+    ~BenchThreadPool();
+
+    unsigned int size() const { return _nThreads; }
+    OfxStatus run(OfxThreadFunctionV1 func, unsigned int nThreads, void* customArg);
+
+    static unsigned int threadIndex();
+    static bool isSpawnedThread();
+
+private:
+    void workerLoop();
+
+    unsigned int _nThreads;
+    std::vector<std::thread> _workers;
+    std::mutex _runMutex;     // held by the multiThread() caller owning the workers
+    std::mutex _mutex;
+    std::condition_variable _wake, _done;
+    OfxThreadFunctionV1* _func = nullptr;
+    void* _arg = nullptr;
+    unsigned int _jobThreads = 0;
+    std::atomic<unsigned int> _next{0};
+    unsigned int _pending = 0;
+    unsigned long _generation = 0;
+    bool _quit = false;
+};
+
+class BenchHost : public OFX::Host::ImageEffect::Host
+{
+public:
+    BenchHost(const BenchProject& project, unsigned int nThreads);
+
+    const BenchProject& project() const { return _project; }
+
+    virtual OFX::Host::ImageEffect::Instance* newInstance(void* clientData,
+                                                          OFX::Host::ImageEffect::ImageEffectPlugin* plugin,
+                                                          OFX::Host::ImageEffect::Descriptor& desc,
+                                                          const std::string& context);
+    virtual OFX::Host::ImageEffect::Descriptor* makeDescriptor(OFX::Host::ImageEffect::ImageEffectPlugin* plugin);
+    virtual OFX::Host::ImageEffect::Descriptor* makeDescriptor(const OFX::Host::ImageEffect::Descriptor& rootContext,
+                                                               OFX::Host::ImageEffect::ImageEffectPlugin* plug);
+    virtual OFX::Host::ImageEffect::Descriptor* makeDescriptor(const std::string& bundlePath,
+                                                               OFX::Host::ImageEffect::ImageEffectPlugin* plug);
+
+    virtual OfxStatus vmessage(const char* type, const char* id, const char* format, va_list args);
+    virtual OfxStatus setPersistentMessage(const char* type, const char* id, const char* format, va_list args);
+    virtual OfxStatus clearPersistentMessage();
+
+    virtual OfxStatus multiThread(OfxThreadFunctionV1 func, unsigned int nThreads, void* customArg);
+    virtual OfxStatus multiThreadNumCPUS(unsigned int* nCPUs) const;
+    virtual OfxStatus multiThreadIndex(unsigned int* threadIndex) const;
+    virtual int multiThreadIsSpawnedThread() const;
+    virtual OfxStatus mutexCreate(OfxMutexHandle* mutex, int lockCount);
+    virtual OfxStatus mutexDestroy(const OfxMutexHandle mutex);
+    virtual OfxStatus mutexLock(const OfxMutexHandle mutex);
+    virtual OfxStatus mutexUnLock(const OfxMutexHandle mutex);
+    virtual OfxStatus mutexTryLock(const OfxMutexHandle mutex);
+
+#ifdef OFX_SUPPORTS_OPENGLRENDER
+    virtual OfxStatus flushOpenGLResources() const { return kOfxStatFailed; }
+#endif
+
+private:
+    BenchProject _project;
+    mutable BenchThreadPool _pool;
+};
+
+class BenchClipInstance;
+
+/** @brief Float RGBA image owned by a clip, one per render thread */
+class BenchImage : public OFX::Host::ImageEffect::Image
+{
+public:
+    BenchImage(BenchClipInstance& clip, const OfxRectI& bounds, double renderScale, bool fill);
+
+    const OfxRectI& bounds() const { return _bounds; }
+    const float* data() const { return _data.data(); }
+
+private:
+    OfxRectI _bounds;
+    std::vector<float> _data;
+};
+
+class BenchEffectInstance : public OFX::Host::ImageEffect::Instance
+{
+public:
+    BenchEffectInstance(BenchHost* host,
+                        OFX::Host::ImageEffect::ImageEffectPlugin* plugin,
+                        OFX::Host::ImageEffect::Descriptor& desc,
+                        const std::string& context);
+
+    const BenchProject& project() const { return _host->project(); }
+
+    /** @brief Region of definition of the output, in canonical coordinates, set by the driver */
+    void setOutputRoD(const OfxRectD& rod) { _outputRoD = rod; }
+    const OfxRectD& outputRoD() const { return _outputRoD; }
+
+    /** @brief Last output image rendered by the calling thread */
+    const BenchImage* lastOutputImage() const;
+
+    virtual const std::string& getDefaultOutputFielding() const;
+    virtual OFX::Host::ImageEffect::ClipInstance* newClipInstance(OFX::Host::ImageEffect::Instance* plugin,
+                                                                  OFX::Host::ImageEffect::ClipDescriptor* descriptor,
+                                                                  int index);
+
+    virtual OfxStatus vmessage(const char* type, const char* id, const char* format, va_list args);
+    virtual OfxStatus setPersistentMessage(const char* type, const char* id, const char* format, va_list args);
+    virtual OfxStatus clearPersistentMessage();
+
+    virtual void getProjectSize(double& xSize, double& ySize) const;
+    virtual void getProjectOffset(double& xOffset, double& yOffset) const;
+    virtual void getProjectExtent(double& xSize, double& ySize) const;
+    virtual double getProjectPixelAspectRatio() const;
+    virtual double getEffectDuration() const;
+    virtual double getFrameRate() const;
+    virtual double getFrameRecursive() const;
+    virtual void getRenderScaleRecursive(double& x, double& y) const;
+
+    virtual OFX::Host::Param::Instance* newParam(const std::string& name, OFX::Host::Param::Descriptor& descriptor);
+    virtual OfxStatus editBegin(const std::string& name);
+    virtual OfxStatus editEnd();
+
+    virtual void progressStart(const std::string& message, const std::string& messageid);
+    virtual void progressEnd();
+    virtual bool progressUpdate(double t);
+
+    virtual double timeLineGetTime();
+    virtual void timeLineGotoTime(double t);
+    virtual void timeLineGetBounds(double& t1, double& t2);
+
+#ifdef OFX_EXTENSIONS_NUKE
+    virtual OfxStatus getViewCount(int* nViews) const;
+    virtual OfxStatus getViewName(int viewIndex, const char** name) const;
+#endif
+
+private:
+    BenchHost* _host;
+    OfxRectD _outputRoD;
+    double _time = 0.;
+};
+
+class BenchClipInstance : public OFX::Host::ImageEffect::ClipInstance
+{
+public:
+    BenchClipInstance(BenchEffectInstance* effect, OFX::Host::ImageEffect::ClipDescriptor* desc);
+    virtual ~BenchClipInstance();
+
+    bool isOutput() const { return _name == kOfxImageEffectOutputClipName; }
+
+    /** @brief Image last handed out to the calling thread, or null */
+    const BenchImage* threadImage() const;
+
+    virtual const std::string& getUnmappedBitDepth() const;
+    virtual const std::string& getUnmappedComponents() const;
+    virtual const std::string& getPremult() const;
+    virtual double getAspectRatio() const;
+    virtual double getFrameRate() const;
+    virtual void getFrameRange(double& startFrame, double& endFrame) const;
+    virtual const std::string& getFieldOrder() const;
+    virtual bool getConnected() const;
+    virtual double getUnmappedFrameRate() const;
+    virtual void getUnmappedFrameRange(double& unmappedStartFrame, double& unmappedEndFrame) const;
+    virtual bool getContinuousSamples() const;
+    virtual OfxRectD getRegionOfDefinition(OfxTime time) const;
+    virtual OFX::Host::ImageEffect::Image* getImage(OfxTime time, const OfxRectD* optionalBounds);
+
+#ifdef OFX_EXTENSIONS_NATRON
+    virtual OfxRectI getFormat() const;
+#endif
+#ifdef OFX_SUPPORTS_OPENGLRENDER
+    virtual OFX::Host::ImageEffect::Texture* loadTexture(OfxTime, const char*, const OfxRectD*) { return NULL; }
+#endif
+#ifdef OFX_EXTENSIONS_NUKE
+    virtual OFX::Host::ImageEffect::Image* getImagePlane(OfxTime time, int view, const std::string& plane, const OfxRectD* optionalBounds);
+    virtual OfxRectD getRegionOfDefinition(OfxTime time, int view) const;
+#endif
+#ifdef OFX_EXTENSIONS_VEGAS
+    virtual OFX::Host::ImageEffect::Image* getStereoscopicImage(OfxTime time, int view, const OfxRectD* optionalBounds);
+#endif
+#if defined(OFX_EXTENSIONS_VEGAS) || defined(OFX_EXTENSIONS_NUKE)
+    virtual void setView(int) {}
+#endif
+
+private:
+    BenchEffectInstance* _effect;
+    std::string _name;
+    mutable std::mutex _imagesMutex;
+    // Images are recycled per thread: the host never shares a buffer between
+    // two concurrent renders and the reference count is only touched by its owner.
+    std::map<std::thread::id, BenchImage*> _images;
+};
+
+/** @brief Set a parameter from its textual JSON form, returns false on a type mismatch */
+bool setParamFromStrings(OFX::Host::Param::Instance* param, const std::vector<std::string>& values);
+
+} // namespace CMSBench
@@ -0,0 +1,580 @@
+/*
+ * cms-bench: headless OFX host rendering frame ranges through one of the CMS
+ * plugins and reporting per frame latency, throughput and peak memory.
+ *
+ *   cms-bench [options] config.json
+ *
+ * The JSON configuration names the plugin, its context, the synthetic input
+ * size, the frame range and the parameter values, e.g.
+ *
+ *   {
+ *     "plugin": "net.sf.openfx.MLVReader",
+ *     "frames": [0, 99],
+ *     "threads": 8,
+ *     "params": { "MLVFilename": "/clips/M01-1234.MLV", "DebayerType": 2 }
+ *   }
+ *
+ * Command line options override the configuration file.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include "benchHost.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace CMSBench;
+namespace pt = boost::property_tree;
+
+namespace {
+
+struct BenchOptions
+{
+    std::string configFile;
+    std::string pluginId;
+    std::string context;
+    std::string pluginPath;
+    std::string csvFile;
+    unsigned int threads = 0;
+    unsigned int concurrency = 1;
+    int repeat = 1;
+    int warmup = 1;
+    bool hasFrames = false;
+    BenchProject project;
+    std::vector<std::pair<std::string, std::vector<std::string> > > params;
+};
+
+struct FrameSample
+{
+    double time;
+    double ms;
+    unsigned long long digest;
+};
+
+void usage()
+{
+    fprintf(stderr,
+            "usage: cms-bench [options] config.json\n"
+            "  --plugin-path DIR   directory searched for CMS.ofx.bundle (prepended to OFX_PLUGIN_PATH)\n"
+            "  --threads N         CPUs exposed through the OFX multithread suite (default: hardware)\n"
+            "  --concurrency N     frames rendered at the same time (default 1)\n"
+            "  --frames A:B        frame range to render\n"
+            "  --repeat N          number of passes over the frame range (default 1)\n"
+            "  --warmup N          untimed frames rendered before measuring (default 1)\n"
+            "  --scale S           render scale (default 1)\n"
+            "  --csv FILE          write per frame latencies and output digests\n");
+}
+
+const char* contextFromName(const std::string& name)
+{
+    if (name == "Filter") return kOfxImageEffectContextFilter;
+    if (name == "General") return kOfxImageEffectContextGeneral;
+    if (name == "Generator") return kOfxImageEffectContextGenerator;
+    if (name == "Reader") return kOfxImageEffectContextReader;
+    return NULL;
+}
+
+bool parseFrames(const std::string& s, BenchProject& project)
+{
+    double a, b;
+    if (sscanf(s.c_str(), "%lf:%lf", &a, &b) == 2 || sscanf(s.c_str(), "%lf-%lf", &a, &b) == 2){
+        project.firstFrame = a;
+        project.lastFrame = b;
+        return b >= a;
+    }
+    if (sscanf(s.c_str(), "%lf", &a) == 1){
+        project.firstFrame = project.lastFrame = a;
+        return true;
+    }
+    return false;
+}
+
+bool loadConfig(const std::string& file, BenchOptions& opts)
+{
+    pt::ptree root;
+    try {
+        pt::read_json(file, root);
+    } catch (const pt::json_parser_error& e) {
+        fprintf(stderr, "cms-bench: %s\n", e.what());
+        return false;
+    }
+
+    opts.pluginId = root.get<std::string>("plugin", "");
+    opts.context = root.get<std::string>("context", "");
+    opts.pluginPath = root.get<std::string>("pluginPath", "");
+    opts.threads = root.get<unsigned int>("threads", 0);
+    opts.concurrency = root.get<unsigned int>("concurrency", 1);
+    opts.repeat = root.get<int>("repeat", 1);
+    opts.warmup = root.get<int>("warmup", 1);
+    opts.project.renderScale = root.get<double>("renderScale", 1.);
+    opts.project.width = root.get<int>("input.width", opts.project.width);
+    opts.project.height = root.get<int>("input.height", opts.project.height);
+    opts.project.fps = root.get<double>("input.fps", opts.project.fps);
+
+    if (auto frames = root.get_child_optional("frames")){
+        std::vector<double> range;
+        for (const auto& v : *frames){
+            range.push_back(v.second.get_value<double>());
+        }
+        if (range.size() != 2 || range[1] < range[0]){
+            fprintf(stderr, "cms-bench: \"frames\" must be [first, last]\n");
+            return false;
+        }
+        opts.project.firstFrame = range[0];
+        opts.project.lastFrame = range[1];
+        opts.hasFrames = true;
+    }
+
+    if (auto params = root.get_child_optional("params")){
+        for (const auto& p : *params){
+            std::vector<std::string> values;
+            if (p.second.empty()){
+                values.push_back(p.second.data());
+            } else {
+                for (const auto& v : p.second){
+                    values.push_back(v.second.data());
+                }
+            }
+            opts.params.push_back(std::make_pair(p.first, values));
+        }
+    }
+    return true;
+}
+
+double peakRssMiB()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))){
+        return pmc.PeakWorkingSetSize / (1024. * 1024.);
+    }
+    return 0.;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0){
+        return 0.;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024. * 1024.);   // bytes
+#else
+    return usage.ru_maxrss / 1024.;             // kilobytes
+#endif
+#endif
+}
+
+unsigned long long digestImage(const BenchImage* image)
+{
+    // FNV-1a over the raw float words, to check that optimisations keep the output unchanged
+    unsigned long long h = 1469598103934665603ULL;
+    if (!image){
+        return 0;
+    }
+    const OfxRectI& b = image->bounds();
+    const uint32_t* p = reinterpret_cast<const uint32_t*>(image->data());
+    const size_t n = (size_t)(b.x2 - b.x1) * (b.y2 - b.y1) * 4;
+    for (size_t i = 0; i < n; ++i){
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+double percentile(const std::vector<double>& sorted, double p)
+{
+    // Nearest rank
+    if (sorted.empty()){
+        return 0.;
+    }
+    size_t rank = (size_t)std::ceil(p / 100. * sorted.size());
+    return sorted[std::min(sorted.size() - 1, rank ? rank - 1 : 0)];
+}
+
+OfxStatus renderSequenceAction(OFX::Host::ImageEffect::Instance* instance, const BenchProject& project, bool begin)
+{
+    OfxPointD scale = {project.renderScale, project.renderScale};
+    if (begin){
+        return instance->beginRenderAction(project.firstFrame, project.lastFrame, 1., false, scale, true, false,
+#ifdef OFX_SUPPORTS_OPENGLRENDER
+                                           false,
+#ifdef OFX_EXTENSIONS_NATRON
+                                           NULL,
+#endif
+#endif
+                                           false
+#ifdef OFX_EXTENSIONS_NUKE
+                                           , 0
+#endif
+                                           );
+    }
+    return instance->endRenderAction(project.firstFrame, project.lastFrame, 1., false, scale, true, false,
+#ifdef OFX_SUPPORTS_OPENGLRENDER
+                                     false,
+#ifdef OFX_EXTENSIONS_NATRON
+                                     NULL,
+#endif
+#endif
+                                     false
+#ifdef OFX_EXTENSIONS_NUKE
+                                     , 0
+#endif
+                                     );
+}
+
+OfxStatus renderFrame(OFX::Host::ImageEffect::Instance* instance, const BenchProject& project, double time, const OfxRectI& window, bool sequential)
+{
+    OfxPointD scale = {project.renderScale, project.renderScale};
+#ifdef OFX_EXTENSIONS_NUKE
+    std::list<std::string> planes;
+    planes.push_back(kFnOfxImagePlaneColour);
+#endif
+    return instance->renderAction(time, kOfxImageFieldNone, window, scale, sequential, false,
+#ifdef OFX_SUPPORTS_OPENGLRENDER
+                                  false,
+#ifdef OFX_EXTENSIONS_NATRON
+                                  NULL,
+#endif
+#endif
+                                  false
+#if defined(OFX_EXTENSIONS_VEGAS) || defined(OFX_EXTENSIONS_NUKE)
+                                  , 0
+#endif
+#ifdef OFX_EXTENSIONS_VEGAS
+                                  , 1
+#endif
+#ifdef OFX_EXTENSIONS_NUKE
+                                  , planes
+#endif
+                                  );
+}
+
+BenchEffectInstance* createInstance(OFX::Host::ImageEffect::ImageEffectPlugin* plugin, const std::string& context, const BenchOptions& opts)
+{
+    BenchEffectInstance* instance = dynamic_cast<BenchEffectInstance*>(plugin->createInstance(context, NULL));
+    if (!instance){
+        return NULL;
+    }
+
+    // Parameters are set before kOfxActionCreateInstance, as when a host loads a project
+    for (const auto& p : opts.params){
+        OFX::Host::Param::Instance* param = instance->getParam(p.first);
+        if (!param){
+            fprintf(stderr, "cms-bench: unknown parameter '%s'\n", p.first.c_str());
+            delete instance;
+            return NULL;
+        }
+        if (!setParamFromStrings(param, p.second)){
+            fprintf(stderr, "cms-bench: bad value for parameter '%s' (%s)\n", p.first.c_str(), param->getType().c_str());
+            delete instance;
+            return NULL;
+        }
+    }
+
+    OfxStatus stat = instance->createInstanceAction();
+    if (stat != kOfxStatOK && stat != kOfxStatReplyDefault){
+        fprintf(stderr, "cms-bench: kOfxActionCreateInstance failed (%d)\n", stat);
+        delete instance;
+        return NULL;
+    }
+    if (!instance->getClipPreferences()){
+        fprintf(stderr, "cms-bench: clip preferences failed\n");
+    }
+    return instance;
+}
+
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+    BenchOptions opts;
+    BenchOptions cli;
+    std::string framesArg;
+    double scaleArg = 0.;
+    int repeatArg = 0, warmupArg = -1;
+
+    for (int i = 1; i < argc; ++i){
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--plugin-path" && hasValue){
+            cli.pluginPath = argv[++i];
+        } else if (arg == "--threads" && hasValue){
+            cli.threads = (unsigned int)atoi(argv[++i]);
+        } else if (arg == "--concurrency" && hasValue){
+            cli.concurrency = (unsigned int)std::max(1, atoi(argv[++i]));
+        } else if (arg == "--frames" && hasValue){
+            framesArg = argv[++i];
+        } else if (arg == "--repeat" && hasValue){
+            repeatArg = atoi(argv[++i]);
+        } else if (arg == "--warmup" && hasValue){
+            warmupArg = atoi(argv[++i]);
+        } else if (arg == "--scale" && hasValue){
+            scaleArg = atof(argv[++i]);
+        } else if (arg == "--csv" && hasValue){
+            cli.csvFile = argv[++i];
+        } else if (arg == "-h" || arg == "--help"){
+            usage();
+            return 0;
+        } else if (arg[0] != '-' && opts.configFile.empty()){
+            opts.configFile = arg;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (opts.configFile.empty()){
+        usage();
+        return 1;
+    }
+    if (!loadConfig(opts.configFile, opts)){
+        return 1;
+    }
+
+    if (!cli.pluginPath.empty()) opts.pluginPath = cli.pluginPath;
+    if (cli.threads) opts.threads = cli.threads;
+    if (cli.concurrency > 1) opts.concurrency = cli.concurrency;
+    if (repeatArg > 0) opts.repeat = repeatArg;
+    if (warmupArg >= 0) opts.warmup = warmupArg;
+    if (scaleArg > 0.) opts.project.renderScale = scaleArg;
+    opts.csvFile = cli.csvFile;
+    if (!framesArg.empty()){
+        if (!parseFrames(framesArg, opts.project)){
+            fprintf(stderr, "cms-bench: bad frame range '%s'\n", framesArg.c_str());
+            return 1;
+        }
+        opts.hasFrames = true;
+    }
+    if (opts.pluginId.empty()){
+        fprintf(stderr, "cms-bench: no \"plugin\" in %s\n", opts.configFile.c_str());
+        return 1;
+    }
+    if (!opts.threads){
+        opts.threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    opts.concurrency = std::max(1u, opts.concurrency);
+    opts.repeat = std::max(1, opts.repeat);
+    if (!opts.hasFrames){
+        opts.project.firstFrame = 0.;
+        opts.project.lastFrame = 9.;
+    }
+
+    OFX::Host::PluginCache* pluginCache = OFX::Host::PluginCache::getPluginCache();
+    pluginCache->setCacheVersion("cmsBenchV1");
+    if (!opts.pluginPath.empty()){
+        pluginCache->prependFileToPath(opts.pluginPath);
+    }
+
+    BenchHost host(opts.project, opts.threads);
+    OFX::Host::ImageEffect::PluginCache imageEffectPluginCache(&host);
+    imageEffectPluginCache.registerInCache(*pluginCache);
+    pluginCache->scanPluginFiles();
+
+    OFX::Host::ImageEffect::ImageEffectPlugin* plugin = imageEffectPluginCache.getPluginById(opts.pluginId);
+    if (!plugin){
+        fprintf(stderr, "cms-bench: plugin '%s' not found, check --plugin-path or OFX_PLUGIN_PATH\n", opts.pluginId.c_str());
+        OFX::Host::PluginCache::clearPluginCache();
+        return 1;
+    }
+
+    // Pick the requested context, or the first one the plugin supports
+    std::string context;
+    const std::set<std::string>& contexts = plugin->getContexts();
+    if (!opts.context.empty()){
+        const char* c = contextFromName(opts.context);
+        context = c ? c : opts.context;
+        if (contexts.find(context) == contexts.end()){
+            fprintf(stderr, "cms-bench: plugin does not support context '%s'\n", opts.context.c_str());
+            OFX::Host::PluginCache::clearPluginCache();
+            return 1;
+        }
+    } else if (!contexts.empty()){
+        context = *contexts.begin();
+    }
+
+    // Fully safe plugins share one instance between the concurrent renders,
+    // instance safe ones get an instance per render thread.
+    const std::string& safety = plugin->getDescriptor().getRenderThreadSafety();
+    unsigned int nInstances = 1;
+    if (opts.concurrency > 1){
+        if (safety == kOfxImageEffectRenderUnsafe){
+            fprintf(stderr, "cms-bench: plugin is not thread safe, concurrency forced to 1\n");
+            opts.concurrency = 1;
+        } else if (safety == kOfxImageEffectRenderInstanceSafe){
+            nInstances = opts.concurrency;
+        }
+    }
+
+    std::vector<std::unique_ptr<BenchEffectInstance> > instances;
+    for (unsigned int i = 0; i < nInstances; ++i){
+        BenchEffectInstance* instance = createInstance(plugin, context, opts);
+        if (!instance){
+            instances.clear();
+            OFX::Host::PluginCache::clearPluginCache();
+            return 1;
+        }
+        instances.emplace_back(instance);
+    }
+
+    // Readers and generators define their own frame range
+    if (!opts.hasFrames && context != kOfxImageEffectContextFilter){
+        OfxRangeD range;
+        if (instances[0]->getTimeDomainAction(range) == kOfxStatOK && range.max >= range.min){
+            opts.project.firstFrame = range.min;
+            opts.project.lastFrame = range.max;
+        }
+    }
+
+    OfxRectD rod;
+    OfxPointD scale = {opts.project.renderScale, opts.project.renderScale};
+    if (instances[0]->getRegionOfDefinitionAction(opts.project.firstFrame, scale,
+#ifdef OFX_EXTENSIONS_NUKE
+                                                  0,
+#endif
+                                                  rod) != kOfxStatOK){
+        rod.x1 = rod.y1 = 0.;
+        rod.x2 = opts.project.width;
+        rod.y2 = opts.project.height;
+    }
+    OfxRectI window;
+    window.x1 = (int)std::floor(rod.x1 * scale.x);
+    window.y1 = (int)std::floor(rod.y1 * scale.y);
+    window.x2 = (int)std::ceil(rod.x2 * scale.x);
+    window.y2 = (int)std::ceil(rod.y2 * scale.y);
+    for (auto& instance : instances){
+        instance->setOutputRoD(rod);
+    }
+    const double pixels = (double)(window.x2 - window.x1) * (window.y2 - window.y1);
+    const double rssBefore = peakRssMiB();
+
+    // Job list: warmup frames first, then the timed passes over the range
+    std::vector<double> jobs;
+    const int nFrames = (int)(opts.project.lastFrame - opts.project.firstFrame) + 1;
+    for (int i = 0; i < opts.warmup; ++i){
+        jobs.push_back(opts.project.firstFrame + (i % nFrames));
+    }
+    const size_t nWarmup = jobs.size();
+    for (int r = 0; r < opts.repeat; ++r){
+        for (int f = 0; f < nFrames; ++f){
+            jobs.push_back(opts.project.firstFrame + f);
+        }
+    }
+
+    for (auto& instance : instances){
+        renderSequenceAction(instance.get(), opts.project, true);
+    }
+
+    std::vector<FrameSample> samples(jobs.size());
+    std::atomic<size_t> nextJob(nWarmup);
+    std::atomic<bool> failed(false);
+    std::atomic<long long> digestNs(0);
+    const bool sequential = opts.concurrency == 1;
+
+    // Warmup runs on the main thread so that one time initialisations are not measured
+    for (size_t j = 0; j < nWarmup * nInstances; ++j){
+        if (renderFrame(instances[j % nInstances].get(), opts.project, jobs[j / nInstances], window, sequential) != kOfxStatOK){
+            failed = true;
+        }
+    }
+
+    auto worker = [&](unsigned int w){
+        BenchEffectInstance* instance = instances[nInstances > 1 ? w : 0].get();
+        for (size_t j; !failed && (j = nextJob++) < jobs.size(); ){
+            auto t0 = std::chrono::steady_clock::now();
+            OfxStatus stat = renderFrame(instance, opts.project, jobs[j], window, sequential);
+            auto t1 = std::chrono::steady_clock::now();
+            if (stat != kOfxStatOK){
+                fprintf(stderr, "cms-bench: render failed at frame %g (%d)\n", jobs[j], stat);
+                failed = true;
+                break;
+            }
+            samples[j].time = jobs[j];
+            samples[j].ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+            samples[j].digest = 0;
+            if (!opts.csvFile.empty()){
+                samples[j].digest = digestImage(instance->lastOutputImage());
+                digestNs += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t1).count();
+            }
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    if (!failed){
+        std::vector<std::thread> workers;
+        for (unsigned int w = 1; w < opts.concurrency; ++w){
+            workers.emplace_back(worker, w);
+        }
+        worker(0);
+        for (std::thread& t : workers){
+            t.join();
+        }
+    }
+    // Output hashing happens between frames, keep it out of the throughput
+    const double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+                             - digestNs * 1e-9 / opts.concurrency;
+
+    for (auto& instance : instances){
+        renderSequenceAction(instance.get(), opts.project, false);
+    }
+
+    int ret = 0;
+    if (failed){
+        ret = 1;
+    } else {
+        std::vector<double> ms;
+        for (size_t j = nWarmup; j < samples.size(); ++j){
+            ms.push_back(samples[j].ms);
+        }
+        std::sort(ms.begin(), ms.end());
+        double mean = 0.;
+        for (double v : ms){
+            mean += v;
+        }
+        mean /= std::max<size_t>(1, ms.size());
+        const double fps = ms.size() / wallSeconds;
+
+        printf("plugin       %s (%s, %s)\n", opts.pluginId.c_str(), context.c_str(), safety.c_str());
+        printf("render       %dx%d, scale %g, %u host threads, concurrency %u\n",
+               window.x2 - window.x1, window.y2 - window.y1, opts.project.renderScale, opts.threads, opts.concurrency);
+        printf("frames       %zu timed [%g..%g] x %d, %zu warmup\n",
+               ms.size(), opts.project.firstFrame, opts.project.lastFrame, opts.repeat, nWarmup);
+        printf("latency ms   min %.3f  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f  mean %.3f\n",
+               ms.front(), percentile(ms, 50.), percentile(ms, 90.), percentile(ms, 99.), ms.back(), mean);
+        printf("throughput   %.2f frames/s  %.1f Mpixels/s\n", fps, fps * pixels * 1e-6);
+        printf("peak RSS     %.1f MiB (%.1f MiB before rendering)\n", peakRssMiB(), rssBefore);
+
+        if (!opts.csvFile.empty()){
+            std::ofstream csv(opts.csvFile.c_str());
+            csv << "frame,ms,digest\n";
+            char digest[32];
+            for (size_t j = nWarmup; j < samples.size(); ++j){
+                snprintf(digest, sizeof(digest), "%016llx", samples[j].digest);
+                csv << samples[j].time << "," << samples[j].ms << "," << digest << "\n";
+            }
+        }
+    }
+
+    for (auto& instance : instances){
+        instance->destroyInstanceAction();
+    }
+    instances.clear();
+    OFX::Host::PluginCache::clearPluginCache();
+    return ret;
+}
@@ -201,7 +201,15 @@ private:
             for (int x = procWindow.x1; x < procWindow.x2; ++x)
             {
                 const float *srcPix = (float *)_src->getPixelAddress(x, y);
-                if (!srcPix) continue;
+                if (!srcPix)
+                {
+                    // Tiles can reach past the source, keep the destination pixels in step
+                    for (int c = 0; c < _nComponentsDst; ++c)
+                    {
+                        *dstPix++ = 0.f;
+                    }
+                    continue;
+                }
 
                 Vector3f srcColor = !_inverse ? inv_gamma_function(Vector3f(srcPix)) : Vector3f(srcPix);
                 Vector3f dstColor = _conversion_matrix * srcColor;
@@ -213,7 +221,7 @@ private:
 
                 if (alphaDst && alphaSrc)
                 {
-                    *dstPix++ = *srcPix++;
+                    *dstPix++ = srcPix[3];
                 }
                 else if (alphaDst)
                 {
@@ -319,35 +327,69 @@ void CMSColorConversionPlugin::render(const OFX::RenderArguments &args)
     {
         clearPersistentMessage();
 
+        // Only the render window goes through the device, the part of it
+        // covered by the source is uploaded, the rest reads as outside
+        const OfxRectI& renderWin = args.renderWindow;
         OfxRectI srcBounds = src->getBounds();
-        OfxRectI dstBounds = dst->getBounds();
-
-        int srcWidth = srcBounds.x2 - srcBounds.x1;
-        int srcHeight = srcBounds.y2 - srcBounds.y1;
-        int dstWidth = dstBounds.x2 - dstBounds.x1;
-        int dstHeight = dstBounds.y2 - dstBounds.y1;
+        OfxRectI srcWin = {std::max(renderWin.x1, srcBounds.x1), std::max(renderWin.y1, srcBounds.y1),
+                           std::min(renderWin.x2, srcBounds.x2), std::min(renderWin.y2, srcBounds.y2)};
+        int tileWidth = renderWin.x2 - renderWin.x1;
+        int tileHeight = renderWin.y2 - renderWin.y1;
+        int srcWidth = std::max(srcWin.x2 - srcWin.x1, 0);
+        int srcHeight = std::max(srcWin.y2 - srcWin.y1, 0);
+
+        // Queue, kernel and images are kept from frame to frame, and from tile
+        // to tile : the images are sized in steps so edge tiles do not reallocate them
+        std::shared_ptr<OpenCLResources> cl_res = acquireCLResources();
+        if (!cl_res)
+        {
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : No program available"));
+            return;
+        }
 
         cl::Event timer;
-        cl::CommandQueue queue = cl::CommandQueue(getCurrentCLContext(), getCurrentCLDevice());
-        cl::Kernel kernel_matrixop(getProgram("imgutils"), "matrix_xform");
+        cl::CommandQueue& queue = cl_res->queue();
+        cl_int errkernel, errin, errout;
+        cl::Kernel kernel_matrixop = cl_res->kernel("imgutils", "matrix_xform", &errkernel);
+
+        cl::Buffer matrixbuffer = cl_res->buffer("matrix", CL_MEM_READ_ONLY, sizeof(float) * 9);
+        cl::Image2D img_in = cl_res->image("in", CL_MEM_READ_ONLY, cl::ImageFormat(CL_RGBA, CL_FLOAT),
+                                           ROUNDUP(tileWidth, 256), ROUNDUP(tileHeight, 256), &errin);
+        cl::Image2D img_out = cl_res->image("out", CL_MEM_WRITE_ONLY, cl::ImageFormat(CL_RGBA, CL_FLOAT),
+                                            ROUNDUP(tileWidth, 256), ROUNDUP(tileHeight, 256), &errout);
+        if (errkernel != CL_SUCCESS || errin != CL_SUCCESS || errout != CL_SUCCESS)
+        {
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Kernel or image allocation failed"));
+            return;
+        }
 
-        cl::Buffer matrixbuffer(getCurrentCLContext(), CL_MEM_READ_ONLY, sizeof(float) * 9);
-        cl::Image2D img_in(getCurrentCLContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, cl::ImageFormat(CL_RGBA, CL_FLOAT), srcWidth, srcHeight, 0, (float*)src->getPixelData());
-        cl::Image2D img_out(getCurrentCLContext(), CL_MEM_WRITE_ONLY, cl::ImageFormat(CL_RGBA, CL_FLOAT), dstWidth, dstHeight, 0, NULL);
+        int errcode = CL_SUCCESS;
+        if (srcWidth > 0 && srcHeight > 0)
+        {
+            cl::array<size_t, 3> src_origin = {0, 0, 0};
+            cl::array<size_t, 3> src_size = {(size_t)srcWidth, (size_t)srcHeight, 1};
+            errcode = queue.enqueueWriteImage(img_in, CL_TRUE, src_origin, src_size, src->getRowBytes(), 0,
+                                              src->getPixelAddress(srcWin.x1, srcWin.y1));
+        }
+        if (errcode != CL_SUCCESS)
+        {
+            setPersistentMessage(OFX::Message::eMessageError, "", string_format("OpenCL : enqueueWriteImage failed with error code %i", errcode));
+            return;
+        }
 
-        // Set CL arguments
+        // Set CL arguments, coordinates are relative to the tile
         kernel_matrixop.setArg(0, img_in);
         kernel_matrixop.setArg(1, img_out);
         kernel_matrixop.setArg(2, matrixbuffer);
-        kernel_matrixop.setArg(3, (int)srcBounds.x1);
-        kernel_matrixop.setArg(4, (int)srcBounds.y1);
+        kernel_matrixop.setArg(3, (int)(srcWin.x1 - renderWin.x1));
+        kernel_matrixop.setArg(4, (int)(srcWin.y1 - renderWin.y1));
         kernel_matrixop.setArg(5, (int)srcWidth);
         kernel_matrixop.setArg(6, (int)srcHeight);
         kernel_matrixop.setArg(7, (int)trc);
         kernel_matrixop.setArg(8, (int)invert);
 
-        cl::NDRange sizes(srcBounds.x2, srcBounds.y2, 1);
-        int errcode = queue.enqueueWriteBuffer(matrixbuffer, CL_TRUE, 0, sizeof(float) * 9, (float*)conversion_matrix.data());
+        cl::NDRange sizes(tileWidth, tileHeight, 1);
+        errcode = queue.enqueueWriteBuffer(matrixbuffer, CL_TRUE, 0, sizeof(float) * 9, (float*)conversion_matrix.data());
         if (errcode != CL_SUCCESS)
         {
             setPersistentMessage(OFX::Message::eMessageError, "", string_format("OpenCL : Enqueue buffer write failed with error code %i", errcode));
@@ -360,10 +402,10 @@ void CMSColorConversionPlugin::render(const OFX::RenderArguments &args)
             return;
         }
 
-        // Fetch result from GPU
-        cl::array<size_t, 3> origin = {(size_t)args.renderWindow.x1, (size_t)args.renderWindow.y1, 0};
-        cl::array<size_t, 3> size = {(size_t)(args.renderWindow.x2 - args.renderWindow.x1), (size_t)(args.renderWindow.y2 - args.renderWindow.y1), 1};
-        errcode = queue.enqueueReadImage(img_out, CL_TRUE, origin, size, 0, 0, (float*)dst->getPixelData());
+        // Fetch result from GPU, at the place of the tile in the output image
+        cl::array<size_t, 3> origin = {0, 0, 0};
+        cl::array<size_t, 3> size = {(size_t)tileWidth, (size_t)tileHeight, 1};
+        errcode = queue.enqueueReadImage(img_out, CL_TRUE, origin, size, dst->getRowBytes(), 0, dst->getPixelAddress(renderWin.x1, renderWin.y1));
         if (errcode != CL_SUCCESS)
         {
             setPersistentMessage(OFX::Message::eMessageError, "", string_format("OpenCL : enqueueReadImage failed with error code %i", errcode));
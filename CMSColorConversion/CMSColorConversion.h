@@ -20,8 +20,7 @@
 #define kSupportsHalf false
 #define kSupportsFloat true
 
-// More work is needed to support tiles
-#define kSupportsTiles 0
+#define kSupportsTiles 1
 #define kSupportsMultiResolution 0
 #define kSupportsRenderScale 0
 #define kSupportsMultipleClipPARs false
@@ -24,6 +24,7 @@
 #include <cmath>
 #include <climits>
 #include <cfloat>
+#include <algorithm>
 
 #include "CMSLogEncoding.h"
 #include "../utils/utils.h"
@@ -85,6 +86,12 @@ private:
             return;
         }
 
+        // Tiles can reach past the source, only the covered columns are read
+        // and the destination pixels outside of it are cleared
+        const OfxRectI &srcBounds = _src->getBounds();
+        const int x1 = std::min(std::max(procWindow.x1, srcBounds.x1), procWindow.x2);
+        const int x2 = std::max(std::min(procWindow.x2, srcBounds.x2), x1);
+
         for (int y = procWindow.y1; y < procWindow.y2; y++)
         {
             if (_effect.abort())
@@ -92,14 +99,24 @@ private:
                 break;
             }
 
-            float *dstPix = (float *)_dstImg->getPixelAddress(procWindow.x1, y);
-            const float *srcPix = (float *)_src->getPixelAddress(procWindow.x1, y);
-            if (!dstPix || !srcPix)
+            float *dstRow = (float *)_dstImg->getPixelAddress(procWindow.x1, y);
+            if (!dstRow)
+            {
+                continue;
+            }
+
+            const float *srcPix = x1 < x2 ? (float *)_src->getPixelAddress(x1, y) : nullptr;
+            if (!srcPix)
             {
+                std::fill(dstRow, dstRow + (size_t)(procWindow.x2 - procWindow.x1) * _nComponentsDst, 0.f);
                 continue;
             }
+            std::fill(dstRow, dstRow + (size_t)(x1 - procWindow.x1) * _nComponentsDst, 0.f);
+            std::fill(dstRow + (size_t)(x2 - procWindow.x1) * _nComponentsDst,
+                      dstRow + (size_t)(procWindow.x2 - procWindow.x1) * _nComponentsDst, 0.f);
 
-            for (int x = procWindow.x1; x < procWindow.x2; ++x)
+            float *dstPix = dstRow + (size_t)(x1 - procWindow.x1) * _nComponentsDst;
+            for (int x = x1; x < x2; ++x)
             {
                 for (int z = 0; z < 3; ++z)
                 {
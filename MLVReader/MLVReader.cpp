@@ -24,7 +24,9 @@
 #include "MLVReader.h"
 #include <RawLib/idt/dng_idt.h>
 #include <RawLib/idt/spectral_idt.h>
+#include <RawLib/idt/spectral_cache.h>
 #include <RawLib/idt/define.h>
+#include <darkframe.h>
 extern "C" {
 #include <RawLib/color_aberration/ColorAberrationCorrection.h>
 }
@@ -77,10 +79,15 @@ public:
         float clipping_value = scale * range * cam_mult.min();
         Vector3f scaledCamMult = cam_mult * scale;
 
+        if (debayer){
+            processDebayer(procWindow);
+            return;
+        }
+
         for (int y = procWindow.y1; y < procWindow.y2; y++)
         {
             if (y >= raw_height) break;
-            float *dstPix = static_cast<float*>(_dstImg->getPixelAddress(procWindow.x1, y) );
+            float *dstPix = target.pixelAddress(procWindow.x1, y);
             uint16_t* srcPix = raw_buffer + (raw_height - 1 - y) * (raw_width * 3) + (procWindow.x1 * 3);
             for (int x = procWindow.x1; x < procWindow.x2; ++x)
             {
@@ -102,22 +109,141 @@ public:
         }
     }
 
+    // Native path : demosaic the bayer rows and columns of this band, then color transform
+    // Levels, white balance and clipping are applied by the debayer
+    void processDebayer(const OfxRectI &procWindow)
+    {
+        const int band_rows = 32;
+        int y2 = std::min(procWindow.y2, raw_height);
+        int x2 = std::min(procWindow.x2, raw_width);
+        int band_width = x2 - procWindow.x1;
+        if (band_width <= 0){
+            return;
+        }
+        std::vector<float> band((size_t)band_rows * band_width * 3);
+
+        for (int y1 = procWindow.y1; y1 < y2; y1 += band_rows)
+        {
+            if (_effect.abort()) break;
+            int ye = std::min(y1 + band_rows, y2);
+
+            // Image is stored top-down, OFX is bottom-up
+            int raw_y1 = raw_height - ye;
+            int raw_y2 = raw_height - y1;
+            debayer->process_rect(procWindow.x1, x2, raw_y1, raw_y2, band.data());
+
+            for (int y = y1; y < ye; y++)
+            {
+                float *dstPix = target.pixelAddress(procWindow.x1, y);
+                float* srcPix = band.data() + (size_t)(raw_height - 1 - y - raw_y1) * (band_width * 3);
+                for (int x = procWindow.x1; x < x2; ++x)
+                {
+                    Vector3f out = idt_matrix * Vector3f(srcPix);
+                    out *= headroom;
+                    out.copy_to(dstPix);
+
+                    dstPix[3] = 1.f;
+                    dstPix += 4;
+                    srcPix += 3;
+                }
+            }
+        }
+    }
+
     Matrix3x3f idt_matrix;
+    RenderTarget target;
     OFX::Image *srcImg;
     float scale, wl, bl;
-    uint16_t *raw_buffer;
+    uint16_t *raw_buffer = nullptr;
+    const Debayer *debayer = nullptr;
     Vector3f cam_mult;
     int raw_width, raw_height;
     bool clip;
     float headroom = 1.0f; // Headroom value for the output
 };
 
-bool MLVReaderPlugin::getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &args, OfxRectD &rod)
+// Reduced render scales : each output pixel averages the 2x2 bayer cells it covers
+// ("superpixel" demosaic, like LibRaw half_size), boxed down further below 0.5
+class ProxyProcessor : public OFX::ImageProcessor
 {
-    if (!kSupportsRenderScale && ((args.renderScale.x != 1.) || (args.renderScale.y != 1.))) {
-        OFX::throwSuiteStatusException(kOfxStatFailed);
+public:
+    ProxyProcessor(OFX::ImageEffect &instance): ImageProcessor(instance)
+    {
     }
 
+    void multiThreadProcessImages(const OfxRectI &procWindow, const OfxPointD &rs) OVERRIDE FINAL
+    {
+        OFX::unused(rs);
+        const float scale = 1.f / float(wl - bl);
+        const float clipping_value = cam_mult.min();
+        const int cells_x = raw_width / 2;
+        const int cells_y = raw_height / 2;
+
+        for (int y = procWindow.y1; y < procWindow.y2; y++)
+        {
+            if (_effect.abort()) break;
+
+            // Rows covered by this output row, the image is stored top-down
+            int r0 = (int)std::floor(raw_height - (y + 1) / render_scale.y);
+            int r1 = (int)std::floor(raw_height - y / render_scale.y);
+            int cy0 = std::max(0, r0 / 2);
+            int cy1 = std::min(cells_y, std::max(cy0 + 1, (r1 + 1) / 2));
+
+            float *dstPix = target.pixelAddress(procWindow.x1, y);
+            for (int x = procWindow.x1; x < procWindow.x2; ++x)
+            {
+                int cx0 = std::max(0, (int)std::floor(x / render_scale.x) / 2);
+                int cx1 = std::min(cells_x, std::max(cx0 + 1, ((int)std::floor((x + 1) / render_scale.x) + 1) / 2));
+
+                Vector3f sum(0.f, 0.f, 0.f);
+                int count = 0;
+                for (int cy = cy0; cy < cy1; ++cy)
+                {
+                    const uint16_t* row0 = raw_buffer + (size_t)(cy * 2) * raw_width;
+                    const uint16_t* row1 = row0 + raw_width;
+                    for (int cx = cx0; cx < cx1; ++cx)
+                    {
+                        // RGGB cell
+                        float r = std::max(0.f, (float)row0[cx * 2] - bl);
+                        float g = std::max(0.f, (float)row0[cx * 2 + 1] - bl) + std::max(0.f, (float)row1[cx * 2] - bl);
+                        float b = std::max(0.f, (float)row1[cx * 2 + 1] - bl);
+                        Vector3f in(r * scale * cam_mult[0], g * 0.5f * scale * cam_mult[1], b * scale * cam_mult[2]);
+                        if (clip){
+                            in.clip_in_place(0.f, clipping_value);
+                        }
+                        sum = sum + in;
+                        count++;
+                    }
+                }
+
+                Vector3f out(0.f, 0.f, 0.f);
+                if (count){
+                    sum *= 1.f / count;
+                    out = idt_matrix * sum;
+                    out *= headroom;
+                }
+                out.copy_to(dstPix);
+
+                dstPix[3] = 1.f;
+                dstPix += 4;
+            }
+        }
+    }
+
+    Matrix3x3f idt_matrix;
+    RenderTarget target;
+    const uint16_t *raw_buffer = nullptr;
+    float wl, bl;
+    Vector3f cam_mult;
+    OfxPointD render_scale;
+    int raw_width, raw_height;
+    bool clip;
+    float headroom = 1.0f;
+};
+
+bool MLVReaderPlugin::getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &args, OfxRectD &rod)
+{
+    // The region of definition is in canonical coordinates, the render scale does not change it
     if (_mlv_video.empty()){
         return false;
     }
@@ -131,85 +257,130 @@ bool MLVReaderPlugin::getRegionOfDefinition(const OFX::RegionOfDefinitionArgumen
     return true;
 }
 
-bool MLVReaderPlugin::prepareSprectralSensIDT()
+bool MLVReaderPlugin::prepareSprectralSensIDT(ColorState& state, int colorspace)
 {
     // matMethod0
     // No color space conversion
     // No camera matrix
-    std::string datapath = _pluginPath + "/Contents/Resources/data";
-
-    _useSpectralIdt->setEnabled(false);
-    
-    SSIDT::Idt idt;
-    int ok = 0;
-    ok = idt.loadIlluminant( vector<string>(), "na" );
-    if (!ok)
-    {
+    // The datasets are resident and the solutions cached process wide,
+    // invalidateIDT() already queued this one when the parameters changed.
+    // Renders never wait for the solver : a missing solution is marked
+    // pending and swapped in by spectralIdtSolved()
+    if (!_useSpectralIdt->getValue()){
         return false;
     }
-    
-    ok = 0;
-    std::vector< std::string > jsonfiles = openDir(datapath + "/camera");
-    for (auto json : jsonfiles){
-        ok = idt.loadCameraSpst(json, _mlv_video[0]->get_camera_make().c_str(), _mlv_video[0]->get_camera_model().c_str());
-        if (ok) break;
-    }
 
-    if (!ok)
-    {
+    SSIDT::SpectralCache& cache = SSIDT::SpectralCache::instance();
+    std::string make = _mlv_video[0]->get_camera_make();
+    std::string model = _mlv_video[0]->get_camera_model();
+    if (!cache.hasCamera(make, model)){
         return false;
     }
 
-    _useSpectralIdt->setEnabled(true);
-
-    if (!_useSpectralIdt->getValue()){
-        // Don't use this IDT, but we know it's possible
+    std::weak_ptr<SpectralListener> listener = _spectralListener;
+    SSIDT::SpectralCache::ResultPtr result = cache.request(SSIDT::SpectralCache::makeKey(make, model, state.wb.data(), colorspace), [listener]{
+        std::shared_ptr<SpectralListener> target = listener.lock();
+        if (target){
+            std::lock_guard<std::mutex> lock(target->mutex);
+            if (target->plugin){
+                target->plugin->spectralIdtSolved();
+            }
+        }
+    });
+    if (!result){
+        state.spectral_pending = true;
         return false;
     }
-
-    idt.loadTrainingData(datapath + "/training/training_spectral.json");
-    
-    // Set the user white balance coeffs
-    std::vector< double > dcoeffs (_asShotNeutral.data(), _asShotNeutral.data() + 3);
-    idt.chooseIllumSrc( dcoeffs, 0 );
-
-    if ( idt.calIDT() )
-    {
-        idt.getIdtF(_idt.data());
-        idt.getWBF(_asShotNeutral.data());
-        return true;
+    if (!result->valid){
+        return false;
     }
 
-    _useSpectralIdt->setValue(false);
-
-    return false;
+    memcpy(state.idt.data(), result->idt, sizeof(float) * 9);
+    memcpy(state.wb.data(), result->wb, sizeof(float) * 3);
+    return true;
 }
 
-void MLVReaderPlugin::computeIDT()
+void MLVReaderPlugin::computeIDT(ColorState& state)
 {
-    IDT_MUTEX_LOCK
     int colorspace = _outputColorSpace->getValue();
 
-    if (colorspace == 3){
+    if (_mlv_video.empty()){
         return;
     }
 
-    if (_mlv_video.empty()){
+    // Thread safe...
+    _mlv_video[0]->get_white_balance_coeffs(_colorTemperature->getValue(), state.wb.data(), _wbcompensation, _cameraWhiteBalance->getValue());
+
+    if (colorspace == 3){
         return;
     }
 
-    // Thread safe...
-    _mlv_video[0]->get_white_balance_coeffs(_colorTemperature->getValue(), _asShotNeutral.data(), _wbcompensation, _cameraWhiteBalance->getValue());
-    
-    if (!prepareSprectralSensIDT()){
+    if (!prepareSprectralSensIDT(state, colorspace)){
         // No spectral sensitivities IDT, fall back to DNG IDT
-        DNGIdt::DNGIdt idt(_mlv_video[0], _asShotNeutral.data());
-        idt.getDNGIDTMatrix(_idt.data(), colorspace);
+        DNGIdt::DNGIdt idt(_mlv_video[0], state.wb.data());
+        idt.getDNGIDTMatrix(state.idt.data(), colorspace);
 
         // Clear checkbox
-        _useSpectralIdt->setValue(false);
+        if (!state.spectral_pending){
+            _useSpectralIdt->setValue(false);
+        }
+    }
+}
+
+// Called by the spectral solver thread : the next render computes a new
+// color state, the revision change makes the host drop the frames
+// rendered with the DNG IDT and render them again
+void MLVReaderPlugin::spectralIdtSolved()
+{
+    ++_idtGeneration;
+    _spectralRevision->setValue(_spectralRevision->getValue() + 1);
+}
+
+// Current color state, recomputed once per parameter change by the first render needing it
+std::shared_ptr<const ColorState> MLVReaderPlugin::colorState()
+{
+    int generation = _idtGeneration;
+    std::shared_ptr<const ColorState> state = std::atomic_load(&_colorState);
+    if (state && state->generation == generation){
+        return state;
+    }
+
+    IDT_MUTEX_LOCK
+    state = std::atomic_load(&_colorState);
+    if (!state || state->generation != generation){
+        std::shared_ptr<ColorState> fresh = std::make_shared<ColorState>();
+        fresh->generation = generation;
+        computeIDT(*fresh);
+        state = fresh;
+        std::atomic_store(&_colorState, state);
     }
     IDT_MUTEX_UNLOCK
+    return state;
+}
+
+// Clip, white balance or colorspace changed : the spectral solution is queued
+// right away, renders find it ready or being solved instead of starting it
+void MLVReaderPlugin::invalidateIDT()
+{
+    ++_idtGeneration;
+
+    if (_mlv_video.empty()){
+        return;
+    }
+
+    SSIDT::SpectralCache& cache = SSIDT::SpectralCache::instance();
+    std::string make = _mlv_video[0]->get_camera_make();
+    std::string model = _mlv_video[0]->get_camera_model();
+    bool available = cache.hasCamera(make, model);
+    _useSpectralIdt->setEnabled(available);
+
+    int colorspace = _outputColorSpace->getValue();
+    if (available && _useSpectralIdt->getValue() && colorspace != 3){
+        Vector3f wb;
+        float compensation;
+        _mlv_video[0]->get_white_balance_coeffs(_colorTemperature->getValue(), wb.data(), compensation, _cameraWhiteBalance->getValue());
+        cache.request(SSIDT::SpectralCache::makeKey(make, model, wb.data(), colorspace));
+    }
 }
 
 Mlv_video* MLVReaderPlugin::getMlv()
@@ -219,16 +390,39 @@ Mlv_video* MLVReaderPlugin::getMlv()
         if (_gThreadHost->mutexLock(_videoMutex) != kOfxStatOK) return nullptr;
         for (unsigned int i = 0; i < _mlv_video.size(); ++i){
             if (!_mlv_video[i]->locked()){
-                _mlv_video[i]->lock();
                 mlv_video = _mlv_video[i];
                 break;
             }
         }
+        // All readers busy, add one. Readers share the clip files and
+        // indexes, so the pool only grows to the real render concurrency.
+        // The copy is made from the template, a reader may be in the middle of a frame
+        if (mlv_video == nullptr && _mlv_template){
+            mlv_video = new Mlv_video(*_mlv_template);
+            _mlv_video.push_back(mlv_video);
+        }
+        if (mlv_video){
+            mlv_video->lock();
+        }
         _gThreadHost->mutexUnLock(_videoMutex);
     } 
     return mlv_video;
 }
 
+namespace {
+// Gives the reader back to the pool when the render leaves, exceptions included
+class MlvUnlocker
+{
+public:
+    explicit MlvUnlocker(Mlv_video* mlv) : _mlv(mlv) {}
+    ~MlvUnlocker(){if (_mlv) _mlv->unlock();}
+    MlvUnlocker(const MlvUnlocker&) = delete;
+    MlvUnlocker& operator=(const MlvUnlocker&) = delete;
+private:
+    Mlv_video* _mlv;
+};
+}
+
 // the overridden render function
 void MLVReaderPlugin::render(const OFX::RenderArguments &args)
 {
@@ -238,11 +432,9 @@ void MLVReaderPlugin::render(const OFX::RenderArguments &args)
         OFX::throwSuiteStatusException(kOfxStatFailed);
         return;
     }
+    MlvUnlocker unlocker(mlv_video);
 
-    if (_idtDirty){
-        computeIDT();
-        _idtDirty = false;
-    }
+    std::shared_ptr<const ColorState> color = colorState();
 
     const int time = floor(args.time+0.5);
 
@@ -262,22 +454,38 @@ void MLVReaderPlugin::render(const OFX::RenderArguments &args)
     
     OfxRectI renderWin = args.renderWindow;
     int width_img = (int)(renderWin.x2 - renderWin.x1);
-    int height_img = (int)(renderWin.y2 - renderWin.y1);
     
     if (_debayerType->getValue() == 0){
-        int dng_size = 0;
         float max_value = _maxValue;
         // Extract raw buffer - No processing (debug)
         Mlv_video::RawInfo  info;
-        mlv_video->low_level_process(info);
-        mlv_video->get_dng_buffer(time, dng_size, true);
-        uint16_t* raw_buffer = mlv_video->postprocecessed_raw_buffer();
+        FrameCache::FramePtr frame = fetchRawFrame(mlv_video, time, info);
+        if (!frame){
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+            return;
+        }
+        const uint16_t* raw_buffer = frame->raw.data();
+        const OfxPointD& rs = args.renderScale;
 
+        // Below render scale 1 each output pixel averages the raw pixels it covers
         for(int y=renderWin.y1; y < renderWin.y2; y++) {
-            uint16_t* srcPix = raw_buffer + ((width_img) * (height_img - 1 - y)) + ((int)renderWin.x1 * 4);
-            float *dstPix = (float*)dst->getPixelAddress((int)renderWin.x1, y+(int)renderWin.y1);
+            // Rows covered by this output row, the image is stored top-down
+            int r1 = std::min(frame->height, (int)std::floor(frame->height - y / rs.y));
+            int r0 = std::max(0, std::min(r1 - 1, (int)std::floor(frame->height - (y + 1) / rs.y)));
+            float *dstPix = (float*)dst->getPixelAddress((int)renderWin.x1, y);
             for(int x=renderWin.x1; x < renderWin.x2; x++) {
-                float pixel_val = float(*srcPix++) / max_value;
+                int c0 = (int)std::floor(x / rs.x);
+                int c1 = std::min(frame->width, std::max(c0 + 1, (int)std::floor((x + 1) / rs.x)));
+                float sum = 0.f;
+                int count = 0;
+                for (int r = r0; r < r1; ++r){
+                    const uint16_t* srcPix = raw_buffer + (size_t)frame->width * r;
+                    for (int c = c0; c < c1; ++c){
+                        sum += srcPix[c];
+                        count++;
+                    }
+                }
+                float pixel_val = count ? sum / (count * max_value) : 0.f;
                 *dstPix++ = pixel_val;
                 *dstPix++ = pixel_val;
                 *dstPix++ = pixel_val;
@@ -302,182 +510,922 @@ void MLVReaderPlugin::render(const OFX::RenderArguments &args)
         rawInfo.dualisointerpolation = _dualIsoAveragingMethod->getValue(); 
         rawInfo.dualiso_fullres_blending = _dualIsoFullresBlending->getValue();
         rawInfo.dualiso_aliasmap = _dualIsoAliasMap->getValue();
+        rawInfo.dualiso_calibration = _dualIsoCalibration->getValue();
         rawInfo.darkframe_file = _mlv_darkframefilename->getValue();
         rawInfo.darkframe_enable = darkframe_fileok;
-        mlv_video->low_level_process(rawInfo);
 
-        if (getUseOpenCL()){
-            renderCL(args, dst.get(), mlv_video, time);
-            
+        bool proxy = args.renderScale.x < 1. || args.renderScale.y < 1.;
+        if (!proxy && getUseOpenCL()){
+            // The tail of the low level processing runs with the demosaic
+            rawInfo.device_stages = Mlv_video::DEVICE_DARK_FRAME | Mlv_video::DEVICE_FOCUS_PIXELS | Mlv_video::DEVICE_CHROMA_SMOOTH;
+            renderCL(args, dst.get(), *color, mlv_video, time, rawInfo);
         } else {
-            renderCPU(args, dst.get(), mlv_video, time, mlv_height, mlv_width);
-        }
+            RenderTarget target;
+            target.image = dst.get();
+            target.window = renderWin;
 
-        float cacorrection_threshold = _cacorrection_threshold->getValue();
-        if(cacorrection_threshold < 1.0){
+            float cacorrection_threshold = _cacorrection_threshold->getValue();
+            bool cacorrection = cacorrection_threshold < 1.0;
             uint8_t cacorrection_radius = (uint8_t)_cacorrection_radius->getValue();
-            // Apply color aberration correction
-            CACorrection(width_img, height_img, (float*)dst.get()->getPixelData(), cacorrection_threshold, cacorrection_radius);
+            if (proxy){
+                cacorrection_radius = (uint8_t)std::max(1., _cacorrection_radius->getValue() * args.renderScale.x);
+            }
+
+            // The correction follows edges across the tile borders : render the tile grown
+            // by its reach into a scratch buffer, correct it and keep the tile.
+            // Full frames rendered to an image of the same size are corrected in place
+            std::vector<float> scratch;
+            const OfxRectI& dst_bounds = dst->getBounds();
+            OfxRectI image_rect = {0, 0, (int)std::ceil(mlv_width * args.renderScale.x), (int)std::ceil(mlv_height * args.renderScale.y)};
+            if (cacorrection){
+                int reach = 2 * cacorrection_radius + 4;
+                OfxRectI grown = {std::max(renderWin.x1 - reach, image_rect.x1), std::max(renderWin.y1 - reach, image_rect.y1),
+                                  std::min(renderWin.x2 + reach, image_rect.x2), std::min(renderWin.y2 + reach, image_rect.y2)};
+                bool in_place = grown.x1 == renderWin.x1 && grown.y1 == renderWin.y1 && grown.x2 == renderWin.x2 && grown.y2 == renderWin.y2 &&
+                                dst_bounds.x1 == renderWin.x1 && dst_bounds.y1 == renderWin.y1 && dst_bounds.x2 == renderWin.x2 && dst_bounds.y2 == renderWin.y2;
+                if (!in_place){
+                    scratch.resize((size_t)(grown.x2 - grown.x1) * (grown.y2 - grown.y1) * 4);
+                    target.image = nullptr;
+                    target.buffer = scratch.data();
+                    target.window = grown;
+                }
+            }
+
+            if (proxy){
+                // Proxy renders skip the demosaic, on any device
+                renderProxy(args, target, *color, mlv_video, time, rawInfo);
+            } else {
+                renderCPU(args, target, *color, mlv_video, time, mlv_height, mlv_width, rawInfo);
+            }
+
+            if (cacorrection){
+                const OfxRectI& win = target.window;
+                float* pixels = target.buffer ? target.buffer : (float*)dst->getPixelData();
+                // Apply color aberration correction
+                if (CACorrection(win.x2 - win.x1, win.y2 - win.y1, pixels, cacorrection_threshold, cacorrection_radius) < 0){
+                    setPersistentMessage(OFX::Message::eMessageWarning, "", std::string("Warning : Not enough memory, color aberration correction is incomplete"));
+                }
+                if (target.buffer){
+                    for (int y = renderWin.y1; y < renderWin.y2; ++y){
+                        memcpy(dst->getPixelAddress(renderWin.x1, y), target.pixelAddress(renderWin.x1, y), sizeof(float) * 4 * width_img);
+                    }
+                }
+            }
         }
     }
-    mlv_video->unlock();
 }
 
-void MLVReaderPlugin::renderCL(const OFX::RenderArguments &args, OFX::Image* dst, Mlv_video* mlv_video, int time)
+FrameCache::FramePtr MLVReaderPlugin::fetchRawFrame(Mlv_video* mlv_video, int time, Mlv_video::RawInfo& rawInfo)
 {
-    int dng_size = 0;
+    FrameCache::FramePtr frame = _frameCache.get(time, rawInfo.settings_hash());
+    if (!frame){
+        frame = _frameCache.decode(mlv_video, time, rawInfo);
+    }
 
-    mlv_video->get_dng_buffer(time, dng_size, true);
-    uint16_t* raw_buffer = mlv_video->postprocecessed_raw_buffer();
+    // Keep decoding ahead in the playback direction
+    int direction = time >= _lastFrame ? 1 : -1;
+    _lastFrame = time;
+    _frameCache.read_ahead(time, direction, _readAheadFrames->getValue(), rawInfo);
+    // Let the kernel prefetch the payloads the read-ahead is about to decode
+    mlv_video->read_ahead(time, direction, _readAheadFrames->getValue() + 1);
 
-    if (_levelsDirty){
-        _blackLevel->setValue(mlv_video->black_level());
-        _whiteLevel->setValue(mlv_video->white_level());
+    if (frame && _levelsDirty){
+        _blackLevel->setValue(frame->black_level);
+        _whiteLevel->setValue(frame->white_level);
         _resetLevels->setValue(false);
         _levelsDirty = false;
     }
 
-    Matrix3x3f cam_matrix;
-    
-    uint32_t black_level = _blackLevel->getValue();  
-    uint32_t white_level = _whiteLevel->getValue();
+    return frame;
+}
 
-    // Compute clip values
-    float scale = 1. / float(white_level - black_level);
-    float clipping_value = scale * float(white_level - black_level) * _asShotNeutral.min();
+std::string MLVReaderPlugin::rawFrameLabelCL(int time, const Mlv_video::RawInfo& rawInfo)
+{
+    return _mlvfilename_param->getValue() + ":" + std::to_string(time) + ":" + std::to_string(rawInfo.settings_hash());
+}
 
-    if (_highlightMode->getValue() > 0){
-        clipping_value = 10000.f;
+bool MLVReaderPlugin::uploadRawFrameCL(OpenCLResources* cl_res, int slot, const FrameCache::Frame& frame, const std::string& label, bool pipelined)
+{
+    std::string name = "raw" + std::to_string(slot);
+    cl::CommandQueue& queue = cl_res->queue();
+    cl::array<size_t, 3> origin = {0, 0, 0};
+    cl::array<size_t, 3> size = {(size_t)frame.width, (size_t)frame.height, 1};
+    size_t bytes = frame.raw.size() * sizeof(uint16_t);
+
+    cl_int err;
+    cl::Image2D img = cl_res->image(name, CL_MEM_READ_ONLY, cl::ImageFormat(CL_R, CL_UNSIGNED_INT16), frame.width, frame.height, &err);
+    cl_res->label(name).clear();
+    if (err != CL_SUCCESS){
+        return false;
     }
 
-    computeColorspaceMatrix(cam_matrix);
+    if (!pipelined){
+        err = queue.enqueueWriteImage(img, CL_TRUE, origin, size, 0, 0, (void*)frame.raw.data());
+    } else {
+        // The staging memory of this slot may still be read by its previous upload
+        cl::Event& upload = cl_res->event(name);
+        if (upload() != NULL){
+            upload.wait();
+        }
+        void* staging = cl_res->pinnedMemory(name, bytes, &err);
+        if (!staging){
+            return false;
+        }
+        memcpy(staging, frame.raw.data(), bytes);
+        err = queue.enqueueWriteImage(img, CL_FALSE, origin, size, 0, 0, staging, NULL, &upload);
+    }
+    if (err != CL_SUCCESS){
+        return false;
+    }
+    cl_res->label(name) = label;
+    return true;
+}
 
-    int width = mlv_video->raw_resolution_x();
-    int height = mlv_video->raw_resolution_y();
+bool MLVReaderPlugin::runRawStagesCL(OpenCLResources* cl_res, Mlv_video* mlv_video, const FrameCache::Frame& frame, Mlv_video::RawInfo& rawInfo, cl::Image2D& img_raw)
+{
+    const Mlv_video::DeviceFrame& stages = frame.device;
+    if (stages.stages == 0){
+        return true;
+    }
 
-    cl::Image2D img_in(getCurrentCLContext(), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, cl::ImageFormat(CL_R, CL_UNSIGNED_INT16), width, height, 0, raw_buffer);
-    cl::Image2D img_out(getCurrentCLContext(), CL_MEM_WRITE_ONLY, cl::ImageFormat(CL_RGBA, CL_FLOAT), width, height, 0, NULL);
-    cl::Image2D img_tmp(getCurrentCLContext(), CL_MEM_READ_WRITE, cl::ImageFormat(CL_RGBA, CL_FLOAT), width, height, 0, NULL);
-    
-    cl::Event timer;
-    cl::CommandQueue queue = cl::CommandQueue(getCurrentCLContext(), getCurrentCLDevice());
+    // Levels, LUTs and maps of the settings the frame was decoded with
+    mlv_video->low_level_process(rawInfo);
+    Mlv_video::DeviceData data;
+    if (!mlv_video->device_data(data) || data.width != frame.width || data.height != frame.height ||
+        ((stages.stages & Mlv_video::DEVICE_DARK_FRAME) && !data.dark_frame)){
+        setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Low level processing data unavailable"));
+        return false;
+    }
+
+    int width = frame.width;
+    int height = frame.height;
+    cl::CommandQueue& queue = cl_res->queue();
+    cl::array<size_t, 3> origin = {0, 0, 0};
+    cl::array<size_t, 3> region = {(size_t)width, (size_t)height, 1};
+
+    // The stages ping-pong between two work images, the uploaded frame stays untouched
+    cl_int err_a, err_b;
+    cl::ImageFormat raw_format(CL_R, CL_UNSIGNED_INT16);
+    cl::Image2D work[2] = {cl_res->image("rawA", CL_MEM_READ_WRITE, raw_format, width, height, &err_a),
+                           cl_res->image("rawB", CL_MEM_READ_WRITE, raw_format, width, height, &err_b)};
+    if (err_a != CL_SUCCESS || err_b != CL_SUCCESS){
+        setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Image allocation failed"));
+        return false;
+    }
+    int next = 0;
+
+    // Clip data is uploaded once, the labels tell what the device holds
+    cl_int err = CL_SUCCESS;
+    cl::Buffer raw2ev, ev2raw;
+    if (stages.stages & (Mlv_video::DEVICE_FOCUS_PIXELS | Mlv_video::DEVICE_CHROMA_SMOOTH)){
+        raw2ev = cl_res->buffer("raw2ev", CL_MEM_READ_ONLY, sizeof(int) * 65536, &err_a);
+        ev2raw = cl_res->buffer("ev2raw", CL_MEM_READ_ONLY, sizeof(int) * 24 * 65536, &err_b);
+        if (err_a != CL_SUCCESS || err_b != CL_SUCCESS){
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Buffer allocation failed"));
+            return false;
+        }
+        std::string lut_label = std::to_string(data.black);
+        if (cl_res->label("lut") != lut_label){
+            cl_res->label("lut").clear();
+            err = queue.enqueueWriteBuffer(raw2ev, CL_TRUE, 0, sizeof(int) * 65536, data.raw2ev);
+            if (err == CL_SUCCESS){
+                err = queue.enqueueWriteBuffer(ev2raw, CL_TRUE, 0, sizeof(int) * 24 * 65536, data.ev2raw);
+            }
+            if (err != CL_SUCCESS){
+                setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : LUT upload failed"));
+                return false;
+            }
+            cl_res->label("lut") = lut_label;
+        }
+    }
+
+    if (stages.stages & Mlv_video::DEVICE_DARK_FRAME){
+        cl::Image2D dark = cl_res->image("darkframe", CL_MEM_READ_ONLY, raw_format, width, height, &err);
+        if (err != CL_SUCCESS){
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Image allocation failed"));
+            return false;
+        }
+        std::error_code ec;
+        auto mtime = std::filesystem::last_write_time(rawInfo.darkframe_file, ec);
+        std::string dark_label = rawInfo.darkframe_file + ":" + std::to_string(mtime.time_since_epoch().count()) + ":" +
+                                 std::to_string((uintptr_t)data.dark_frame);
+        if (cl_res->label("darkframe") != dark_label){
+            cl_res->label("darkframe").clear();
+            if (queue.enqueueWriteImage(dark, CL_TRUE, origin, region, 0, 0, (void*)data.dark_frame) != CL_SUCCESS){
+                setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Dark frame upload failed"));
+                return false;
+            }
+            cl_res->label("darkframe") = dark_label;
+        }
+
+        cl::Kernel kernel = cl_res->kernel("rawproc", "raw_darkframe");
+        kernel.setArg(0, img_raw);
+        kernel.setArg(1, dark);
+        kernel.setArg(2, work[next]);
+        kernel.setArg(3, width);
+        kernel.setArg(4, height);
+        kernel.setArg(5, data.dark_frame_black);
+        kernel.setArg(6, data.dark_frame_white);
+        kernel.setArg(7, stages.shift_in);
+        if (queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(width, height), cl::NullRange) != CL_SUCCESS){
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Dark frame subtraction failed"));
+            return false;
+        }
+        img_raw = work[next];
+        next = 1 - next;
+    }
+
+    if ((stages.stages & Mlv_video::DEVICE_FOCUS_PIXELS) && data.focus_pixel_count){
+        size_t map_size = sizeof(int) * 2 * data.focus_pixel_count;
+        cl::Buffer pixels = cl_res->buffer("focuspixels", CL_MEM_READ_ONLY, map_size, &err);
+        if (err != CL_SUCCESS){
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Buffer allocation failed"));
+            return false;
+        }
+        std::string map_label = std::to_string((uintptr_t)data.focus_pixels) + ":" + std::to_string(data.focus_pixel_count);
+        if (cl_res->label("focuspixels") != map_label){
+            cl_res->label("focuspixels").clear();
+            if (queue.enqueueWriteBuffer(pixels, CL_TRUE, 0, map_size, data.focus_pixels) != CL_SUCCESS){
+                setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Focus pixel map upload failed"));
+                return false;
+            }
+            cl_res->label("focuspixels") = map_label;
+        }
+
+        // Only the pixels of the map are written
+        queue.enqueueCopyImage(img_raw, work[next], origin, origin, region);
+        cl::Kernel kernel = cl_res->kernel("rawproc", "raw_focus_pixels");
+        kernel.setArg(0, img_raw);
+        kernel.setArg(1, work[next]);
+        kernel.setArg(2, pixels);
+        kernel.setArg(3, (int)data.focus_pixel_count);
+        kernel.setArg(4, stages.crop_x);
+        kernel.setArg(5, stages.crop_y);
+        kernel.setArg(6, width);
+        kernel.setArg(7, height);
+        kernel.setArg(8, raw2ev);
+        kernel.setArg(9, ev2raw);
+        if (queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(data.focus_pixel_count), cl::NullRange) != CL_SUCCESS){
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Focus pixel interpolation failed"));
+            return false;
+        }
+        img_raw = work[next];
+        next = 1 - next;
+    }
+
+    if (stages.stages & Mlv_video::DEVICE_CHROMA_SMOOTH){
+        queue.enqueueCopyImage(img_raw, work[next], origin, origin, region);
+        cl::Kernel kernel = cl_res->kernel("rawproc", "raw_chroma_smooth");
+        kernel.setArg(0, img_raw);
+        kernel.setArg(1, work[next]);
+        kernel.setArg(2, width);
+        kernel.setArg(3, height);
+        kernel.setArg(4, data.chroma_smooth);
+        kernel.setArg(5, data.black);
+        kernel.setArg(6, data.white);
+        kernel.setArg(7, raw2ev);
+        kernel.setArg(8, ev2raw);
+        if (queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(width / 2, height / 2), cl::NullRange) != CL_SUCCESS){
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Chroma smoothing failed"));
+            return false;
+        }
+        img_raw = work[next];
+        next = 1 - next;
+    }
+
+    return true;
+}
+
+bool MLVReaderPlugin::correctCACL(OpenCLResources* cl_res, cl::Image2D& img, int width, int height, cl::Buffer& out)
+{
+    cl::CommandQueue& queue = cl_res->queue();
+    cl_int err;
+    out = cl_res->buffer("ca", CL_MEM_READ_WRITE, sizeof(float) * 4 * width * height, &err);
+    if (err != CL_SUCCESS){
+        setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Buffer allocation failed"));
+        return false;
+    }
+
+    cl::array<size_t, 3> origin = {0, 0, 0};
+    cl::array<size_t, 3> region = {(size_t)width, (size_t)height, 1};
+    if (queue.enqueueCopyImageToBuffer(img, out, origin, region, 0) != CL_SUCCESS){
+        setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Color aberration correction failed"));
+        return false;
+    }
+
+    // Rows then columns, like the transposed second pass of the host version
+    float threshold = _cacorrection_threshold->getValue();
+    int radius = (uint8_t)_cacorrection_radius->getValue();
+    cl::Kernel kernel = cl_res->kernel("rawproc", "ca_correct_lines");
+    const int passes[2][4] = {{height, width, width, 1}, {width, height, 1, width}};
+    for (const int* pass : passes){
+        kernel.setArg(0, out);
+        kernel.setArg(1, pass[0]);
+        kernel.setArg(2, pass[1]);
+        kernel.setArg(3, pass[2]);
+        kernel.setArg(4, pass[3]);
+        kernel.setArg(5, threshold);
+        kernel.setArg(6, radius);
+        if (queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(pass[0]), cl::NullRange) != CL_SUCCESS){
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Color aberration correction failed"));
+            return false;
+        }
+    }
+    return true;
+}
+
+// Bayer color at row, col, the vng kernels take a filter with the second green as a fourth color
+static inline int vngColor(int row, int col, uint32_t filters)
+{
+    return filters >> ((((row) << 1 & 14) + ((col) & 1)) << 1) & 3;
+}
+
+// Interpolation tables of the vng kernels, built like darktable's process_vng_cl
+static void vngTablesCL(uint32_t filters, std::vector<int>& lookup, std::vector<int>& ips, std::vector<int>& code)
+{
+    // neighbors of each sensor position for the linear pass:
+    // count, (offset, weight, color) * count, (color, total weight) * 3, center color
+    const int size = 16;
+    lookup.assign(16 * 16 * 32, 0);
+    for (int row = 0; row < size; row++){
+        for (int col = 0; col < size; col++){
+            int* ip = &lookup[(16 * row + col) * 32 + 1];
+            int sum[4] = {0};
+            const int f = vngColor(row, col, filters);
+            for (int y = -1; y <= 1; y++){
+                for (int x = -1; x <= 1; x++){
+                    const int weight = 1 << ((y == 0) + (x == 0));
+                    const int color = vngColor(row + y, col + x, filters);
+                    if (color == f){
+                        continue;
+                    }
+                    *ip++ = (y << 16) | (x & 0xffff);
+                    *ip++ = weight;
+                    *ip++ = color;
+                    sum[color] += weight;
+                }
+            }
+            lookup[(16 * row + col) * 32] = (ip - &lookup[(16 * row + col) * 32] - 1) / 3;
+            for (int c = 0; c < 4; c++){
+                if (c != f){
+                    *ip++ = c;
+                    *ip++ = sum[c];
+                }
+            }
+            *ip = f;
+        }
+    }
+
+    // gradient terms: y1, x1, y2, x2, weight, gradient mask
+    static const int terms[] = {
+        -2, -2, +0, -1, 1, 0x01, -2, -2, +0, +0, 2, 0x01, -2, -1, -1, +0, 1, 0x01, -2, -1, +0, -1, 1, 0x02,
+        -2, -1, +0, +0, 1, 0x03, -2, -1, +0, +1, 2, 0x01, -2, +0, +0, -1, 1, 0x06, -2, +0, +0, +0, 2, 0x02,
+        -2, +0, +0, +1, 1, 0x03, -2, +1, -1, +0, 1, 0x04, -2, +1, +0, -1, 2, 0x04, -2, +1, +0, +0, 1, 0x06,
+        -2, +1, +0, +1, 1, 0x02, -2, +2, +0, +0, 2, 0x04, -2, +2, +0, +1, 1, 0x04, -1, -2, -1, +0, 1, 0x80,
+        -1, -2, +0, -1, 1, 0x01, -1, -2, +1, -1, 1, 0x01, -1, -2, +1, +0, 2, 0x01, -1, -1, -1, +1, 1, 0x88,
+        -1, -1, +1, -2, 1, 0x40, -1, -1, +1, -1, 1, 0x22, -1, -1, +1, +0, 1, 0x33, -1, -1, +1, +1, 2, 0x11,
+        -1, +0, -1, +2, 1, 0x08, -1, +0, +0, -1, 1, 0x44, -1, +0, +0, +1, 1, 0x11, -1, +0, +1, -2, 2, 0x40,
+        -1, +0, +1, -1, 1, 0x66, -1, +0, +1, +0, 2, 0x22, -1, +0, +1, +1, 1, 0x33, -1, +0, +1, +2, 2, 0x10,
+        -1, +1, +1, -1, 2, 0x44, -1, +1, +1, +0, 1, 0x66, -1, +1, +1, +1, 1, 0x22, -1, +1, +1, +2, 1, 0x10,
+        -1, +2, +0, +1, 1, 0x04, -1, +2, +1, +0, 2, 0x04, -1, +2, +1, +1, 1, 0x04, +0, -2, +0, +0, 2, 0x80,
+        +0, -1, +0, +1, 2, 0x88, +0, -1, +1, -2, 1, 0x40, +0, -1, +1, +0, 1, 0x11, +0, -1, +2, -2, 1, 0x40,
+        +0, -1, +2, -1, 1, 0x20, +0, -1, +2, +0, 1, 0x30, +0, -1, +2, +1, 2, 0x10, +0, +0, +0, +2, 2, 0x08,
+        +0, +0, +2, -2, 2, 0x40, +0, +0, +2, -1, 1, 0x60, +0, +0, +2, +0, 2, 0x20, +0, +0, +2, +1, 1, 0x30,
+        +0, +0, +2, +2, 2, 0x10, +0, +1, +1, +0, 1, 0x44, +0, +1, +1, +2, 1, 0x10, +0, +1, +2, -1, 2, 0x40,
+        +0, +1, +2, +0, 1, 0x60, +0, +1, +2, +1, 1, 0x20, +0, +1, +2, +2, 1, 0x10, +1, -2, +1, +0, 1, 0x80,
+        +1, -1, +1, +1, 1, 0x88, +1, +0, +1, +2, 1, 0x08, +1, +0, +2, -1, 1, 0x40, +1, +0, +2, +1, 1, 0x10,
+    };
+    static const int chood[] = {-1, -1, -1, 0, -1, +1, 0, +1, +1, +1, +1, 0, +1, -1, 0, -1};
+
+    const int prow = 8, pcol = 2;
+    ips.assign(prow * pcol * 352, 0);
+    code.assign(16 * 16, 0);
+    int* ip = ips.data();
+    for (int row = 0; row < prow; row++){
+        for (int col = 0; col < pcol; col++){
+            code[16 * row + col] = ip - ips.data();
+            const int* cp = terms;
+            for (int t = 0; t < 64; t++){
+                const int y1 = *cp++, x1 = *cp++;
+                const int y2 = *cp++, x2 = *cp++;
+                const int weight = *cp++;
+                const int grads = *cp++;
+                const int color = vngColor(row + y1, col + x1, filters);
+                if (vngColor(row + y2, col + x2, filters) != color){
+                    continue;
+                }
+                const int diag = (vngColor(row, col + 1, filters) == color && vngColor(row + 1, col, filters) == color) ? 2 : 1;
+                if (abs(y1 - y2) == diag && abs(x1 - x2) == diag){
+                    continue;
+                }
+                *ip++ = (y1 << 16) | (x1 & 0xffff);
+                *ip++ = (y2 << 16) | (x2 & 0xffff);
+                *ip++ = (color << 16) | (weight & 0xffff);
+                for (int g = 0; g < 8; g++){
+                    if (grads & 1 << g){
+                        *ip++ = g;
+                    }
+                }
+                *ip++ = -1;
+            }
+            *ip++ = INT_MAX;
+            cp = chood;
+            for (int g = 0; g < 8; g++){
+                const int y = *cp++, x = *cp++;
+                *ip++ = (y << 16) | (x & 0xffff);
+                const int color = vngColor(row, col, filters);
+                if (vngColor(row + y, col + x, filters) != color && vngColor(row + y * 2, col + x * 2, filters) == color){
+                    *ip++ = (2 * y << 16) | (2 * x & 0xffff);
+                    *ip++ = color;
+                } else {
+                    *ip++ = 0;
+                    *ip++ = 0;
+                }
+            }
+        }
+    }
+}
+
+bool MLVReaderPlugin::demosaicVNGCL(OpenCLResources* cl_res, const ColorState& color, cl::Image2D& img_in, cl::Image2D& img_tmp, cl::Image2D& img_out, cl::Buffer& matrix,
+                                    int width, int height, uint32_t filters, uint32_t black_level, uint32_t white_level, float clipping_value, float headroom)
+{
+    cl::CommandQueue& queue = cl_res->queue();
+    const uint32_t filters4 = (filters & 3) == 1 ? filters | 0x03030303u : filters | 0x0c0c0c0cu;
+
+    cl_int err_cfa, err_aux;
+    cl::Image2D img_cfa = cl_res->image("vng_cfa", CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), width, height, &err_cfa);
+    cl::Image2D img_aux = cl_res->image("vng_aux", CL_MEM_READ_WRITE, cl::ImageFormat(CL_RGBA, CL_FLOAT), width, height, &err_aux);
+    if (err_cfa != CL_SUCCESS || err_aux != CL_SUCCESS){
+        setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Image allocation failed"));
+        return false;
+    }
+
+    // The tables only depend on the filter, they stay on the device
+    cl_int err_lookup, err_ips, err_code, err_xtrans;
+    cl::Buffer lookup_buffer = cl_res->buffer("vng_lookup", CL_MEM_READ_ONLY, sizeof(int) * 16 * 16 * 32, &err_lookup);
+    cl::Buffer ips_buffer = cl_res->buffer("vng_ips", CL_MEM_READ_ONLY, sizeof(int) * 8 * 2 * 352, &err_ips);
+    cl::Buffer code_buffer = cl_res->buffer("vng_code", CL_MEM_READ_ONLY, sizeof(int) * 16 * 16, &err_code);
+    // X-Trans pattern, unused with Bayer filters
+    cl::Buffer xtrans_buffer = cl_res->buffer("vng_xtrans", CL_MEM_READ_ONLY, 6 * 6, &err_xtrans);
+    if (err_lookup != CL_SUCCESS || err_ips != CL_SUCCESS || err_code != CL_SUCCESS || err_xtrans != CL_SUCCESS){
+        setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Buffer allocation failed"));
+        return false;
+    }
+    std::string tables_label = std::to_string(filters4);
+    if (cl_res->label("vng") != tables_label){
+        std::vector<int> lookup, ips, code;
+        vngTablesCL(filters4, lookup, ips, code);
+        cl_res->label("vng").clear();
+        if (queue.enqueueWriteBuffer(lookup_buffer, CL_TRUE, 0, sizeof(int) * lookup.size(), lookup.data()) != CL_SUCCESS ||
+            queue.enqueueWriteBuffer(ips_buffer, CL_TRUE, 0, sizeof(int) * ips.size(), ips.data()) != CL_SUCCESS ||
+            queue.enqueueWriteBuffer(code_buffer, CL_TRUE, 0, sizeof(int) * code.size(), code.data()) != CL_SUCCESS){
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : VNG tables upload failed"));
+            return false;
+        }
+        cl_res->label("vng") = tables_label;
+    }
+
+    cl::NDRange full(width, height);
+    int r_x = 0, r_y = 0;
+
+    {
+        // Normalized, white balanced sensor data
+        cl::Kernel kernel_prepare = cl_res->kernel("debayer_vng", "vng_prepare_raw");
+        kernel_prepare.setArg(0, img_in);
+        kernel_prepare.setArg(1, img_cfa);
+        kernel_prepare.setArg(2, width);
+        kernel_prepare.setArg(3, height);
+        kernel_prepare.setArg(4, filters);
+        kernel_prepare.setArg(5, black_level);
+        kernel_prepare.setArg(6, white_level);
+        kernel_prepare.setArg(7, color.wb[0]);
+        kernel_prepare.setArg(8, color.wb[2]);
+        kernel_prepare.setArg(9, clipping_value);
+        if (queue.enqueueNDRangeKernel(kernel_prepare, cl::NullRange, full, cl::NullRange) != CL_SUCCESS){
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : VNG input failed"));
+            return false;
+        }
+    }
 
-    // Standard Canon filter (RGGB)
-    uint32_t bayer_filter = 0x94949494;
     {
-        // Process borders
+        // Borders and linear interpolation
+        cl::Kernel kernel_border = cl_res->kernel("debayer_vng", "vng_border_interpolate");
+        kernel_border.setArg(0, img_cfa);
+        kernel_border.setArg(1, img_tmp);
+        kernel_border.setArg(2, width);
+        kernel_border.setArg(3, height);
+        kernel_border.setArg(4, 1);
+        kernel_border.setArg(5, r_x);
+        kernel_border.setArg(6, r_y);
+        kernel_border.setArg(7, filters4);
+        kernel_border.setArg(8, xtrans_buffer);
+        if (queue.enqueueNDRangeKernel(kernel_border, cl::NullRange, full, cl::NullRange) != CL_SUCCESS){
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Border interpolation failed"));
+            return false;
+        }
+
         OpenCLLocalBufferStruct locopt
         = (OpenCLLocalBufferStruct){ .xoffset = 2*1, .xfactor = 1, .yoffset = 2*1, .yfactor = 1,
-                                     .cellsize = 4 * sizeof(float), .overhead = 0,
+                                     .cellsize = sizeof(float) * 1, .overhead = 0,
                                      .sizex = 1 << 8, .sizey = 1 << 8 };
-        cl::Kernel kernel_demosaic_border(getProgram("debayer_ppg"), "border_interpolate");
-        if (!openCLGetLocalBufferOpt(getCurrentCLDevice(), kernel_demosaic_border, &locopt)){
-            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Invalid work dimension (border_interpolate)"));
-            return;
+        if (!cl_res->localBufferOpt("debayer_vng", "vng_lin_interpolate", locopt)){
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Invalid work dimension (vng_lin_interpolate)"));
+            return false;
         }
 
-        kernel_demosaic_border.setArg(0, img_in);
-        kernel_demosaic_border.setArg(1, img_tmp);
-        kernel_demosaic_border.setArg(2, width);
-        kernel_demosaic_border.setArg(3, height);
-        kernel_demosaic_border.setArg(4, bayer_filter);
-        kernel_demosaic_border.setArg(5, 3);
-        kernel_demosaic_border.setArg(6, black_level);
-        kernel_demosaic_border.setArg(7, white_level);
-        kernel_demosaic_border.setArg(8, _asShotNeutral[0]);
-        kernel_demosaic_border.setArg(9, _asShotNeutral[2]);
-        kernel_demosaic_border.setArg(10, clipping_value);
+        cl::NDRange sizes( ROUNDUP(width, locopt.sizex), ROUNDUP(height, locopt.sizey) );
+        cl::NDRange local( locopt.sizex, locopt.sizey );
 
-        cl::NDRange sizes(width, height);
-        
-        bool ok = queue.enqueueNDRangeKernel(kernel_demosaic_border, cl::NullRange, sizes, cl::NullRange, NULL, &timer);
-        if (ok != CL_SUCCESS){
-            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Border interpolation failed"));
-            return;
+        cl::Kernel kernel_linear = cl_res->kernel("debayer_vng", "vng_lin_interpolate");
+        kernel_linear.setArg(0, img_cfa);
+        kernel_linear.setArg(1, img_tmp);
+        kernel_linear.setArg(2, width);
+        kernel_linear.setArg(3, height);
+        kernel_linear.setArg(4, filters4);
+        kernel_linear.setArg(5, lookup_buffer);
+        kernel_linear.setArg(6, sizeof(float) * (locopt.sizex + 2) * (locopt.sizey + 2), nullptr);
+        if (queue.enqueueNDRangeKernel(kernel_linear, cl::NullRange, sizes, local) != CL_SUCCESS){
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : VNG linear interpolation failed"));
+            return false;
         }
     }
 
     {
-        // Process green channel
+        // Gradient based interpolation, the outermost 2 pixels come from the border kernel
         OpenCLLocalBufferStruct locopt
-        = (OpenCLLocalBufferStruct){ .xoffset = 2*3, .xfactor = 1, .yoffset = 2*3, .yfactor = 1,
-                                     .cellsize = sizeof(float) * 1, .overhead = 0,
+        = (OpenCLLocalBufferStruct){ .xoffset = 2*2, .xfactor = 1, .yoffset = 2*2, .yfactor = 1,
+                                     .cellsize = 4 * sizeof(float), .overhead = 0,
                                      .sizex = 1 << 8, .sizey = 1 << 8 };
-        cl::Kernel kernel_demosaic_green(getProgram("debayer_ppg"), "ppg_demosaic_green");
-        if (!openCLGetLocalBufferOpt(getCurrentCLDevice(), kernel_demosaic_green, &locopt)){
-            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Invalid work dimension (green)"));
-            return;
+        if (!cl_res->localBufferOpt("debayer_vng", "vng_interpolate", locopt)){
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Invalid work dimension (vng_interpolate)"));
+            return false;
         }
-        
+
         cl::NDRange sizes( ROUNDUP(width, locopt.sizex), ROUNDUP(height, locopt.sizey) );
         cl::NDRange local( locopt.sizex, locopt.sizey );
 
-        kernel_demosaic_green.setArg(0, img_in);
-        kernel_demosaic_green.setArg(1, img_tmp);
-        kernel_demosaic_green.setArg(2, width);
-        kernel_demosaic_green.setArg(3, height);
-        kernel_demosaic_green.setArg(4, bayer_filter);
-        kernel_demosaic_green.setArg(5, black_level);
-        kernel_demosaic_green.setArg(6, white_level);
-        kernel_demosaic_green.setArg(7, sizeof(float) * (locopt.sizex + 2*3) * (locopt.sizey + 2*3), nullptr);
-        kernel_demosaic_green.setArg(8, _asShotNeutral[0]);
-        kernel_demosaic_green.setArg(9, _asShotNeutral[2]);
-        kernel_demosaic_green.setArg(10, clipping_value);
-        
-        bool ok = queue.enqueueNDRangeKernel(kernel_demosaic_green, cl::NullRange, sizes, local, NULL, &timer);
-        if (ok != CL_SUCCESS){
-            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Green channel demosaic failed"));
-            return;
+        cl::Kernel kernel_vng = cl_res->kernel("debayer_vng", "vng_interpolate");
+        kernel_vng.setArg(0, img_tmp);
+        kernel_vng.setArg(1, img_aux);
+        kernel_vng.setArg(2, width);
+        kernel_vng.setArg(3, height);
+        kernel_vng.setArg(4, r_x);
+        kernel_vng.setArg(5, r_y);
+        kernel_vng.setArg(6, filters4);
+        kernel_vng.setArg(7, xtrans_buffer);
+        kernel_vng.setArg(8, ips_buffer);
+        kernel_vng.setArg(9, code_buffer);
+        kernel_vng.setArg(10, sizeof(float) * 4 * (locopt.sizex + 4) * (locopt.sizey + 4), nullptr);
+        if (queue.enqueueNDRangeKernel(kernel_vng, cl::NullRange, sizes, local) != CL_SUCCESS){
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : VNG interpolation failed"));
+            return false;
+        }
+
+        cl::Kernel kernel_border = cl_res->kernel("debayer_vng", "vng_border_interpolate");
+        kernel_border.setArg(0, img_cfa);
+        kernel_border.setArg(1, img_aux);
+        kernel_border.setArg(2, width);
+        kernel_border.setArg(3, height);
+        kernel_border.setArg(4, 2);
+        kernel_border.setArg(5, r_x);
+        kernel_border.setArg(6, r_y);
+        kernel_border.setArg(7, filters4);
+        kernel_border.setArg(8, xtrans_buffer);
+        if (queue.enqueueNDRangeKernel(kernel_border, cl::NullRange, full, cl::NullRange) != CL_SUCCESS){
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Border interpolation failed"));
+            return false;
         }
     }
 
     {
-        // Process red/blue channels
-        OpenCLLocalBufferStruct locopt
-        = (OpenCLLocalBufferStruct){  .xoffset = 2*1, .xfactor = 1, .yoffset = 2*1, .yfactor = 1,
-                                    .cellsize = 4 * sizeof(float), .overhead = 0,
-                                    .sizex = 1 << 8, .sizey = 1 << 8 };
-        cl::Kernel kernel_demosaic_redblue(getProgram("debayer_ppg"), "ppg_demosaic_redblue");
-        if (!openCLGetLocalBufferOpt(getCurrentCLDevice(), kernel_demosaic_redblue, &locopt)){
-            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Invalid work dimension (red/blue)"));
-            return;
+        // Green equilibration and output transform
+        cl::Kernel kernel_output = cl_res->kernel("debayer_vng", "vng_color_output");
+        kernel_output.setArg(0, img_aux);
+        kernel_output.setArg(1, img_out);
+        kernel_output.setArg(2, width);
+        kernel_output.setArg(3, height);
+        kernel_output.setArg(4, matrix);
+        kernel_output.setArg(5, headroom);
+        if (queue.enqueueNDRangeKernel(kernel_output, cl::NullRange, full, cl::NullRange) != CL_SUCCESS){
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : VNG output failed"));
+            return false;
         }
+    }
 
-        float headroom = _outputColorSpace->getValue() < 2 ? _headroom->getValue() : 1;
+    return true;
+}
 
+// Device stages and demosaic of the frame uploaded to the raw slot, into img_out
+bool MLVReaderPlugin::developCL(OpenCLResources* cl_res, const ColorState& color, Mlv_video* mlv_video, const FrameCache::Frame& frame, Mlv_video::RawInfo& rawInfo,
+                                int slot, const Matrix3x3f& cam_matrix, bool pipelined, cl::Image2D& img_out)
+{
+    int width = mlv_video->raw_resolution_x();
+    int height = mlv_video->raw_resolution_y();
+
+    uint32_t black_level = _blackLevel->getValue();  
+    uint32_t white_level = _whiteLevel->getValue();
+
+    // Compute clip values
+    float scale = 1. / float(white_level - black_level);
+    float clipping_value = scale * float(white_level - black_level) * color.wb.min();
+
+    if (_highlightMode->getValue() > 0){
+        clipping_value = 10000.f;
+    }
+
+    cl_int err_in, err_tmp;
+    cl::Image2D img_in = cl_res->image("raw" + std::to_string(slot), CL_MEM_READ_ONLY, cl::ImageFormat(CL_R, CL_UNSIGNED_INT16), width, height, &err_in);
+    cl::Image2D img_tmp = cl_res->image("tmp", CL_MEM_READ_WRITE, cl::ImageFormat(CL_RGBA, CL_FLOAT), width, height, &err_tmp);
+    if (err_in != CL_SUCCESS || err_tmp != CL_SUCCESS){
+        setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Image allocation failed"));
+        return false;
+    }
+
+    // Low level stages the host processing left for the device, they keep 14bit precision
+    if (!runRawStagesCL(cl_res, mlv_video, frame, rawInfo, img_in)){
+        return false;
+    }
+    black_level <<= frame.device.shift_out;
+    white_level <<= frame.device.shift_out;
+
+    cl::Event timer;
+    cl::CommandQueue& queue = cl_res->queue();
+
+    // Standard Canon filter (RGGB)
+    uint32_t bayer_filter = 0x94949494;
+    float headroom = _outputColorSpace->getValue() < 2 ? _headroom->getValue() : 1;
+
+    // matrixbufer [0-8] = forward matrix, [9-17] = idt matrix
+    cl::Buffer matrixbuffer = cl_res->buffer("matrix", CL_MEM_READ_ONLY, sizeof(float) * 9);
+    if (pipelined){
+        // Non blocking write, cam_matrix does not outlive an early return
+        float* matrix_host = (float*)cl_res->pinnedMemory("matrix", sizeof(float) * 9);
+        if (!matrix_host){
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Pinned memory allocation failed"));
+            return false;
+        }
+        memcpy(matrix_host, cam_matrix.data(), sizeof(float) * 9);
+        queue.enqueueWriteBuffer(matrixbuffer, CL_FALSE, 0, sizeof(float) * 9, matrix_host);
+    } else {
+        queue.enqueueWriteBuffer(matrixbuffer, CL_TRUE, 0, sizeof(float) * 9, cam_matrix.data());
+    }
+
+    // VNG on request, PPG for the other algorithms
+    if (_debayerType->getValue() == 2){
+        if (!demosaicVNGCL(cl_res, color, img_in, img_tmp, img_out, matrixbuffer, width, height, bayer_filter,
+                           black_level, white_level, clipping_value, headroom)){
+            queue.finish();
+            return false;
+        }
+    } else {
+        {
+            // Process borders
+            OpenCLLocalBufferStruct locopt
+            = (OpenCLLocalBufferStruct){ .xoffset = 2*1, .xfactor = 1, .yoffset = 2*1, .yfactor = 1,
+                                         .cellsize = 4 * sizeof(float), .overhead = 0,
+                                         .sizex = 1 << 8, .sizey = 1 << 8 };
+            cl::Kernel kernel_demosaic_border = cl_res->kernel("debayer_ppg", "border_interpolate");
+            if (!cl_res->localBufferOpt("debayer_ppg", "border_interpolate", locopt)){
+                setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Invalid work dimension (border_interpolate)"));
+                return false;
+            }
+
+            kernel_demosaic_border.setArg(0, img_in);
+            kernel_demosaic_border.setArg(1, img_tmp);
+            kernel_demosaic_border.setArg(2, width);
+            kernel_demosaic_border.setArg(3, height);
+            kernel_demosaic_border.setArg(4, bayer_filter);
+            kernel_demosaic_border.setArg(5, 3);
+            kernel_demosaic_border.setArg(6, black_level);
+            kernel_demosaic_border.setArg(7, white_level);
+            kernel_demosaic_border.setArg(8, color.wb[0]);
+            kernel_demosaic_border.setArg(9, color.wb[2]);
+            kernel_demosaic_border.setArg(10, clipping_value);
+
+            cl::NDRange sizes(width, height);
         
-        cl::NDRange sizes( ROUNDUP(width, locopt.sizex), ROUNDUP(height, locopt.sizey) );
-        cl::NDRange local( locopt.sizex, locopt.sizey );
+            bool ok = queue.enqueueNDRangeKernel(kernel_demosaic_border, cl::NullRange, sizes, cl::NullRange, NULL, &timer);
+            if (ok != CL_SUCCESS){
+                setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Border interpolation failed"));
+                return false;
+            }
+        }
+
+        {
+            // Process green channel
+            OpenCLLocalBufferStruct locopt
+            = (OpenCLLocalBufferStruct){ .xoffset = 2*3, .xfactor = 1, .yoffset = 2*3, .yfactor = 1,
+                                         .cellsize = sizeof(float) * 1, .overhead = 0,
+                                         .sizex = 1 << 8, .sizey = 1 << 8 };
+            cl::Kernel kernel_demosaic_green = cl_res->kernel("debayer_ppg", "ppg_demosaic_green");
+            if (!cl_res->localBufferOpt("debayer_ppg", "ppg_demosaic_green", locopt)){
+                setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Invalid work dimension (green)"));
+                return false;
+            }
         
-        // matrixbufer [0-8] = forward matrix, [9-17] = idt matrix
-        cl::Buffer matrixbuffer(getCurrentCLContext(), CL_MEM_READ_ONLY, sizeof(float) * 9);
-        kernel_demosaic_redblue.setArg(0, img_tmp);
-        kernel_demosaic_redblue.setArg(1, img_out);
-        kernel_demosaic_redblue.setArg(2, width);
-        kernel_demosaic_redblue.setArg(3, height);
-        kernel_demosaic_redblue.setArg(4, bayer_filter);
-        kernel_demosaic_redblue.setArg(5, matrixbuffer);
-        kernel_demosaic_redblue.setArg(6, headroom);
-        kernel_demosaic_redblue.setArg(7, sizeof(float) * 4 * (locopt.sizex + 2) * (locopt.sizey + 2), nullptr);
+            cl::NDRange sizes( ROUNDUP(width, locopt.sizex), ROUNDUP(height, locopt.sizey) );
+            cl::NDRange local( locopt.sizex, locopt.sizey );
+
+            kernel_demosaic_green.setArg(0, img_in);
+            kernel_demosaic_green.setArg(1, img_tmp);
+            kernel_demosaic_green.setArg(2, width);
+            kernel_demosaic_green.setArg(3, height);
+            kernel_demosaic_green.setArg(4, bayer_filter);
+            kernel_demosaic_green.setArg(5, black_level);
+            kernel_demosaic_green.setArg(6, white_level);
+            kernel_demosaic_green.setArg(7, sizeof(float) * (locopt.sizex + 2*3) * (locopt.sizey + 2*3), nullptr);
+            kernel_demosaic_green.setArg(8, color.wb[0]);
+            kernel_demosaic_green.setArg(9, color.wb[2]);
+            kernel_demosaic_green.setArg(10, clipping_value);
         
-        queue.enqueueWriteBuffer(matrixbuffer, CL_TRUE, 0, sizeof(float) * 9, cam_matrix.data());
-        bool ok = queue.enqueueNDRangeKernel(kernel_demosaic_redblue, cl::NullRange, sizes, local, NULL, &timer);
-        if (ok != CL_SUCCESS){
-            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Green channel demosaic failed"));
+            bool ok = queue.enqueueNDRangeKernel(kernel_demosaic_green, cl::NullRange, sizes, local, NULL, &timer);
+            if (ok != CL_SUCCESS){
+                setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Green channel demosaic failed"));
+                return false;
+            }
+        }
+
+        {
+            // Process red/blue channels
+            OpenCLLocalBufferStruct locopt
+            = (OpenCLLocalBufferStruct){  .xoffset = 2*1, .xfactor = 1, .yoffset = 2*1, .yfactor = 1,
+                                        .cellsize = 4 * sizeof(float), .overhead = 0,
+                                        .sizex = 1 << 8, .sizey = 1 << 8 };
+            cl::Kernel kernel_demosaic_redblue = cl_res->kernel("debayer_ppg", "ppg_demosaic_redblue");
+            if (!cl_res->localBufferOpt("debayer_ppg", "ppg_demosaic_redblue", locopt)){
+                setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Invalid work dimension (red/blue)"));
+                return false;
+            }
+
+            cl::NDRange sizes( ROUNDUP(width, locopt.sizex), ROUNDUP(height, locopt.sizey) );
+            cl::NDRange local( locopt.sizex, locopt.sizey );
+        
+            kernel_demosaic_redblue.setArg(0, img_tmp);
+            kernel_demosaic_redblue.setArg(1, img_out);
+            kernel_demosaic_redblue.setArg(2, width);
+            kernel_demosaic_redblue.setArg(3, height);
+            kernel_demosaic_redblue.setArg(4, bayer_filter);
+            kernel_demosaic_redblue.setArg(5, matrixbuffer);
+            kernel_demosaic_redblue.setArg(6, headroom);
+            kernel_demosaic_redblue.setArg(7, sizeof(float) * 4 * (locopt.sizex + 2) * (locopt.sizey + 2), nullptr);
+        
+            bool ok = queue.enqueueNDRangeKernel(kernel_demosaic_redblue, cl::NullRange, sizes, local, NULL, &timer);
+            if (ok != CL_SUCCESS){
+                setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Green channel demosaic failed"));
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+void MLVReaderPlugin::renderCL(const OFX::RenderArguments &args, OFX::Image* dst, const ColorState& color, Mlv_video* mlv_video, int time, Mlv_video::RawInfo& rawInfo)
+{
+    int previous_frame = _lastFrame;
+    FrameCache::FramePtr frame = fetchRawFrame(mlv_video, time, rawInfo);
+    if (!frame){
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+        return;
+    }
+
+    Matrix3x3f cam_matrix;
+    computeColorspaceMatrix(color, mlv_video, cam_matrix);
+
+    int width = mlv_video->raw_resolution_x();
+    int height = mlv_video->raw_resolution_y();
+
+    // Queue, kernels and images are kept from frame to frame
+    std::shared_ptr<OpenCLResources> cl_res = acquireCLResources();
+    if (!cl_res){
+        setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : No program available"));
+        return;
+    }
+
+    // In pipelined mode the raw frame goes through two slots: while this frame
+    // is processed, the next one in the playback direction is uploaded to the
+    // other slot, and the next render finds it already on the device
+    bool pipelined = _openCLPipeline->getValue();
+    std::string frame_label = rawFrameLabelCL(time, rawInfo);
+    int slot = 0;
+    if (pipelined && cl_res->label("raw1") == frame_label){
+        slot = 1;
+    }
+
+    cl_int err_out;
+    cl::Image2D img_out = cl_res->image("out", CL_MEM_WRITE_ONLY, cl::ImageFormat(CL_RGBA, CL_FLOAT), width, height, &err_out);
+    if (err_out != CL_SUCCESS){
+        setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Image allocation failed"));
+        return;
+    }
+
+    // The developed frame stays on the device, the other tiles of this frame
+    // and parameter set only read their window back.
+    // The label holds every scalar the develop kernels get
+    bool cacorrection = _cacorrection_threshold->getValue() < 1.0;
+    std::string developed_label = frame_label + ":" + std::to_string(width) + "x" + std::to_string(height) + ":" +
+                                  std::to_string(frame->device.shift_out) + ":" + std::to_string(_debayerType->getValue()) + ":" +
+                                  std::to_string(_blackLevel->getValue()) + ":" + std::to_string(_whiteLevel->getValue()) + ":" +
+                                  std::to_string(_highlightMode->getValue()) + ":" + std::to_string(_outputColorSpace->getValue()) + ":" +
+                                  std::to_string(_headroom->getValue());
+    for (int i = 0; i < 3; ++i){
+        developed_label += ":" + std::to_string(color.wb[i]);
+    }
+    for (int i = 0; i < 9; ++i){
+        developed_label += ":" + std::to_string(cam_matrix.data()[i]);
+    }
+    if (cacorrection){
+        developed_label += ":" + std::to_string(_cacorrection_threshold->getValue()) + ":" + std::to_string(_cacorrection_radius->getValue());
+    }
+
+    cl::CommandQueue& queue = cl_res->queue();
+    cl::Buffer ca_buffer;
+    if (cl_res->label("out") != developed_label){
+        cl_res->label("out").clear();
+        if (cl_res->label("raw" + std::to_string(slot)) != frame_label &&
+            !uploadRawFrameCL(cl_res.get(), slot, *frame, frame_label, pipelined)){
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Raw frame upload failed"));
             return;
         }
+        if (!developCL(cl_res.get(), color, mlv_video, *frame, rawInfo, slot, cam_matrix, pipelined, img_out)){
+            queue.finish();
+            return;
+        }
+
+        // Color aberration correction works on a buffer copy of the output
+        if (cacorrection && !correctCACL(cl_res.get(), img_out, width, height, ca_buffer)){
+            queue.finish();
+            return;
+        }
+        cl_res->label("out") = developed_label;
+    } else if (cacorrection){
+        ca_buffer = cl_res->buffer("ca", CL_MEM_READ_WRITE, sizeof(float) * 4 * width * height);
     }
 
     // Fetch result from GPU
     cl::array<size_t, 3> origin = {(size_t)args.renderWindow.x1, (size_t)args.renderWindow.y1, 0};
     cl::array<size_t, 3> size = {(size_t)(args.renderWindow.x2 - args.renderWindow.x1), (size_t)(args.renderWindow.y2 - args.renderWindow.y1), 1};
-    queue.enqueueReadImage(img_out, CL_TRUE, origin, size, 0, 0, (float*)dst->getPixelData());
-    queue.finish();
+    cl::array<size_t, 3> buffer_origin = {origin[0] * sizeof(float) * 4, origin[1], 0};
+    cl::array<size_t, 3> host_origin = {0, 0, 0};
+    cl::array<size_t, 3> buffer_region = {size[0] * sizeof(float) * 4, size[1], 1};
+    size_t row_pitch = sizeof(float) * 4 * width;
+    // The tile lands at its place in the output image, which can be larger
+    size_t host_pitch = dst->getRowBytes();
+    void* host_ptr = dst->getPixelAddress(args.renderWindow.x1, args.renderWindow.y1);
+    if (!pipelined){
+        if (cacorrection){
+            queue.enqueueReadBufferRect(ca_buffer, CL_TRUE, buffer_origin, host_origin, buffer_region, row_pitch, 0, host_pitch, 0, host_ptr);
+        } else {
+            queue.enqueueReadImage(img_out, CL_TRUE, origin, size, host_pitch, 0, host_ptr);
+        }
+        queue.finish();
+        return;
+    }
+
+    cl::Event readback;
+    cl_int err_read;
+    if (cacorrection){
+        err_read = queue.enqueueReadBufferRect(ca_buffer, CL_FALSE, buffer_origin, host_origin, buffer_region, row_pitch, 0, host_pitch, 0, host_ptr, NULL, &readback);
+    } else {
+        err_read = queue.enqueueReadImage(img_out, CL_FALSE, origin, size, host_pitch, 0, host_ptr, NULL, &readback);
+    }
+    if (err_read != CL_SUCCESS){
+        queue.finish();
+        setPersistentMessage(OFX::Message::eMessageError, "", std::string("OpenCL : Image read back failed"));
+        return;
+    }
+    queue.flush();
+
+    // Decode and upload the next frame while the device works on this one
+    int step = time - previous_frame;
+    int next = time + step;
+    if ((step == 1 || step == -1) && next >= 0 && next < (int)mlv_video->frame_count()){
+        std::string next_label = rawFrameLabelCL(next, rawInfo);
+        if (cl_res->label("raw" + std::to_string(1 - slot)) != next_label){
+            // Only a frame the read-ahead thread already decoded, this render
+            // never waits for the next one : its own render does if needed
+            FrameCache::FramePtr next_frame = _frameCache.get(next, rawInfo.settings_hash());
+            if (next_frame){
+                uploadRawFrameCL(cl_res.get(), 1 - slot, *next_frame, next_label, true);
+                queue.flush();
+            }
+        }
+    }
+
+    readback.wait();
 }
 
-void MLVReaderPlugin::renderCPU(const OFX::RenderArguments &args, OFX::Image* dst, Mlv_video* mlv_video, int time, int height_img, int width_img)
+void MLVReaderPlugin::renderCPU(const OFX::RenderArguments &args, const RenderTarget& target, const ColorState& color, Mlv_video* mlv_video, int time, int height_img, int width_img, Mlv_video::RawInfo& rawInfo)
 {
+    // Linear, PPG and AHD have a native multithreaded implementation
+    int debayer_type = _debayerType->getValue();
+    if (debayer_type == 1 || debayer_type == 3 || debayer_type == 4){
+        renderCPUNative(args, target, color, mlv_video, time, height_img, width_img, rawInfo);
+        return;
+    }
+
     int dng_size = 0;
+    mlv_video->low_level_process(rawInfo);
     mlv_video->set_dng_raw_levels(_blackLevel->getValue(), _whiteLevel->getValue());
     uint16_t* dng_buffer = mlv_video->get_dng_buffer(time, dng_size, false);
 
@@ -501,35 +1449,96 @@ void MLVReaderPlugin::renderCPU(const OFX::RenderArguments &args, OFX::Image* ds
     dng_processor.set_highlight(highlight_mode);
 
     // Get raw buffer -> raw colors
-    uint16_t* processed_buffer = dng_processor.get_processed_image((uint8_t*)dng_buffer, dng_size, _asShotNeutral.data());
+    Vector3f wb = color.wb;
+    uint16_t* processed_buffer = dng_processor.get_processed_image((uint8_t*)dng_buffer, dng_size, wb.data());
     free(dng_buffer);
     
     ColorProcessor processor(*this);
-    processor.setDstImg(dst);
+    processor.setDstImg(target.image);
+    processor.target = target;
     processor.raw_buffer = processed_buffer;
-    processor.setRenderWindow(args.renderWindow, args.renderScale);
+    processor.setRenderWindow(target.window, args.renderScale);
     processor.wl =_whiteLevel->getValue();
     processor.bl = _blackLevel->getValue();
     processor.raw_width = width_img;
     processor.raw_height = height_img;
-    processor.cam_mult = _asShotNeutral;
+    processor.cam_mult = color.wb;
     processor.clip = _highlightMode->getValue() == 0;
     processor.headroom = _outputColorSpace->getValue() < 2 ? _headroom->getValue() : 1;
-    computeColorspaceMatrix(processor.idt_matrix);
+    computeColorspaceMatrix(color, mlv_video, processor.idt_matrix);
 
     processor.process();
 }
 
-void MLVReaderPlugin::computeColorspaceMatrix(Matrix3x3f& out_matrix)
+void MLVReaderPlugin::renderProxy(const OFX::RenderArguments &args, const RenderTarget& target, const ColorState& color, Mlv_video* mlv_video, int time, Mlv_video::RawInfo& rawInfo)
 {
-    Mlv_video * mlv_video = getMlv();
-    if (mlv_video == nullptr){
+    FrameCache::FramePtr frame = fetchRawFrame(mlv_video, time, rawInfo);
+    if (!frame){
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+        return;
+    }
+
+    ProxyProcessor processor(*this);
+    processor.setDstImg(target.image);
+    processor.target = target;
+    processor.raw_buffer = frame->raw.data();
+    processor.setRenderWindow(target.window, args.renderScale);
+    processor.render_scale = args.renderScale;
+    processor.wl = _whiteLevel->getValue();
+    processor.bl = _blackLevel->getValue();
+    processor.raw_width = frame->width;
+    processor.raw_height = frame->height;
+    processor.cam_mult = color.wb;
+    processor.clip = _highlightMode->getValue() == 0;
+    processor.headroom = _outputColorSpace->getValue() < 2 ? _headroom->getValue() : 1;
+    computeColorspaceMatrix(color, mlv_video, processor.idt_matrix);
+
+    processor.process();
+}
+
+void MLVReaderPlugin::renderCPUNative(const OFX::RenderArguments &args, const RenderTarget& target, const ColorState& color, Mlv_video* mlv_video, int time, int height_img, int width_img, Mlv_video::RawInfo& rawInfo)
+{
+    // Direct path : unpacked bayer plane -> native demosaic -> color processor
+    FrameCache::FramePtr frame = fetchRawFrame(mlv_video, time, rawInfo);
+    if (!frame){
+        OFX::throwSuiteStatusException(kOfxStatFailed);
         return;
     }
 
+    Debayer debayer(frame->raw.data(), width_img, height_img);
+    switch (_debayerType->getValue()){
+        case 3:
+        debayer.set_method(Debayer::PPG);
+        break;
+        case 4:
+        debayer.set_method(Debayer::AHD);
+        break;
+        case 1:
+        default:
+        debayer.set_method(Debayer::BILINEAR);
+    }
+    debayer.set_levels(_blackLevel->getValue(), _whiteLevel->getValue());
+    debayer.set_white_balance(color.wb.data());
+    debayer.set_clip(_highlightMode->getValue() == 0 ? color.wb.min() : FLT_MAX);
+
+    ColorProcessor processor(*this);
+    processor.setDstImg(target.image);
+    processor.target = target;
+    processor.debayer = &debayer;
+    processor.setRenderWindow(target.window, args.renderScale);
+    processor.raw_width = width_img;
+    processor.raw_height = height_img;
+    processor.headroom = _outputColorSpace->getValue() < 2 ? _headroom->getValue() : 1;
+    computeColorspaceMatrix(color, mlv_video, processor.idt_matrix);
+
+    processor.process();
+}
+
+void MLVReaderPlugin::computeColorspaceMatrix(const ColorState& color, Mlv_video* mlv_video, Matrix3x3f& out_matrix)
+{
     if (_useSpectralIdt->getValue()){
         // Spectral sensitivity based matrix
-        out_matrix = _idt;
+        out_matrix = color.idt;
     } else {
         Matrix3x3f xyzd65tocam, rgb2rgb;
         int colorspace = _outputColorSpace->getValue();
@@ -539,14 +1548,12 @@ void MLVReaderPlugin::computeColorspaceMatrix(Matrix3x3f& out_matrix)
         rgb2rgb = get_neutral_cam2rec709_matrix(xyzd65tocam);
         if (colorspace <= REC709){
             // Using DNG IDT matrix
-            out_matrix = _idt * rec709_to_xyzD50_matrix<float>() * rgb2rgb;
+            out_matrix = color.idt * rec709_to_xyzD50_matrix<float>() * rgb2rgb;
         } else {
             // XYZD50 output
             out_matrix = rec709_to_xyzD50_matrix<float>() * rgb2rgb;
         }
     }
-
-    mlv_video->unlock();
 }
 
 bool MLVReaderPlugin::getTimeDomain(OfxRangeD& range)
@@ -570,25 +1577,30 @@ void MLVReaderPlugin::setMlvFile(std::string file, bool set)
 {
     if (_gThreadHost->mutexLock(_videoMutex) != kOfxStatOK) return;
 
+    // Stop read-ahead before its source stream goes away
+    _frameCache.set_source(nullptr);
+    _frameCache.clear();
+
+    // Wait for the readers to be released by renderers
     for (Mlv_video* mlv : _mlv_video){
-        if (mlv){
-            // Wait for the videostream to be released by renderer
-            while (mlv->locked()){Sleep(10);}
-            // Now we're sure no one is using the stream
-            delete mlv;
-        }
+        while (mlv->locked()){Sleep(10);}
+    }
+    // Now we're sure no one is using the streams, the template
+    // owning the shared files goes last
+    for (Mlv_video* mlv : _mlv_video){
+        delete mlv;
     }
-    
     _mlv_video.clear();
+    delete _mlv_template;
+    _mlv_template = nullptr;
     
-    // As mlv-lib does not support multi threading
-    // because of file operations, I just create
-    // multiples instances
     Mlv_video* mlv_video = new Mlv_video(file);
     _mlvfilename = file;
     if (!mlv_video->valid()){
         delete mlv_video;
     } else {
+        _mlv_template = mlv_video;
+        mlv_video = new Mlv_video(*_mlv_template);
         _maxValue = pow(2, mlv_video->bpp());
         OfxPointI tr;
         tr.x = 0;
@@ -605,14 +1617,11 @@ void MLVReaderPlugin::setMlvFile(std::string file, bool set)
         }
     }
 
-    // Reserve as MLV readers as threads + some extra for safety 
-    for (unsigned int i = 0; i < _numThreads+4; ++i){
-        // Copy video stream, fast way
-        Mlv_video* mlv_videodup = new Mlv_video(*mlv_video);
-        _mlv_video.push_back(mlv_videodup);
+    if (_mlv_template){
+        _frameCache.set_source(_mlv_template);
     }
 
-    _idtDirty = true;
+    invalidateIDT();
 
     _gThreadHost->mutexUnLock(_videoMutex);
 }
@@ -695,12 +1704,12 @@ void MLVReaderPlugin::changedParam(const OFX::InstanceChangedArgs& args, const s
 
     if (paramName == kCameraWhiteBalance){
         _colorTemperature->setEnabled(_cameraWhiteBalance->getValue() == false);
-        _idtDirty = true;
+        invalidateIDT();
     }
 
     if (paramName == kColorSpaceFormat || paramName == kColorTemperature)
     {
-        _idtDirty = true;
+        invalidateIDT();
         _headroom->setEnabled(_outputColorSpace->getValue() < 2);
     }
 
@@ -712,7 +1721,7 @@ void MLVReaderPlugin::changedParam(const OFX::InstanceChangedArgs& args, const s
         } else {
             _outputColorSpace->setEnabled(true);
         }
-        _idtDirty = true;
+        invalidateIDT();
     }
 
     if (paramName == kAudioExport){
@@ -731,25 +1740,57 @@ void MLVReaderPlugin::changedParam(const OFX::InstanceChangedArgs& args, const s
     if (paramName == kDarkFrameButton){
         int sf = _darkframeRange->getValue().x;
         int ef = _darkframeRange->getValue().y;
-        if (sf >= ef) return;
+        if (sf > ef) return;
         std::string filename = _mlv_darkframefilename->getValue();
         if (filename.empty()) return;
         if (_mlv_video.empty()) return;
         
         Mlv_video  *mlv_video = getMlv();
+        if (!mlv_video) return;
+
+        DarkFrameBuilder::Options options;
+        options.mode = (DarkFrameBuilder::Mode)_darkframeMode->getValue();
+        options.sigma = _darkframeSigma->getValue();
+        options.threads = _numThreads;
+        options.memory_budget = (size_t)_darkframeMemory->getValue() << 20;
+
+        // Frames are averaged by the builder threads, this thread only reports progress
+        DarkFrameBuilder builder(mlv_video);
+        if (builder.start(filename, sf, ef, options)){
+            progressStart("Generating darkframe", "darkframe");
+            while (!builder.wait(100)){
+                if (!progressUpdate(builder.progress())){
+                    builder.abort();
+                }
+            }
+            progressEnd();
+        }
+        mlv_video->unlock();
 
-        if (mlv_video)
-        {
-            mlv_video->generate_darkframe(filename.c_str(), sf, ef);
-            mlv_video->unlock();
+        if (!builder.succeeded()){
+            if (!builder.aborted()){
+                sendMessage(OFX::Message::eMessageError, "", "Darkframe generation failed: " + builder.error());
+            }
+            return;
         }
 
+        if (_gThreadHost->mutexLock(_videoMutex) != kOfxStatOK) return;
+        // Stop read-ahead, its reader holds the old dark frame too
+        _frameCache.set_source(nullptr);
         for (auto &mlv : _mlv_video){
             // Wait for the videostream to be released by renderer
             while (mlv->locked()) {Sleep(100);}
             // Destroy darkframe data on all streams
             mlv->destroy_darkframe_data();
         }
+        if (_mlv_template){
+            _mlv_template->destroy_darkframe_data();
+            // New read-ahead reader copied without dark frame
+            _frameCache.set_source(_mlv_template);
+        }
+        // Same file name, new content
+        _frameCache.clear();
+        _gThreadHost->mutexUnLock(_videoMutex);
         // This is the only way I found to invalidate the playback cache
         _enableDarkFrame->setValue(false);
         _enableDarkFrame->setValue(true);
@@ -761,16 +1802,18 @@ void MLVReaderPlugin::changedParam(const OFX::InstanceChangedArgs& args, const s
         _dualIsoAliasMap->setEnabled(enabled);
         _dualIsoAveragingMethod->setEnabled(enabled);
         _dualIsoFullresBlending->setEnabled(enabled);
+        _dualIsoCalibration->setEnabled(enabled);
     }
 
     if (paramName == kResetLevels){
         _levelsDirty = true;
     }
 
-    if (OpenCLBase::changedParamCL(this, args, paramName))
-    {
-        _debayerType->setEnabled(getUseOpenCL() == false);
+    if (paramName == kFrameCacheSize){
+        _frameCache.set_budget((size_t)_frameCacheSize->getValue() << 20);
     }
+
+    OpenCLBase::changedParamCL(this, args, paramName);
 }
 
 void MLVReaderPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
@@ -822,6 +1865,34 @@ void MLVReaderPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
         }
     }
 
+    {
+        OFX::IntParamDescriptor *param = desc.defineIntParam(kFrameCacheSize);
+        param->setLabel("Frame cache (MB)");
+        param->setHint("Memory used to keep decoded raw frames, 0 disables the cache and read-ahead");
+        param->setRange(0, 65536);
+        param->setDisplayRange(0, 8192);
+        param->setDefault(1024);
+        param->setEvaluateOnChange(false);
+        if (page)
+        {
+            page->addChild(*param);
+        }
+    }
+
+    {
+        OFX::IntParamDescriptor *param = desc.defineIntParam(kReadAheadFrames);
+        param->setLabel("Read-ahead frames");
+        param->setHint("Number of frames decoded in background in the playback direction");
+        param->setRange(0, 64);
+        param->setDisplayRange(0, 16);
+        param->setDefault(4);
+        param->setEvaluateOnChange(false);
+        if (page)
+        {
+            page->addChild(*param);
+        }
+    }
+
 
     {
         OFX::StringParamDescriptor *param = desc.defineStringParam(kMLVfileParamter);
@@ -849,7 +1920,7 @@ void MLVReaderPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
         param->appendOption("DCB", "", "dcb");
         //param->appendOption("DHT", "", "dht");
         //param->appendOption("Modifier AHD", "", "mahd");
-        param->setHint("The demosaic algorithm to use (CPU only)");
+        param->setHint("The demosaic algorithm to use (OpenCL runs VNG, PPG for the others)");
         param->setDefault(1);
         if (page_debayer)
         {
@@ -859,6 +1930,26 @@ void MLVReaderPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
 
     OpenCLBase::describeInContextCL(desc, context, page_debayer);
 
+    {
+        // Bumped when a spectral IDT solved in background replaces the DNG one
+        OFX::IntParamDescriptor* param = desc.defineIntParam(kSpectralRevision);
+        param->setIsSecret(true);
+        param->setAnimates(false);
+        param->setDefault(0);
+    }
+
+    {
+        OFX::BooleanParamDescriptor* param = desc.defineBooleanParam(kOpenCLPipeline);
+        param->setLabel("Pipelined OpenCL");
+        param->setHint("Decode and upload the next frame while the current one is processed on the device, faster sequential playback");
+        param->setDefault(true);
+        param->setEvaluateOnChange(false);
+        if (page_debayer)
+        {
+            page_debayer->addChild(*param);
+        }
+    }
+
     { 
         // raw, sRGB, Adobe, Wide, ProPhoto, XYZ, ACES, DCI-P3, Rec. 2020
         OFX::ChoiceParamDescriptor* param = desc.defineChoiceParam(kColorSpaceFormat);
@@ -1125,6 +2216,19 @@ void MLVReaderPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
         }
     }
 
+    { 
+        OFX::ChoiceParamDescriptor* param = desc.defineChoiceParam(kDualIsoCalibration);
+        param->setLabel("Calibration");
+        param->setHint("How the HQ 20bits mode measures the levels and the ISO difference");
+        param->appendOption("Per clip", "Measured once on a few frames of the clip", "clip");
+        param->appendOption("Per frame", "Measured on every frame and averaged with the previous frames to follow exposure changes, slower", "frame");
+        param->setDefault(0);
+        if (page_dualiso)
+        {
+            page_dualiso->addChild(*param);
+        }
+    }
+
     {
         OFX::StringParamDescriptor *param = desc.defineStringParam(kAudioFilename);
         param->setLabel("Audio Filename");
@@ -1204,6 +2308,61 @@ void MLVReaderPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
         }
     }
     
+    {
+        OFX::ChoiceParamDescriptor *param = desc.defineChoiceParam(kDarkframeMode);
+        param->setLabel("Darkframe averaging");
+        param->setHint("How the frames are combined, median and sigma clipping reject hot pixels and cosmic rays");
+        param->appendOption("Mean", "", "mean");
+        param->appendOption("Median", "", "median");
+        param->appendOption("Sigma clipped mean", "", "sigmaclip");
+        param->setDefault(0);
+        param->setEvaluateOnChange(false);
+        if (DFgroup)
+        {
+            param->setParent(*DFgroup);
+        }
+        if (page_raw)
+        {
+            page_raw->addChild(*param);
+        }
+    }
+
+    {
+        OFX::DoubleParamDescriptor *param = desc.defineDoubleParam(kDarkframeSigma);
+        param->setLabel("Darkframe sigma");
+        param->setHint("Samples further than this number of standard deviations from the mean are rejected");
+        param->setRange(0.5, 10.0);
+        param->setDisplayRange(1.0, 5.0);
+        param->setDefault(3.0);
+        param->setEvaluateOnChange(false);
+        if (DFgroup)
+        {
+            param->setParent(*DFgroup);
+        }
+        if (page_raw)
+        {
+            page_raw->addChild(*param);
+        }
+    }
+
+    {
+        OFX::IntParamDescriptor *param = desc.defineIntParam(kDarkframeMemory);
+        param->setLabel("Darkframe memory (MB)");
+        param->setHint("Memory used by the darkframe generation, median and sigma clipping decode the clip once per band of rows fitting in it");
+        param->setRange(64, 65536);
+        param->setDisplayRange(64, 8192);
+        param->setDefault(1024);
+        param->setEvaluateOnChange(false);
+        if (DFgroup)
+        {
+            param->setParent(*DFgroup);
+        }
+        if (page_raw)
+        {
+            page_raw->addChild(*param);
+        }
+    }
+
     {
         OFX::PushButtonParamDescriptor *param = desc.definePushButtonParam(kDarkFrameButton);
         param->setLabel("Generate darkframe");
@@ -10,6 +10,11 @@
 
 #include <mlv_video.h>
 #include <dng_convert.h>
+#include <debayer.h>
+#include <frame_cache.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 #include "OpenCLBase.h"
@@ -24,9 +29,9 @@
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
 #define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
 
-#define kSupportsTiles 0
+#define kSupportsTiles 1
 #define kSupportsMultiResolution 0
-#define kSupportsRenderScale 0
+#define kSupportsRenderScale 1
 #define kSupportsMultipleClipPARs false
 #define kSupportsMultipleClipDepths false
 #define kRenderThreadSafety eRenderFullySafe
@@ -45,12 +50,16 @@
 #define kDualIsoAliasMap "dualIsoAliasMap"
 #define kDualIsoFullresBlending "dualIsoFullResBlending"
 #define kDualIsoAveragingMethod "dualIsoAveragingMethod"
+#define kDualIsoCalibration "dualIsoCalibration"
 #define kAudioFilename "audioFilename"
 #define kAudioExport "audioExport"
 #define kDarkFrameEnable "darkFrameEnable"
 #define kDarkframefilename "darkframeFilename"
 #define kDarkFrameButton "darkFrameButton"
 #define kDarkframeRange "darkframeRange"
+#define kDarkframeMode "darkframeMode"
+#define kDarkframeSigma "darkframeSigma"
+#define kDarkframeMemory "darkframeMemory"
 #define kBlackLevel "blackLevel"
 #define kWhiteLevel "whiteLevel"
 #define kHeadRoom "headroom"
@@ -62,6 +71,10 @@
 #define kGroupColorAberration "groupColorAberration"
 #define kGroupWhiteBalance "groupWhiteBalance"
 #define kGroupDarkFrame "groupDarkFrame"
+#define kFrameCacheSize "frameCacheSize"
+#define kReadAheadFrames "readAheadFrames"
+#define kOpenCLPipeline "openclPipeline"
+#define kSpectralRevision "spectralRevision"
 
 
 extern "C"
@@ -77,6 +90,46 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 void loadPlugin();
 
+// Where the CPU renders write : the output image, or a packed RGBA buffer
+// covering window when the color aberration correction needs the pixels
+// around the tile
+struct RenderTarget
+{
+    OFX::Image* image = nullptr;
+    float* buffer = nullptr;
+    OfxRectI window;
+
+    float* pixelAddress(int x, int y) const
+    {
+        if (image){
+            return static_cast<float*>(image->getPixelAddress(x, y));
+        }
+        return buffer + ((size_t)(y - window.y1) * (window.x2 - window.x1) + (x - window.x1)) * 4;
+    }
+};
+
+// White balance and IDT matrix used by the renders. A new state replaces the
+// previous one as a whole, so a render never mixes two of them
+struct ColorState
+{
+    Matrix3x3f idt;
+    Vector3f wb = Vector3f(1.f, 1.f, 1.f);
+    // Value of the plugin IDT generation the state was computed for
+    int generation = -1;
+    // DNG IDT standing in for the spectral one being solved
+    bool spectral_pending = false;
+};
+
+class MLVReaderPlugin;
+
+// Target of the spectral solver notifications, outlives the plugin
+// when a solve finishes after the instance is destroyed
+struct SpectralListener
+{
+    std::mutex mutex;
+    MLVReaderPlugin* plugin = nullptr;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 class MLVReaderPlugin: public OpenCLBase
@@ -89,6 +142,9 @@ public:
         _darkFrameButton = fetchPushButtonParam(kDarkFrameButton);
         _mlv_darkframefilename = fetchStringParam(kDarkframefilename);
         _darkframeRange = fetchInt2DParam(kDarkframeRange);
+        _darkframeMode = fetchChoiceParam(kDarkframeMode);
+        _darkframeSigma = fetchDoubleParam(kDarkframeSigma);
+        _darkframeMemory = fetchIntParam(kDarkframeMemory);
         _mlvfilename_param = fetchStringParam(kMLVfileParamter);
         _mlv_audiofilename = fetchStringParam(kAudioFilename);
         _audioExportButton = fetchPushButtonParam(kAudioExport);
@@ -105,6 +161,7 @@ public:
         _dualIsoAliasMap = fetchBooleanParam(kDualIsoAliasMap);
         _dualIsoFullresBlending = fetchBooleanParam(kDualIsoFullresBlending);
         _dualIsoAveragingMethod = fetchChoiceParam(kDualIsoAveragingMethod);
+        _dualIsoCalibration = fetchChoiceParam(kDualIsoCalibration);
         _blackLevel = fetchIntParam(kBlackLevel);
         _whiteLevel = fetchIntParam(kWhiteLevel);
         _bpp = fetchIntParam(kBpp);
@@ -114,8 +171,16 @@ public:
         _cacorrection_radius = fetchIntParam(kCACorrectionRadius);
         _enableDarkFrame = fetchBooleanParam(kDarkFrameEnable);
         _headroom = fetchDoubleParam(kHeadRoom);
+        _frameCacheSize = fetchIntParam(kFrameCacheSize);
+        _readAheadFrames = fetchIntParam(kReadAheadFrames);
+        _openCLPipeline = fetchBooleanParam(kOpenCLPipeline);
+        _spectralRevision = fetchIntParam(kSpectralRevision);
+        _spectralListener = std::make_shared<SpectralListener>();
+        _spectralListener->plugin = this;
 
         _gThreadHost->multiThreadNumCPUs(&_numThreads);
+        // mlv-lib processes frames on the host threads
+        Mlv_video::set_thread_suite({_gThreadHost->multiThread, _gThreadHost->multiThreadNumCPUs, _gThreadHost->multiThreadIsSpawnedThread});
         _gThreadHost->mutexCreate(&_videoMutex, 0);
         _gThreadHost->mutexCreate(&_idtMutex, 0);
         _pluginPath = getPluginFilePath();
@@ -124,6 +189,9 @@ public:
         
         strcpy(FOCUSPIXELMAP_DIRECTORY, focusPixelMap.c_str());
         addProgram(debayer_program, "debayer_ppg");
+        addProgram(_pluginPath + "/Contents/Resources/Shaders/debayer_vng.cl", "debayer_vng");
+        addProgram(_pluginPath + "/Contents/Resources/Shaders/rawproc.cl", "rawproc");
+        _frameCache.set_budget((size_t)_frameCacheSize->getValue() << 20);
 
         if (_mlvfilename_param->getValue().empty() == false) {
             setMlvFile(_mlvfilename_param->getValue(), false);
@@ -132,11 +200,17 @@ public:
 
     ~MLVReaderPlugin()
     {
+        {
+            std::lock_guard<std::mutex> lock(_spectralListener->mutex);
+            _spectralListener->plugin = nullptr;
+        }
+        _frameCache.set_source(nullptr);
         for (Mlv_video* mlv : _mlv_video){
             if (mlv){
                 delete mlv;
             }
         }
+        delete _mlv_template;
         _gThreadHost->mutexDestroy(_videoMutex);
         _gThreadHost->mutexDestroy(_idtMutex);
     }
@@ -154,13 +228,27 @@ private:
     
     private:
     void renderCLTest(OFX::Image* destimg, int width, int height);
-    void renderCPU(const OFX::RenderArguments &args, OFX::Image* dst, Mlv_video* mlv_video, int time, int height_img, int width_img);
-    void renderCL(const OFX::RenderArguments &args, OFX::Image* destimg, Mlv_video* mlv_video, int time);
+    void renderCPU(const OFX::RenderArguments &args, const RenderTarget& target, const ColorState& color, Mlv_video* mlv_video, int time, int height_img, int width_img, Mlv_video::RawInfo& rawInfo);
+    void renderCPUNative(const OFX::RenderArguments &args, const RenderTarget& target, const ColorState& color, Mlv_video* mlv_video, int time, int height_img, int width_img, Mlv_video::RawInfo& rawInfo);
+    void renderProxy(const OFX::RenderArguments &args, const RenderTarget& target, const ColorState& color, Mlv_video* mlv_video, int time, Mlv_video::RawInfo& rawInfo);
+    void renderCL(const OFX::RenderArguments &args, OFX::Image* destimg, const ColorState& color, Mlv_video* mlv_video, int time, Mlv_video::RawInfo& rawInfo);
+    std::string rawFrameLabelCL(int time, const Mlv_video::RawInfo& rawInfo);
+    bool uploadRawFrameCL(OpenCLResources* cl_res, int slot, const FrameCache::Frame& frame, const std::string& label, bool pipelined);
+    bool runRawStagesCL(OpenCLResources* cl_res, Mlv_video* mlv_video, const FrameCache::Frame& frame, Mlv_video::RawInfo& rawInfo, cl::Image2D& img_raw);
+    bool developCL(OpenCLResources* cl_res, const ColorState& color, Mlv_video* mlv_video, const FrameCache::Frame& frame, Mlv_video::RawInfo& rawInfo,
+                   int slot, const Matrix3x3f& cam_matrix, bool pipelined, cl::Image2D& img_out);
+    bool correctCACL(OpenCLResources* cl_res, cl::Image2D& img, int width, int height, cl::Buffer& out);
+    bool demosaicVNGCL(OpenCLResources* cl_res, const ColorState& color, cl::Image2D& img_in, cl::Image2D& img_tmp, cl::Image2D& img_out, cl::Buffer& matrix,
+                       int width, int height, uint32_t filters, uint32_t black_level, uint32_t white_level, float clipping_value, float headroom);
+    FrameCache::FramePtr fetchRawFrame(Mlv_video* mlv_video, int time, Mlv_video::RawInfo& rawInfo);
 
     Mlv_video* getMlv();
-    void computeIDT();
-    bool prepareSprectralSensIDT();
-    void computeColorspaceMatrix(Matrix3x3f& out_matrix);
+    std::shared_ptr<const ColorState> colorState();
+    void invalidateIDT();
+    void computeIDT(ColorState& state);
+    bool prepareSprectralSensIDT(ColorState& state, int colorspace);
+    void spectralIdtSolved();
+    void computeColorspaceMatrix(const ColorState& color, Mlv_video* mlv_video, Matrix3x3f& out_matrix);
     void setMlvFile(std::string file, bool set = true);
 
     OfxMutexHandle _videoMutex, _idtMutex;
@@ -182,9 +270,13 @@ private:
     OFX::ChoiceParam* _chromaSmooth;
     OFX::ChoiceParam* _dualIsoMode;
     OFX::ChoiceParam* _dualIsoAveragingMethod;
+    OFX::ChoiceParam* _dualIsoCalibration;
     OFX::IntParam* _colorTemperature;
     OFX::Int2DParam* _timeRange;
     OFX::Int2DParam* _darkframeRange;
+    OFX::ChoiceParam* _darkframeMode;
+    OFX::DoubleParam* _darkframeSigma;
+    OFX::IntParam* _darkframeMemory;
     OFX::BooleanParam* _cameraWhiteBalance;
     OFX::BooleanParam* _fixFocusPixel;
     OFX::BooleanParam* _dualIsoFullresBlending;
@@ -197,14 +289,23 @@ private:
     OFX::BooleanParam* _resetLevels;
     OFX::DoubleParam* _cacorrection_threshold;
     OFX::IntParam* _cacorrection_radius;
-    Matrix3x3f _idt;
-    Vector3f _asShotNeutral;
+    OFX::IntParam* _frameCacheSize;
+    OFX::IntParam* _readAheadFrames;
+    OFX::BooleanParam* _openCLPipeline;
+    OFX::IntParam* _spectralRevision;
+    std::shared_ptr<SpectralListener> _spectralListener;
+    // Published with std::atomic_load/atomic_store
+    std::shared_ptr<const ColorState> _colorState;
+    std::atomic<int> _idtGeneration{0};
     float _wbcompensation;
     int _maxValue=0;
-    bool _idtDirty = true;
     bool _levelsDirty = true;
 
     std::vector<Mlv_video*> _mlv_video;
+    // Owner of the clip files, never rendered with : new readers are copied from it
+    Mlv_video* _mlv_template = nullptr;
+    FrameCache _frameCache;
+    std::atomic<int> _lastFrame{0};
 };
 
 class MLVReaderPluginFactory : public OFX::PluginFactoryHelper<MLVReaderPluginFactory> { 
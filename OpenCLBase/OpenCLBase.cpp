@@ -1,5 +1,8 @@
 #include "OpenCLBase.h"
 #include <fstream>
+#include <filesystem>
+#include <cstdlib>
+#include <random>
 
 static std::vector<cl::Device> g_cldevices;
 
@@ -117,26 +120,311 @@ int openCLGetLocalBufferOpt(cl::Device dev,
     return true;
 }
 
-void OpenCLBase::setupOpenCL()
+OpenCLResources::OpenCLResources(const cl::Context& context, const cl::Device& device,
+                                 const std::map<std::string, cl::Program>& programs, unsigned int generation)
+    : _context(context), _device(device), _programs(programs), _generation(generation)
 {
-    std::vector<std::pair<std::string, std::string>> paths = _program_paths;
+    _queue = cl::CommandQueue(_context, _device);
+}
 
-    _programs.clear();
-    _program_paths.clear();
+OpenCLResources::~OpenCLResources()
+{
+    // Transfers may still read or write the pinned memory
+    for (auto& it : _pinned){
+        _queue.enqueueUnmapMemObject(it.second.buffer, it.second.host);
+    }
+    _queue.finish();
+}
 
-    for (auto prog : paths){
-        addProgram(prog.first, prog.second);
+cl::Kernel OpenCLResources::kernel(const std::string& program, const std::string& name, cl_int* err)
+{
+    std::string key = program + "/" + name;
+    auto it = _kernels.find(key);
+    if (it != _kernels.end()){
+        if (err) *err = CL_SUCCESS;
+        return it->second;
+    }
+
+    cl_int errcode = CL_SUCCESS;
+    cl::Kernel kernel(_programs[program], name.c_str(), &errcode);
+    if (err) *err = errcode;
+    if (errcode != CL_SUCCESS){
+        return cl::Kernel();
     }
+    return _kernels[key] = kernel;
 }
 
-bool OpenCLBase::addProgram(std::string program_path, std::string program_name)
+cl::Image2D OpenCLResources::image(const std::string& name, cl_mem_flags flags, const cl::ImageFormat& format,
+                                    size_t width, size_t height, cl_int* err)
 {
-    if (g_cldevices.empty()){
+    ImageEntry& entry = _images[name];
+    if (entry.image() == NULL || entry.flags != flags || entry.width != width || entry.height != height ||
+        entry.order != format.image_channel_order || entry.type != format.image_channel_data_type){
+        cl_int errcode = CL_SUCCESS;
+        // Release the previous image before allocating its replacement
+        entry.image = cl::Image2D();
+        entry.image = cl::Image2D(_context, flags, format, width, height, 0, NULL, &errcode);
+        if (err) *err = errcode;
+        if (errcode != CL_SUCCESS){
+            _images.erase(name);
+            return cl::Image2D();
+        }
+        entry.flags = flags;
+        entry.order = format.image_channel_order;
+        entry.type = format.image_channel_data_type;
+        entry.width = width;
+        entry.height = height;
+    } else if (err){
+        *err = CL_SUCCESS;
+    }
+    return entry.image;
+}
+
+cl::Buffer OpenCLResources::buffer(const std::string& name, cl_mem_flags flags, size_t size, cl_int* err)
+{
+    BufferEntry& entry = _buffers[name];
+    if (entry.buffer() == NULL || entry.flags != flags || entry.size != size){
+        cl_int errcode = CL_SUCCESS;
+        entry.buffer = cl::Buffer();
+        entry.buffer = cl::Buffer(_context, flags, size, NULL, &errcode);
+        if (err) *err = errcode;
+        if (errcode != CL_SUCCESS){
+            _buffers.erase(name);
+            return cl::Buffer();
+        }
+        entry.flags = flags;
+        entry.size = size;
+    } else if (err){
+        *err = CL_SUCCESS;
+    }
+    return entry.buffer;
+}
+
+void* OpenCLResources::pinnedMemory(const std::string& name, size_t size, cl_int* err)
+{
+    PinnedEntry& entry = _pinned[name];
+    if (entry.host && entry.size == size){
+        if (err) *err = CL_SUCCESS;
+        return entry.host;
+    }
+
+    if (entry.host){
+        _queue.enqueueUnmapMemObject(entry.buffer, entry.host);
+        _queue.finish();
+    }
+
+    cl_int errcode = CL_SUCCESS;
+    entry.buffer = cl::Buffer(_context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL, &errcode);
+    if (errcode == CL_SUCCESS){
+        entry.host = _queue.enqueueMapBuffer(entry.buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size, NULL, NULL, &errcode);
+    }
+    if (err) *err = errcode;
+    if (errcode != CL_SUCCESS || !entry.host){
+        _pinned.erase(name);
+        if (err && errcode == CL_SUCCESS) *err = CL_MAP_FAILURE;
+        return NULL;
+    }
+    entry.size = size;
+    return entry.host;
+}
+
+bool OpenCLResources::localBufferOpt(const std::string& program, const std::string& name, OpenCLLocalBufferStruct& factors)
+{
+    std::string key = program + "/" + name;
+    auto it = _localSizes.find(key);
+    if (it != _localSizes.end()){
+        factors.sizex = it->second.first;
+        factors.sizey = it->second.second;
+        return true;
+    }
+
+    cl_int err;
+    cl::Kernel ker = kernel(program, name, &err);
+    if (err != CL_SUCCESS || !openCLGetLocalBufferOpt(_device, ker, &factors)){
         return false;
     }
+    _localSizes[key] = std::make_pair(factors.sizex, factors.sizey);
+    return true;
+}
+
+std::shared_ptr<OpenCLResources> OpenCLBase::acquireCLResources()
+{
+    OpenCLResources* resources = NULL;
+
+    _gThreadHost->mutexLock(_OclMutex);
+    if (!_clResources.empty()){
+        resources = _clResources.back().release();
+        _clResources.pop_back();
+    } else if (!_programs.empty()){
+        resources = new OpenCLResources(_current_clcontext, _current_cldevice, _programs, _clGeneration);
+    }
+    _gThreadHost->mutexUnLock(_OclMutex);
 
+    if (!resources){
+        return std::shared_ptr<OpenCLResources>();
+    }
+    return std::shared_ptr<OpenCLResources>(resources, [this](OpenCLResources* res){ releaseCLResources(res); });
+}
+
+void OpenCLBase::releaseCLResources(OpenCLResources* resources)
+{
     _gThreadHost->mutexLock(_OclMutex);
+    bool current = resources->generation() == _clGeneration;
+    if (current){
+        _clResources.emplace_back(resources);
+    }
+    _gThreadHost->mutexUnLock(_OclMutex);
+
+    // Sets built for a previous device or program are not reused
+    if (!current){
+        delete resources;
+    }
+}
+
+// Options passed to every program build, part of the binary cache key
+static const char* kCLBuildOptions = "";
+
+static uint64_t fnv1a(const std::string& data, uint64_t hash = 0xcbf29ce484222325ULL)
+{
+    for (unsigned char c : data){
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Compiled programs are kept in OFX_CMS_CL_CACHE, or in the user cache directory
+static std::filesystem::path programCacheDir()
+{
+    const char* dir = getenv("OFX_CMS_CL_CACHE");
+    if (dir && *dir){
+        return std::filesystem::path(dir);
+    }
+#ifdef _WIN32
+    dir = getenv("LOCALAPPDATA");
+    if (dir && *dir){
+        return std::filesystem::path(dir) / "openfx-cms" / "clcache";
+    }
+#else
+    dir = getenv("XDG_CACHE_HOME");
+    if (dir && *dir){
+        return std::filesystem::path(dir) / "openfx-cms" / "clcache";
+    }
+    dir = getenv("HOME");
+    if (dir && *dir){
+        return std::filesystem::path(dir) / ".cache" / "openfx-cms" / "clcache";
+    }
+#endif
+    return std::filesystem::path();
+}
+
+// A binary is only valid for the exact device, driver, source and options it was built with
+static std::filesystem::path programCachePath(const cl::Device& device, const std::string& source, const std::string& program_name)
+{
+    std::filesystem::path dir = programCacheDir();
+    if (dir.empty()){
+        return dir;
+    }
 
+    cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+    uint64_t hash = fnv1a(platform.getInfo<CL_PLATFORM_NAME>());
+    hash = fnv1a(platform.getInfo<CL_PLATFORM_VERSION>(), hash);
+    hash = fnv1a(device.getInfo<CL_DEVICE_NAME>(), hash);
+    hash = fnv1a(device.getInfo<CL_DEVICE_VERSION>(), hash);
+    hash = fnv1a(device.getInfo<CL_DRIVER_VERSION>(), hash);
+    hash = fnv1a(kCLBuildOptions, hash);
+    hash = fnv1a(source, hash);
+
+    char name[32];
+    snprintf(name, sizeof(name), "-%016llx.bin", (unsigned long long)hash);
+    return dir / (program_name + name);
+}
+
+static bool loadProgramBinary(const std::filesystem::path& path, const cl::Context& context, const cl::Device& device, cl::Program& prog)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file){
+        return false;
+    }
+    std::vector<unsigned char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (binary.empty()){
+        return false;
+    }
+
+    cl_int err;
+    std::vector<cl_int> status;
+    cl::Program::Binaries binaries(1, binary);
+    prog = cl::Program(context, std::vector<cl::Device>(1, device), binaries, &status, &err);
+    if (err != CL_SUCCESS || status.empty() || status[0] != CL_SUCCESS){
+        return false;
+    }
+    return prog.build(std::vector<cl::Device>(1, device), kCLBuildOptions) == CL_SUCCESS;
+}
+
+static void saveProgramBinary(const std::filesystem::path& path, const cl::Program& prog)
+{
+    cl_int err;
+    cl::Program::Binaries binaries = prog.getInfo<CL_PROGRAM_BINARIES>(&err);
+    if (err != CL_SUCCESS || binaries.empty() || binaries[0].empty()){
+        return;
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+
+    // Write aside and rename, other instances may be loading the same file
+    std::filesystem::path tmp_path = path;
+    tmp_path += "." + std::to_string(std::random_device()()) + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!file){
+            return;
+        }
+        file.write((const char*)binaries[0].data(), binaries[0].size());
+        if (!file){
+            file.close();
+            std::filesystem::remove(tmp_path, ec);
+            return;
+        }
+    }
+    std::filesystem::rename(tmp_path, path, ec);
+    if (ec){
+        std::filesystem::remove(tmp_path, ec);
+    }
+}
+
+void OpenCLBase::setupOpenCL()
+{
+    if (g_cldevices.empty()){
+        return;
+    }
+
+    _gThreadHost->mutexLock(_OclMutex);
+
+    // Rebuild every program for the selected device, renders keep the
+    // previous set until the new one is published
+    cl::Device device = g_cldevices[_openCLDevices->getValue()];
+    cl::Context context(device);
+    std::map<std::string, cl::Program> programs;
+    for (const auto& prog : _program_paths){
+        cl::Program program;
+        if (buildProgram(prog.first, prog.second, context, device, program)){
+            programs[prog.second] = program;
+        }
+    }
+
+    _current_cldevice = device;
+    _current_clcontext = context;
+    _programs.swap(programs);
+    ++_clGeneration;
+    _clResources.clear();
+
+    _gThreadHost->mutexUnLock(_OclMutex);
+}
+
+bool OpenCLBase::buildProgram(const std::string& program_path, const std::string& program_name,
+                              const cl::Context& context, const cl::Device& device, cl::Program& prog)
+{
     std::ifstream programfile;
     programfile.open(program_path.c_str());
     std::ostringstream programtext;
@@ -146,32 +434,61 @@ bool OpenCLBase::addProgram(std::string program_path, std::string program_name)
     if (programtext.str().empty()){
         printf("Falied to load OpenCL program\n");
         setPersistentMessage(OFX::Message::eMessageError, "", "Failed to load OpenCL program");
-        _gThreadHost->mutexUnLock(_OclMutex);
         return false;
     }
 
+    // Building from source takes seconds, reuse the binary of a previous run when possible
+    std::filesystem::path cache_path = programCachePath(device, programtext.str(), program_name);
+    if (cache_path.empty() || !loadProgramBinary(cache_path, context, device, prog)){
+        cl_int err;
+        prog = cl::Program(context, programtext.str(), false, &err);
+        if (err == CL_SUCCESS){
+            err = prog.build(std::vector<cl::Device>(1, device), kCLBuildOptions);
+        }
+        if (err != CL_SUCCESS){
+            std::string errlog = prog.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+            printf("OpenCL Error :\n%s\n", errlog.c_str());
+            setPersistentMessage(OFX::Message::eMessageError, "", "Failed to create program");
+            return false;
+        }
+        if (!cache_path.empty()){
+            saveProgramBinary(cache_path, prog);
+        }
+    }
+
     clearPersistentMessage();
+    return true;
+}
 
-    int cl_dev = _openCLDevices->getValue();
-    _current_cldevice = g_cldevices[cl_dev];
+bool OpenCLBase::addProgram(std::string program_path, std::string program_name)
+{
+    if (g_cldevices.empty()){
+        return false;
+    }
+
+    _gThreadHost->mutexLock(_OclMutex);
 
-    cl::Platform platform(_current_cldevice.getInfo<CL_DEVICE_PLATFORM>());
-    _current_clcontext = cl::Context(_current_cldevice);
+    // Rebuilt by setupOpenCL when the device changes, even if it fails now
+    _program_paths.push_back(std::make_pair(program_path, program_name));
 
-    cl_int err;
-    cl::Program prog(_current_clcontext, programtext.str(), true, &err);
-    if (err != CL_SUCCESS){
-        std::string errlog = prog.getBuildInfo<CL_PROGRAM_BUILD_LOG>(_current_cldevice);
-        printf("OpenCL Error :\n%s\n", errlog.c_str());
-        setPersistentMessage(OFX::Message::eMessageError, "", "Failed to create program");
+    // All the programs of the plugin share the context of the selected device
+    int cl_dev = _openCLDevices->getValue();
+    if (_current_clcontext() == NULL || _current_cldevice != g_cldevices[cl_dev]){
+        _current_cldevice = g_cldevices[cl_dev];
+        _current_clcontext = cl::Context(_current_cldevice);
+    }
+
+    cl::Program prog;
+    if (!buildProgram(program_path, program_name, _current_clcontext, _current_cldevice, prog)){
         _gThreadHost->mutexUnLock(_OclMutex);
         return false;
     }
 
     _programs[program_name] = prog;
-    _program_paths.push_back(std::make_pair(program_path, program_name));
 
-    clearPersistentMessage();
+    // New context and programs, renders in flight finish with their own set
+    ++_clGeneration;
+    _clResources.clear();
 
     _gThreadHost->mutexUnLock(_OclMutex);
 
@@ -183,7 +500,7 @@ void OpenCLBase::describeInContextCL(OFX::ImageEffectDescriptor &desc, OFX::Cont
     { 
         OFX::BooleanParamDescriptor* param = desc.defineBooleanParam(kUseOpenCL);
         param->setLabel("OpenCL acceleration");
-        param->setHint("Use OpenCL GPU acceleration (Only PPG demosaic supported)");
+        param->setHint("Use OpenCL GPU acceleration (PPG and VNG demosaic supported)");
         param->setDefault(0);
         if (page)
         {
@@ -8,6 +8,8 @@
 #include "ofxsMacros.h"
 #include "ofxsThreadSuite.h"
 #include <map>
+#include <memory>
+#include <vector>
 
 #define kUseOpenCL "UseOpenCL"
 #define kOpenCLDevice "OpenCLDevice"
@@ -19,6 +21,79 @@ class OpenCLInstanceData
     OpenCLInstanceData();
 };
 
+struct OpenCLLocalBufferStruct;
+
+/** @brief OpenCL objects reused from frame to frame by one render at a time
+ *
+ * Creating a queue, kernels and images costs as much as running the kernels
+ * on small frames. A render borrows a set with OpenCLBase::acquireCLResources,
+ * so concurrent renders never share kernel arguments, and gives it back when
+ * done. Images and buffers are only reallocated when their size or format
+ * changes; the whole set is dropped when the device or the programs change.
+ */
+class OpenCLResources
+{
+public:
+    OpenCLResources(const cl::Context& context, const cl::Device& device,
+                    const std::map<std::string, cl::Program>& programs, unsigned int generation);
+    ~OpenCLResources();
+
+    cl::CommandQueue& queue() { return _queue; }
+    const cl::Device& device() const { return _device; }
+    cl::Kernel kernel(const std::string& program, const std::string& name, cl_int* err = NULL);
+    cl::Image2D image(const std::string& name, cl_mem_flags flags, const cl::ImageFormat& format,
+                       size_t width, size_t height, cl_int* err = NULL);
+    cl::Buffer buffer(const std::string& name, cl_mem_flags flags, size_t size, cl_int* err = NULL);
+    /** @brief Page locked host memory (CL_MEM_ALLOC_HOST_PTR), mapped as long as the set lives.
+     * Non blocking transfers from or to it run at full bus speed. */
+    void* pinnedMemory(const std::string& name, size_t size, cl_int* err = NULL);
+    /** @brief Event of the last transfer or kernel a render attached to a name */
+    cl::Event& event(const std::string& name) { return _events[name]; }
+    /** @brief What a named object currently holds, lets a render find data uploaded by the previous one */
+    std::string& label(const std::string& name) { return _labels[name]; }
+    /** @brief openCLGetLocalBufferOpt, computed once per kernel */
+    bool localBufferOpt(const std::string& program, const std::string& name, OpenCLLocalBufferStruct& factors);
+
+    unsigned int generation() const { return _generation; }
+
+private:
+    struct ImageEntry
+    {
+        cl::Image2D image;
+        cl_mem_flags flags = 0;
+        cl_channel_order order = 0;
+        cl_channel_type type = 0;
+        size_t width = 0;
+        size_t height = 0;
+    };
+    struct BufferEntry
+    {
+        cl::Buffer buffer;
+        cl_mem_flags flags = 0;
+        size_t size = 0;
+    };
+
+    struct PinnedEntry
+    {
+        cl::Buffer buffer;
+        void* host = NULL;
+        size_t size = 0;
+    };
+
+    cl::Context _context;
+    cl::Device _device;
+    cl::CommandQueue _queue;
+    std::map<std::string, cl::Program> _programs;
+    std::map<std::string, cl::Kernel> _kernels;
+    std::map<std::string, ImageEntry> _images;
+    std::map<std::string, BufferEntry> _buffers;
+    std::map<std::string, PinnedEntry> _pinned;
+    std::map<std::string, cl::Event> _events;
+    std::map<std::string, std::string> _labels;
+    std::map<std::string, std::pair<int, int>> _localSizes;
+    unsigned int _generation;
+};
+
 class OpenCLBase: public OFX::ImageEffect
 {
 public:
@@ -44,13 +119,25 @@ public:
     cl::Program getProgram(std::string program_name){return _programs[program_name];}
 protected:
     void setupOpenCL();
+    /** @brief Borrow a set of OpenCL resources, returned to the pool when the last copy is released.
+     * Null if no program could be built. */
+    std::shared_ptr<OpenCLResources> acquireCLResources();
     cl::Device& getCurrentCLDevice(){return _current_cldevice;}
     cl::Context& getCurrentCLContext(){return _current_clcontext;}
     OfxMultiThreadSuiteV1 *_gThreadHost = 0;
 
 private:
+    void releaseCLResources(OpenCLResources* resources);
+    /** @brief Build a program for device, from the binary cache when possible. Called with _OclMutex held */
+    bool buildProgram(const std::string& program_path, const std::string& program_name,
+                      const cl::Context& context, const cl::Device& device, cl::Program& prog);
+
     OfxMutexHandle _OclMutex;
 
+    // Sets not in use, all from the current device and programs
+    std::vector<std::unique_ptr<OpenCLResources>> _clResources;
+    unsigned int _clGeneration = 0;
+
     std::map<std::string, cl::Program> _programs;
     std::vector<std::pair<std::string, std::string>> _program_paths;
     OFX::ChoiceParam* _openCLDevices;
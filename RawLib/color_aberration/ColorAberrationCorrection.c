@@ -1,140 +1,206 @@
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 #include "ColorAberrationCorrection.h"
+#include "parallel.h"
 
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
 #define MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
 
-static void rmCA(float* rVec, float* gVec, float* bVec, int width, int height, float threshold, int radius)
+/* columns gathered at once by the vertical pass, 16 RGBA pixels fill a cache line pair per row */
+#define CA_STRIP_WIDTH 16
+/* rows and strips handed out at once to the threads of parallel_for */
+#define CA_ROW_GRAIN 8
+#define CA_STRIP_GRAIN 1
+
+/* Scratch memory of the vertical pass. Arenas go back to a pool after each
+   strip range and are reused by the next corrections, whatever thread runs them */
+typedef struct ca_arena
+{
+    struct ca_arena * next;
+    float * data;
+    size_t size;
+} ca_arena;
+
+static pthread_mutex_t ca_arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ca_arena * ca_arena_pool = NULL;
+
+static ca_arena * arena_acquire(size_t size)
 {
-    for (int y = 0; y < height; ++y)
-	{
-        float *bptr = &bVec[y*width];
-        float *gptr = &gVec[y*width];
-        float *rptr = &rVec[y*width];
-
-        for (int x = 2; x < width - 2; ++x)
-		{
-			//find the edge by finding green channel gradient bigger than threshold
-            float diff = gptr[x + 1] - gptr[x - 1];
-			if (fabsf(diff) >= threshold)
-			{
-				// +/- sign of this edge
-				float sign = diff > 0 ? 1 : -1;
-
-				//Searching the boundary for correction range
-				int lpos = x-1, rpos = x+1;
-                for (; lpos > 1; --lpos)
-				{
-					//make sure the gradient is the same sign with edge
-					float ggrad = (gptr[lpos + 1] - gptr[lpos - 1])*sign;
-					float bgrad = (bptr[lpos + 1] - bptr[lpos - 1])*sign;
-					float rgrad = (rptr[lpos + 1] - rptr[lpos - 1])*sign;
-                    if ( x-lpos >= radius ) { break; }
-                    if (MAX(MAX(bgrad, ggrad), rgrad) < threshold) { break; }
-                }
-				lpos -= 1;
-                for (; rpos < width - 2; ++rpos)
-				{
-					//make sure the gradient is the same sign with edge
-					float ggrad = (gptr[rpos + 1] - gptr[rpos - 1])*sign;
-					float bgrad = (bptr[rpos + 1] - bptr[rpos - 1])*sign;
-					float rgrad = (rptr[rpos + 1] - rptr[rpos - 1])*sign;
-                    if ( rpos-x >= radius ) { break; }
-                    if (MAX(MAX(bgrad, ggrad), rgrad) < threshold) { break; }
-                }
-				rpos += 1;
-
-				//record the maximum and minimum color difference between R&G and B&G of range boundary
-                float bgmaxVal = MAX(bptr[lpos] - gptr[lpos], bptr[rpos] - gptr[rpos]);
-                float bgminVal = MIN(bptr[lpos] - gptr[lpos], bptr[rpos] - gptr[rpos]);
-                float rgmaxVal = MAX(rptr[lpos] - gptr[lpos], rptr[rpos] - gptr[rpos]);
-                float rgminVal = MIN(rptr[lpos] - gptr[lpos], rptr[rpos] - gptr[rpos]);
-
-				for (int k = lpos; k <= rpos; ++k)
-				{
-					float bdiff = bptr[k] - gptr[k];
-					float rdiff = rptr[k] - gptr[k];
-
-					//Replace the B or R value if its color difference of R/G and B/G is bigger(smaller)
-					//than maximum(minimum) of color difference on range boundary
-                    bptr[k] =  bdiff > bgmaxVal ? bgmaxVal + gptr[k] :
-						(bdiff < bgminVal ? bgminVal + gptr[k] : bptr[k]);
-                    rptr[k] =  rdiff > rgmaxVal ? rgmaxVal + gptr[k] :
-						(rdiff < rgminVal ? rgminVal + gptr[k] : rptr[k]) ;			
-				}
-				x = rpos - 2;
-			}
-		}
-	}
+    pthread_mutex_lock(&ca_arena_mutex);
+    ca_arena * arena = ca_arena_pool;
+    if (arena) ca_arena_pool = arena->next;
+    pthread_mutex_unlock(&ca_arena_mutex);
+
+    if (!arena)
+    {
+        arena = calloc(1, sizeof(ca_arena));
+        if (!arena) return NULL;
+    }
+    if (arena->size < size)
+    {
+        float * data = realloc(arena->data, size * sizeof(float));
+        if (!data)
+        {
+            free(arena->data);
+            free(arena);
+            return NULL;
+        }
+        arena->data = data;
+        arena->size = size;
+    }
+    return arena;
 }
 
-/* Filter CAs and ColorMoiree in RGB picture data */
-void CACorrection(int imageX, int imageY,
-                  float * __restrict inputImage,
-                  float threshold, uint8_t radius)
+static void arena_release(ca_arena * arena)
 {
-    //getting working memory
-    float *bVec = malloc( imageX * imageY * sizeof( float ) );
-    float *gVec = malloc( imageX * imageY * sizeof( float ) );
-    float *rVec = malloc( imageX * imageY * sizeof( float ) );
-    float *temp = malloc( imageX * imageY * sizeof( float ) );
-
-	//split the color image into individual color channel for convenient in calculation
-    for( int i = 0, j = 0; i < imageX*imageY*4; i+=4, j++ )
+    pthread_mutex_lock(&ca_arena_mutex);
+    arena->next = ca_arena_pool;
+    ca_arena_pool = arena;
+    pthread_mutex_unlock(&ca_arena_mutex);
+}
+
+/* One line of RGBA pixels, step floats apart */
+static void rmCA(float* pix, int length, int step, float threshold, int radius)
+{
+#define R(k) pix[(k)*step + 0]
+#define G(k) pix[(k)*step + 1]
+#define B(k) pix[(k)*step + 2]
+
+    for (int x = 2; x < length - 2; ++x)
     {
-        rVec[j] = inputImage[i+0];
-        gVec[j] = inputImage[i+1];
-        bVec[j] = inputImage[i+2];
+        //find the edge by finding green channel gradient bigger than threshold
+        float diff = G(x + 1) - G(x - 1);
+        if (fabsf(diff) >= threshold)
+        {
+            // +/- sign of this edge
+            float sign = diff > 0 ? 1 : -1;
+
+            //Searching the boundary for correction range
+            int lpos = x-1, rpos = x+1;
+            for (; lpos > 1; --lpos)
+            {
+                //make sure the gradient is the same sign with edge
+                float ggrad = (G(lpos + 1) - G(lpos - 1))*sign;
+                float bgrad = (B(lpos + 1) - B(lpos - 1))*sign;
+                float rgrad = (R(lpos + 1) - R(lpos - 1))*sign;
+                if ( x-lpos >= radius ) { break; }
+                if (MAX(MAX(bgrad, ggrad), rgrad) < threshold) { break; }
+            }
+            lpos -= 1;
+            for (; rpos < length - 2; ++rpos)
+            {
+                //make sure the gradient is the same sign with edge
+                float ggrad = (G(rpos + 1) - G(rpos - 1))*sign;
+                float bgrad = (B(rpos + 1) - B(rpos - 1))*sign;
+                float rgrad = (R(rpos + 1) - R(rpos - 1))*sign;
+                if ( rpos-x >= radius ) { break; }
+                if (MAX(MAX(bgrad, ggrad), rgrad) < threshold) { break; }
+            }
+            rpos += 1;
+
+            //record the maximum and minimum color difference between R&G and B&G of range boundary
+            float bgmaxVal = MAX(B(lpos) - G(lpos), B(rpos) - G(rpos));
+            float bgminVal = MIN(B(lpos) - G(lpos), B(rpos) - G(rpos));
+            float rgmaxVal = MAX(R(lpos) - G(lpos), R(rpos) - G(rpos));
+            float rgminVal = MIN(R(lpos) - G(lpos), R(rpos) - G(rpos));
+
+            for (int k = lpos; k <= rpos; ++k)
+            {
+                float bdiff = B(k) - G(k);
+                float rdiff = R(k) - G(k);
+
+                //Replace the B or R value if its color difference of R/G and B/G is bigger(smaller)
+                //than maximum(minimum) of color difference on range boundary
+                B(k) = bdiff > bgmaxVal ? bgmaxVal + G(k) :
+                    (bdiff < bgminVal ? bgminVal + G(k) : B(k));
+                R(k) = rdiff > rgmaxVal ? rgmaxVal + G(k) :
+                    (rdiff < rgminVal ? rgminVal + G(k) : R(k));
+            }
+            x = rpos - 2;
+        }
     }
 
-    //first run
-    rmCA(rVec, gVec, bVec, imageX, imageY, threshold, radius);
-
-	//transpose the R,G B channel image to correct chromatic aberration in vertical direction 
-    memcpy( temp, rVec, imageX*imageY * sizeof(float) );
-    for( int y = 0; y < imageY; y++ )
-        for( int x = 0; x < imageX; x++ )
-            rVec[x*imageY+y] = temp[y*imageX+x];
-    memcpy( temp, gVec, imageX*imageY * sizeof(float) );
-    for( int y = 0; y < imageY; y++ )
-        for( int x = 0; x < imageX; x++ )
-            gVec[x*imageY+y] = temp[y*imageX+x];
-    memcpy( temp, bVec, imageX*imageY * sizeof(float) );
-    for( int y = 0; y < imageY; y++ )
-        for( int x = 0; x < imageX; x++ )
-            bVec[x*imageY+y] = temp[y*imageX+x];
-
-    //second run
-    rmCA(rVec, gVec, bVec, imageY, imageX, threshold, radius);
-
-    //rotate the image back to original position
-    memcpy( temp, rVec, imageX*imageY * sizeof(float) );
-    for( int y = 0; y < imageY; y++ )
-        for( int x = 0; x < imageX; x++ )
-            rVec[y*imageX+x] = temp[x*imageY+y];
-    memcpy( temp, gVec, imageX*imageY * sizeof(float) );
-    for( int y = 0; y < imageY; y++ )
-        for( int x = 0; x < imageX; x++ )
-            gVec[y*imageX+x] = temp[x*imageY+y];
-    memcpy( temp, bVec, imageX*imageY * sizeof(float) );
-    for( int y = 0; y < imageY; y++ )
-        for( int x = 0; x < imageX; x++ )
-            bVec[y*imageX+x] = temp[x*imageY+y];
-
-    //merge channels into final image
-    for( int i = 0; i < imageX*imageY; i++ )
+#undef R
+#undef G
+#undef B
+}
+
+typedef struct
+{
+    float * image;
+    int imageX, imageY;
+    float threshold;
+    int radius;
+    int failed;         /* atomic */
+} ca_job;
+
+/* Rows are corrected in place */
+static void ca_rows(void * arg, int first, int last)
+{
+    ca_job * job = arg;
+    for (int y = first; y < last; ++y)
+    {
+        float * row = job->image + (size_t)y * job->imageX * 4;
+        rmCA(row, job->imageX, 4, job->threshold, job->radius);
+        // Set alpha channel to 1.0 (opaque)
+        for (int x = 0; x < job->imageX; ++x) row[x*4 + 3] = 1.0f;
+    }
+}
+
+/* Columns go through a strip of the arena, one contiguous line per column.
+   Gathering and scattering read whole row segments, no full transpose is needed */
+static void ca_columns(void * arg, int first, int last)
+{
+    ca_job * job = arg;
+    const int height = job->imageY;
+    ca_arena * arena = arena_acquire((size_t)CA_STRIP_WIDTH * height * 4);
+    if (!arena)
+    {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    for (int strip = first; strip < last; ++strip)
     {
-        int j = i * 4;
-        inputImage[j+0] = rVec[i];
-        inputImage[j+1] = gVec[i];
-        inputImage[j+2] = bVec[i];
-        inputImage[j+3] = 1.0f; // Set alpha channel to 1.0 (opaque)
+        const int x0 = strip * CA_STRIP_WIDTH;
+        const int columns = MIN(CA_STRIP_WIDTH, job->imageX - x0);
+
+        for (int y = 0; y < height; ++y)
+        {
+            const float * src = job->image + ((size_t)y * job->imageX + x0) * 4;
+            for (int c = 0; c < columns; ++c)
+                memcpy(arena->data + ((size_t)c * height + y) * 4, src + c * 4, 4 * sizeof(float));
+        }
+
+        for (int c = 0; c < columns; ++c)
+            rmCA(arena->data + (size_t)c * height * 4, height, 4, job->threshold, job->radius);
+
+        for (int y = 0; y < height; ++y)
+        {
+            float * dst = job->image + ((size_t)y * job->imageX + x0) * 4;
+            for (int c = 0; c < columns; ++c)
+                memcpy(dst + c * 4, arena->data + ((size_t)c * height + y) * 4, 4 * sizeof(float));
+        }
     }
 
-    //clean up
-    free( bVec );
-    free( gVec );
-    free( rVec );
-    free( temp );
+    arena_release(arena);
+}
+
+/* Filter CAs and ColorMoiree in RGB picture data */
+int CACorrection(int imageX, int imageY,
+                 float * __restrict inputImage,
+                 float threshold, uint8_t radius)
+{
+    if (imageX <= 0 || imageY <= 0) return 0;
+
+    ca_job job = { inputImage, imageX, imageY, threshold, radius, 0 };
+    int strips = (imageX + CA_STRIP_WIDTH - 1) / CA_STRIP_WIDTH;
+
+    //first run, horizontal
+    parallel_for(0, imageY, CA_ROW_GRAIN, ca_rows, &job);
+
+    //second run, vertical
+    parallel_for(0, strips, CA_STRIP_GRAIN, ca_columns, &job);
+    return job.failed ? -1 : 0;
 }
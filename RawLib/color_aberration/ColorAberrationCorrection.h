@@ -4,8 +4,10 @@
 #include <stdlib.h>
 #include <stdint.h>
 
-void CACorrection(int imageX, int imageY,
-                  float * __restrict inputImage,
-                  float threshold, uint8_t radius);
+/* Corrects an RGBA image in place on the threads of parallel_for (mlv-lib),
+   returns -1 if the vertical pass lacked memory and was left incomplete */
+int CACorrection(int imageX, int imageY,
+                 float * __restrict inputImage,
+                 float threshold, uint8_t radius);
 
 #endif
@@ -0,0 +1,383 @@
+extern "C"{
+	#include "video_mlv.h"
+	#include "dng/dng.h"
+	#include "llrawproc/llrawproc.h"
+}
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <vector>
+#include "darkframe.h"
+
+// Decode scratch of a worker thread
+struct DarkFrameBuilder::Worker
+{
+	std::vector<uint16_t> unpacked;
+	std::vector<uint8_t> packed;
+};
+
+// Run func(thread_index) on count threads and wait for all of them
+static void run_threads(int count, const std::function<void(int)>& func)
+{
+	std::vector<std::thread> threads;
+	for (int t = 1; t < count; ++t){
+		threads.emplace_back(func, t);
+	}
+	func(0);
+	for (std::thread& thread : threads){
+		thread.join();
+	}
+}
+
+// Process [0, size) by blocks claimed from a shared counter
+static void parallel_ranges(int count, size_t size, const std::function<void(size_t, size_t)>& func)
+{
+	const size_t block = 4096;
+	std::atomic<size_t> next(0);
+	run_threads(count, [&](int){
+		for (size_t begin = next.fetch_add(block); begin < size; begin = next.fetch_add(block)){
+			func(begin, std::min(begin + block, size));
+		}
+	});
+}
+
+// Mean of the samples left after iteratively rejecting the ones further than
+// sigma standard deviations from the mean. samples is sorted in place, the
+// rejected samples are always at one end of the sorted range.
+static uint16_t sigma_clipped_mean(uint16_t* samples, int count, float sigma)
+{
+	std::sort(samples, samples + count);
+	int lo = 0, hi = count;
+	double mean = 0.;
+	for (int iteration = 0; iteration < 8; ++iteration){
+		uint64_t sum = 0, sum2 = 0;
+		for (int i = lo; i < hi; ++i){
+			sum += samples[i];
+			sum2 += (uint64_t)samples[i] * samples[i];
+		}
+		const int n = hi - lo;
+		mean = double(sum) / n;
+		const double deviation = std::sqrt(std::max(0., double(sum2) / n - mean * mean));
+		const double low = mean - sigma * deviation;
+		const double high = mean + sigma * deviation;
+		int new_lo = lo, new_hi = hi;
+		while (new_lo < new_hi && samples[new_lo] < low) ++new_lo;
+		while (new_hi > new_lo && samples[new_hi - 1] > high) --new_hi;
+		if (new_hi - new_lo < 2 || (new_lo == lo && new_hi == hi)){
+			break;
+		}
+		lo = new_lo;
+		hi = new_hi;
+	}
+	return (uint16_t)(mean + 0.5);
+}
+
+static uint16_t median(uint16_t* samples, int count)
+{
+	uint16_t* mid = samples + count / 2;
+	std::nth_element(samples, mid, samples + count);
+	if (count & 1){
+		return *mid;
+	}
+	const uint16_t below = *std::max_element(samples, mid);
+	return (uint16_t)((below + *mid + 1) / 2);
+}
+
+DarkFrameBuilder::DarkFrameBuilder(Mlv_video* mlv) : _mlv(mlv)
+{
+}
+
+DarkFrameBuilder::~DarkFrameBuilder()
+{
+	abort();
+	join_thread();
+}
+
+bool DarkFrameBuilder::start(const std::string& path, int frame_in, int frame_out, const Options& options)
+{
+	join_thread();
+
+	mlvObject_t* video = (mlvObject_t*)_mlv->get_mlv_object();
+	_error.clear();
+	_succeeded = false;
+	_abort = false;
+	_progress_done = 0;
+	_progress_total = 0;
+
+	frame_in = std::max(frame_in, 0);
+	frame_out = std::min(frame_out, (int)video->frames - 1);
+	if (frame_out < frame_in){
+		_error = "Averaging: empty frame range";
+		return false;
+	}
+
+	_path = path;
+	_frame_in = frame_in;
+	_frame_out = frame_out;
+	_options = options;
+
+	const uint64_t frames = frame_out - frame_in + 1;
+	uint64_t passes = 1;
+	if (options.mode != MODE_MEAN){
+		const uint64_t band_rows = std::max<uint64_t>(1, options.memory_budget / ((uint64_t)video->RAWI.xRes * 2 * frames));
+		passes = (video->RAWI.yRes + band_rows - 1) / band_rows;
+	}
+	_progress_total = frames * passes;
+
+	printf("Averaging frames %d to %d from MLV file: %s\n", frame_in, frame_out, video->path);
+
+	_finished = false;
+	_thread = std::thread(&DarkFrameBuilder::run, this);
+	return true;
+}
+
+void DarkFrameBuilder::abort()
+{
+	_abort = true;
+}
+
+bool DarkFrameBuilder::wait(int timeout_ms)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (timeout_ms < 0){
+		_finished_cond.wait(lock, [this]{ return _finished; });
+		return true;
+	}
+	return _finished_cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this]{ return _finished; });
+}
+
+void DarkFrameBuilder::join_thread()
+{
+	if (_thread.joinable()){
+		_thread.join();
+	}
+}
+
+void DarkFrameBuilder::set_error(const std::string& error)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_error.empty()){
+		_error = error;
+		printf("\n%s\n", error.c_str());
+	}
+}
+
+int DarkFrameBuilder::worker_count(size_t budget, size_t bytes_per_worker) const
+{
+	int threads = _options.threads > 0 ? _options.threads : (int)std::thread::hardware_concurrency();
+	threads = std::min(threads, _frame_out - _frame_in + 1);
+	threads = std::min<size_t>(threads, budget / std::max<size_t>(bytes_per_worker, 1));
+	return std::max(threads, 1);
+}
+
+void DarkFrameBuilder::run()
+{
+	mlvObject_t* video = (mlvObject_t*)_mlv->get_mlv_object();
+	std::vector<uint16_t> result((size_t)video->RAWI.xRes * video->RAWI.yRes);
+
+	bool ok;
+	if (_options.mode == MODE_MEAN){
+		// 32 bits sums hold 2^(32-bpp) samples of bpp bits
+		const uint64_t frames = _frame_out - _frame_in + 1;
+		if ((frames << video->RAWI.raw_info.bits_per_pixel) <= UINT32_MAX){
+			ok = build_mean<uint32_t>(result.data());
+		} else {
+			ok = build_mean<uint64_t>(result.data());
+		}
+	} else {
+		ok = build_bands(result.data());
+	}
+
+	if (ok && !_abort){
+		_succeeded = write_result(result.data());
+	}
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	_finished = true;
+	_finished_cond.notify_all();
+}
+
+bool DarkFrameBuilder::decode_frame(int frame, Worker& worker)
+{
+	mlvObject_t* video = (mlvObject_t*)_mlv->get_mlv_object();
+	const int chunk = video->video_index[frame].chunk_num;
+	const uint32_t frame_size = video->video_index[frame].frame_size;
+	const uint64_t frame_offset = video->video_index[frame].frame_offset;
+	const int width = video->RAWI.xRes;
+	const int height = video->RAWI.yRes;
+	const int bpp = video->RAWI.raw_info.bits_per_pixel;
+
+	worker.unpacked.resize((size_t)width * height);
+
+	/* read frame buffer, straight from the mapping if there is one */
+	const uint8_t* frame_data = getMlvChunkData(video, chunk, frame_offset, frame_size);
+	if (!frame_data){
+		// Keep the unpacked size as a floor, the bit unpacker may read past the payload
+		worker.packed.resize(std::max<size_t>(worker.packed.size(), std::max<size_t>(frame_size, worker.unpacked.size() * 2)));
+		if (readMlvChunkData(video, chunk, frame_offset, frame_size, worker.packed.data())){
+			set_error(std::string("Could not read VIDF image data from:  ") + video->path);
+			return false;
+		}
+		frame_data = worker.packed.data();
+	}
+
+	if (isMlvCompressed(video)){
+		int ret = dng_decompress_image(worker.unpacked.data(), (uint16_t*)frame_data, frame_size, width, height, bpp);
+		if (ret != 0){
+			set_error("Averaging: could not decompress frame:  LJ92_ERROR " + std::to_string(ret));
+			return false;
+		}
+	} else {
+		dng_unpack_image_bits(worker.unpacked.data(), (uint16_t*)frame_data, width, height, bpp);
+	}
+	return true;
+}
+
+template<typename T>
+bool DarkFrameBuilder::build_mean(uint16_t* result)
+{
+	mlvObject_t* video = (mlvObject_t*)_mlv->get_mlv_object();
+	const size_t pixel_count = (size_t)video->RAWI.xRes * video->RAWI.yRes;
+	const uint64_t frames = _frame_out - _frame_in + 1;
+	const int workers = worker_count(_options.memory_budget, pixel_count * (sizeof(T) + 2 * sizeof(uint16_t)));
+
+	std::vector<std::vector<T>> sums(workers);
+	std::atomic<int> next(_frame_in);
+	std::atomic<bool> failed(false);
+
+	run_threads(workers, [&](int t){
+		std::vector<T>& sum = sums[t];
+		sum.assign(pixel_count, 0);
+		Worker worker;
+		for (int frame = next++; frame <= _frame_out && !_abort && !failed; frame = next++){
+			if (!decode_frame(frame, worker)){
+				failed = true;
+				return;
+			}
+			const uint16_t* data = worker.unpacked.data();
+			for (size_t i = 0; i < pixel_count; ++i){
+				sum[i] += data[i];
+			}
+			++_progress_done;
+		}
+	});
+	if (failed || _abort){
+		return false;
+	}
+
+	parallel_ranges(workers, pixel_count, [&](size_t begin, size_t end){
+		for (size_t i = begin; i < end; ++i){
+			uint64_t total = 0;
+			for (int t = 0; t < workers; ++t){
+				total += sums[t][i];
+			}
+			result[i] = (uint16_t)((total + frames / 2) / frames);
+		}
+	});
+	return true;
+}
+
+bool DarkFrameBuilder::build_bands(uint16_t* result)
+{
+	mlvObject_t* video = (mlvObject_t*)_mlv->get_mlv_object();
+	const size_t width = video->RAWI.xRes;
+	const size_t height = video->RAWI.yRes;
+	const int frames = _frame_out - _frame_in + 1;
+
+	// At least one row per band, even when it does not fit the budget
+	const size_t band_rows = std::min(height, std::max<size_t>(1, _options.memory_budget / (width * 2 * frames)));
+	const size_t band_size = band_rows * width * frames * sizeof(uint16_t);
+	const size_t budget_left = _options.memory_budget > band_size ? _options.memory_budget - band_size : 0;
+	const int workers = worker_count(budget_left, width * height * 2 * sizeof(uint16_t));
+
+	std::vector<uint16_t> band(band_rows * width * frames);
+	std::vector<Worker> scratch(workers);
+
+	for (size_t y0 = 0; y0 < height && !_abort; y0 += band_rows){
+		const size_t rows = std::min(band_rows, height - y0);
+		const size_t band_pixels = rows * width;
+		std::atomic<int> next(_frame_in);
+		std::atomic<bool> failed(false);
+
+		run_threads(workers, [&](int t){
+			Worker& worker = scratch[t];
+			for (int frame = next++; frame <= _frame_out && !_abort && !failed; frame = next++){
+				if (!decode_frame(frame, worker)){
+					failed = true;
+					return;
+				}
+				memcpy(&band[(size_t)(frame - _frame_in) * band_pixels], &worker.unpacked[y0 * width], band_pixels * sizeof(uint16_t));
+				++_progress_done;
+			}
+		});
+		if (failed){
+			return false;
+		}
+
+		parallel_ranges(workers, band_pixels, [&](size_t begin, size_t end){
+			std::vector<uint16_t> samples(frames);
+			for (size_t i = begin; i < end; ++i){
+				for (int f = 0; f < frames; ++f){
+					samples[f] = band[f * band_pixels + i];
+				}
+				if (_options.mode == MODE_MEDIAN){
+					result[y0 * width + i] = median(samples.data(), frames);
+				} else {
+					result[y0 * width + i] = sigma_clipped_mean(samples.data(), frames, _options.sigma);
+				}
+			}
+		});
+	}
+	return !_abort;
+}
+
+bool DarkFrameBuilder::write_result(const uint16_t* result)
+{
+	char error_message[256] = { 0 };
+	mlvObject_t* video = (mlvObject_t*)_mlv->get_mlv_object();
+	const uint32_t pixel_count = video->RAWI.xRes * video->RAWI.yRes;
+	const uint32_t frame_size_packed = (uint32_t)(pixel_count * video->RAWI.raw_info.bits_per_pixel / 8);
+	const uint32_t frame_count = _frame_out - _frame_in + 1;
+
+	/* the averaged frame keeps the VIDF header of the first frame */
+	mlv_vidf_hdr_t vidf_hdr = { 0 };
+	const int chunk = video->video_index[_frame_in].chunk_num;
+	const uint64_t block_offset = video->video_index[_frame_in].block_offset;
+	const uint8_t* vidf = getMlvChunkData(video, chunk, block_offset, sizeof(mlv_vidf_hdr_t));
+	if (vidf){
+		memcpy(&vidf_hdr, vidf, sizeof(mlv_vidf_hdr_t));
+	} else if (readMlvChunkData(video, chunk, block_offset, sizeof(mlv_vidf_hdr_t), &vidf_hdr)){
+		set_error(std::string("Could not read VIDF block header from:  ") + video->path);
+		return false;
+	}
+	vidf_hdr.frameSpace = 0;
+	vidf_hdr.frameNumber = frame_count;
+	vidf_hdr.blockSize = sizeof(mlv_vidf_hdr_t) + frame_size_packed;
+
+	/* for safety allocate max possible size buffer for the packed image, calculated for 16bits per pixel */
+	std::vector<uint8_t> block_buf(sizeof(mlv_vidf_hdr_t) + pixel_count * sizeof(uint16_t));
+	memcpy(block_buf.data(), &vidf_hdr, sizeof(mlv_vidf_hdr_t));
+	dng_pack_image_bits((uint16_t*)(block_buf.data() + sizeof(mlv_vidf_hdr_t)), (uint16_t*)result, video->RAWI.xRes, video->RAWI.yRes, video->RAWI.raw_info.bits_per_pixel, 0);
+
+	FILE* mlv_file = fopen(_path.c_str(), "wb");
+	if (!mlv_file){
+		set_error("Could not open darkframe file:  " + _path);
+		return false;
+	}
+	bool ok = saveMlvHeaders(video, mlv_file, 0, MLV_AVERAGED_FRAME, _frame_in, _frame_out, "1.0", error_message) == 0;
+	if (!ok){
+		set_error(error_message);
+	} else if (fwrite(block_buf.data(), vidf_hdr.blockSize, 1, mlv_file) != 1){
+		set_error("Could not write darkvideo frame");
+		ok = false;
+	}
+	fclose(mlv_file);
+	if (!ok){
+		remove(_path.c_str());
+	}
+	// Clips using the previous content of the file reload it
+	llrpInvalidateExtDarkFrame(_path.c_str());
+	return ok;
+}
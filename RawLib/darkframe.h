@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <thread>
+#include "mlv_video.h"
+
+// Builds an averaged dark frame MLV from a range of frames of a clip.
+// Frames are decoded in parallel by worker threads reading the chunks with
+// positional reads, so the clip can keep rendering meanwhile. The build runs
+// on its own thread, the caller polls progress() and may abort() it.
+//
+// MODE_MEAN keeps one accumulator per worker and reduces them at the end.
+// MODE_MEDIAN and MODE_SIGMA_CLIP need every sample of a pixel: frames are
+// stored by bands of rows fitting the memory budget and the clip is decoded
+// once per band.
+class DarkFrameBuilder
+{
+public:
+	enum Mode {
+		MODE_MEAN = 0,
+		MODE_MEDIAN,
+		MODE_SIGMA_CLIP
+	};
+
+	struct Options {
+		Mode mode = MODE_MEAN;
+		// Samples further than sigma standard deviations from the mean are rejected
+		float sigma = 3.0f;
+		// Worker threads, 0 uses the hardware concurrency
+		int threads = 0;
+		// Bytes used for accumulators and stored bands
+		size_t memory_budget = (size_t)1024 << 20;
+	};
+
+	// mlv must stay valid until the build is finished
+	DarkFrameBuilder(Mlv_video* mlv);
+	// Aborts and waits for a running build
+	~DarkFrameBuilder();
+
+	// Average frames frame_in to frame_out (inclusive) into the MLV file path
+	bool start(const std::string& path, int frame_in, int frame_out, const Options& options);
+	void abort();
+	// Returns true once the build is over, false if timeout_ms elapsed before
+	bool wait(int timeout_ms = -1);
+
+	float progress() const { return _progress_total ? float(_progress_done) / float(_progress_total) : 0.0f; }
+	bool aborted() const { return _abort; }
+	bool succeeded() const { return _succeeded; }
+	const std::string& error() const { return _error; }
+
+private:
+	struct Worker;
+
+	void run();
+	template<typename T> bool build_mean(uint16_t* result);
+	bool build_bands(uint16_t* result);
+	bool decode_frame(int frame, Worker& worker);
+	bool write_result(const uint16_t* result);
+	void set_error(const std::string& error);
+	int worker_count(size_t budget, size_t bytes_per_worker) const;
+	void join_thread();
+
+	Mlv_video* _mlv;
+	std::string _path;
+	int _frame_in = 0;
+	int _frame_out = 0;
+	Options _options;
+
+	std::thread _thread;
+	std::mutex _mutex;
+	std::condition_variable _finished_cond;
+	bool _finished = true;
+	std::atomic<bool> _abort{false};
+	std::atomic<bool> _succeeded{false};
+	std::atomic<uint64_t> _progress_done{0};
+	uint64_t _progress_total = 0;
+	std::string _error;
+};
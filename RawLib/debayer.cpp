@@ -0,0 +1,369 @@
+#include "debayer.h"
+#include <algorithm>
+#include <vector>
+#include <cmath>
+
+// Rows demosaiced at once, keeps the scratch buffers in cache
+#define DEBAYER_BAND_ROWS 64
+
+Debayer::Debayer(const uint16_t* raw, int width, int height, uint32_t filters) :
+	_raw(raw), _width(width), _height(height), _filters(filters)
+{
+}
+
+void Debayer::set_levels(float black, float white)
+{
+	_black = black;
+	_scale = white > black ? 1.f / (white - black) : 1.f;
+}
+
+void Debayer::set_white_balance(const float wb[3])
+{
+	// Both greens share the same multiplier
+	_wb[0] = wb[0];
+	_wb[1] = wb[1];
+	_wb[2] = wb[2];
+	_wb[3] = wb[1];
+}
+
+inline float Debayer::sample(int y, int x) const
+{
+	float v = ((float)_raw[y * _width + x] - _black) * _scale;
+	return std::max(v, 0.f) * _wb[fc(y, x)];
+}
+
+void Debayer::bilinear_pixel(int y, int x, float* rgb) const
+{
+	float sum[4] = {0.f, 0.f, 0.f, 0.f};
+	int count[4] = {0, 0, 0, 0};
+	// Average each color over the 3x3 neighbourhood
+	for (int j = y - 1; j <= y + 1; ++j){
+		if (j < 0 || j >= _height) continue;
+		for (int i = x - 1; i <= x + 1; ++i){
+			if (i < 0 || i >= _width) continue;
+			const int f = fc(j, i);
+			sum[f] += sample(j, i);
+			count[f]++;
+		}
+	}
+	// Greens are stored with index 1 and 3 depending on the filter
+	sum[1] += sum[3];
+	count[1] += count[3];
+
+	const int c = color(y, x);
+	const float center = sample(y, x);
+	for (int k = 0; k < 3; ++k){
+		rgb[k] = (k == c || !count[k]) ? center : sum[k] / (float)count[k];
+	}
+}
+
+void Debayer::process_rect(int x1, int x2, int y1, int y2, float* out) const
+{
+	x1 = std::max(x1, 0);
+	x2 = std::min(x2, _width);
+	y1 = std::max(y1, 0);
+	y2 = std::min(y2, _height);
+	if (x1 >= x2){
+		return;
+	}
+
+	for (int y = y1; y < y2; y += DEBAYER_BAND_ROWS){
+		const int ye = std::min(y + DEBAYER_BAND_ROWS, y2);
+		float* band = out + (size_t)(y - y1) * (x2 - x1) * 3;
+		switch(_method){
+			case PPG:
+				ppg_rows(x1, x2, y, ye, band);
+				break;
+			case AHD:
+				ahd_rows(x1, x2, y, ye, band);
+				break;
+			case BILINEAR:
+			default:
+				bilinear_rows(x1, x2, y, ye, band);
+				break;
+		}
+	}
+}
+
+void Debayer::bilinear_rows(int x1, int x2, int y1, int y2, float* out) const
+{
+	for (int y = y1; y < y2; ++y){
+		float* dst = out + (size_t)(y - y1) * (x2 - x1) * 3;
+		for (int x = x1; x < x2; ++x){
+			bilinear_pixel(y, x, dst);
+			for (int k = 0; k < 3; ++k){
+				dst[k] = std::min(dst[k], _clip);
+			}
+			dst += 3;
+		}
+	}
+}
+
+// Patterned pixel grouping, same passes as resources/opencl/debayer_ppg.cl
+void Debayer::ppg_rows(int x1, int x2, int y1, int y2, float* out) const
+{
+	const int w = _width;
+	const int h = _height;
+	const int border = 3;
+	// The red/blue pass needs the green of the pixels around the band
+	const int gx1 = std::max(x1 - 1, 0);
+	const int gx2 = std::min(x2 + 1, w);
+	const int gy1 = std::max(y1 - 1, 0);
+	const int gy2 = std::min(y2 + 1, h);
+	const int stride = (gx2 - gx1) * 3;
+	std::vector<float> green((size_t)(gy2 - gy1) * stride);
+
+	for (int y = gy1; y < gy2; ++y){
+		float* rgb = &green[(size_t)(y - gy1) * stride];
+		for (int x = gx1; x < gx2; ++x, rgb += 3){
+			if (x < border || y < border || x >= w - border || y >= h - border){
+				bilinear_pixel(y, x, rgb);
+			} else {
+				const int c = color(y, x);
+				const float pc = sample(y, x);
+				rgb[0] = rgb[1] = rgb[2] = 0.f;
+				rgb[c] = pc;
+
+				// Fill green layer for red and blue pixels
+				if (c != 1){
+					const float pym  = sample(y - 1, x);
+					const float pym2 = sample(y - 2, x);
+					const float pym3 = sample(y - 3, x);
+					const float pyM  = sample(y + 1, x);
+					const float pyM2 = sample(y + 2, x);
+					const float pyM3 = sample(y + 3, x);
+					const float pxm  = sample(y, x - 1);
+					const float pxm2 = sample(y, x - 2);
+					const float pxm3 = sample(y, x - 3);
+					const float pxM  = sample(y, x + 1);
+					const float pxM2 = sample(y, x + 2);
+					const float pxM3 = sample(y, x + 3);
+
+					const float guessx = (pxm + pc + pxM) * 2.0f - pxM2 - pxm2;
+					const float diffx  = (std::fabs(pxm2 - pc) + std::fabs(pxM2 - pc) + std::fabs(pxm  - pxM)) * 3.0f +
+										 (std::fabs(pxM3 - pxM) + std::fabs(pxm3 - pxm)) * 2.0f;
+					const float guessy = (pym + pc + pyM) * 2.0f - pyM2 - pym2;
+					const float diffy  = (std::fabs(pym2 - pc) + std::fabs(pyM2 - pc) + std::fabs(pym  - pyM)) * 3.0f +
+										 (std::fabs(pyM3 - pyM) + std::fabs(pym3 - pym)) * 2.0f;
+					if (diffx > diffy){
+						rgb[1] = std::max(std::min(guessy * 0.25f, std::max(pym, pyM)), std::min(pym, pyM));
+					} else {
+						rgb[1] = std::max(std::min(guessx * 0.25f, std::max(pxm, pxM)), std::min(pxm, pxM));
+					}
+				}
+			}
+			for (int k = 0; k < 3; ++k){
+				rgb[k] = std::min(rgb[k], _clip);
+			}
+		}
+	}
+
+	for (int y = y1; y < y2; ++y){
+		const float* src = &green[(size_t)(y - gy1) * stride + (x1 - gx1) * 3];
+		float* dst = out + (size_t)(y - y1) * (x2 - x1) * 3;
+		for (int x = x1; x < x2; ++x, src += 3, dst += 3){
+			dst[0] = src[0];
+			dst[1] = src[1];
+			dst[2] = src[2];
+			if (x == 0 || y == 0 || x == w - 1 || y == h - 1){
+				continue;
+			}
+
+			const int c = color(y, x);
+			if (c == 1){
+				// Red and blue for green pixels, 4-neighbourhood
+				const float* nt = src - stride;
+				const float* nb = src + stride;
+				const float* nl = src - 3;
+				const float* nr = src + 3;
+				if (color(y, x + 1) == 0){
+					dst[2] = (nt[2] + nb[2] + 2.0f * src[1] - nt[1] - nb[1]) * 0.5f;
+					dst[0] = (nl[0] + nr[0] + 2.0f * src[1] - nl[1] - nr[1]) * 0.5f;
+				} else {
+					dst[0] = (nt[0] + nb[0] + 2.0f * src[1] - nt[1] - nb[1]) * 0.5f;
+					dst[2] = (nl[2] + nr[2] + 2.0f * src[1] - nl[1] - nr[1]) * 0.5f;
+				}
+			} else {
+				// Blue for red pixels and red for blue pixels, diagonal neighbourhood
+				const int o = c == 0 ? 2 : 0;
+				const float* ntl = src - stride - 3;
+				const float* ntr = src - stride + 3;
+				const float* nbl = src + stride - 3;
+				const float* nbr = src + stride + 3;
+				const float diff1  = std::fabs(ntl[o] - nbr[o]) + std::fabs(ntl[1] - src[1]) + std::fabs(nbr[1] - src[1]);
+				const float guess1 = ntl[o] + nbr[o] + 2.0f * src[1] - ntl[1] - nbr[1];
+				const float diff2  = std::fabs(ntr[o] - nbl[o]) + std::fabs(ntr[1] - src[1]) + std::fabs(nbl[1] - src[1]);
+				const float guess2 = ntr[o] + nbl[o] + 2.0f * src[1] - ntr[1] - nbl[1];
+				if (diff1 > diff2) dst[o] = guess2 * 0.5f;
+				else if (diff1 < diff2) dst[o] = guess1 * 0.5f;
+				else dst[o] = (guess1 + guess2) * 0.25f;
+			}
+			for (int k = 0; k < 3; ++k){
+				dst[k] = std::max(std::min(dst[k], _clip), 0.f);
+			}
+		}
+	}
+}
+
+static inline float lab_f(float t)
+{
+	return t > 0.008856f ? std::cbrt(t) : 7.787f * t + 16.f / 116.f;
+}
+
+static inline void rgb_to_lab(const float* rgb, float* lab)
+{
+	const float r = std::max(rgb[0], 0.f);
+	const float g = std::max(rgb[1], 0.f);
+	const float b = std::max(rgb[2], 0.f);
+	const float fx = lab_f((0.412453f * r + 0.357580f * g + 0.180423f * b) / 0.950456f);
+	const float fy = lab_f( 0.212671f * r + 0.715160f * g + 0.072169f * b);
+	const float fz = lab_f((0.019334f * r + 0.119193f * g + 0.950227f * b) / 1.088754f);
+	lab[0] = 116.f * fy - 16.f;
+	lab[1] = 500.f * (fx - fy);
+	lab[2] = 200.f * (fy - fz);
+}
+
+// Adaptive homogeneity-directed interpolation (Hirakawa & Parks)
+// Horizontal and vertical candidates are built, the most homogeneous
+// one in CIELab is kept per pixel
+void Debayer::ahd_rows(int x1, int x2, int y1, int y2, float* out) const
+{
+	const int w = _width;
+	const int h = _height;
+	const int border = 3;
+
+	// Green estimates, candidates and homogeneity maps each need one or
+	// two more rows and columns than the next stage
+	const int gx1 = std::max(x1 - 3, 0), gx2 = std::min(x2 + 3, w);
+	const int cx1 = std::max(x1 - 2, 0), cx2 = std::min(x2 + 2, w);
+	const int hx1 = std::max(x1 - 1, 0), hx2 = std::min(x2 + 1, w);
+	const int gy1 = std::max(y1 - 3, 0), gy2 = std::min(y2 + 3, h);
+	const int cy1 = std::max(y1 - 2, 0), cy2 = std::min(y2 + 2, h);
+	const int hy1 = std::max(y1 - 1, 0), hy2 = std::min(y2 + 1, h);
+	const int gw = gx2 - gx1, cw = cx2 - cx1, hw = hx2 - hx1;
+
+	std::vector<float> green[2], rgb[2], lab[2];
+	std::vector<uint8_t> hom[2];
+	for (int d = 0; d < 2; ++d){
+		green[d].resize((size_t)(gy2 - gy1) * gw);
+		rgb[d].resize((size_t)(cy2 - cy1) * cw * 3);
+		lab[d].resize((size_t)(cy2 - cy1) * cw * 3);
+		hom[d].assign((size_t)(hy2 - hy1) * hw, 0);
+	}
+
+	// Directional green, Laplacian corrected and limited to its neighbours
+	for (int y = gy1; y < gy2; ++y){
+		float* gh = &green[0][(size_t)(y - gy1) * gw] - gx1;
+		float* gv = &green[1][(size_t)(y - gy1) * gw] - gx1;
+		for (int x = gx1; x < gx2; ++x){
+			const int c = color(y, x);
+			const float pc = sample(y, x);
+			if (c == 1){
+				gh[x] = gv[x] = pc;
+			} else if (x < 2 || y < 2 || x >= w - 2 || y >= h - 2){
+				float px[3];
+				bilinear_pixel(y, x, px);
+				gh[x] = gv[x] = px[1];
+			} else {
+				const float l = sample(y, x - 1), r = sample(y, x + 1);
+				const float t = sample(y - 1, x), b = sample(y + 1, x);
+				const float vh = (l + r) * 0.5f + (2.f * pc - sample(y, x - 2) - sample(y, x + 2)) * 0.25f;
+				const float vv = (t + b) * 0.5f + (2.f * pc - sample(y - 2, x) - sample(y + 2, x)) * 0.25f;
+				gh[x] = std::max(std::min(vh, std::max(l, r)), std::min(l, r));
+				gv[x] = std::max(std::min(vv, std::max(t, b)), std::min(t, b));
+			}
+		}
+	}
+
+	// Red and blue from color differences against each green candidate
+	for (int d = 0; d < 2; ++d){
+		for (int y = cy1; y < cy2; ++y){
+			const float* g = &green[d][(size_t)(y - gy1) * gw] - gx1;
+			float* px = &rgb[d][(size_t)(y - cy1) * cw * 3];
+			float* lb = &lab[d][(size_t)(y - cy1) * cw * 3];
+			for (int x = cx1; x < cx2; ++x, px += 3, lb += 3){
+				if (x < 1 || y < 1 || x >= w - 1 || y >= h - 1){
+					bilinear_pixel(y, x, px);
+				} else {
+					const int c = color(y, x);
+					px[1] = g[x];
+					if (c == 1){
+						const int ch = color(y, x + 1);
+						const int cv = 2 - ch;
+						px[ch] = g[x] + ((sample(y, x - 1) - g[x - 1]) + (sample(y, x + 1) - g[x + 1])) * 0.5f;
+						px[cv] = g[x] + ((sample(y - 1, x) - g[x - gw]) + (sample(y + 1, x) - g[x + gw])) * 0.5f;
+					} else {
+						const int o = 2 - c;
+						px[c] = sample(y, x);
+						px[o] = g[x] + ((sample(y - 1, x - 1) - g[x - gw - 1]) + (sample(y - 1, x + 1) - g[x - gw + 1]) +
+										(sample(y + 1, x - 1) - g[x + gw - 1]) + (sample(y + 1, x + 1) - g[x + gw + 1])) * 0.25f;
+					}
+				}
+				for (int k = 0; k < 3; ++k){
+					px[k] = std::max(std::min(px[k], _clip), 0.f);
+				}
+				rgb_to_lab(px, lb);
+			}
+		}
+	}
+
+	// Homogeneity maps
+	const int stride = cw * 3;
+	const int nb[4] = {-3, 3, -stride, stride};
+	for (int y = std::max(hy1, 1); y < std::min(hy2, h - 1); ++y){
+		const float* lh = &lab[0][(size_t)(y - cy1) * stride] - cx1 * 3;
+		const float* lv = &lab[1][(size_t)(y - cy1) * stride] - cx1 * 3;
+		uint8_t* hh = &hom[0][(size_t)(y - hy1) * hw] - hx1;
+		uint8_t* hv = &hom[1][(size_t)(y - hy1) * hw] - hx1;
+		for (int x = std::max(hx1, 1); x < std::min(hx2, w - 1); ++x){
+			const float* p[2] = {lh + x * 3, lv + x * 3};
+			float ldiff[2][4], abdiff[2][4];
+			for (int d = 0; d < 2; ++d){
+				for (int i = 0; i < 4; ++i){
+					const float* n = p[d] + nb[i];
+					ldiff[d][i] = std::fabs(p[d][0] - n[0]);
+					abdiff[d][i] = (p[d][1] - n[1]) * (p[d][1] - n[1]) + (p[d][2] - n[2]) * (p[d][2] - n[2]);
+				}
+			}
+			const float leps = std::min(std::max(ldiff[0][0], ldiff[0][1]), std::max(ldiff[1][2], ldiff[1][3]));
+			const float abeps = std::min(std::max(abdiff[0][0], abdiff[0][1]), std::max(abdiff[1][2], abdiff[1][3]));
+			uint8_t count[2] = {0, 0};
+			for (int d = 0; d < 2; ++d){
+				for (int i = 0; i < 4; ++i){
+					count[d] += (ldiff[d][i] <= leps && abdiff[d][i] <= abeps);
+				}
+			}
+			hh[x] = count[0];
+			hv[x] = count[1];
+		}
+	}
+
+	// Pick the direction with the most homogeneous 3x3 neighbourhood
+	for (int y = y1; y < y2; ++y){
+		float* dst = out + (size_t)(y - y1) * (x2 - x1) * 3;
+		const float* ph = &rgb[0][(size_t)(y - cy1) * stride] - cx1 * 3;
+		const float* pv = &rgb[1][(size_t)(y - cy1) * stride] - cx1 * 3;
+		for (int x = x1; x < x2; ++x, dst += 3){
+			if (x < border || y < border || x >= w - border || y >= h - border){
+				bilinear_pixel(y, x, dst);
+				for (int k = 0; k < 3; ++k){
+					dst[k] = std::min(dst[k], _clip);
+				}
+				continue;
+			}
+			int hm[2] = {0, 0};
+			for (int j = y - 1; j <= y + 1; ++j){
+				const size_t row = (size_t)(j - hy1) * hw - hx1;
+				for (int i = x - 1; i <= x + 1; ++i){
+					hm[0] += hom[0][row + i];
+					hm[1] += hom[1][row + i];
+				}
+			}
+			for (int k = 0; k < 3; ++k){
+				if (hm[0] > hm[1]) dst[k] = ph[x * 3 + k];
+				else if (hm[0] < hm[1]) dst[k] = pv[x * 3 + k];
+				else dst[k] = (ph[x * 3 + k] + pv[x * 3 + k]) * 0.5f;
+			}
+		}
+	}
+}
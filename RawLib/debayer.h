@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+
+// Native CPU demosaic working directly on the unpacked 16 bit bayer plane
+// (Mlv_video::get_raw_buffer), no DNG/LibRaw round trip.
+// Rectangles are independent, so callers can split a frame in tiles and run
+// them concurrently, the bayer plane is only read. Each rectangle recomputes
+// the few rows and columns of halo its neighbourhood needs in its own
+// scratch buffers, so it gives the same pixels as a full frame.
+class Debayer
+{
+public:
+	enum Method {
+		BILINEAR = 0,
+		PPG,
+		AHD
+	};
+
+	// Standard Canon filter (RGGB)
+	Debayer(const uint16_t* raw, int width, int height, uint32_t filters = 0x94949494);
+
+	void set_method(Method m){_method = m;}
+	void set_levels(float black, float white);
+	void set_white_balance(const float wb[3]);
+	void set_clip(float clip_value){_clip = clip_value;}
+
+	int width() const {return _width;}
+	int height() const {return _height;}
+
+	// Demosaic the columns [x1, x2) of rows [y1, y2) to interleaved float RGB
+	// (black subtracted, normalized to white level, white balanced and clipped)
+	// out must hold (y2 - y1) * (x2 - x1) * 3 floats
+	void process_rect(int x1, int x2, int y1, int y2, float* out) const;
+
+private:
+	int fc(int y, int x) const {return (_filters >> ((((y << 1) & 14) + (x & 1)) << 1)) & 3;}
+	// Color index with both greens mapped to 1
+	int color(int y, int x) const {int c = fc(y, x); return c == 3 ? 1 : c;}
+	float sample(int y, int x) const;
+	void bilinear_pixel(int y, int x, float* rgb) const;
+
+	void bilinear_rows(int x1, int x2, int y1, int y2, float* out) const;
+	void ppg_rows(int x1, int x2, int y1, int y2, float* out) const;
+	void ahd_rows(int x1, int x2, int y1, int y2, float* out) const;
+
+	const uint16_t* _raw;
+	int _width, _height;
+	uint32_t _filters;
+	Method _method = BILINEAR;
+	float _black = 0.f;
+	float _scale = 1.f;
+	float _wb[4] = {1.f, 1.f, 1.f, 1.f};
+	float _clip = 1.f;
+};
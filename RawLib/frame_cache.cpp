@@ -0,0 +1,250 @@
+#include "frame_cache.h"
+#include <algorithm>
+
+FrameCache::FrameCache()
+{
+}
+
+FrameCache::~FrameCache()
+{
+	set_source(nullptr);
+}
+
+void FrameCache::set_budget(size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_budget = bytes;
+	evict();
+}
+
+void FrameCache::set_source(const Mlv_video* mlv)
+{
+	stop_worker();
+
+	delete _reader;
+	_reader = nullptr;
+
+	if (mlv == nullptr){
+		return;
+	}
+
+	// Copy video stream, the read-ahead thread has its own file handles
+	_reader = new Mlv_video(*mlv);
+	_quit = false;
+	_pending = false;
+	_thread = std::thread(&FrameCache::worker, this);
+}
+
+void FrameCache::stop_worker()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_quit = true;
+	}
+	_cond.notify_all();
+	if (_thread.joinable()){
+		_thread.join();
+	}
+}
+
+void FrameCache::clear()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_entries.clear();
+	_lru.clear();
+	_size = 0;
+	// Drop any decode in flight, its data may be outdated
+	_decoding.clear();
+	_epoch++;
+}
+
+FrameCache::FramePtr FrameCache::get(uint32_t frame, uint64_t settings)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	auto it = _entries.find(Key(frame, settings));
+	if (it == _entries.end()){
+		return nullptr;
+	}
+	// Move to most recently used
+	_lru.splice(_lru.begin(), _lru, it->second.lru);
+	return it->second.frame;
+}
+
+FrameCache::FramePtr FrameCache::decode(Mlv_video* mlv, uint32_t frame, Mlv_video::RawInfo& ri)
+{
+	Key key(frame, ri.settings_hash());
+	uint64_t epoch;
+	std::promise<FramePtr> promise;
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		auto it = _entries.find(key);
+		if (it != _entries.end()){
+			_lru.splice(_lru.begin(), _lru, it->second.lru);
+			return it->second.frame;
+		}
+		auto pending = _decoding.find(key);
+		if (pending != _decoding.end()){
+			std::shared_future<FramePtr> result = pending->second;
+			lock.unlock();
+			return result.get();
+		}
+		_decoding[key] = promise.get_future().share();
+		epoch = _epoch;
+	}
+
+	std::shared_ptr<Frame> f;
+	try {
+		mlv->low_level_process(ri);
+		uint16_t* raw = mlv->get_raw_buffer(frame);
+		if (raw != nullptr){
+			f = std::make_shared<Frame>();
+			f->width = mlv->raw_resolution_x();
+			f->height = mlv->raw_resolution_y();
+			f->raw.assign(raw, raw + (size_t)f->width * f->height);
+			f->black_level = mlv->black_level();
+			f->white_level = mlv->white_level();
+			f->device = mlv->device_frame();
+		}
+	} catch (...){
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (epoch == _epoch){
+				_decoding.erase(key);
+			}
+		}
+		promise.set_exception(std::current_exception());
+		throw;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		// Cache was cleared while decoding, don't store stale data.
+		// The pending entry is then gone, or belongs to a newer decode
+		if (epoch == _epoch){
+			if (f){
+				insert(key, f);
+			}
+			_decoding.erase(key);
+		}
+	}
+	promise.set_value(f);
+	return f;
+}
+
+void FrameCache::insert(const Key& key, FramePtr frame)
+{
+	size_t bytes = frame->raw.size() * sizeof(uint16_t);
+	if (bytes > _budget || _entries.count(key)){
+		return;
+	}
+
+	_lru.push_front(key);
+	_entries[key] = Entry{frame, _lru.begin()};
+	_size += bytes;
+	evict();
+}
+
+bool FrameCache::in_window(const Key& key) const
+{
+	return key.second == _window_settings && (int64_t)key.first >= _window_first && (int64_t)key.first <= _window_last;
+}
+
+bool FrameCache::can_make_room(size_t bytes) const
+{
+	size_t size = _size + bytes;
+	for (auto it = _lru.rbegin(); it != _lru.rend() && size > _budget; ++it){
+		if (!in_window(*it)){
+			size -= _entries.at(*it).frame->raw.size() * sizeof(uint16_t);
+		}
+	}
+	return size <= _budget;
+}
+
+void FrameCache::evict()
+{
+	// Least recently used frames outside the read-ahead window go first
+	auto it = _lru.end();
+	while (_size > _budget && it != _lru.begin()){
+		--it;
+		if (in_window(*it)){
+			continue;
+		}
+		auto entry = _entries.find(*it);
+		_size -= entry->second.frame->raw.size() * sizeof(uint16_t);
+		_entries.erase(entry);
+		it = _lru.erase(it);
+	}
+	// Only the window is left, it doesn't fit the budget
+	while (_size > _budget && !_lru.empty()){
+		auto entry = _entries.find(_lru.back());
+		_size -= entry->second.frame->raw.size() * sizeof(uint16_t);
+		_entries.erase(entry);
+		_lru.pop_back();
+	}
+}
+
+void FrameCache::read_ahead(uint32_t frame, int direction, int count, const Mlv_video::RawInfo& ri)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_reader == nullptr || _budget == 0 || count <= 0){
+			return;
+		}
+		_request.frame = frame;
+		_request.direction = direction < 0 ? -1 : 1;
+		_request.count = count;
+		_request.rawinfo = ri;
+		int64_t last = (int64_t)frame + (int64_t)count * _request.direction;
+		_window_first = std::min<int64_t>(frame, last);
+		_window_last = std::max<int64_t>(frame, last);
+		_window_settings = ri.settings_hash();
+		// Newer request supersedes the one being processed
+		_pending = true;
+	}
+	_cond.notify_one();
+}
+
+void FrameCache::worker()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	while (!_quit){
+		_cond.wait(lock, [this]{return _quit || _pending;});
+		if (_quit){
+			break;
+		}
+
+		Request req = _request;
+		_pending = false;
+		uint64_t epoch = _epoch;
+		uint64_t settings = req.rawinfo.settings_hash();
+		int64_t frame_count = _reader->frame_count();
+
+		for (int i = 1; i <= req.count; ++i){
+			if (_quit || _pending || epoch != _epoch){
+				break;
+			}
+			int64_t frame = (int64_t)req.frame + (int64_t)i * req.direction;
+			if (frame < 0 || frame >= frame_count){
+				break;
+			}
+			Key key((uint32_t)frame, settings);
+			if (_entries.count(key) || _decoding.count(key)){
+				continue;
+			}
+			// Window larger than the budget, decoding more would push out
+			// frames just decoded for the current position
+			if (!can_make_room((size_t)_reader->raw_resolution_x() * _reader->raw_resolution_y() * sizeof(uint16_t))){
+				break;
+			}
+
+			lock.unlock();
+			try {
+				decode(_reader, (uint32_t)frame, req.rawinfo);
+			} catch (...){
+				// Waiters get the error from the promise, the caller
+				// decoding this frame again will report it
+			}
+			lock.lock();
+		}
+	}
+}
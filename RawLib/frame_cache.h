@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <future>
+#include "mlv_video.h"
+
+// LRU cache of low level processed (llrawproc) bayer frames.
+// Entries are keyed by frame number and the RawInfo settings hash, so
+// parameters that only act after demosaic never trigger a new decode.
+// An optional background thread decodes the next frames in the
+// playback direction with its own copy of the video stream.
+// Callers missing on a frame being decoded wait for that decode,
+// with or without a memory budget.
+class FrameCache
+{
+public:
+	struct Frame {
+		std::vector<uint16_t> raw;
+		int width = 0;
+		int height = 0;
+		uint32_t black_level = 0;
+		uint32_t white_level = 0;
+		// Low level stages still to run on the device
+		Mlv_video::DeviceFrame device;
+	};
+	typedef std::shared_ptr<const Frame> FramePtr;
+
+	FrameCache();
+	~FrameCache();
+
+	// Memory budget in bytes, 0 disables caching and read-ahead
+	void set_budget(size_t bytes);
+	// Stream used as template for the read-ahead decoder, NULL stops it
+	// Must be called before the source stream is destroyed
+	void set_source(const Mlv_video* mlv);
+	void clear();
+
+	FramePtr get(uint32_t frame, uint64_t settings);
+	// Decode frame with mlv (owned by the caller) and store it,
+	// or wait for the decode of the same frame already running
+	FramePtr decode(Mlv_video* mlv, uint32_t frame, Mlv_video::RawInfo& ri);
+	// Ask the background decoder for frames frame+direction ... frame+count*direction
+	void read_ahead(uint32_t frame, int direction, int count, const Mlv_video::RawInfo& ri);
+
+private:
+	typedef std::pair<uint32_t, uint64_t> Key;
+	struct Entry {
+		FramePtr frame;
+		std::list<Key>::iterator lru;
+	};
+	struct Request {
+		uint32_t frame = 0;
+		int direction = 1;
+		int count = 0;
+		Mlv_video::RawInfo rawinfo;
+	};
+
+	void insert(const Key& key, FramePtr frame);
+	bool in_window(const Key& key) const;
+	// True if bytes more fit in the budget once frames outside the window are evicted
+	bool can_make_room(size_t bytes) const;
+	void evict();
+	void worker();
+	void stop_worker();
+
+	std::mutex _mutex;
+	std::condition_variable _cond;
+	std::map<Key, Entry> _entries;
+	std::map<Key, std::shared_future<FramePtr>> _decoding;
+	std::list<Key> _lru;
+	size_t _budget = 0;
+	size_t _size = 0;
+
+	Mlv_video* _reader = nullptr;
+	std::thread _thread;
+	Request _request;
+	bool _pending = false;
+	bool _quit = false;
+	uint64_t _epoch = 0;
+	// Frames around the current position, evicted last
+	int64_t _window_first = 0;
+	int64_t _window_last = -1;
+	uint64_t _window_settings = 0;
+};
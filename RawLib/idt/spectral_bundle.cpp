@@ -0,0 +1,47 @@
+#include "spectral_bundle.h"
+#include "spectral_bundle_data.h"
+#include <cctype>
+#include <unordered_map>
+
+namespace SSIDT {
+
+namespace SpectralBundle {
+
+static std::string cameraKey( const std::string &make, const std::string &model )
+{
+    std::string key = make + '\n' + model;
+    for ( char &c: key )
+        c = (char)tolower( (unsigned char)c );
+    return key;
+}
+
+// Make/model hash index over the generated table, built on first lookup
+static const std::unordered_map<std::string, const Camera *> &cameraIndex()
+{
+    static const std::unordered_map<std::string, const Camera *> index = [] {
+        std::unordered_map<std::string, const Camera *> cameras;
+        for ( const Camera &camera: spectral_bundle_cameras )
+            cameras[cameraKey( camera.make, camera.model )] = &camera;
+        return cameras;
+    }();
+    return index;
+}
+
+const Camera *findCamera( const std::string &make, const std::string &model )
+{
+    const std::unordered_map<std::string, const Camera *> &index = cameraIndex();
+    auto it = index.find( cameraKey( make, model ) );
+    return it != index.end() ? it->second : nullptr;
+}
+
+const Training *training()
+{
+    static_assert(
+        sizeof( spectral_bundle_training ) / sizeof( Training ) == SAMPLES,
+        "training data should have one row per sample" );
+    return spectral_bundle_training;
+}
+
+} // namespace SpectralBundle
+
+} // namespace SSIDT
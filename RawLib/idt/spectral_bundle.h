@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+namespace SSIDT {
+
+// Camera sensitivities and training patches of resources/data, compiled in
+// at build time by scripts/spectral_bundle.cmake. Lookups are done in memory,
+// no JSON is parsed and no directory is scanned at runtime.
+namespace SpectralBundle {
+
+// 380nm to 780nm with 5nm step
+const int SAMPLES = 81;
+const int PATCHES = 190;
+
+struct Camera
+{
+    const char *make;
+    const char *model;
+    int         increment;
+    double      rgb[SAMPLES][3];
+};
+
+struct Training
+{
+    uint16_t wl;
+    double   data[PATCHES];
+};
+
+// Case insensitive make/model lookup, NULL if the camera is not in the bundle
+const Camera *findCamera( const std::string &make, const std::string &model );
+// SAMPLES rows
+const Training *training();
+
+} // namespace SpectralBundle
+
+} // namespace SSIDT
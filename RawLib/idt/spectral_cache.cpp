@@ -0,0 +1,173 @@
+#include "spectral_cache.h"
+#include "define.h"
+#include <cmath>
+
+namespace SSIDT {
+
+// White balance multipliers closer than this share a solution
+#define SPECTRAL_WB_QUANTUM 4096.0f
+
+bool SpectralCache::Key::operator<( const Key &other ) const
+{
+    if ( make != other.make )
+        return make < other.make;
+    if ( model != other.model )
+        return model < other.model;
+    FORI( 3 )
+    {
+        if ( wb[i] != other.wb[i] )
+            return wb[i] < other.wb[i];
+    }
+    return colorspace < other.colorspace;
+}
+
+SpectralCache &SpectralCache::instance()
+{
+    static SpectralCache cache;
+    return cache;
+}
+
+SpectralCache::SpectralCache()
+{
+}
+
+SpectralCache::~SpectralCache()
+{
+    {
+        std::lock_guard<std::mutex> lock( _mutex );
+        _quit = true;
+    }
+    _workCond.notify_all();
+    if ( _thread.joinable() )
+        _thread.join();
+}
+
+// Called with _mutex held
+void SpectralCache::loadDatasets()
+{
+    if ( _loaded )
+        return;
+    _loaded = true;
+
+    Idt idt;
+    idt.loadIlluminant( vector<string>(), "na" );
+    idt.loadTrainingData();
+    _illuminants = idt.getIlluminants();
+    _training    = idt.getTrainingSpec();
+}
+
+bool SpectralCache::hasCamera( const string &make, const string &model )
+{
+    return SpectralBundle::findCamera( make, model ) != nullptr;
+}
+
+SpectralCache::Key SpectralCache::makeKey(
+    const string &make, const string &model, const float wb[3], int colorspace )
+{
+    Key key;
+    key.make  = make;
+    key.model = model;
+    FORI( 3 ) key.wb[i] = (int)std::lround( wb[i] * SPECTRAL_WB_QUANTUM );
+    key.colorspace = colorspace;
+    return key;
+}
+
+// Called with _mutex held
+void SpectralCache::queue( const Key &key )
+{
+    if ( _pending.count( key ) )
+        return;
+    _pending.insert( key );
+    _queue.push_back( key );
+    if ( !_thread.joinable() )
+        _thread = std::thread( &SpectralCache::worker, this );
+    _workCond.notify_one();
+}
+
+SpectralCache::ResultPtr
+SpectralCache::request( const Key &key, const Listener &solved )
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+    auto it = _results.find( key );
+    if ( it != _results.end() )
+        return it->second;
+    queue( key );
+    if ( solved )
+        _listeners[key].push_back( solved );
+    return ResultPtr();
+}
+
+void SpectralCache::worker()
+{
+    std::unique_lock<std::mutex> lock( _mutex );
+    while ( true )
+    {
+        _workCond.wait( lock, [this] { return _quit || !_queue.empty(); } );
+        if ( _quit )
+            break;
+
+        Key key = _queue.front();
+        _queue.pop_front();
+
+        ResultPtr result;
+        try
+        {
+            loadDatasets();
+            lock.unlock();
+            result = solve( key );
+        }
+        catch ( ... )
+        {
+            // Cached as a failed solve, the listeners fall back to the DNG matrix
+            result = std::make_shared<Result>();
+        }
+        if ( !lock.owns_lock() )
+            lock.lock();
+
+        _results[key] = result;
+        _pending.erase( key );
+        vector<Listener> listeners;
+        auto it = _listeners.find( key );
+        if ( it != _listeners.end() )
+        {
+            listeners.swap( it->second );
+            _listeners.erase( it );
+        }
+
+        lock.unlock();
+        for ( const Listener &solved: listeners )
+            solved();
+        lock.lock();
+    }
+}
+
+// The datasets are resident, only the fit runs here
+SpectralCache::ResultPtr SpectralCache::solve( const Key &key )
+{
+    std::shared_ptr<Result> result = std::make_shared<Result>();
+
+    const SpectralBundle::Camera *camera =
+        SpectralBundle::findCamera( key.make, key.model );
+    if ( !camera )
+        return result;
+
+    Idt idt;
+    idt.loadCameraSpst( *camera );
+    for ( const Illum &illum: _illuminants )
+        idt.setIlluminants( illum );
+    idt.setTrainingSpec( _training );
+
+    vector<double> wb( 3 );
+    FORI( 3 ) wb[i] = key.wb[i] / SPECTRAL_WB_QUANTUM;
+    idt.chooseIllumSrc( wb, 0 );
+
+    if ( idt.calIDT() )
+    {
+        idt.getIdtF( result->idt );
+        idt.getWBF( result->wb );
+        result->valid = true;
+    }
+    return result;
+}
+
+} // namespace SSIDT
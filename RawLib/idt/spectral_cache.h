@@ -0,0 +1,83 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include "spectral_idt.h"
+
+namespace SSIDT {
+
+// Process wide cache of the spectral IDT solver.
+// The illuminants are computed once and stay resident, the camera
+// sensitivities and training patches come from the SpectralBundle.
+// Solved matrices are kept by camera, quantized white balance and
+// colorspace. Missing ones are solved one after the other by a worker
+// thread, callers queue them with request() and get notified from the
+// worker thread once the solution is published.
+class SpectralCache
+{
+public:
+    struct Key
+    {
+        string make;
+        string model;
+        int    wb[3];
+        int    colorspace;
+
+        bool operator<( const Key &other ) const;
+    };
+
+    struct Result
+    {
+        // False when the solver failed or did not converge
+        bool  valid = false;
+        float idt[9];
+        float wb[3];
+    };
+    typedef std::shared_ptr<const Result> ResultPtr;
+    // Called by the worker thread when a queued key is solved
+    typedef std::function<void()> Listener;
+
+    static SpectralCache &instance();
+
+    // True if the sensitivities of this camera are in the bundle
+    bool hasCamera( const string &make, const string &model );
+
+    static Key makeKey(
+        const string &make, const string &model, const float wb[3], int colorspace );
+
+    // Cached solution, or NULL after queuing the missing one,
+    // solved is then called once it is available
+    ResultPtr request( const Key &key, const Listener &solved = Listener() );
+
+private:
+    SpectralCache();
+    ~SpectralCache();
+
+    void      loadDatasets();
+    void      queue( const Key &key );
+    void      worker();
+    ResultPtr solve( const Key &key );
+
+    std::mutex              _mutex;
+    std::condition_variable _workCond;
+    std::thread             _thread;
+    bool                    _quit = false;
+
+    bool _loaded = false;
+    // Handed to a new Idt for each solve
+    vector<Illum>     _illuminants;
+    vector<trainSpec> _training;
+
+    std::map<Key, ResultPtr> _results;
+    std::set<Key>            _pending;
+    std::deque<Key>          _queue;
+    std::map<Key, vector<Listener>> _listeners;
+};
+
+} // namespace SSIDT
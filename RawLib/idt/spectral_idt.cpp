@@ -477,6 +477,44 @@ uint8_t Spst::getWLIncrement() const
     return _increment;
 }
 
+//	=====================================================================
+//	Load the sensitivity data of the camera compiled in the plugin
+//
+//	inputs:
+//      SpectralBundle::Camera: camera found with SpectralBundle::findCamera
+//
+//	outputs:
+//		int : the private data members (e.g., _rgbsen) will be filled
+
+int Spst::loadSpst( const SpectralBundle::Camera &camera )
+{
+    vector<RGBSen> rgbsen;
+    vector<double> max( 3, dmin );
+
+    setBrand( camera.make );
+    setModel( camera.model );
+    setWLIncrement( camera.increment );
+
+    FORI( SpectralBundle::SAMPLES )
+    {
+        RGBSen tmp_sen( camera.rgb[i][0], camera.rgb[i][1], camera.rgb[i][2] );
+
+        if ( tmp_sen._RSen > max[0] )
+            max[0] = tmp_sen._RSen;
+        if ( tmp_sen._GSen > max[1] )
+            max[1] = tmp_sen._GSen;
+        if ( tmp_sen._BSen > max[2] )
+            max[2] = tmp_sen._BSen;
+
+        rgbsen.push_back( tmp_sen );
+    }
+
+    _spstMaxCol = max_element( max.begin(), max.end() ) - max.begin();
+    setSensitivity( rgbsen );
+
+    return 1;
+}
+
 //	=====================================================================
 //	Fetch the sensitivity data of the camera (reading from the file)
 //
@@ -823,6 +861,20 @@ int Idt::loadCameraSpst(
     return _cameraSpst.loadSpst( path, maker, model );
 }
 
+//	=====================================================================
+//	Load the Camera Sensitivty data compiled in the plugin
+//
+//	inputs:
+//      SpectralBundle::Camera: camera found with SpectralBundle::findCamera
+//
+//	outputs:
+//		boolean: _cameraSpst will be filled and return 1
+
+int Idt::loadCameraSpst( const SpectralBundle::Camera &camera )
+{
+    return _cameraSpst.loadSpst( camera );
+}
+
 //	=====================================================================
 //	Load the Illuminant data
 //
@@ -973,6 +1025,27 @@ void Idt::loadTrainingData( const string &path )
     }
 }
 
+//	=====================================================================
+//	Load the 190-patch training data compiled in the plugin
+//
+//	inputs:
+//		N/A
+//
+//	outputs:
+//		_trainingSpec: _trainingSpec will be filled
+
+void Idt::loadTrainingData()
+{
+    const SpectralBundle::Training *training = SpectralBundle::training();
+
+    FORI( SpectralBundle::SAMPLES )
+    {
+        _trainingSpec[i]._wl = training[i].wl;
+        _trainingSpec[i]._data.assign(
+            training[i].data, training[i].data + SpectralBundle::PATCHES );
+    }
+}
+
 //	=====================================================================
 //	Push new Illuminant to further process Spectral Power Data
 //
@@ -987,6 +1060,21 @@ void Idt::setIlluminants( const Illum &Illuminant )
     _Illuminants.push_back( Illuminant );
 }
 
+//	=====================================================================
+//	Use 190-patch training data loaded beforehand, instead of
+//  loadTrainingData(...)
+//
+//	inputs:
+//      vector<trainSpec>: training data
+//
+//	outputs:
+//		N/A:   _trainingSpec is replaced
+
+void Idt::setTrainingSpec( const vector<trainSpec> &trainingSpec )
+{
+    _trainingSpec = trainingSpec;
+}
+
 //	=====================================================================
 //	Set Verbosity value for the length of IDT generation status message
 //
@@ -3,6 +3,7 @@
 #include <string>
 #include <vector>
 #include <stdint.h>
+#include "spectral_bundle.h"
 
 using namespace std;
 
@@ -96,6 +97,7 @@ public:
 
     int getWLIncrement();
     int loadSpst( const string &path, const char *maker, const char *model );
+    int loadSpst( const SpectralBundle::Camera &camera );
 
     vector<RGBSen> getSensitivity();
 
@@ -115,12 +117,15 @@ public:
 
     int
     loadCameraSpst( const string &path, const char *maker, const char *model );
+    int loadCameraSpst( const SpectralBundle::Camera &camera );
     int loadIlluminant( const vector<string> &paths, string type = "na" );
 
     void loadTrainingData( const string &path );
+    void loadTrainingData();
     void chooseIllumSrc( const vector<double> &src, int highlight );
     void chooseIllumType( const char *type, int highlight );
     void setIlluminants( const Illum &Illuminant );
+    void setTrainingSpec( const vector<trainSpec> &trainingSpec );
     void setVerbosity( const int verbosity );
     void scaleLSC( Illum &Illuminant );
 
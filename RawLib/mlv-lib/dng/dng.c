@@ -34,7 +34,9 @@
 #include "camid/camera_id.h"
 
 #include "liblj92/lj92.h"
+#include "video_mlv.h"
 #include "llrawproc/llrawproc.h"
+#include "parallel.h"
 
 #define IFD0_COUNT 41
 #define EXIF_IFD_COUNT 11
@@ -51,8 +53,6 @@
 #define MAX(a,b) (((a)>(b))?(a):(b))
 #define COERCE(x,lo,hi) MAX(MIN((x),(hi)),(lo))
 #define ABS(a) ((a) > 0 ? (a) : -(a))
-#define ROR32(v,a) ((v) >> (a) | (v) << (32-(a)))
-#define ROL32(v,a) ((v) << (a) | (v) >> (32-(a)))
 #define ROR16(v,a) ((v) >> (a) | (v) << (16-(a)))
 #define ROL16(v,a) ((v) << (a) | (v) >> (16-(a)))
 #define log2(x) log((float)(x))/log(2.)
@@ -664,74 +664,6 @@ static void dng_fill_header(mlvObject_t * mlv_data, dngObject_t * dng_data, uint
     }
 }
 
-/* unpack bits to 16 bit little endian and converts to real 14bit if less then 14bit depth detected
-   output_buffer - the buffer where the result will be written
-   input_buffer - a buffer containing the packed imaged data
-   width - image width
-   height - image height
-   bpp - raw data bits per pixel
-*/
-void dng_unpack_image_bits(uint16_t * output_buffer, uint16_t * input_buffer, int width, int height, uint32_t bpp)
-{
-    uint32_t pixel_count = width * height;
-    uint32_t mask = (1 << bpp) - 1;
-    uint16_t *packed_bits = input_buffer;
-    uint16_t *unpacked_bits = output_buffer;
-
-    #pragma omp parallel for
-    for (uint32_t pixel_index = 0; pixel_index < pixel_count; pixel_index++)
-    {
-        uint32_t bits_offset = pixel_index * bpp;
-        uint32_t bits_address = bits_offset / 16;
-        uint32_t bits_shift = bits_offset % 16;
-
-        /* fetch two 16 bit words into a 32 bit register and correct it plus shift it as needed.
-        after the 32 bit fetch, the two 16 bit words will be swapped, so use a ROR to align them correctly.
-        ROR by 16 to swap 16 bit words plus the bits needed to put the needed pixel bits to right position */
-        uint32_t rotate_value = 16 + ((32 - bpp) - bits_shift);
-        uint32_t uncorrected_data = *((uint32_t *)&packed_bits[bits_address]);
-        uint32_t data = ROR32(uncorrected_data, rotate_value);
-
-        unpacked_bits[pixel_index] = (uint16_t)(data & mask);
-    }
-}
-
-/* pack bits to 16 bit little endian and convert to big endian (raw payload DNG spec)
-   output_buffer - the buffer where the result will be written
-   input_buffer - a buffer containing the unpacked imaged data
-   width - image width
-   height - image height
-   bpp - raw data bits per pixel 
-*/
-void dng_pack_image_bits(uint16_t * output_buffer, uint16_t * input_buffer, int width, int height, uint32_t bpp, int big_endian)
-{
-    uint32_t pixel_count = width * height;
-    uint32_t bits_free = 16 - bpp;
-    uint16_t *unpacked_bits = input_buffer;
-    uint16_t *packed_bits = output_buffer;
-
-    packed_bits[0] = unpacked_bits[0] << bits_free;
-    for (uint32_t pixel_index = 1; pixel_index < pixel_count; pixel_index++)
-    {
-        uint32_t bits_offset = (pixel_index * bits_free) % 16;
-        uint32_t bits_to_rol = bits_free + bits_offset + (bits_offset > 0) * 16;
-
-        /* increment pointer by two bytes but fetch 32 bit words from input and outbut buffers.
-        after the 32 bit fetch, the two 16 bit words will be swapped, so use a ROL by 16 to swap
-        16 bit words plus shift to the left to put the needed pixel bits to right position.
-        mask/zero high 16 bits of 32 bit word of packed buffer and do logical OR to ROLed unpacked one.
-        make current packed 16 bit word big endian to satisfy DNG spec */
-        uint32_t data = ROL32((uint32_t)unpacked_bits[pixel_index], bits_to_rol);
-        *(uint32_t *)packed_bits = (*(uint32_t *)packed_bits & 0x0000FFFF) | data;
-
-        if(bits_offset > 0 && bits_offset <= bpp)
-        {
-            if(big_endian) *(uint16_t *)packed_bits = ROL16(*(uint16_t *)packed_bits, 8);
-            packed_bits++;
-        }
-    }
-}
-
 /* decompress LJ92 image to output_buffer */
 int dng_decompress_image(uint16_t * output_buffer, uint16_t * input_buffer, size_t input_buffer_size, int width, int height, uint32_t bpp)
 {
@@ -795,131 +727,117 @@ int dng_compress_image(uint16_t * output_buffer, uint16_t * input_buffer, size_t
    input_buffer - pointer to the buffer
    buf_size - the size of the buffer in bytes
 */
-static void dng_reverse_byte_order(uint16_t * input_buffer, size_t buf_size)
+static void dng_reverse_byte_order_range(void * arg, int begin, int end)
 {
-    uint32_t index_max = buf_size / 2;
+    uint16_t * input_buffer = arg;
 
-    #pragma omp parallel for
-    for (uint32_t index = 0; index < index_max; index++)
+    for (int index = begin; index < end; index++)
     {
         input_buffer[index] = ROL16(input_buffer[index], 8);
     }
 }
 
-/* build whole DNG frame (header + image), process image if needed and put to the dng struct ready to save */
-static int dng_get_frame(mlvObject_t * mlv_data, dngObject_t * dng_data, uint32_t frame_index)
+static void dng_reverse_byte_order(uint16_t * input_buffer, size_t buf_size)
 {
-    int ret = 0;
-    /* Move to start of frame in file and read the RAW data */
-    file_set_pos(mlv_data->file[mlv_data->video_index[frame_index].chunk_num], mlv_data->video_index[frame_index].frame_offset, SEEK_SET);
+    parallel_for(0, buf_size / 2, 65536, dng_reverse_byte_order_range, input_buffer);
+}
+
+/* get raw payload of the frame (packed or LJ92 compressed). Points into the chunk
+ * mapping if there is one and the caller only reads it, else it is read into dng_data->image_buf */
+static const uint8_t * dng_read_frame(mlvObject_t * mlv_data, dngObject_t * dng_data, uint32_t frame_index, int read_only)
+{
+    int chunk = mlv_data->video_index[frame_index].chunk_num;
+    uint64_t frame_offset = mlv_data->video_index[frame_index].frame_offset;
+
+    dng_data->image_size = dng_get_image_size(mlv_data, (dng_data->raw_input_state == COMPRESSED_RAW) ? IMG_SIZE_LOSLESS : IMG_SIZE_PACKED, frame_index);
 
-    if (dng_data->raw_input_state == COMPRESSED_RAW) /* If lossless, decompress or pass trough */
+    const uint8_t * payload = read_only ? getMlvChunkData(mlv_data, chunk, frame_offset, dng_data->image_size) : NULL;
+    if(payload) return payload;
+
+    /* Read the RAW data, positional so readers sharing the chunks do not race on the file position */
+    if(readMlvChunkData(mlv_data, chunk, frame_offset, dng_data->image_size, dng_data->image_buf))
     {
-        dng_data->image_size = dng_get_image_size(mlv_data, IMG_SIZE_LOSLESS, frame_index);
-        if(fread(dng_data->image_buf, dng_data->image_size, 1, mlv_data->file[mlv_data->video_index[frame_index].chunk_num]) != 1)
-        {
 #ifndef STDOUT_SILENT
-            printf("Can not read raw frame from %s\n", mlv_data->path);
+        printf("Can not read raw frame from %s\n", mlv_data->path);
 #endif
-        }
+    }
+    return (const uint8_t *)dng_data->image_buf;
+}
 
-        if(dng_data->raw_output_state == COMPRESSED_ORIG)
-        {
-            // do nothing, compressed raw data is ready to save unchanged
-        }
-        else
-        {
-            ret = dng_decompress_image(dng_data->image_buf_unpacked,
-                                       dng_data->image_buf,
-                                       dng_data->image_size,
-                                       mlv_data->RAWI.xRes,
-                                       mlv_data->RAWI.yRes,
-                                       mlv_data->RAWI.raw_info.bits_per_pixel);
+/* decompress or unpack the raw payload to dng_data->image_buf_unpacked and apply low level raw processing */
+static int dng_unpack_frame(mlvObject_t * mlv_data, dngObject_t * dng_data, const uint8_t * payload)
+{
+    int ret = 0;
+    if (dng_data->raw_input_state == COMPRESSED_RAW)
+    {
+        ret = dng_decompress_image(dng_data->image_buf_unpacked,
+                                   (uint16_t *)payload,
+                                   dng_data->image_size,
+                                   mlv_data->RAWI.xRes,
+                                   mlv_data->RAWI.yRes,
+                                   mlv_data->RAWI.raw_info.bits_per_pixel);
+    }
+    else
+    {
+        dng_unpack_image_bits(dng_data->image_buf_unpacked,
+                              (uint16_t *)payload,
+                              mlv_data->RAWI.xRes,
+                              mlv_data->RAWI.yRes,
+                              mlv_data->RAWI.raw_info.bits_per_pixel);
+    }
 
-            /* apply low level raw processing to the unpacked_frame */
-            applyLLRawProcObject(mlv_data, dng_data->image_buf_unpacked, dng_data->image_size_unpacked);
+    /* apply low level raw processing to the unpacked_frame */
+    applyLLRawProcObject(mlv_data, dng_data->image_buf_unpacked, dng_data->image_size_unpacked);
 
-            if(dng_data->raw_output_state == COMPRESSED_RAW)
-            {
-                ret = dng_compress_image(dng_data->image_buf,
-                                         dng_data->image_buf_unpacked,
-                                         &dng_data->image_size,
-                                         mlv_data->RAWI.xRes,
-                                         mlv_data->RAWI.yRes,
-                                         (llrpHQDualIso(mlv_data)) ? 16 : mlv_data->RAWI.raw_info.bits_per_pixel);
-            }
-            else
-            {
-                if(!llrpHQDualIso(mlv_data))
-                {
-                    dng_data->image_size = dng_get_image_size(mlv_data, IMG_SIZE_PACKED, frame_index);
-                    dng_pack_image_bits(dng_data->image_buf,
-                                        dng_data->image_buf_unpacked,
-                                        mlv_data->RAWI.xRes,
-                                        mlv_data->RAWI.yRes,
-                                        mlv_data->RAWI.raw_info.bits_per_pixel,
-                                        1);
-                }
-                else
-                {
-                    dng_data->image_size = dng_get_image_size(mlv_data, IMG_SIZE_UNPACKED, frame_index);
-                    memcpy(dng_data->image_buf, dng_data->image_buf_unpacked, dng_data->image_size);
-                }
-            }
-        }
+    return ret;
+}
+
+/* build whole DNG frame (header + image), process image if needed and put to the dng struct ready to save */
+static int dng_get_frame(mlvObject_t * mlv_data, dngObject_t * dng_data, uint32_t frame_index)
+{
+    int ret = 0;
+    /* Original data is saved or byte swapped in place, so it needs its own copy */
+    int keep_orig = (dng_data->raw_input_state == COMPRESSED_RAW && dng_data->raw_output_state == COMPRESSED_ORIG)
+                 || (dng_data->raw_input_state != COMPRESSED_RAW && dng_data->raw_output_state == UNCOMPRESSED_ORIG);
+    const uint8_t * payload = dng_read_frame(mlv_data, dng_data, frame_index, !keep_orig);
+
+    if (dng_data->raw_input_state == COMPRESSED_RAW && dng_data->raw_output_state == COMPRESSED_ORIG)
+    {
+        // do nothing, compressed raw data is ready to save unchanged
     }
-    else /* If uncompressed, unpack to 16bit or pass trough */
+    else if (dng_data->raw_input_state != COMPRESSED_RAW && dng_data->raw_output_state == UNCOMPRESSED_ORIG)
     {
-        dng_data->image_size = dng_get_image_size(mlv_data, IMG_SIZE_PACKED, frame_index);
-        if(fread(dng_data->image_buf, dng_data->image_size, 1, mlv_data->file[mlv_data->video_index[frame_index].chunk_num]) != 1)
-        {
-#ifndef STDOUT_SILENT
-            printf("Can not read raw frame from %s\n", mlv_data->path);
-#endif
-        }
+        dng_reverse_byte_order(dng_data->image_buf, dng_data->image_size);
+    }
+    else
+    {
+        ret = dng_unpack_frame(mlv_data, dng_data, payload);
 
-        if(dng_data->raw_output_state == UNCOMPRESSED_ORIG)
+        if(dng_data->raw_output_state == COMPRESSED_RAW)
         {
-            dng_reverse_byte_order(dng_data->image_buf, dng_data->image_size);
+            ret = dng_compress_image(dng_data->image_buf,
+                                     dng_data->image_buf_unpacked,
+                                     &dng_data->image_size,
+                                     mlv_data->RAWI.xRes,
+                                     mlv_data->RAWI.yRes,
+                                     (llrpHQDualIso(mlv_data)) ? 16 : mlv_data->RAWI.raw_info.bits_per_pixel);
         }
         else
         {
-            dng_unpack_image_bits(dng_data->image_buf_unpacked,
-                                  dng_data->image_buf,
-                                  mlv_data->RAWI.xRes,
-                                  mlv_data->RAWI.yRes,
-                                  mlv_data->RAWI.raw_info.bits_per_pixel);
-
-            /* apply low level raw processing to the unpacked_frame */
-            applyLLRawProcObject(mlv_data, dng_data->image_buf_unpacked, dng_data->image_size_unpacked);
-
-            if(dng_data->raw_output_state == COMPRESSED_RAW)
+            if(!llrpHQDualIso(mlv_data))
             {
-                ret = dng_compress_image(dng_data->image_buf,
-                                         dng_data->image_buf_unpacked,
-                                         &dng_data->image_size,
-                                         mlv_data->RAWI.xRes,
-                                         mlv_data->RAWI.yRes,
-                                         (llrpHQDualIso(mlv_data)) ? 16 : mlv_data->RAWI.raw_info.bits_per_pixel);
+                dng_data->image_size = dng_get_image_size(mlv_data, IMG_SIZE_PACKED, frame_index);
+                dng_pack_image_bits(dng_data->image_buf,
+                                    dng_data->image_buf_unpacked,
+                                    mlv_data->RAWI.xRes,
+                                    mlv_data->RAWI.yRes,
+                                    mlv_data->RAWI.raw_info.bits_per_pixel,
+                                    1);
             }
             else
             {
-                if(!llrpHQDualIso(mlv_data))
-                {
-                    dng_data->image_size = dng_get_image_size(mlv_data, IMG_SIZE_PACKED, frame_index);
-                    dng_pack_image_bits(dng_data->image_buf,
-                                        dng_data->image_buf_unpacked,
-                                        mlv_data->RAWI.xRes,
-                                        mlv_data->RAWI.yRes,
-                                        mlv_data->RAWI.raw_info.bits_per_pixel,
-                                        1);
-                }
-                else
-                {
-                    dng_data->image_size = dng_get_image_size(mlv_data, IMG_SIZE_UNPACKED, frame_index);
-                    memcpy(dng_data->image_buf, dng_data->image_buf_unpacked, dng_data->image_size);
-                }
-
+                dng_data->image_size = dng_get_image_size(mlv_data, IMG_SIZE_UNPACKED, frame_index);
+                memcpy(dng_data->image_buf, dng_data->image_buf_unpacked, dng_data->image_size);
             }
         }
     }
@@ -974,6 +892,13 @@ uint8_t* getDngFrameBuffer(mlvObject_t * mlv_data, dngObject_t * dng_data, uint3
     return dng_buffer;
 }
 
+/* get low level processed 16 bit bayer frame in dng_data->image_buf_unpacked, skipping DNG packing and header */
+int getDngUnpackedFrame(mlvObject_t * mlv_data, dngObject_t * dng_data, uint32_t frame_index)
+{
+    const uint8_t * payload = dng_read_frame(mlv_data, dng_data, frame_index, 1);
+    return dng_unpack_frame(mlv_data, dng_data, payload);
+}
+
 /* save DNG file */
 int saveDngFrame(mlvObject_t * mlv_data, dngObject_t * dng_data, uint32_t frame_index, char * dng_filename)
 {
@@ -0,0 +1,347 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/* Raw payload bit packing/unpacking.
+   Packed MLV/DNG data is a stream of 16 bit words, pixels are stored MSB first.
+   8 pixels of an even bit depth always take exactly bpp bytes, so the frame is
+   processed in such groups with SSE4.1 or AVX2 kernels when the CPU has them,
+   the remaining pixels (and other CPUs) use the scalar code. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "dng.h"
+#include "../parallel.h"
+
+#define ROR32(v,a) ((v) >> (a) | (v) << (32-(a)))
+#define ROL16(v,a) ((v) << (a) | (v) >> (16-(a)))
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DNG_BITPACK_SIMD
+#include <immintrin.h>
+#endif
+
+/* pixels per group, a group takes bpp bytes */
+#define GROUP_PIXELS 8
+/* pixels per range of the parallel unpacking */
+#define UNPACK_GRAIN 32768
+
+/* arguments of the parallel unpacking */
+typedef struct
+{
+    uint16_t * output_buffer;
+    const uint16_t * input_buffer;
+    uint32_t bpp;
+} unpack_job_t;
+
+/* scalar unpack of pixels [start, end) */
+static void unpack_bits_scalar(uint16_t * output_buffer, const uint16_t * input_buffer, uint32_t start, uint32_t end, uint32_t bpp)
+{
+    uint32_t mask = (1 << bpp) - 1;
+
+    for (uint32_t pixel_index = start; pixel_index < end; pixel_index++)
+    {
+        uint32_t bits_offset = pixel_index * bpp;
+        uint32_t bits_address = bits_offset / 16;
+        uint32_t bits_shift = bits_offset % 16;
+
+        /* fetch two 16 bit words into a 32 bit register and correct it plus shift it as needed.
+        after the 32 bit fetch, the two 16 bit words will be swapped, so use a ROR to align them correctly.
+        ROR by 16 to swap 16 bit words plus the bits needed to put the needed pixel bits to right position */
+        uint32_t rotate_value = 16 + ((32 - bpp) - bits_shift);
+        uint32_t uncorrected_data = *((uint32_t *)&input_buffer[bits_address]);
+        uint32_t data = ROR32(uncorrected_data, rotate_value);
+
+        output_buffer[pixel_index] = (uint16_t)(data & mask);
+    }
+}
+
+static void unpack_bits_scalar_range(void * arg, int start, int end)
+{
+    unpack_job_t * job = arg;
+    unpack_bits_scalar(job->output_buffer, job->input_buffer, start, end, job->bpp);
+}
+
+/* scalar pack of pixels [start, end), start must be a multiple of GROUP_PIXELS */
+static void pack_bits_scalar(uint16_t * output_buffer, const uint16_t * input_buffer, uint32_t start, uint32_t end, uint32_t bpp, int big_endian)
+{
+    uint32_t mask = (1 << bpp) - 1;
+    uint16_t * packed_bits = output_buffer + start * bpp / 16;
+    uint32_t acc = 0;
+    uint32_t acc_bits = 0;
+
+    for (uint32_t pixel_index = start; pixel_index < end; pixel_index++)
+    {
+        acc = (acc << bpp) | (input_buffer[pixel_index] & mask);
+        acc_bits += bpp;
+        if (acc_bits >= 16)
+        {
+            acc_bits -= 16;
+            uint16_t word = (uint16_t)(acc >> acc_bits);
+            *packed_bits++ = big_endian ? ROL16(word, 8) : word;
+        }
+    }
+
+    /* flush last incomplete word, left aligned. Like the original packer
+       it is left in native order, only complete words are made big endian */
+    if (acc_bits > 0)
+    {
+        *packed_bits = (uint16_t)(acc << (16 - acc_bits));
+    }
+}
+
+#ifdef DNG_BITPACK_SIMD
+
+/* shuffle and shift tables of one group for a bit depth */
+typedef struct
+{
+    /* unpack : gather words a and a + 1 of each pixel in a 32 bit lane, pixels 0-3 and 4-7 */
+    uint8_t gather[2][16];
+    /* shift left aligning the pixel bits to the top of the lane */
+    uint32_t shift[GROUP_PIXELS];
+    /* pack : for each output byte, up to two lane bytes of pixels 0-3 and 4-7 */
+    uint8_t scatter[2][2][16];
+} bitpack_tables_t;
+
+static void bitpack_init_tables(bitpack_tables_t * t, uint32_t bpp, int big_endian)
+{
+    memset(t->gather, 0x80, sizeof(t->gather));
+    memset(t->scatter, 0x80, sizeof(t->scatter));
+
+    for (int j = 0; j < GROUP_PIXELS; j++)
+    {
+        uint32_t bits_offset = j * bpp;
+        uint32_t a = bits_offset / 16;
+        uint8_t * g = &t->gather[j / 4][(j % 4) * 4];
+
+        /* little endian lane = word a << 16 | word a + 1 */
+        g[0] = 2 * a + 2;
+        g[1] = 2 * a + 3;
+        g[2] = 2 * a;
+        g[3] = 2 * a + 1;
+        t->shift[j] = bits_offset % 16;
+
+        /* lane bytes that hold pixel bits, stream bits of the output byte */
+        for (int lb = 0; lb < 4; lb++)
+        {
+            uint32_t word = (lb < 2) ? a + 1 : a;
+            int high = lb & 1;
+            uint32_t stream_bit = word * 16 + (high ? 0 : 8);
+            if (stream_bit + 8 <= bits_offset || stream_bit >= bits_offset + bpp) continue;
+
+            uint32_t out_byte = 2 * word + ((high ^ (big_endian != 0)) ? 1 : 0);
+            uint8_t * slot = &t->scatter[j / 4][0][out_byte];
+            if (*slot != 0x80) slot = &t->scatter[j / 4][1][out_byte];
+            *slot = (j % 4) * 4 + lb;
+        }
+    }
+}
+
+__attribute__((target("sse4.1"), always_inline))
+static inline void unpack_bits_sse41(uint16_t * output_buffer, const uint16_t * input_buffer, uint32_t first, uint32_t last, uint32_t bpp)
+{
+    bitpack_tables_t t;
+    bitpack_init_tables(&t, bpp, 0);
+
+    const __m128i gather0 = _mm_loadu_si128((const __m128i *)t.gather[0]);
+    const __m128i gather1 = _mm_loadu_si128((const __m128i *)t.gather[1]);
+    const __m128i mul0 = _mm_setr_epi32(1 << t.shift[0], 1 << t.shift[1], 1 << t.shift[2], 1 << t.shift[3]);
+    const __m128i mul1 = _mm_setr_epi32(1 << t.shift[4], 1 << t.shift[5], 1 << t.shift[6], 1 << t.shift[7]);
+    const __m128i right = _mm_cvtsi32_si128(32 - bpp);
+    const uint8_t * in = (const uint8_t *)input_buffer;
+
+    for (uint32_t group = first; group < last; group++)
+    {
+        __m128i src = _mm_loadu_si128((const __m128i *)(in + group * bpp));
+        /* variable left shift through multiply, then drop the lower bits */
+        __m128i lo = _mm_srl_epi32(_mm_mullo_epi32(_mm_shuffle_epi8(src, gather0), mul0), right);
+        __m128i hi = _mm_srl_epi32(_mm_mullo_epi32(_mm_shuffle_epi8(src, gather1), mul1), right);
+        _mm_storeu_si128((__m128i *)(output_buffer + group * GROUP_PIXELS), _mm_packus_epi32(lo, hi));
+    }
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void unpack_bits_avx2(uint16_t * output_buffer, const uint16_t * input_buffer, uint32_t first, uint32_t last, uint32_t bpp)
+{
+    bitpack_tables_t t;
+    bitpack_init_tables(&t, bpp, 0);
+
+    const __m256i gather = _mm256_loadu2_m128i((const __m128i *)t.gather[1], (const __m128i *)t.gather[0]);
+    const __m256i shift = _mm256_loadu_si256((const __m256i *)t.shift);
+    const uint8_t * in = (const uint8_t *)input_buffer;
+
+    for (uint32_t group = first; group < last; group++)
+    {
+        __m256i src = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(in + group * bpp)));
+        __m256i pixels = _mm256_srli_epi32(_mm256_sllv_epi32(_mm256_shuffle_epi8(src, gather), shift), 32 - bpp);
+        /* pack both 128 bit lanes, pixels end up in qwords 0 and 2 */
+        pixels = _mm256_permute4x64_epi64(_mm256_packus_epi32(pixels, pixels), 0x08);
+        _mm_storeu_si128((__m128i *)(output_buffer + group * GROUP_PIXELS), _mm256_castsi256_si128(pixels));
+    }
+}
+
+__attribute__((target("sse4.1"), always_inline))
+static inline void pack_bits_sse41(uint16_t * output_buffer, const uint16_t * input_buffer, uint32_t groups, uint32_t bpp, int big_endian)
+{
+    bitpack_tables_t t;
+    bitpack_init_tables(&t, bpp, big_endian);
+
+    const __m128i scatter00 = _mm_loadu_si128((const __m128i *)t.scatter[0][0]);
+    const __m128i scatter01 = _mm_loadu_si128((const __m128i *)t.scatter[0][1]);
+    const __m128i scatter10 = _mm_loadu_si128((const __m128i *)t.scatter[1][0]);
+    const __m128i scatter11 = _mm_loadu_si128((const __m128i *)t.scatter[1][1]);
+    const __m128i mul0 = _mm_setr_epi32(1 << (32 - bpp - t.shift[0]), 1 << (32 - bpp - t.shift[1]), 1 << (32 - bpp - t.shift[2]), 1 << (32 - bpp - t.shift[3]));
+    const __m128i mul1 = _mm_setr_epi32(1 << (32 - bpp - t.shift[4]), 1 << (32 - bpp - t.shift[5]), 1 << (32 - bpp - t.shift[6]), 1 << (32 - bpp - t.shift[7]));
+    const __m128i mask = _mm_set1_epi16((1 << bpp) - 1);
+    uint8_t * out = (uint8_t *)output_buffer;
+
+    /* groups are written with 16 byte stores, a group only owns bpp bytes so
+       each store spills into the next group : do it sequentially */
+    for (uint32_t group = 0; group < groups; group++)
+    {
+        __m128i src = _mm_and_si128(_mm_loadu_si128((const __m128i *)(input_buffer + group * GROUP_PIXELS)), mask);
+        /* each pixel placed at its position in the 32 bit window of its words */
+        __m128i lo = _mm_mullo_epi32(_mm_cvtepu16_epi32(src), mul0);
+        __m128i hi = _mm_mullo_epi32(_mm_cvtepu16_epi32(_mm_srli_si128(src, 8)), mul1);
+        __m128i packed = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(lo, scatter00), _mm_shuffle_epi8(lo, scatter01)),
+                                      _mm_or_si128(_mm_shuffle_epi8(hi, scatter10), _mm_shuffle_epi8(hi, scatter11)));
+        _mm_storeu_si128((__m128i *)(out + group * bpp), packed);
+    }
+}
+
+/* kernels specialized on the bit depth, shifts and loop strides become constants.
+   The unpacking ones run ranges of groups for parallel_for */
+#define BITPACK_SPECIALIZE(bpp) \
+__attribute__((target("sse4.1"))) \
+static void unpack_bits_sse41_##bpp(void * arg, int first, int last) \
+{ unpack_job_t * job = arg; unpack_bits_sse41(job->output_buffer, job->input_buffer, first, last, bpp); } \
+__attribute__((target("avx2"))) \
+static void unpack_bits_avx2_##bpp(void * arg, int first, int last) \
+{ unpack_job_t * job = arg; unpack_bits_avx2(job->output_buffer, job->input_buffer, first, last, bpp); } \
+__attribute__((target("sse4.1"))) \
+static void pack_bits_sse41_##bpp(uint16_t * output_buffer, const uint16_t * input_buffer, uint32_t groups, int big_endian) \
+{ pack_bits_sse41(output_buffer, input_buffer, groups, bpp, big_endian); }
+
+BITPACK_SPECIALIZE(10)
+BITPACK_SPECIALIZE(12)
+BITPACK_SPECIALIZE(14)
+
+enum { BITPACK_SCALAR = 0, BITPACK_SSE41, BITPACK_AVX2 };
+
+static int bitpack_cpu_level(void)
+{
+    static int level = -1;
+    if (level < 0)
+    {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) level = BITPACK_AVX2;
+        else if (__builtin_cpu_supports("sse4.1")) level = BITPACK_SSE41;
+        else level = BITPACK_SCALAR;
+    }
+    return level;
+}
+
+#endif
+
+/* unpack bits to 16 bit little endian and converts to real 14bit if less then 14bit depth detected
+   output_buffer - the buffer where the result will be written
+   input_buffer - a buffer containing the packed imaged data
+   width - image width
+   height - image height
+   bpp - raw data bits per pixel
+*/
+void dng_unpack_image_bits(uint16_t * output_buffer, uint16_t * input_buffer, int width, int height, uint32_t bpp)
+{
+    uint32_t pixel_count = width * height;
+    uint32_t done = 0;
+    unpack_job_t job = { output_buffer, input_buffer, bpp };
+
+#ifdef DNG_BITPACK_SIMD
+    if ((bpp == 10 || bpp == 12 || bpp == 14) && bitpack_cpu_level() != BITPACK_SCALAR)
+    {
+        /* a group reads 16 bytes from its start, keep the loads inside the packed frame */
+        uint32_t packed_size = pixel_count * bpp / 8;
+        uint32_t groups = packed_size >= 16 ? (packed_size - 16) / bpp + 1 : 0;
+        if (groups > pixel_count / GROUP_PIXELS) groups = pixel_count / GROUP_PIXELS;
+
+        parallel_body unpack;
+        if (bitpack_cpu_level() == BITPACK_AVX2)
+        {
+            switch (bpp)
+            {
+                case 10: unpack = unpack_bits_avx2_10; break;
+                case 12: unpack = unpack_bits_avx2_12; break;
+                default: unpack = unpack_bits_avx2_14; break;
+            }
+        }
+        else
+        {
+            switch (bpp)
+            {
+                case 10: unpack = unpack_bits_sse41_10; break;
+                case 12: unpack = unpack_bits_sse41_12; break;
+                default: unpack = unpack_bits_sse41_14; break;
+            }
+        }
+        parallel_for(0, groups, UNPACK_GRAIN / GROUP_PIXELS, unpack, &job);
+        done = groups * GROUP_PIXELS;
+    }
+#endif
+
+    if (done == 0)
+    {
+        parallel_for(0, pixel_count, UNPACK_GRAIN, unpack_bits_scalar_range, &job);
+    }
+    else
+    {
+        unpack_bits_scalar(output_buffer, input_buffer, done, pixel_count, bpp);
+    }
+}
+
+/* pack bits to 16 bit little endian and convert to big endian (raw payload DNG spec)
+   output_buffer - the buffer where the result will be written
+   input_buffer - a buffer containing the unpacked imaged data
+   width - image width
+   height - image height
+   bpp - raw data bits per pixel
+*/
+void dng_pack_image_bits(uint16_t * output_buffer, uint16_t * input_buffer, int width, int height, uint32_t bpp, int big_endian)
+{
+    uint32_t pixel_count = width * height;
+    uint32_t done = 0;
+
+#ifdef DNG_BITPACK_SIMD
+    if ((bpp == 10 || bpp == 12 || bpp == 14) && bitpack_cpu_level() != BITPACK_SCALAR)
+    {
+        /* a group stores 16 bytes from its start, keep the stores inside the packed frame */
+        uint32_t packed_size = pixel_count * bpp / 8;
+        uint32_t groups = packed_size >= 16 ? (packed_size - 16) / bpp + 1 : 0;
+        if (groups > pixel_count / GROUP_PIXELS) groups = pixel_count / GROUP_PIXELS;
+
+        switch (bpp)
+        {
+            case 10: pack_bits_sse41_10(output_buffer, input_buffer, groups, big_endian); break;
+            case 12: pack_bits_sse41_12(output_buffer, input_buffer, groups, big_endian); break;
+            default: pack_bits_sse41_14(output_buffer, input_buffer, groups, big_endian); break;
+        }
+        done = groups * GROUP_PIXELS;
+    }
+#endif
+
+    pack_bits_scalar(output_buffer, input_buffer, done, pixel_count, bpp, big_endian);
+}
@@ -28,6 +28,7 @@ SOFTWARE.
 #include <string.h>
 
 #include "lj92.h"
+#include "../parallel.h"
 
 typedef uint8_t u8;
 typedef uint16_t u16;
@@ -36,6 +37,16 @@ typedef uint32_t u32;
 //#define SLOW_HUFF
 //#define DEBUG
 
+/* Multi-symbol decode table: the next LJ92_LUT_BITS bits of the stream
+ * give up to two complete differences (huffman code + extra bits) at once */
+#define LJ92_LUT_BITS 12
+typedef struct {
+    u16 diff[2];
+    u8 count; // 0 if the first code does not fit, decode it through hufflut
+    u8 bits;  // Stream bits used by the decoded differences
+    u8 bits1; // Stream bits used by the first difference alone
+} lj92_lutentry;
+
 typedef struct _ljp {
     u8* data;
     u8* dataend;
@@ -63,7 +74,9 @@ typedef struct _ljp {
 #else
     u16* hufflut;
     int huffbits;
+    lj92_lutentry* fastlut;
 #endif
+    int restart_interval; // Restart interval in MCUs (DRI), 0 if none
     // Parse state
     int cnt;
     u32 b;
@@ -86,13 +99,71 @@ static int find(ljp* self) {
 
 #define BEH(ptr) ((((int)(*&ptr))<<8)|(*(&ptr+1)))
 
+#ifndef SLOW_HUFF
+/* Difference of a t bit extra value, as in nextdiff */
+static inline u16 extendDiff(int v, int t) {
+    if (t == 0) return 0;
+    if (t == 16) return 1 << 15;
+    if (v < (1 << (t-1))) v += (-1 << t) + 1;
+    return (u16)v;
+}
+
+static int buildFastLut(ljp* self, const u8* bits, const u8* huffvals) {
+    /* First code of every LJ92_LUT_BITS window: length and SSSS */
+    u8 codelen[1 << LJ92_LUT_BITS];
+    u8 codessss[1 << LJ92_LUT_BITS];
+    memset(codelen, 0, sizeof(codelen));
+    int code = 0;
+    int hv = 0;
+    for (int len = 1; len <= 16; len++) {
+        for (int n = 0; n < bits[len]; n++, code++, hv++) {
+            if (len > LJ92_LUT_BITS) continue;
+            int first = code << (LJ92_LUT_BITS - len);
+            int last = (code + 1) << (LJ92_LUT_BITS - len);
+            for (int i = first; i < last && i < (1 << LJ92_LUT_BITS); i++) {
+                codelen[i] = len;
+                codessss[i] = huffvals[hv];
+            }
+        }
+        code <<= 1;
+    }
+
+    lj92_lutentry* lut = malloc((1 << LJ92_LUT_BITS) * sizeof(lj92_lutentry));
+    if (lut == NULL) return LJ92_ERROR_NO_MEMORY;
+    self->fastlut = lut;
+
+    const int mask = (1 << LJ92_LUT_BITS) - 1;
+    for (int i = 0; i <= mask; i++) {
+        lj92_lutentry e = { { 0, 0 }, 0, 0, 0 };
+        int used = 0;
+        for (int sym = 0; sym < 2; sym++) {
+            int window = (i << used) & mask;
+            int len = codelen[window];
+            int t = codessss[window];
+            int extra = (t == 16) ? 0 : t;
+            if (len == 0 || used + len + extra > LJ92_LUT_BITS) break;
+            int v = extra ? ((window >> (LJ92_LUT_BITS - len - extra)) & ((1 << extra) - 1)) : 0;
+            e.diff[sym] = extendDiff(v, t);
+            e.count++;
+            used += len + extra;
+            if (sym == 0) e.bits1 = used;
+        }
+        e.bits = used;
+        lut[i] = e;
+    }
+    return LJ92_ERROR_NONE;
+}
+#endif
+
 static int parseHuff(ljp* self) {
     int ret = LJ92_ERROR_CORRUPT;
     u8* huffhead = &self->data[self->ix]; // xstruct.unpack('>HB16B',self.data[self.ix:self.ix+19])
-    u8* bits = &huffhead[2];
-    bits[0] = 0; // Because table starts from 1
     int hufflen = BEH(huffhead[0]);
-    if ((self->ix + hufflen) >= self->datalen) return ret;
+    if ((self->ix + hufflen) >= self->datalen || hufflen < 19) return ret;
+    // Local copy, the stream may be read only (mapped file)
+    u8 bits[17];
+    memcpy(bits, &huffhead[2], 17);
+    bits[0] = 0; // Because table starts from 1
 #ifdef SLOW_HUFF
     u8* huffval = calloc(hufflen - 19,sizeof(u8));
     if (huffval == NULL) return LJ92_ERROR_NO_MEMORY;
@@ -261,7 +332,7 @@ static int parseHuff(ljp* self) {
         i++;
         rv++;
     }
-    ret = LJ92_ERROR_NONE;
+    ret = buildFastLut(self, bits, huffvals);
 #endif
     return ret;
 }
@@ -276,6 +347,13 @@ static int parseSof3(ljp* self) {
     return LJ92_ERROR_NONE;
 }
 
+static int parseDri(ljp* self) {
+    if (self->ix+4 >= self->datalen) return LJ92_ERROR_CORRUPT;
+    self->restart_interval = BEH(self->data[self->ix+2]);
+    self->ix += BEH(self->data[self->ix]);
+    return LJ92_ERROR_NONE;
+}
+
 static int parseBlock(ljp* self) {
     self->ix += BEH(self->data[self->ix]);
     if (self->ix >= self->datalen) return LJ92_ERROR_CORRUPT;
@@ -513,6 +591,203 @@ static int parsePred6(ljp* self) {
     return ret;
 }
 
+#ifndef SLOW_HUFF
+/* Bit reader over one entropy coded segment, removes 0xFF00 stuffing and
+ * feeds zeros once a marker or the end of the data is reached */
+typedef struct {
+    const u8* data;
+    const u8* end;
+    uint64_t b;
+    int cnt;
+    int pad; // Zero bytes fed past the segment
+} lj92_bitreader;
+
+static inline void fillBits(lj92_bitreader* br) {
+    while (br->cnt <= 56) {
+        u32 byte = 0;
+        if (br->data < br->end) {
+            byte = *br->data++;
+            if (byte == 0xFF) {
+                if (br->data < br->end && *br->data == 0x00) {
+                    br->data++;
+                } else { // Marker, end of the segment
+                    br->end = br->data;
+                    byte = 0;
+                    br->pad++;
+                }
+            }
+        } else {
+            br->pad++;
+        }
+        br->b = (br->b << 8) | byte;
+        br->cnt += 8;
+    }
+}
+
+/* Entropy decode count differences of one segment to out, no prediction */
+static int decodeDiffs(ljp* self, const u8* start, const u8* end, u16* out, int count) {
+    lj92_bitreader br = { start, end, 0, 0, 0 };
+    const lj92_lutentry* lut = self->fastlut;
+    const u16* hufflut = self->hufflut;
+    const int huffbits = self->huffbits;
+    int c = 0;
+    while (c < count) {
+        if (br.cnt < 32) fillBits(&br);
+        lj92_lutentry e = lut[(br.b >> (br.cnt - LJ92_LUT_BITS)) & ((1 << LJ92_LUT_BITS) - 1)];
+        if (e.count) {
+            out[c++] = e.diff[0];
+            if (e.count == 2 && c < count) {
+                out[c++] = e.diff[1];
+                br.cnt -= e.bits;
+            } else {
+                // The second code belongs to the next segment, or is padding
+                br.cnt -= e.bits1;
+            }
+        } else {
+            // Long code, same lookup as nextdiff
+            u16 ssssused = hufflut[(br.b >> (br.cnt - huffbits)) & ((1 << huffbits) - 1)];
+            br.cnt -= ssssused & 0xFF;
+            int t = ssssused >> 8;
+            int extra = (t == 16) ? 0 : t;
+            br.cnt -= extra;
+            int v = extra ? (int)((br.b >> br.cnt) & ((1 << extra) - 1)) : 0;
+            out[c++] = extendDiff(v, t);
+        }
+    }
+    // Decoding ran into the padding, the segment is truncated
+    if (br.pad * 8 > br.cnt) return LJ92_ERROR_CORRUPT;
+    return LJ92_ERROR_NONE;
+}
+
+// Rows reconstructed by one task
+#define LJ92_ROW_GRAIN 16
+
+typedef struct {
+    u16* out;
+    int w;
+    int comps;
+} predictJob;
+
+static void predictLeftRows(void* arg, int first, int last) {
+    predictJob* job = (predictJob*)arg;
+    for (int row = first; row < last; row++) {
+        u16* line = job->out + row*job->w;
+        for (int i = job->comps; i < job->w; i++) line[i] += line[i-job->comps];
+    }
+}
+
+/* Turn the differences of a segment into sample values in place. The first
+ * row of a segment is predicted from the left only, like the first image row */
+static void predictRows(ljp* self, int pred, u16* out, int rows) {
+    const int comps = self->components;
+    const int w = self->x * comps;
+    for (int c = 0; c < comps; c++) out[c] += 1 << (self->bits-1);
+    for (int i = comps; i < w; i++) out[i] += out[i-comps];
+
+    if (pred == 1) {
+        // Rows only depend on the sample above their first column
+        for (int row = 1; row < rows; row++)
+            for (int c = 0; c < comps; c++)
+                out[row*w + c] += out[(row-1)*w + c];
+        // Runs on the calling thread when segments already decode in parallel
+        predictJob job = { out, w, comps };
+        parallel_for(1, rows, LJ92_ROW_GRAIN, predictLeftRows, &job);
+        return;
+    }
+
+    // Components are interleaved with one component only for predictors 4 to 7
+    for (int row = 1; row < rows; row++) {
+        u16* line = out + row*w;
+        const u16* above = line - w;
+        for (int c = 0; c < comps; c++) line[c] += above[c];
+        switch (pred) {
+            case 0:
+                break;
+            case 2:
+                for (int i = comps; i < w; i++) line[i] += above[i];
+                break;
+            case 3:
+                for (int i = comps; i < w; i++) line[i] += above[i-comps];
+                break;
+            case 4:
+                for (int i = 1; i < w; i++) line[i] += line[i-1] + above[i] - above[i-1];
+                break;
+            case 5:
+                for (int i = 1; i < w; i++) line[i] += line[i-1] + ((above[i] - above[i-1]) >> 1);
+                break;
+            case 6:
+                for (int i = 1; i < w; i++) line[i] += above[i] + ((line[i-1] - above[i-1]) >> 1);
+                break;
+            case 7:
+                for (int i = 1; i < w; i++) line[i] += (line[i-1] + above[i]) >> 1;
+                break;
+        }
+    }
+}
+
+/* Table driven decode of a whole scan. With restart markers (DRI) covering
+ * whole rows every interval is an independent segment and segments decode
+ * in parallel. Without them entropy decoding stays serial, reconstruction
+ * of predictor 1 images runs in parallel over rows */
+typedef struct {
+    ljp* self;
+    int pred;
+    int segrows;
+    const u8** segstart;
+    int ret;
+} segmentJob;
+
+static void decodeSegments(void* arg, int first, int last) {
+    segmentJob* job = (segmentJob*)arg;
+    ljp* self = job->self;
+    const int w = self->x * self->components;
+    for (int s = first; s < last; s++) {
+        int row0 = s * job->segrows;
+        int rows = (self->y - row0 < job->segrows) ? self->y - row0 : job->segrows;
+        u16* out = self->image + row0 * w;
+        if (decodeDiffs(self, job->segstart[s], job->segstart[s+1], out, rows * w) != LJ92_ERROR_NONE) {
+            job->ret = LJ92_ERROR_CORRUPT;
+            continue;
+        }
+        predictRows(self, job->pred, out, rows);
+    }
+}
+
+static int parseScanFast(ljp* self, int pred) {
+    const u8* start = &self->data[self->scanstart + BEH(self->data[self->scanstart])];
+    const u8* end = self->dataend;
+
+    int segrows = self->y;
+    if (self->restart_interval) {
+        if (self->restart_interval % self->x) return LJ92_ERROR_CORRUPT;
+        segrows = self->restart_interval / self->x;
+    }
+    int segments = (self->y + segrows - 1) / segrows;
+
+    const u8** segstart = malloc((segments + 1) * sizeof(u8*));
+    if (segstart == NULL) return LJ92_ERROR_NO_MEMORY;
+    segstart[0] = start;
+    int found = 1;
+    for (const u8* p = start; found < segments && p + 1 < end; p++) {
+        if (p[0] == 0xFF && p[1] >= 0xD0 && p[1] <= 0xD7) {
+            segstart[found++] = p + 2;
+            p++;
+        }
+    }
+    segstart[segments] = end;
+    if (found < segments) {
+        free(segstart);
+        return LJ92_ERROR_CORRUPT;
+    }
+
+    segmentJob job = { self, pred, segrows, segstart, LJ92_ERROR_NONE };
+    parallel_for(0, segments, 1, decodeSegments, &job);
+
+    free(segstart);
+    return job.ret;
+}
+#endif
+
 static int parseScan(ljp* self) {
     int ret = LJ92_ERROR_CORRUPT;
     memset(self->sssshist,0,sizeof(self->sssshist));
@@ -520,6 +795,12 @@ static int parseScan(ljp* self) {
     int compcount = self->data[self->ix+2];
     int pred = self->data[self->ix+3+2*compcount];
     if (pred<0 || pred>7) return ret;
+#ifndef SLOW_HUFF
+    // Contiguous output without linearization, predictors 4 to 7 use the previous
+    // sample of any component here so they only take the table path for one component
+    if (self->skiplen == 0 && !self->linearize && (pred <= 3 || self->components == 1))
+        return parseScanFast(self, pred);
+#endif
     if (pred==6) return parsePred6(self); // Fast path
     self->ix += BEH(self->data[self->ix]);
     self->cnt = 0;
@@ -611,6 +892,8 @@ static int parseImage(ljp* self) {
             ret = parseSof3(self);
         else if (nextMarker == 0xfe)// Comment
             ret = parseBlock(self);
+        else if (nextMarker == 0xdd) // Restart interval
+            ret = parseDri(self);
         else if (nextMarker == 0xd9) // End of image
             break;
         else if (nextMarker == 0xda) {
@@ -651,6 +934,8 @@ static void free_memory(ljp* self) {
 #else
     free(self->hufflut);
     self->hufflut = NULL;
+    free(self->fastlut);
+    self->fastlut = NULL;
 #endif
     free(self->rowcache);
     self->rowcache = NULL;
@@ -24,6 +24,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include "darkframe.h"
+#include "sharedcache.h"
+#include "../parallel.h"
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
@@ -46,127 +48,176 @@ static void df_unload(FILE ** files, int entries)
     if(files) free(files);
 }
 
-/* load dark frame from external averaged MLV file */
-static int df_load_ext(mlvObject_t * video, char * error_message)
+/* external dark frame as stored in the shared cache */
+typedef struct
 {
-    /* If file name is not set return error */
-    if(!video->llrawproc->dark_frame_filename) return 1;
+    mlv_dark_hdr_t hdr;     /* DARK block header filled from the averaged MLV */
+    uint16_t * data;        /* unpacked first frame */
+    uint32_t size;          /* size of data in bytes */
+    uint32_t frame_count;   /* frames of the MLV, more than one means it was not averaged */
+} df_shared;
+
+typedef struct
+{
+    const char * filename;
+    char * error_message;
+} df_read_args;
+
+static void df_free_shared(void * value)
+{
+    df_shared * df = value;
+    free(df->data);
+    free(df);
+}
+
+/* parse the averaged MLV and unpack its first frame, called by sc_acquire for a missing key */
+static void * df_read_ext(void * arg)
+{
+    df_read_args * args = arg;
     /* Parse dark frame MLV */
     mlvObject_t * df_mlv = initMlvObject();
-
-    if (video->llrawproc->dark_frame_data){
-        free(video->llrawproc->dark_frame_data);
-        video->llrawproc->dark_frame_data = NULL;
-    }
     
     char err_msg[256] = { 0 };
-    int ret = openMlvClip(df_mlv, video->llrawproc->dark_frame_filename, err_msg);
+    int ret = openMlvClip(df_mlv, args->filename, err_msg);
     if(ret != 0)
     {
 #ifndef STDOUT_SILENT
         printf("DF: %s\n", err_msg);
 #endif
-        if(error_message != NULL) strcpy(error_message, err_msg);
+        if(args->error_message != NULL) strcpy(args->error_message, err_msg);
         freeMlvObject(df_mlv, 0);
-        return ret;
+        return NULL;
     }
 
     /* if lossless MLV return error */
     if(df_mlv->MLVI.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92)
     {
-        sprintf(err_msg, "Can not use lossless MLV as a dark frame:\n\n%s", video->llrawproc->dark_frame_filename);
+        sprintf(err_msg, "Can not use lossless MLV as a dark frame:\n\n%s", args->filename);
 #ifndef STDOUT_SILENT
         printf("DF: %s\n", err_msg);
 #endif
-        if(error_message != NULL) strcpy(error_message, err_msg);
+        if(args->error_message != NULL) strcpy(args->error_message, err_msg);
         /* Close darkframe MLV */
         df_unload( df_mlv->file, df_mlv->filenum );
-        return 1;
+        return NULL;
     }
-    /* if resolution mismatch detected */
-    if( (df_mlv->RAWI.xRes != video->RAWI.xRes) || (df_mlv->RAWI.yRes != video->RAWI.yRes) )
+
+    /* Allocate dark frame data buffer */
+    uint8_t * df_packed_buf = calloc(df_mlv->video_index[0].frame_size, 1);
+    df_shared * df = calloc(1, sizeof(df_shared));
+    if(!df_packed_buf || !df)
     {
-        sprintf(err_msg, "Video clip and dark frame resolutions have not matched:\n\n%s", video->llrawproc->dark_frame_filename);
+        sprintf(err_msg, "Packed buffer allocation error");
 #ifndef STDOUT_SILENT
         printf("DF: %s\n", err_msg);
 #endif
-        if(error_message != NULL) strcpy(error_message, err_msg);
+        if(args->error_message != NULL) strcpy(args->error_message, err_msg);
         /* Close darkframe MLV */
-        df_unload( df_mlv->file, df_mlv->filenum );
-        return 1;
+        free(df_packed_buf);
+        free(df);
+        freeMlvObject(df_mlv, 0);
+        return NULL;
     }
-    /* if MLV has more than one frame just show the warning */
-    if( df_mlv->MLVI.videoFrameCount > 1 )
+    /* Load dark frame data to the allocated buffer */
+    file_set_pos(df_mlv->file[0], df_mlv->video_index[0].frame_offset, SEEK_SET);
+    if ( fread(df_packed_buf, df_mlv->video_index[0].frame_size, 1, df_mlv->file[0]) != 1 )
     {
-        sprintf(err_msg, "For proper use as a dark frame all frames of this MLV have to be averaged first:\n\n%s", video->llrawproc->dark_frame_filename);
+        sprintf(err_msg, "Could not read dark frame from the file:\n\n%s", args->filename);
 #ifndef STDOUT_SILENT
         printf("DF: %s\n", err_msg);
 #endif
-        if(error_message != NULL) strcpy(error_message, err_msg);
+        if(args->error_message != NULL) strcpy(args->error_message, err_msg);
+        free(df_packed_buf);
+        free(df);
+        freeMlvObject(df_mlv, 0);
+        return NULL;
+    }
+    /* Fill DARK block header */
+    memcpy(&df->hdr.blockType, "DARK", 4);
+    df->hdr.blockSize = sizeof(mlv_dark_hdr_t) + df_mlv->video_index[0].frame_size;
+    df->hdr.timestamp = 0xFFFFFFFFFFFFFFFF;
+    df->hdr.samplesAveraged = MAX(df_mlv->VIDF.frameNumber + 1, df_mlv->MLVI.videoFrameCount);
+    df->hdr.cameraModel = df_mlv->IDNT.cameraModel;
+    df->hdr.xRes = df_mlv->RAWI.xRes;
+    df->hdr.yRes = df_mlv->RAWI.yRes;
+    df->hdr.rawWidth = df_mlv->RAWI.raw_info.width;
+    df->hdr.rawHeight = df_mlv->RAWI.raw_info.height;
+    df->hdr.bits_per_pixel = df_mlv->RAWI.raw_info.bits_per_pixel;
+    df->hdr.black_level = df_mlv->RAWI.raw_info.black_level;
+    df->hdr.white_level = df_mlv->RAWI.raw_info.white_level;
+    df->hdr.sourceFpsNom = df_mlv->MLVI.sourceFpsNom;
+    df->hdr.sourceFpsDenom = df_mlv->MLVI.sourceFpsDenom;
+    df->hdr.isoMode = df_mlv->EXPO.isoMode;
+    df->hdr.isoValue = df_mlv->EXPO.isoValue;
+    df->hdr.isoAnalog = df_mlv->EXPO.isoAnalog;
+    df->hdr.digitalGain = df_mlv->EXPO.digitalGain;
+    df->hdr.shutterValue = df_mlv->EXPO.shutterValue;
+    df->hdr.binning_x = df_mlv->RAWC.binning_x;
+    df->hdr.skipping_x = df_mlv->RAWC.skipping_x;
+    df->hdr.binning_y = df_mlv->RAWC.binning_y;
+    df->hdr.skipping_y = df_mlv->RAWC.skipping_y;
+    df->frame_count = df_mlv->MLVI.videoFrameCount;
+    /* Allocate the dark frame 16bit buffer */
+    df->size = df_mlv->RAWI.xRes * df_mlv->RAWI.yRes * 2;
+    df->data = calloc(df->size + 4, 1);
+    if(df->data)
+    {
+        dng_unpack_image_bits(df->data, (uint16_t*)df_packed_buf, df_mlv->RAWI.xRes, df_mlv->RAWI.yRes, df_mlv->RAWI.raw_info.bits_per_pixel);
     }
+    free(df_packed_buf);
+    freeMlvObject(df_mlv, 0);
 
-    /* Allocate dark frame data buffer */
-    uint8_t * df_packed_buf = calloc(df_mlv->video_index[0].frame_size, 1);
-    if(!df_packed_buf)
+    if(!df->data)
     {
-        sprintf(err_msg, "Packed buffer allocation error");
+        free(df);
+        return NULL;
+    }
+    return df;
+}
+
+/* load dark frame from external averaged MLV file, shared with the other clips using it */
+static int df_load_ext(mlvObject_t * video, char * error_message)
+{
+    /* If file name is not set return error */
+    if(!video->llrawproc->dark_frame_filename) return 1;
+
+    df_free(video);
+
+    char key[1100];
+    sc_file_key("df", video->llrawproc->dark_frame_filename, key, sizeof(key));
+    df_read_args args = { video->llrawproc->dark_frame_filename, error_message };
+    df_shared * df = sc_acquire(key, df_read_ext, df_free_shared, &args);
+    if(!df) return 1;
+
+    char err_msg[256] = { 0 };
+    /* if resolution mismatch detected */
+    if( (df->hdr.xRes != video->RAWI.xRes) || (df->hdr.yRes != video->RAWI.yRes) )
+    {
+        sprintf(err_msg, "Video clip and dark frame resolutions have not matched:\n\n%s", video->llrawproc->dark_frame_filename);
 #ifndef STDOUT_SILENT
         printf("DF: %s\n", err_msg);
 #endif
         if(error_message != NULL) strcpy(error_message, err_msg);
-        /* Close darkframe MLV */
-        if(error_message != NULL) strcpy(error_message, err_msg);
-        freeMlvObject(df_mlv, 0);
+        sc_release(df);
         return 1;
     }
-    /* Load dark frame data to the allocated buffer */
-    file_set_pos(df_mlv->file[0], df_mlv->video_index[0].frame_offset, SEEK_SET);
-    if ( fread(df_packed_buf, df_mlv->video_index[0].frame_size, 1, df_mlv->file[0]) != 1 )
+    /* if MLV has more than one frame just show the warning */
+    if( df->frame_count > 1 )
     {
-        sprintf(err_msg, "Could not read dark frame from the file:\n\n%s", video->llrawproc->dark_frame_filename);
+        sprintf(err_msg, "For proper use as a dark frame all frames of this MLV have to be averaged first:\n\n%s", video->llrawproc->dark_frame_filename);
 #ifndef STDOUT_SILENT
         printf("DF: %s\n", err_msg);
 #endif
         if(error_message != NULL) strcpy(error_message, err_msg);
-        freeMlvObject(df_mlv, 0);
-        return 1;
     }
-    /* Free all data related to the dark frame if needed */
-    /* Fill DARK block header */
-    memcpy(&video->llrawproc->dark_frame_hdr.blockType, "DARK", 4);
-    video->llrawproc->dark_frame_hdr.blockSize = sizeof(mlv_dark_hdr_t) + df_mlv->video_index[0].frame_size;
-    video->llrawproc->dark_frame_hdr.timestamp = 0xFFFFFFFFFFFFFFFF;
-    video->llrawproc->dark_frame_hdr.samplesAveraged = MAX(df_mlv->VIDF.frameNumber + 1, df_mlv->MLVI.videoFrameCount);
-    video->llrawproc->dark_frame_hdr.cameraModel = df_mlv->IDNT.cameraModel;
-    video->llrawproc->dark_frame_hdr.xRes = df_mlv->RAWI.xRes;
-    video->llrawproc->dark_frame_hdr.yRes = df_mlv->RAWI.yRes;
-    video->llrawproc->dark_frame_hdr.rawWidth = df_mlv->RAWI.raw_info.width;
-    video->llrawproc->dark_frame_hdr.rawHeight = df_mlv->RAWI.raw_info.height;
-    video->llrawproc->dark_frame_hdr.bits_per_pixel = df_mlv->RAWI.raw_info.bits_per_pixel;
-    video->llrawproc->dark_frame_hdr.black_level = df_mlv->RAWI.raw_info.black_level;
-    video->llrawproc->dark_frame_hdr.white_level = df_mlv->RAWI.raw_info.white_level;
-    video->llrawproc->dark_frame_hdr.sourceFpsNom = df_mlv->MLVI.sourceFpsNom;
-    video->llrawproc->dark_frame_hdr.sourceFpsDenom = df_mlv->MLVI.sourceFpsDenom;
-    video->llrawproc->dark_frame_hdr.isoMode = df_mlv->EXPO.isoMode;
-    video->llrawproc->dark_frame_hdr.isoValue = df_mlv->EXPO.isoValue;
-    video->llrawproc->dark_frame_hdr.isoAnalog = df_mlv->EXPO.isoAnalog;
-    video->llrawproc->dark_frame_hdr.digitalGain = df_mlv->EXPO.digitalGain;
-    video->llrawproc->dark_frame_hdr.shutterValue = df_mlv->EXPO.shutterValue;
-    video->llrawproc->dark_frame_hdr.binning_x = df_mlv->RAWC.binning_x;
-    video->llrawproc->dark_frame_hdr.skipping_x = df_mlv->RAWC.skipping_x;
-    video->llrawproc->dark_frame_hdr.binning_y = df_mlv->RAWC.binning_y;
-    video->llrawproc->dark_frame_hdr.skipping_y = df_mlv->RAWC.skipping_y;
-    /* Allocate the dark frame 16bit buffer */
-    video->llrawproc->dark_frame_size = df_mlv->RAWI.xRes * df_mlv->RAWI.yRes * 2;
-    video->llrawproc->dark_frame_data = calloc(video->llrawproc->dark_frame_size + 4, 1);
-    dng_unpack_image_bits(video->llrawproc->dark_frame_data, (uint16_t*)df_packed_buf, df_mlv->RAWI.xRes, df_mlv->RAWI.yRes, df_mlv->RAWI.raw_info.bits_per_pixel);
+
+    memcpy(&video->llrawproc->dark_frame_hdr, &df->hdr, sizeof(mlv_dark_hdr_t));
+    video->llrawproc->dark_frame_size = df->size;
+    video->llrawproc->dark_frame_data = df->data;
+    video->llrawproc->dark_frame_shared = df;
 #ifndef STDOUT_SILENT
     printf("DF: initialized Ext mode\n");
 #endif
-    free(df_packed_buf);
-
-    freeMlvObject(df_mlv, 0);
-
     return 0;
 }
 
@@ -185,9 +236,8 @@ static int df_load_int(mlvObject_t * video)
 #endif
         return 1;
     }
-    /* Load dark frame data to the allocated buffer */
-    file_set_pos(video->file[0], video->dark_frame_offset, SEEK_SET);
-    if ( fread(df_packed_buf, df_packed_size, 1, video->file[0]) != 1 )
+    /* Load dark frame data to the allocated buffer, the clip chunks may be shared by other readers */
+    if ( readMlvChunkData(video, 0, video->dark_frame_offset, df_packed_size, df_packed_buf) )
     {
 #ifndef STDOUT_SILENT
         printf("DF: could not read frame: %s\n", video->llrawproc->dark_frame_filename);
@@ -225,24 +275,25 @@ void df_free_filename(mlvObject_t * video)
     video->llrawproc->dark_frame_filename = NULL;
 }
 
-/* subtract dark frame from the current frame */
-void df_subtract(mlvObject_t * video, uint16_t * raw_image_buff, size_t raw_image_size)
+/* check the dark frame can be subtracted from the current frame */
+int df_check(mlvObject_t * video, size_t raw_image_size)
 {
     if( !video->llrawproc->dark_frame_data || (raw_image_size != video->llrawproc->dark_frame_size) )
     {
         printf("DF: subtracting is impossible, invalid dark frame'\n\n");
-        return;
+        return 1;
     }
-#ifndef STDOUT_SILENT
-    printf("Subtracting dark frame...'\n\n");
-#endif
+    return 0;
+}
+
+/* subtract dark frame from the pixels [begin, end) of the current frame, df_check must have passed */
+void df_subtract_range(mlvObject_t * video, uint16_t * raw_image_buff, uint32_t begin, uint32_t end)
+{
     uint16_t * dark_frame_data = video->llrawproc->dark_frame_data;
     uint32_t black_level = video->llrawproc->dark_frame_hdr.black_level;
     uint16_t white_level = (1 << video->RAWI.raw_info.bits_per_pixel) - 1;
 
-    uint32_t pixel_count = raw_image_size / 2;
-#pragma omp parallel for
-    for(uint32_t i = 0; i < pixel_count; i++)
+    for(uint32_t i = begin; i < end; i++)
     {
         int32_t orig_val = raw_image_buff[i];
         int32_t dark_val = dark_frame_data[i];
@@ -251,6 +302,29 @@ void df_subtract(mlvObject_t * video, uint16_t * raw_image_buff, size_t raw_imag
     }
 }
 
+typedef struct
+{
+    mlvObject_t * video;
+    uint16_t * raw_image_buff;
+} df_subtract_job;
+
+static void df_subtract_block(void * arg, int begin, int end)
+{
+    df_subtract_job * job = arg;
+    df_subtract_range(job->video, job->raw_image_buff, begin, end);
+}
+
+/* subtract dark frame from the current frame */
+void df_subtract(mlvObject_t * video, uint16_t * raw_image_buff, size_t raw_image_size)
+{
+    if( df_check(video, raw_image_size) ) return;
+#ifndef STDOUT_SILENT
+    printf("Subtracting dark frame...'\n\n");
+#endif
+    df_subtract_job job = { video, raw_image_buff };
+    parallel_for(0, raw_image_size / 2, 65536, df_subtract_block, &job);
+}
+
 /* validate external dark frame file */
 int df_validate(mlvObject_t * video, const char * df_filename, char * error_message)
 {
@@ -284,9 +358,26 @@ void df_free(mlvObject_t * video)
 #ifndef STDOUT_SILENT
         printf("DF: all data freed\n");
 #endif
-        free(video->llrawproc->dark_frame_data);
+        if(video->llrawproc->dark_frame_shared)
+        {
+            sc_release(video->llrawproc->dark_frame_shared);
+            video->llrawproc->dark_frame_shared = NULL;
+        }
+        else
+        {
+            free(video->llrawproc->dark_frame_data);
+        }
         video->llrawproc->dark_frame_data = NULL;
         video->llrawproc->dark_frame_size = 0;
         memset(&video->llrawproc->dark_frame_hdr, 0, sizeof(mlv_dark_hdr_t));
     }
 }
+
+/* forget the cached copy of an external dark frame file which was rewritten,
+   clips still using it keep it until they load the dark frame again */
+void df_invalidate(const char * df_filename)
+{
+    char prefix[1100];
+    snprintf(prefix, sizeof(prefix), "df:%s:", df_filename);
+    sc_invalidate(prefix);
+}
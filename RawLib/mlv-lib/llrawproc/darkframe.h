@@ -25,6 +25,7 @@
 
 /* from video_mlv.c */
 extern int openMlvClip(mlvObject_t * video, const char * mlvPath, char * error_message);
+extern int readMlvChunkData(mlvObject_t * video, int chunk, uint64_t offset, uint64_t size, void * buffer);
 /* from dng.c */
 extern void dng_unpack_image_bits(uint16_t * input_buffer, uint16_t * output_buffer, int width, int height, uint32_t bpp);
 
@@ -38,7 +39,11 @@ enum { DF_OFF, DF_EXT, DF_INT };
 int df_validate(mlvObject_t * video, const char * df_filename, char * error_message);
 int df_init(mlvObject_t * video);
 void df_free(mlvObject_t * video);
+void df_invalidate(const char * df_filename);
 
 void df_subtract(mlvObject_t * video, uint16_t * raw_image_buff, size_t raw_image_size);
+/* for callers fusing the subtraction with other per pixel stages */
+int df_check(mlvObject_t * video, size_t raw_image_size);
+void df_subtract_range(mlvObject_t * video, uint16_t * raw_image_buff, uint32_t begin, uint32_t end);
 
 #endif
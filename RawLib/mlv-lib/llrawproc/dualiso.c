@@ -27,7 +27,7 @@
  #include "dualiso.h"
  #include "opt_med.h"
  #include "wirth.h"
- #include <pthread.h>
+ #include "../parallel.h"
  
  #define EV_RESOLUTION 65536
  #ifndef M_PI
@@ -39,9 +39,6 @@
  #define COERCE(x,lo,hi) MAX(MIN((x),(hi)),(lo))
  #define ABS(a) ((a) > 0 ? (a) : -(a))
  
- #define LOCK(x) static pthread_mutex_t x = PTHREAD_MUTEX_INITIALIZER; pthread_mutex_lock(&x);
- #define UNLOCK(x) pthread_mutex_unlock(&(x));
- 
  //this is just meant to be fast
  int diso_get_preview(uint16_t * image_data, uint16_t width, uint16_t height, int32_t black, int32_t white, int diso_check)
  {
@@ -242,7 +239,7 @@
  
  
  //from cr2hdr 20bit version
- //this is not thread safe (yet)
+ //thread safe: each call only uses the buffers and LUTs of its workspace
  
  #define BRIGHT_ROW (is_bright[y % 4])
  #define COUNT(x) ((int)(sizeof(x)/sizeof((x)[0])))
@@ -253,7 +250,7 @@
  #define raw_get_pixel32(x,y) (raw_buffer_32[(x) + (y) * raw_info.width])
  #define raw_set_pixel32(x,y,value) raw_buffer_32[(x) + (y)*raw_info.width] = value
  #define raw_get_pixel_20to16(x,y) ((raw_get_pixel32(x,y) >> 4) & 0xFFFF)
- #define raw_set_pixel_20to16_rand(x,y,value) image_data[(x) + (y) * raw_info.width] = COERCE((int)((value) / 16.0 + fast_randn05() + 0.5), 0, 0xFFFF)
+ #define raw_set_pixel_20to16_rand(x,y,value) image_data[(x) + (y) * raw_info.width] = COERCE((int)((value) / 16.0 + randn05_cache[((x) + (y) * raw_info.width) & 1023] + 0.5), 0, 0xFFFF)
  #define raw_set_pixel20(x,y,value) raw_buffer_32[(x) + (y) * raw_info.width] = COERCE((value), 0, 0xFFFFF)
  
  static const double fullres_thr = 0.8;
@@ -261,7 +258,84 @@
  /* trial and error - too high = aliasing, too low = noisy */
  static const int ALIAS_MAP_MAX = 15000;
  
- static void white_detect(struct raw_info raw_info, uint16_t * image_data, int* white_dark, int* white_bright, int * is_bright)
+ /* rows and LUT entries processed by one task */
+ #define DISO_ROW_GRAIN 16
+ #define DISO_LUT_GRAIN 4096
+ 
+ /* full frame scratch buffers, grown when needed and kept from frame to frame */
+ enum
+ {
+     WS_RAW32, WS_DARK, WS_BRIGHT, WS_FULLRES, WS_FULLRES_SMOOTH, WS_HALFRES, WS_HALFRES_SMOOTH,
+     WS_OVEREXPOSED, WS_OVER_AUX, WS_ALIAS_MAP, WS_ALIAS_AUX, WS_GRAY, WS_EDGE_DIRECTION,
+     WS_MATCH_DARK, WS_MATCH_BRIGHT, WS_MATCH_TMP, WS_HI_DARK, WS_HI_BRIGHT, WS_EVS, WS_SCORES,
+     WS_WHITE_DARK, WS_WHITE_BRIGHT, WS_SQUEEZED, WS_PLANES, WS_PLANE_ROWS,
+     WS_BUFFERS
+ };
+ 
+ struct diso_workspace
+ {
+     void * buffers[WS_BUFFERS];
+     size_t sizes[WS_BUFFERS];
+     
+     /* raw <-> EV conversion, for the levels they were built with */
+     int * raw2ev;       /* EV x EV_RESOLUTION */
+     int * ev2raw_0;     /* from -10 to 14 EV */
+     int lut_black;
+     int lut_white;
+     
+     /* fullres mixing curve */
+     double * fullres_curve;
+     int fullres_black;
+     
+     /* halfres mixing curve, its exposure parameters barely move within a clip */
+     double * mix_curve;
+     int mix_black;
+     int mix_white;
+     double mix_corr_ev;
+     double mix_overlap;
+ };
+ 
+ diso_workspace_t * diso_workspace_create()
+ {
+     diso_workspace_t * ws = calloc(1, sizeof(diso_workspace_t));
+     ws->lut_black = -1;
+     ws->fullres_black = -1;
+     ws->mix_black = -1;
+     return ws;
+ }
+ 
+ void diso_workspace_free(diso_workspace_t * ws)
+ {
+     if (!ws) return;
+     for (int i = 0; i < WS_BUFFERS; i++)
+         free(ws->buffers[i]);
+     free(ws->raw2ev);
+     free(ws->ev2raw_0);
+     free(ws->fullres_curve);
+     free(ws->mix_curve);
+     free(ws);
+ }
+ 
+ /* buffer of at least size bytes, its content is left from the previous frame */
+ static void * ws_buffer(diso_workspace_t * ws, int id, size_t size)
+ {
+     if (ws->sizes[id] < size)
+     {
+         free(ws->buffers[id]);
+         ws->buffers[id] = malloc(size);
+         ws->sizes[id] = size;
+     }
+     return ws->buffers[id];
+ }
+ 
+ static void * ws_zeroed(diso_workspace_t * ws, int id, size_t size)
+ {
+     void * buffer = ws_buffer(ws, id, size);
+     memset(buffer, 0, size);
+     return buffer;
+ }
+ 
+ static void white_detect(diso_workspace_t * ws, struct raw_info raw_info, uint16_t * image_data, int* white_dark, int* white_bright, int * is_bright)
  {
      /* sometimes the white level is much lower than 15000; this would cause pink highlights */
      /* workaround: consider the white level as a little under the maximum pixel value from the raw file */
@@ -275,10 +349,8 @@
      
      int* pixels[2];
      int max_pix = raw_info.width * raw_info.height / 2 / 9;
-     pixels[0] = malloc(max_pix * sizeof(pixels[0][0]));
-     pixels[1] = malloc(max_pix * sizeof(pixels[0][0]));
-     memset(pixels[0], 0, sizeof(max_pix * sizeof(pixels[0][0])));
-     memset(pixels[1], 0, sizeof(max_pix * sizeof(pixels[0][0])));
+     pixels[0] = ws_buffer(ws, WS_WHITE_DARK, max_pix * sizeof(pixels[0][0]));
+     pixels[1] = ws_buffer(ws, WS_WHITE_BRIGHT, max_pix * sizeof(pixels[0][0]));
      int counts[2] = {0, 0};
      
      /* collect all the pixels and find the k-th max, thus ignoring hot pixels */
@@ -310,8 +382,6 @@
  #ifndef STDOUT_SILENT
      printf("White levels    : %d %d\n", *white_dark, *white_bright);
  #endif
-     free(pixels[0]);
-     free(pixels[1]);
  }
  
  static void compute_black_noise(struct raw_info raw_info, uint16_t * image_data, int x1, int x2, int y1, int y2, int dx, int dy, double* out_mean, double* out_stdev)
@@ -403,6 +473,7 @@
  
  /* anti-posterization noise */
  /* before rounding, it's a good idea to add a Gaussian noise of stdev=0.5 */
+ /* picked by pixel position, so the noise does not depend on the order rows are processed in */
  static float randn05_cache[1024];
  
  void fast_randn_init()
@@ -414,12 +485,6 @@
      }
  }
  
- float fast_randn05()
- {
-     static int k = 0;
-     return randn05_cache[(k++) & 1023];
- }
- 
  static int identify_rggb_or_gbrg(struct raw_info raw_info, uint16_t * image_data)
  {
      int w = raw_info.width;
@@ -623,28 +688,34 @@
      return 1;
  }
  
- static int match_exposures(struct raw_info raw_info, uint32_t * raw_buffer_32, double * corr_ev, int * white_darkened, int * is_bright)
+ typedef struct
  {
-     /* guess ISO - find the factor and the offset for matching the bright and dark images */
-     int black20 = raw_info.black_level;
-     int white20 = MIN(raw_info.white_level, *white_darkened);
-     int black = black20/16;
-     int white = white20/16;
-     int clip0 = white - black;
-     int clip  = clip0 * 0.95;    /* there may be nonlinear response in very bright areas */
-     
+     struct raw_info raw_info;
+     uint32_t * raw_buffer_32;
+     int * is_bright;
+     int * dark;
+     int * bright;
+     int y0;
+     int black;
+     int clip0;
+     int clip;
+ } match_grid_job;
+ 
+ /* quick interpolation of the rows y0 + 3k, k in [k1, k2) */
+ static void match_grid_rows(void * arg, int k1, int k2)
+ {
+     match_grid_job * job = (match_grid_job *)arg;
+     struct raw_info raw_info = job->raw_info;
+     uint32_t * raw_buffer_32 = job->raw_buffer_32;
+     int * is_bright = job->is_bright;
      int w = raw_info.width;
-     int h = raw_info.height;
-     int y0 = raw_info.active_area.y1 + 2;
-     
-     /* quick interpolation for matching */
-     int* dark   = malloc(w * h * sizeof(dark[0]));
-     int* bright = malloc(w * h * sizeof(bright[0]));
-     memset(dark, 0, w * h * sizeof(dark[0]));
-     memset(bright, 0, w * h * sizeof(bright[0]));
+     int* dark = job->dark;
+     int* bright = job->bright;
+     int black = job->black;
+     int clip0 = job->clip0;
+     int clip = job->clip;
      
-     //#pragma omp parallel for
-     for (int y = y0; y < h-2; y += 3)
+     for (int y = job->y0 + 3*k1; y < job->y0 + 3*k2; y += 3)
      {
          int* native = BRIGHT_ROW ? bright : dark;
          int* interp = BRIGHT_ROW ? dark : bright;
@@ -661,6 +732,67 @@
              native[x + y * w] = pn;
          }
      }
+ }
+ 
+ typedef struct
+ {
+     double * evs;
+     int * scores;
+     int * hi_dark;
+     int * hi_bright;
+     int hi_n;
+     int dmed;
+     int bmed;
+ } slope_score_job;
+ 
+ static void slope_scores(void * arg, int k1, int k2)
+ {
+     slope_score_job * job = (slope_score_job *)arg;
+     double * evs = job->evs;
+     int * hi_dark = job->hi_dark;
+     int * hi_bright = job->hi_bright;
+     int hi_n = job->hi_n;
+     int dmed = job->dmed;
+     int bmed = job->bmed;
+     
+     for (int k = k1; k < k2; k++)
+     {
+         double test_a = pow(2, -evs[k]);
+         double test_b = dmed - bmed * test_a;
+         
+         int score = 0;
+         for (int i = 0; i < hi_n; i++)
+         {
+             int d = hi_dark[i];
+             int b = hi_bright[i];
+             int e = d - (b*test_a + test_b);
+             if (ABS(e) < 50) score++;
+         }
+         job->scores[k] = score;
+     }
+ }
+ 
+ static int match_exposures(diso_workspace_t * ws, struct raw_info raw_info, uint32_t * raw_buffer_32, int white_bright, int * is_bright, double * out_a, double * out_b)
+ {
+     /* guess ISO - find the factor and the offset for matching the bright and dark images */
+     int black20 = raw_info.black_level;
+     int white20 = MIN(raw_info.white_level, white_bright);
+     int black = black20/16;
+     int white = white20/16;
+     int clip0 = white - black;
+     int clip  = clip0 * 0.95;    /* there may be nonlinear response in very bright areas */
+     
+     int w = raw_info.width;
+     int h = raw_info.height;
+     int y0 = raw_info.active_area.y1 + 2;
+     
+     /* quick interpolation for matching */
+     /* only the 3x3 grid below is written and read back */
+     int* dark   = ws_buffer(ws, WS_MATCH_DARK, w * h * sizeof(dark[0]));
+     int* bright = ws_buffer(ws, WS_MATCH_BRIGHT, w * h * sizeof(bright[0]));
+     
+     match_grid_job grid = { raw_info, raw_buffer_32, is_bright, dark, bright, y0, black, clip0, clip };
+     parallel_for(0, (h-2 - y0 + 2) / 3, DISO_ROW_GRAIN, match_grid_rows, &grid);
      
      /*
       * Robust line fit (match unclipped data):
@@ -674,7 +806,7 @@
       * - as ad-hoc as it looks, it's the only method that passed all the test samples so far.
       */
      int nmax = (w+2) * (h+2) / 9;   /* downsample by 3x3 for speed */
-     int * tmp = malloc(nmax * sizeof(tmp[0]));
+     int * tmp = ws_buffer(ws, WS_MATCH_TMP, nmax * sizeof(tmp[0]));
      
      /* median_bright */
      int n = 0;
@@ -689,8 +821,6 @@
      }
      int bmed = median_int_wirth(tmp, n);
      
-     int * bps = 0;
-     
      /* also compute the range for bright pixels (used to find the slope) */
      int b_lo = kth_smallest_int(tmp, n, n*98/100);
      int b_hi = kth_smallest_int(tmp, n, n*99.9/100);
@@ -709,14 +839,12 @@
      }
      int dmed = median_int_wirth(tmp, n);
      
-     int * dps = 0;
-     
      /* select highlights used to find the slope (ISO) */
      /* (98th percentile => up to 2% highlights) */
      int hi_nmax = nmax/50;
      int hi_n = 0;
-     int* hi_dark = malloc(hi_nmax * sizeof(hi_dark[0]));
-     int* hi_bright = malloc(hi_nmax * sizeof(hi_bright[0]));
+     int* hi_dark = ws_buffer(ws, WS_HI_DARK, hi_nmax * sizeof(hi_dark[0]));
+     int* hi_bright = ws_buffer(ws, WS_HI_BRIGHT, hi_nmax * sizeof(hi_bright[0]));
      
      for (int y = y0; y < h-2; y += 3)
      {
@@ -738,41 +866,72 @@
      double a = 0;
      double b = 0;
      
-     int best_score = 0;
+     /* the slopes are scored in parallel, the first best one wins */
+     int num_ev = 0;
      for (double ev = 0; ev < 6; ev += 0.002)
+         num_ev++;
+     double * evs = ws_buffer(ws, WS_EVS, num_ev * sizeof(evs[0]));
+     int * scores = ws_buffer(ws, WS_SCORES, num_ev * sizeof(scores[0]));
+     num_ev = 0;
+     for (double ev = 0; ev < 6; ev += 0.002)
+         evs[num_ev++] = ev;
+     
+     slope_score_job score_job = { evs, scores, hi_dark, hi_bright, hi_n, dmed, bmed };
+     parallel_for(0, num_ev, 64, slope_scores, &score_job);
+     
+     int best_score = 0;
+     for (int k = 0; k < num_ev; k++)
      {
-         double test_a = pow(2, -ev);
-         double test_b = dmed - bmed * test_a;
-         
-         int score = 0;
-         for (int i = 0; i < hi_n; i++)
+         if (scores[k] > best_score)
          {
-             int d = hi_dark[i];
-             int b = hi_bright[i];
-             int e = d - (b*test_a + test_b);
-             if (ABS(e) < 50) score++;
-         }
-         if (score > best_score)
-         {
-             best_score = score;
-             a = test_a;
-             b = test_b;
-             //~ printf("%f: %d\n", a, score);
+             best_score = scores[k];
+             a = pow(2, -evs[k]);
+             b = dmed - bmed * a;
+             //~ printf("%f: %d\n", a, best_score);
          }
      }
-     free(hi_dark); hi_dark = 0;
-     free(hi_bright); hi_bright = 0;
-     free(tmp); tmp = 0;
      
-     free(dark);
-     free(bright);
-     if (dps) free(dps);
-     if (bps) free(bps);
+     *out_a = a;
+     *out_b = b;
      
-     /* apply the correction */
-     double b20 = b * 16;
-     //#pragma omp parallel for collapse(2)
-     for (int y = 0; y < h; y ++)
+     double factor = 1/a;
+     if (factor < 1.2 || !isfinite(factor))
+     {
+ #ifndef STDOUT_SILENT
+         printf("Doesn't look like interlaced ISO\n");
+ #endif
+         return 0;
+     }
+     
+ #ifndef STDOUT_SILENT
+     printf("ISO difference  : %.2f EV (%d)\n", log2(factor), (int)round(factor*100));
+     printf("Black delta     : %.2f\n", b/4); /* we want to display black delta for the 14-bit original data, but we have computed it from 16-bit data */
+ #endif
+     return 1;
+ }
+ 
+ typedef struct
+ {
+     struct raw_info raw_info;
+     uint32_t * raw_buffer_32;
+     int * is_bright;
+     int black20;
+     double a;
+     double b20;
+ } apply_exposures_job;
+ 
+ static void apply_exposures_rows(void * arg, int y1, int y2)
+ {
+     apply_exposures_job * job = (apply_exposures_job *)arg;
+     struct raw_info raw_info = job->raw_info;
+     uint32_t * raw_buffer_32 = job->raw_buffer_32;
+     int * is_bright = job->is_bright;
+     int w = raw_info.width;
+     int black20 = job->black20;
+     double a = job->a;
+     double b20 = job->b20;
+     
+     for (int y = y1; y < y2; y ++)
      {
          for (int x = 0; x < w; x ++)
          {
@@ -796,46 +955,69 @@
              raw_set_pixel20(x, y, p);
          }
      }
-     *white_darkened = (white20 - black20 + b20) * a + black20;
+ }
+ 
+ /* darken the bright exposure with the matching found by match_exposures, returns its white level */
+ static int apply_exposures(struct raw_info raw_info, uint32_t * raw_buffer_32, int white_bright, int * is_bright, double a, double b)
+ {
+     int black20 = raw_info.black_level;
+     int white20 = MIN(raw_info.white_level, white_bright);
+     int h = raw_info.height;
      
-     double factor = 1/a;
-     if (factor < 1.2 || !isfinite(factor))
-     {
- #ifndef STDOUT_SILENT
-         printf("Doesn't look like interlaced ISO\n");
- #endif
-         return 0;
-     }
+     double b20 = b * 16;
+     apply_exposures_job job = { raw_info, raw_buffer_32, is_bright, black20, a, b20 };
+     parallel_for(0, h, DISO_ROW_GRAIN, apply_exposures_rows, &job);
+     return (white20 - black20 + b20) * a + black20;
+ }
+ 
+ typedef struct
+ {
+     struct raw_info raw_info;
+     uint16_t * image_data;
+     uint32_t * raw_buffer_32;
+ } convert_bits_job;
+ 
+ static void convert_to_20bit_rows(void * arg, int y1, int y2)
+ {
+     convert_bits_job * job = (convert_bits_job *)arg;
+     struct raw_info raw_info = job->raw_info;
+     uint16_t * image_data = job->image_data;
+     uint32_t * raw_buffer_32 = job->raw_buffer_32;
+     int w = raw_info.width;
      
-     *corr_ev = log2(factor);
- #ifndef STDOUT_SILENT
-     printf("ISO difference  : %.2f EV (%d)\n", log2(factor), (int)round(factor*100));
-     printf("Black delta     : %.2f\n", b/4); /* we want to display black delta for the 14-bit original data, but we have computed it from 16-bit data */
- #endif
-     return 1;
+     for (int y = y1; y < y2; y ++)
+         for (int x = 0; x < w; x ++)
+             raw_buffer_32[x + y*w] = raw_get_pixel_14to20(x, y);
  }
  
- static inline uint32_t * convert_to_20bit(struct raw_info raw_info, uint16_t * image_data)
+ static inline uint32_t * convert_to_20bit(diso_workspace_t * ws, struct raw_info raw_info, uint16_t * image_data)
  {
      int w = raw_info.width;
      int h = raw_info.height;
      /* promote from 14 to 20 bits (original raw buffer holds 14-bit values stored as uint16_t) */
-     uint32_t * raw_buffer_32 = malloc(w * h * sizeof(raw_buffer_32[0]));
+     uint32_t * raw_buffer_32 = ws_buffer(ws, WS_RAW32, w * h * sizeof(raw_buffer_32[0]));
      
-     //#pragma omp parallel for collapse(2)
-     for (int y = 0; y < h; y ++)
-         for (int x = 0; x < w; x ++)
-             raw_buffer_32[x + y*w] = raw_get_pixel_14to20(x, y);
+     convert_bits_job job = { raw_info, image_data, raw_buffer_32 };
+     parallel_for(0, h, DISO_ROW_GRAIN, convert_to_20bit_rows, &job);
      
      return raw_buffer_32;
  }
  
- static inline void build_ev2raw_lut(int * raw2ev, int * ev2raw_0, int black, int white)
+ typedef struct
  {
-     int* ev2raw = ev2raw_0 + 10*EV_RESOLUTION;
+     int * raw2ev;
+     int * ev2raw;       /* offset to 0 EV */
+     int black;
+     int white;
+ } ev_lut_job;
+ 
+ static void raw2ev_block(void * arg, int begin, int end)
+ {
+     ev_lut_job * job = (ev_lut_job *)arg;
+     int * raw2ev = job->raw2ev;
+     int black = job->black;
      
-     //#pragma omp parallel for
-     for (int i = 0; i < 1<<20; i++)
+     for (int i = begin; i < end; i++)
      {
          double signal = MAX(i/64.0 - black/64.0, -1023);
          if (signal > 0)
@@ -843,15 +1025,29 @@
          else
              raw2ev[i] = -(int)round(log2(1-signal) * EV_RESOLUTION);
      }
+ }
+ 
+ static void ev2raw_below_block(void * arg, int begin, int end)
+ {
+     ev_lut_job * job = (ev_lut_job *)arg;
+     int * ev2raw = job->ev2raw;
+     int black = job->black;
      
-     //#pragma omp parallel for
-     for (int i = -10*EV_RESOLUTION; i < 0; i++)
+     for (int i = begin; i < end; i++)
      {
          ev2raw[i] = COERCE(black+64 - round(64*pow(2, ((double)-i/EV_RESOLUTION))), 0, black);
      }
+ }
+ 
+ static void ev2raw_above_block(void * arg, int begin, int end)
+ {
+     ev_lut_job * job = (ev_lut_job *)arg;
+     int * raw2ev = job->raw2ev;
+     int * ev2raw = job->ev2raw;
+     int black = job->black;
+     int white = job->white;
      
-     //#pragma omp parallel for
-     for (int i = 0; i < 14*EV_RESOLUTION; i++)
+     for (int i = begin; i < end; i++)
      {
          ev2raw[i] = COERCE(black-64 + round(64*pow(2, ((double)i/EV_RESOLUTION))), black, (1<<20)-1);
          
@@ -860,6 +1056,18 @@
              ev2raw[i] = MAX(ev2raw[i], white);
          }
      }
+ }
+ 
+ static inline void build_ev2raw_lut(int * raw2ev, int * ev2raw_0, int black, int white)
+ {
+     int* ev2raw = ev2raw_0 + 10*EV_RESOLUTION;
+     
+     ev_lut_job job = { raw2ev, ev2raw, black, white };
+     parallel_for(0, 1<<20, DISO_LUT_GRAIN, raw2ev_block, &job);
+     
+     parallel_for(-10*EV_RESOLUTION, 0, DISO_LUT_GRAIN, ev2raw_below_block, &job);
+     
+     parallel_for(0, 14*EV_RESOLUTION, DISO_LUT_GRAIN, ev2raw_above_block, &job);
      
      /* keep "bad" pixels, if any */
      ev2raw[raw2ev[0]] = 0;
@@ -870,7 +1078,7 @@
      //~ printf("%d %d %d %d %d %d %d *%d* %d %d %d %d %d\n", ev2raw[raw2ev[0]], ev2raw[raw2ev[16000]], ev2raw[raw2ev[32000]], ev2raw[raw2ev[131068]], ev2raw[raw2ev[131069]], ev2raw[raw2ev[131070]], ev2raw[raw2ev[131071]], ev2raw[raw2ev[131072]], ev2raw[raw2ev[131073]], ev2raw[raw2ev[131074]], ev2raw[raw2ev[131075]], ev2raw[raw2ev[131076]], ev2raw[raw2ev[132000]]);
  }
  
- static inline double compute_noise(struct raw_info raw_info, uint16_t * image_data, double * noise_std, double * dark_noise, double * bright_noise, double * dark_noise_ev, double * bright_noise_ev)
+ static inline void compute_noise(struct raw_info raw_info, uint16_t * image_data, double * noise_std)
  {
      double noise_avg = 0.0;
      for (int y = 0; y < 4; y++)
@@ -878,35 +1086,67 @@
  #ifndef STDOUT_SILENT
      printf("Noise levels    : %.02f %.02f %.02f %.02f (14-bit)\n", noise_std[0], noise_std[1], noise_std[2], noise_std[3]);
  #endif
-     *dark_noise = MIN(MIN(noise_std[0], noise_std[1]), MIN(noise_std[2], noise_std[3]));
-     *bright_noise = MAX(MAX(noise_std[0], noise_std[1]), MAX(noise_std[2], noise_std[3]));
-     *dark_noise_ev = log2(*dark_noise);
-     *bright_noise_ev = log2(*bright_noise);
-     return noise_avg;
  }
  
- static inline double * build_fullres_curve(int black)
+ /* raw2ev and ev2raw (offset to 0 EV) for these levels, built once per workspace */
+ static void get_ev_luts(diso_workspace_t * ws, int black, int white, int ** raw2ev, int ** ev2raw)
  {
-     /* fullres mixing curve */
-     static double fullres_curve[1<<20];
-     static int previous_black = -1;
+     if (!ws->raw2ev)
+     {
+         ws->raw2ev = malloc((1<<20) * sizeof(int));
+         ws->ev2raw_0 = malloc(24*EV_RESOLUTION * sizeof(int));
+     }
      
-     if(previous_black == black) return fullres_curve;
+     if (black != ws->lut_black || white != ws->lut_white)
+     {
+         build_ev2raw_lut(ws->raw2ev, ws->ev2raw_0, black, white);
+         ws->lut_black = black;
+         ws->lut_white = white;
+     }
      
-     previous_black = black;
+     /* handle sub-black values (negative EV) */
+     *raw2ev = ws->raw2ev;
+     *ev2raw = ws->ev2raw_0 + 10*EV_RESOLUTION;
+ }
+ 
+ typedef struct
+ {
+     double * curve;
+     int black;
+ } fullres_curve_job;
+ 
+ static void fullres_curve_block(void * arg, int begin, int end)
+ {
+     fullres_curve_job * job = (fullres_curve_job *)arg;
+     double * fullres_curve = job->curve;
+     int black = job->black;
      
      const double fullres_start = 4;
      const double fullres_transition = 4;
      //const double fullres_thr = 0.8;
      
-     //#pragma omp parallel for
-     for (int i = 0; i < (1<<20); i++)
+     for (int i = begin; i < end; i++)
      {
          double ev2 = log2(MAX(i/64.0 - black/64.0, 1));
          double c2 = -cos(COERCE(ev2 - fullres_start, 0, fullres_transition)*M_PI/fullres_transition);
          double f = (c2+1) / 2;
          fullres_curve[i] = f;
      }
+ }
+ 
+ static inline double * build_fullres_curve(diso_workspace_t * ws, int black)
+ {
+     /* fullres mixing curve */
+     if (!ws->fullres_curve)
+         ws->fullres_curve = malloc((1<<20) * sizeof(double));
+     
+     double * fullres_curve = ws->fullres_curve;
+     if(ws->fullres_black == black) return fullres_curve;
+     
+     ws->fullres_black = black;
+     
+     fullres_curve_job job = { fullres_curve, black };
+     parallel_for(0, 1<<20, DISO_LUT_GRAIN, fullres_curve_block, &job);
      
      return fullres_curve;
  }
@@ -950,65 +1190,116 @@
      return pi;
  }
  
- static inline void amaze_interpolate(struct raw_info raw_info, uint32_t * raw_buffer_32, uint32_t* dark, uint32_t* bright, int black, int white, int white_darkened, int * is_bright)
+ typedef struct
  {
-     int w = raw_info.width;
-     int h = raw_info.height;
-     
-     int* squeezed = malloc(h * sizeof(int));
-     memset(squeezed, 0, h * sizeof(int));
-     
-     float** rawData = malloc(h * sizeof(rawData[0]));
-     float** red     = malloc(h * sizeof(red[0]));
-     float** green   = malloc(h * sizeof(green[0]));
-     float** blue    = malloc(h * sizeof(blue[0]));
-     
-     //#pragma omp parallel for
-     for (int i = 0; i < h; i++)
-     {
-         int wx = w + 16;
-         rawData[i] =   malloc(wx * sizeof(rawData[0][0]));
-         memset(rawData[i], 0, wx * sizeof(rawData[0][0]));
-         red[i]     = malloc(wx * sizeof(red[0][0]));
-         green[i]   = malloc(wx * sizeof(green[0][0]));
-         blue[i]    = malloc(wx * sizeof(blue[0][0]));
-     }
-     
-     /* squeeze the dark image by deleting fields from the bright exposure */
-     int yh = -1;
-     for (int y = 0; y < h; y ++)
-     {
-         if (BRIGHT_ROW)
-             continue;
-         
-         if (yh < 0) /* make sure we start at the same parity (RGGB cell) */
-             yh = y;
+     float ** rawData;
+     float ** red;
+     float ** green;
+     float ** blue;
+     int w;
+     int h;
+ } demosaic_job;
+ 
+ static void squeezed_demosaic_rows(void * arg, int y1, int y2)
+ {
+     demosaic_job * job = (demosaic_job *)arg;
+     float ** rawData = job->rawData;
+     float ** red = job->red;
+     float ** green = job->green;
+     float ** blue = job->blue;
+     int w = job->w;
+     int h = job->h;
+     
+     for (int y = y1; y < y2; y++)
+     {
+         /* mirrored neighbours keep the bayer phase at the borders */
+         float * up   = rawData[y > 0 ? y-1 : y+1];
+         float * row  = rawData[y];
+         float * down = rawData[y < h-1 ? y+1 : y-1];
          
          for (int x = 0; x < w; x++)
          {
-             int p = raw_get_pixel32(x, y);
-             
-             if (x%2 != y%2) /* divide green channel by 2 to approximate the final WB better */
-                 p = (p - black) / 2 + black;
+             int xm = x > 0 ? x-1 : x+1;
+             int xp = x < w-1 ? x+1 : x-1;
+             float c = row[x];
+             float hv = (row[xm] + row[xp] + up[x] + down[x]) / 4;
+             float diag = (up[xm] + up[xp] + down[xm] + down[xp]) / 4;
+             float hor = (row[xm] + row[xp]) / 2;
+             float ver = (up[x] + down[x]) / 2;
              
-             rawData[yh][x] = p;
+             if (y%2 == 0 && x%2 == 0)
+             {
+                 red[y][x] = c; green[y][x] = hv; blue[y][x] = diag;
+             }
+             else if (y%2 == 1 && x%2 == 1)
+             {
+                 red[y][x] = diag; green[y][x] = hv; blue[y][x] = c;
+             }
+             else if (y%2 == 0)
+             {
+                 red[y][x] = hor; green[y][x] = c; blue[y][x] = ver;
+             }
+             else
+             {
+                 red[y][x] = ver; green[y][x] = c; blue[y][x] = hor;
+             }
          }
-         
-         squeezed[y] = yh;
-         
-         yh++;
      }
+ }
+ 
+ /* the AMaZE demosaic cr2hdr runs here is not part of mlv-lib: the squeezed
+  * exposures are demosaiced bilinearly into the red, green and blue planes */
+ static inline void squeezed_demosaic(float ** rawData, float ** red, float ** green, float ** blue, int w, int h)
+ {
+     demosaic_job job = { rawData, red, green, blue, w, h };
+     parallel_for(0, h, DISO_ROW_GRAIN, squeezed_demosaic_rows, &job);
+ }
+ 
+ typedef struct
+ {
+     struct raw_info raw_info;
+     uint32_t * raw_buffer_32;
+     int * is_bright;
+     uint32_t * dark;
+     uint32_t * bright;
+     int black;
+     int white_darkened;
+     int * squeezed;
+     float ** rawData;
+     float ** red;
+     float ** green;
+     float ** blue;
+     uint32_t * gray;
+     uint8_t * edge_direction;
+     double * fullres_curve;
+     int * raw2ev;
+     int * ev2raw;
+     int d0;
+     int bright_rows;        /* rows copied by amaze_copy_rows */
+     /* counted by amaze_edge_rows, atomic */
+     int semi_overexposed;
+     int not_overexposed;
+     int deep_shadow;
+     int not_shadow;
+ } amaze_job;
+ 
+ static void amaze_copy_rows(void * arg, int y1, int y2)
+ {
+     amaze_job * job = (amaze_job *)arg;
+     struct raw_info raw_info = job->raw_info;
+     uint32_t * raw_buffer_32 = job->raw_buffer_32;
+     int * is_bright = job->is_bright;
+     int w = raw_info.width;
+     int bright_rows = job->bright_rows;
+     int black = job->black;
+     int * squeezed = job->squeezed;
+     float ** rawData = job->rawData;
      
-     /* now the same for the bright exposure */
-     yh = -1;
-     for (int y = 0; y < h; y ++)
+     for (int y = y1; y < y2; y ++)
      {
-         if (!BRIGHT_ROW)
+         if (BRIGHT_ROW != bright_rows)
              continue;
          
-         if (yh < 0) /* make sure we start with the same parity (RGGB cell) */
-             yh = h/4*2 + y;
-         
          for (int x = 0; x < w; x++)
          {
              int p = raw_get_pixel32(x, y);
@@ -1016,18 +1307,21 @@
              if (x%2 != y%2) /* divide green channel by 2 to approximate the final WB better */
                  p = (p - black) / 2 + black;
              
-             rawData[yh][x] = p;
+             rawData[squeezed[y]][x] = p;
          }
-         
-         squeezed[y] = yh;
-         
-         yh++;
-         if (yh >= h) break; /* just in case */
      }
+ }
+ 
+ static void amaze_green_rows(void * arg, int y1, int y2)
+ {
+     amaze_job * job = (amaze_job *)arg;
+     int w = job->raw_info.width;
+     int black = job->black;
+     float ** red = job->red;
+     float ** green = job->green;
+     float ** blue = job->blue;
      
-     /* undo green channel scaling and clamp the other channels */
-     //#pragma omp parallel for collapse(2)
-     for (int y = 0; y < h; y ++)
+     for (int y = y1; y < y2; y ++)
      {
          for (int x = 0; x < w; x ++)
          {
@@ -1036,264 +1330,371 @@
              blue[y][x] = COERCE(blue[y][x], 0, 0xFFFFF);
          }
      }
- #ifndef STDOUT_SILENT
-     printf("Edge-directed interpolation...\n");
- #endif
-     //~ printf("Grayscale...\n");
-     /* convert to grayscale and de-squeeze for easier processing */
-     uint32_t * gray = malloc(w * h * sizeof(gray[0]));
-     //#pragma omp parallel for collapse(2)
-     for (int y = 0; y < h; y ++)
+ }
+ 
+ static void amaze_gray_rows(void * arg, int y1, int y2)
+ {
+     amaze_job * job = (amaze_job *)arg;
+     int w = job->raw_info.width;
+     int * squeezed = job->squeezed;
+     float ** red = job->red;
+     float ** green = job->green;
+     float ** blue = job->blue;
+     uint32_t * gray = job->gray;
+     
+     for (int y = y1; y < y2; y ++)
          for (int x = 0; x < w; x ++)
              gray[x + y*w] = green[squeezed[y]][x]/2 + red[squeezed[y]][x]/4 + blue[squeezed[y]][x]/4;
-     
-     
-     uint8_t* edge_direction = malloc(w * h * sizeof(edge_direction[0]));
-     int d0 = COUNT(edge_directions)/2;
-     //#pragma omp parallel for collapse(2)
-     for (int y = 0; y < h; y ++)
-         for (int x = 0; x < w; x ++)
-             edge_direction[x + y*w] = d0;
-     
-     double * fullres_curve = build_fullres_curve(black);
-     
-     //~ printf("Cross-correlation...\n");
+ }
+ 
+ static void amaze_edge_rows(void * arg, int y1, int y2)
+ {
+     amaze_job * job = (amaze_job *)arg;
+     struct raw_info raw_info = job->raw_info;
+     uint32_t * raw_buffer_32 = job->raw_buffer_32;
+     int * is_bright = job->is_bright;
+     int w = raw_info.width;
+     int white_darkened = job->white_darkened;
+     uint32_t * gray = job->gray;
+     uint8_t * edge_direction = job->edge_direction;
+     double * fullres_curve = job->fullres_curve;
+     int * raw2ev = job->raw2ev;
+     int d0 = job->d0;
      int semi_overexposed = 0;
      int not_overexposed = 0;
      int deep_shadow = 0;
      int not_shadow = 0;
      
-     /* for fast EV - raw conversion */
-     static int raw2ev[1<<20];   /* EV x EV_RESOLUTION */
-     static int ev2raw_0[24*EV_RESOLUTION];
-     static int previous_black = -1;
-     
-     /* handle sub-black values (negative EV) */
-     int* ev2raw = ev2raw_0 + 10*EV_RESOLUTION;
-     
-     LOCK(ev2raw_mutex)
+     for (int y = y1; y < y2; y ++)
      {
-         if(black != previous_black)
+         int s = (is_bright[y%4] == is_bright[(y+1)%4]) ? -1 : 1;    /* points to the closest row having different exposure */
+         for (int x = 5; x < w-5; x ++)
          {
-             build_ev2raw_lut(raw2ev, ev2raw_0, black, white);
-             previous_black = black;
-         }
-         //#pragma omp parallel for
-         for (int y = 5; y < h-5; y ++)
-         {
-             int s = (is_bright[y%4] == is_bright[(y+1)%4]) ? -1 : 1;    /* points to the closest row having different exposure */
-             //#pragma omp parallel for
-             for (int x = 5; x < w-5; x ++)
+             int e_best = INT_MAX;
+             int d_best = d0;
+             int dmin = 0;
+             int dmax = COUNT(edge_directions)-1;
+             int search_area = 5;
+             
+             /* only use high accuracy on the dark exposure where the bright ISO is overexposed */
+             if (!BRIGHT_ROW)
              {
-                 int e_best = INT_MAX;
-                 int d_best = d0;
-                 int dmin = 0;
-                 int dmax = COUNT(edge_directions)-1;
-                 int search_area = 5;
-                 
-                 /* only use high accuracy on the dark exposure where the bright ISO is overexposed */
-                 if (!BRIGHT_ROW)
-                 {
-                     /* interpolating bright exposure */
-                     if (fullres_curve[raw_get_pixel32(x, y)] > fullres_thr)
-                     {
-                         /* no high accuracy needed, just interpolate vertically */
-                         not_shadow++;
-                         dmin = d0;
-                         dmax = d0;
-                     }
-                     else
-                     {
-                         /* deep shadows, unlikely to use fullres, so we need a good interpolation */
-                         deep_shadow++;
-                     }
-                 }
-                 else if (raw_get_pixel32(x, y) < (unsigned int)white_darkened)
+                 /* interpolating bright exposure */
+                 if (fullres_curve[raw_get_pixel32(x, y)] > fullres_thr)
                  {
-                     /* interpolating dark exposure, but we also have good data from the bright one */
-                     not_overexposed++;
+                     /* no high accuracy needed, just interpolate vertically */
+                     not_shadow++;
                      dmin = d0;
                      dmax = d0;
                  }
                  else
                  {
-                     /* interpolating dark exposure, but the bright one is clipped */
-                     semi_overexposed++;
-                 }
-                 
-                 if (dmin == dmax)
-                 {
-                     d_best = dmin;
-                 }
-                 else
-                 {
-                     for (int d = dmin; d <= dmax; d++)
-                     {
-                         int e = 0;
-                         for (int j = -search_area; j <= search_area; j++)
-                         {
-                             int dx1 = edge_directions[d].ack.x + j;
-                             int dy1 = edge_directions[d].ack.y * s;
-                             int p1 = raw2ev[gray[x+dx1 + (y+dy1)*w]];
-                             int dx2 = edge_directions[d].a.x + j;
-                             int dy2 = edge_directions[d].a.y * s;
-                             int p2 = raw2ev[gray[x+dx2 + (y+dy2)*w]];
-                             int dx3 = edge_directions[d].b.x + j;
-                             int dy3 = edge_directions[d].b.y * s;
-                             int p3 = raw2ev[gray[x+dx3 + (y+dy3)*w]];
-                             int dx4 = edge_directions[d].bck.x + j;
-                             int dy4 = edge_directions[d].bck.y * s;
-                             int p4 = raw2ev[gray[x+dx4 + (y+dy4)*w]];
-                             e += ABS(p1-p2) + ABS(p2-p3) + ABS(p3-p4);
-                         }
-                         
-                         /* add a small penalty for diagonal directions */
-                         /* (the improvement should be significant in order to choose one of these) */
-                         e += ABS(d - d0) * EV_RESOLUTION/8;
-                         
-                         if (e < e_best)
-                         {
-                             e_best = e;
-                             d_best = d;
-                         }
-                     }
+                     /* deep shadows, unlikely to use fullres, so we need a good interpolation */
+                     deep_shadow++;
                  }
-                 
-                 edge_direction[x + y*w] = d_best;
              }
-         }
- #ifndef STDOUT_SILENT
-         printf("Semi-overexposed: %.02f%%\n", semi_overexposed * 100.0 / (semi_overexposed + not_overexposed));
-         printf("Deep shadows    : %.02f%%\n", deep_shadow * 100.0 / (deep_shadow + not_shadow));
- #endif
-         //~ printf("Actual interpolation...\n");
-         
-         //#pragma omp parallel for
-         for (int y = 2; y < h-2; y ++)
-         {
-             uint32_t* native = BRIGHT_ROW ? bright : dark;
-             uint32_t* interp = BRIGHT_ROW ? dark : bright;
-             int is_rg = (y % 2 == 0); /* RG or GB? */
-             int s = (is_bright[y%4] == is_bright[(y+1)%4]) ? -1 : 1;    /* points to the closest row having different exposure */
-             
-             //~ printf("Interpolating %s line %d from [near] %d (squeezed %d) and [far] %d (squeezed %d)\n", BRIGHT_ROW ? "BRIGHT" : "DARK", y, y+s, yh_near, y-2*s, yh_far);
+             else if (raw_get_pixel32(x, y) < (unsigned int)white_darkened)
+             {
+                 /* interpolating dark exposure, but we also have good data from the bright one */
+                 not_overexposed++;
+                 dmin = d0;
+                 dmax = d0;
+             }
+             else
+             {
+                 /* interpolating dark exposure, but the bright one is clipped */
+                 semi_overexposed++;
+             }
              
-             //#pragma omp parallel for
-             for (int x = 2; x < w-2; x += 2)
+             if (dmin == dmax)
+             {
+                 d_best = dmin;
+             }
+             else
              {
-                 for (int k = 0; k < 2; k++, x++)
+                 for (int d = dmin; d <= dmax; d++)
                  {
-                     float** plane = is_rg ? (x%2 == 0 ? red   : green)
-                     : (x%2 == 0 ? green : blue );
-                     
-                     int dir = edge_direction[x + y*w];
+                     int e = 0;
+                     for (int j = -search_area; j <= search_area; j++)
+                     {
+                         int dx1 = edge_directions[d].ack.x + j;
+                         int dy1 = edge_directions[d].ack.y * s;
+                         int p1 = raw2ev[gray[x+dx1 + (y+dy1)*w]];
+                         int dx2 = edge_directions[d].a.x + j;
+                         int dy2 = edge_directions[d].a.y * s;
+                         int p2 = raw2ev[gray[x+dx2 + (y+dy2)*w]];
+                         int dx3 = edge_directions[d].b.x + j;
+                         int dy3 = edge_directions[d].b.y * s;
+                         int p3 = raw2ev[gray[x+dx3 + (y+dy3)*w]];
+                         int dx4 = edge_directions[d].bck.x + j;
+                         int dy4 = edge_directions[d].bck.y * s;
+                         int p4 = raw2ev[gray[x+dx4 + (y+dy4)*w]];
+                         e += ABS(p1-p2) + ABS(p2-p3) + ABS(p3-p4);
+                     }
                      
-                     /* vary the interpolation direction and average the result (reduces aliasing) */
-                     int pi0 = edge_interp(plane, squeezed, raw2ev, dir, x, y, s);
-                     int pip = edge_interp(plane, squeezed, raw2ev, MIN(dir+1, COUNT(edge_directions)-1), x, y, s);
-                     int pim = edge_interp(plane, squeezed, raw2ev, MAX(dir-1,0), x, y, s);
+                     /* add a small penalty for diagonal directions */
+                     /* (the improvement should be significant in order to choose one of these) */
+                     e += ABS(d - d0) * EV_RESOLUTION/8;
                      
-                     interp[x   + y * w] = ev2raw[(2*pi0+pip+pim)/4];
-                     native[x   + y * w] = raw_get_pixel32(x, y);
+                     if (e < e_best)
+                     {
+                         e_best = e;
+                         d_best = d;
+                     }
                  }
-                 x -= 2;
              }
+             
+             edge_direction[x + y*w] = d_best;
          }
      }
-     UNLOCK(ev2raw_mutex)
      
-     //#pragma omp parallel for
-     for (int i = 0; i < h; i++)
+     __atomic_fetch_add(&job->semi_overexposed, semi_overexposed, __ATOMIC_RELAXED);
+     __atomic_fetch_add(&job->not_overexposed, not_overexposed, __ATOMIC_RELAXED);
+     __atomic_fetch_add(&job->deep_shadow, deep_shadow, __ATOMIC_RELAXED);
+     __atomic_fetch_add(&job->not_shadow, not_shadow, __ATOMIC_RELAXED);
+ }
+ 
+ static void amaze_interpolate_rows(void * arg, int y1, int y2)
+ {
+     amaze_job * job = (amaze_job *)arg;
+     struct raw_info raw_info = job->raw_info;
+     uint32_t * raw_buffer_32 = job->raw_buffer_32;
+     int * is_bright = job->is_bright;
+     int w = raw_info.width;
+     uint32_t * dark = job->dark;
+     uint32_t * bright = job->bright;
+     int * squeezed = job->squeezed;
+     float ** red = job->red;
+     float ** green = job->green;
+     float ** blue = job->blue;
+     uint8_t * edge_direction = job->edge_direction;
+     int * raw2ev = job->raw2ev;
+     int * ev2raw = job->ev2raw;
+     
+     for (int y = y1; y < y2; y ++)
      {
-         free(rawData[i]);
-         free(red[i]);
-         free(green[i]);
-         free(blue[i]);
+         uint32_t* native = BRIGHT_ROW ? bright : dark;
+         uint32_t* interp = BRIGHT_ROW ? dark : bright;
+         int is_rg = (y % 2 == 0); /* RG or GB? */
+         int s = (is_bright[y%4] == is_bright[(y+1)%4]) ? -1 : 1;    /* points to the closest row having different exposure */
+         
+         //~ printf("Interpolating %s line %d from [near] %d (squeezed %d) and [far] %d (squeezed %d)\n", BRIGHT_ROW ? "BRIGHT" : "DARK", y, y+s, yh_near, y-2*s, yh_far);
+         
+         for (int x = 2; x < w-2; x += 2)
+         {
+             for (int k = 0; k < 2; k++, x++)
+             {
+                 float** plane = is_rg ? (x%2 == 0 ? red   : green)
+                 : (x%2 == 0 ? green : blue );
+                 
+                 int dir = edge_direction[x + y*w];
+                 
+                 /* vary the interpolation direction and average the result (reduces aliasing) */
+                 int pi0 = edge_interp(plane, squeezed, raw2ev, dir, x, y, s);
+                 int pip = edge_interp(plane, squeezed, raw2ev, MIN(dir+1, COUNT(edge_directions)-1), x, y, s);
+                 int pim = edge_interp(plane, squeezed, raw2ev, MAX(dir-1,0), x, y, s);
+                 
+                 interp[x   + y * w] = ev2raw[(2*pi0+pip+pim)/4];
+                 native[x   + y * w] = raw_get_pixel32(x, y);
+             }
+             x -= 2;
+         }
      }
-     
-     free(squeezed); squeezed = 0;
-     free(rawData); rawData = 0;
-     free(red); red = 0;
-     free(green); green = 0;
-     free(blue); blue = 0;
-     free(gray); gray = 0;
-     free(edge_direction);
  }
  
- static inline void mean23_interpolate(struct raw_info raw_info, uint32_t * raw_buffer_32, uint32_t* dark, uint32_t* bright, int black, int white, int white_darkened, int * is_bright)
+ static inline void amaze_interpolate(diso_workspace_t * ws, struct raw_info raw_info, uint32_t * raw_buffer_32, uint32_t* dark, uint32_t* bright, int black, int white, int white_darkened, int * is_bright)
  {
      int w = raw_info.width;
      int h = raw_info.height;
+     
+     int* squeezed = ws_zeroed(ws, WS_SQUEEZED, h * sizeof(int));
+     
+     /* one allocation for the four planes, with the row pointers the interpolation expects */
+     int wx = w + 16;
+     float * planes = ws_zeroed(ws, WS_PLANES, 4 * (size_t)h * wx * sizeof(float));
+     float ** rows = ws_buffer(ws, WS_PLANE_ROWS, 4 * h * sizeof(rows[0]));
+     
+     float** rawData = rows;
+     float** red     = rows + h;
+     float** green   = rows + 2*h;
+     float** blue    = rows + 3*h;
+     
+     for (int i = 0; i < 4*h; i++)
+         rows[i] = planes + (size_t)i * wx;
+     
+     /* squeeze the dark image by deleting fields from the bright exposure */
+     int yh = -1;
+     for (int y = 0; y < h; y ++)
+     {
+         if (BRIGHT_ROW)
+             continue;
+         
+         if (yh < 0) /* make sure we start at the same parity (RGGB cell) */
+             yh = y;
+         
+         squeezed[y] = yh;
+         
+         yh++;
+     }
+     
+     /* now the same for the bright exposure */
+     int bright_end = h;
+     yh = -1;
+     for (int y = 0; y < h; y ++)
+     {
+         if (!BRIGHT_ROW)
+             continue;
+         
+         if (yh < 0) /* make sure we start with the same parity (RGGB cell) */
+             yh = h/4*2 + y;
+         
+         squeezed[y] = yh;
+         
+         yh++;
+         if (yh >= h) { bright_end = y + 1; break; } /* just in case */
+     }
+     
+     amaze_job job = { .raw_info = raw_info, .raw_buffer_32 = raw_buffer_32, .is_bright = is_bright, .dark = dark, .bright = bright,
+                       .black = black, .white_darkened = white_darkened, .squeezed = squeezed,
+                       .rawData = rawData, .red = red, .green = green, .blue = blue };
+     
+     /* copy the rows mapped above, the bright ones last as they may
+      * overwrite the last dark ones */
+     for (int bright_rows = 0; bright_rows < 2; bright_rows++)
+     {
+         job.bright_rows = bright_rows;
+         parallel_for(0, bright_rows ? bright_end : h, DISO_ROW_GRAIN, amaze_copy_rows, &job);
+     }
+     
+     squeezed_demosaic(rawData, red, green, blue, w, h);
+     
+     /* undo green channel scaling and clamp the other channels */
+     parallel_for(0, h, DISO_ROW_GRAIN, amaze_green_rows, &job);
  #ifndef STDOUT_SILENT
-     printf("Interpolation   : mean23\n");
+     printf("Edge-directed interpolation...\n");
  #endif
+     //~ printf("Grayscale...\n");
+     /* convert to grayscale and de-squeeze for easier processing */
+     uint32_t * gray = ws_buffer(ws, WS_GRAY, w * h * sizeof(gray[0]));
+     job.gray = gray;
+     parallel_for(0, h, DISO_ROW_GRAIN, amaze_gray_rows, &job);
+     
+     
+     uint8_t* edge_direction = ws_buffer(ws, WS_EDGE_DIRECTION, w * h * sizeof(edge_direction[0]));
+     int d0 = COUNT(edge_directions)/2;
+     memset(edge_direction, d0, w * h * sizeof(edge_direction[0]));
+     
+     double * fullres_curve = build_fullres_curve(ws, black);
+     
+     //~ printf("Cross-correlation...\n");
      /* for fast EV - raw conversion */
-     static int raw2ev[1<<20];   /* EV x EV_RESOLUTION */
-     static int ev2raw_0[24*EV_RESOLUTION];
-     static int previous_black = -1;
+     int * raw2ev;
+     int * ev2raw;
+     get_ev_luts(ws, black, white, &raw2ev, &ev2raw);
+     
+     job.edge_direction = edge_direction;
+     job.fullres_curve = fullres_curve;
+     job.raw2ev = raw2ev;
+     job.ev2raw = ev2raw;
+     job.d0 = d0;
+     parallel_for(5, h-5, DISO_ROW_GRAIN, amaze_edge_rows, &job);
+ #ifndef STDOUT_SILENT
+     printf("Semi-overexposed: %.02f%%\n", job.semi_overexposed * 100.0 / (job.semi_overexposed + job.not_overexposed));
+     printf("Deep shadows    : %.02f%%\n", job.deep_shadow * 100.0 / (job.deep_shadow + job.not_shadow));
+ #endif
+     //~ printf("Actual interpolation...\n");
      
-     /* handle sub-black values (negative EV) */
-     int* ev2raw = ev2raw_0 + 10*EV_RESOLUTION;
+     parallel_for(2, h-2, DISO_ROW_GRAIN, amaze_interpolate_rows, &job);
+ }
+ 
+ typedef struct
+ {
+     struct raw_info raw_info;
+     uint32_t * raw_buffer_32;
+     int * is_bright;
+     uint32_t * dark;
+     uint32_t * bright;
+     int white_darkened;
+     int * raw2ev;
+     int * ev2raw;
+ } mean23_job;
+ 
+ static void mean23_interpolate_rows(void * arg, int y1, int y2)
+ {
+     mean23_job * job = (mean23_job *)arg;
+     struct raw_info raw_info = job->raw_info;
+     uint32_t * raw_buffer_32 = job->raw_buffer_32;
+     int * is_bright = job->is_bright;
+     int w = raw_info.width;
+     uint32_t * dark = job->dark;
+     uint32_t * bright = job->bright;
+     int white_darkened = job->white_darkened;
+     int * raw2ev = job->raw2ev;
+     int * ev2raw = job->ev2raw;
      
-     LOCK(ev2raw_mutex)
+     for (int y = y1; y < y2; y ++)
      {
-         if(black != previous_black)
-         {
-             build_ev2raw_lut(raw2ev, ev2raw_0, black, white);
-             previous_black = black;
-         }
-         //#pragma omp parallel for
-         for (int y = 2; y < h-2; y ++)
+         uint32_t* native = BRIGHT_ROW ? bright : dark;
+         uint32_t* interp = BRIGHT_ROW ? dark : bright;
+         int is_rg = (y % 2 == 0); /* RG or GB? */
+         int white = !BRIGHT_ROW ? white_darkened : raw_info.white_level;
+         
+         for (int x = 2; x < w-3; x += 2)
          {
-             uint32_t* native = BRIGHT_ROW ? bright : dark;
-             uint32_t* interp = BRIGHT_ROW ? dark : bright;
-             int is_rg = (y % 2 == 0); /* RG or GB? */
-             int white = !BRIGHT_ROW ? white_darkened : raw_info.white_level;
              
-             //#pragma omp parallel for
-             for (int x = 2; x < w-3; x += 2)
+             /* red/blue: interpolate from (x,y+2) and (x,y-2) */
+             /* green: interpolate from (x+1,y+1),(x-1,y+1),(x,y-2) or (x+1,y-1),(x-1,y-1),(x,y+2), whichever has the correct brightness */
+             
+             int s = (is_bright[y%4] == is_bright[(y+1)%4]) ? -1 : 1;
+             
+             if (is_rg)
              {
+                 int ra = raw_get_pixel32(x, y-2);
+                 int rb = raw_get_pixel32(x, y+2);
+                 int ri = mean2(raw2ev[ra], raw2ev[rb], raw2ev[white], 0);
                  
-                 /* red/blue: interpolate from (x,y+2) and (x,y-2) */
-                 /* green: interpolate from (x+1,y+1),(x-1,y+1),(x,y-2) or (x+1,y-1),(x-1,y-1),(x,y+2), whichever has the correct brightness */
+                 int ga = raw_get_pixel32(x+1+1, y+s);
+                 int gb = raw_get_pixel32(x+1-1, y+s);
+                 int gc = raw_get_pixel32(x+1, y-2*s);
+                 int gi = mean3(raw2ev[ga], raw2ev[gb], raw2ev[gc], raw2ev[white], 0);
                  
-                 int s = (is_bright[y%4] == is_bright[(y+1)%4]) ? -1 : 1;
+                 interp[x   + y * w] = ev2raw[ri];
+                 interp[x+1 + y * w] = ev2raw[gi];
+             }
+             else
+             {
+                 int ba = raw_get_pixel32(x+1  , y-2);
+                 int bb = raw_get_pixel32(x+1  , y+2);
+                 int bi = mean2(raw2ev[ba], raw2ev[bb], raw2ev[white], 0);
                  
-                 if (is_rg)
-                 {
-                     int ra = raw_get_pixel32(x, y-2);
-                     int rb = raw_get_pixel32(x, y+2);
-                     int ri = mean2(raw2ev[ra], raw2ev[rb], raw2ev[white], 0);
-                     
-                     int ga = raw_get_pixel32(x+1+1, y+s);
-                     int gb = raw_get_pixel32(x+1-1, y+s);
-                     int gc = raw_get_pixel32(x+1, y-2*s);
-                     int gi = mean3(raw2ev[ga], raw2ev[gb], raw2ev[gc], raw2ev[white], 0);
-                     
-                     interp[x   + y * w] = ev2raw[ri];
-                     interp[x+1 + y * w] = ev2raw[gi];
-                 }
-                 else
-                 {
-                     int ba = raw_get_pixel32(x+1  , y-2);
-                     int bb = raw_get_pixel32(x+1  , y+2);
-                     int bi = mean2(raw2ev[ba], raw2ev[bb], raw2ev[white], 0);
-                     
-                     int ga = raw_get_pixel32(x+1, y+s);
-                     int gb = raw_get_pixel32(x-1, y+s);
-                     int gc = raw_get_pixel32(x, y-2*s);
-                     int gi = mean3(raw2ev[ga], raw2ev[gb], raw2ev[gc], raw2ev[white], 0);
-                     
-                     interp[x   + y * w] = ev2raw[gi];
-                     interp[x+1 + y * w] = ev2raw[bi];
-                 }
+                 int ga = raw_get_pixel32(x+1, y+s);
+                 int gb = raw_get_pixel32(x-1, y+s);
+                 int gc = raw_get_pixel32(x, y-2*s);
+                 int gi = mean3(raw2ev[ga], raw2ev[gb], raw2ev[gc], raw2ev[white], 0);
                  
-                 native[x   + y * w] = raw_get_pixel32(x, y);
-                 native[x+1 + y * w] = raw_get_pixel32(x+1, y);
+                 interp[x   + y * w] = ev2raw[gi];
+                 interp[x+1 + y * w] = ev2raw[bi];
              }
+             
+             native[x   + y * w] = raw_get_pixel32(x, y);
+             native[x+1 + y * w] = raw_get_pixel32(x+1, y);
          }
      }
-     UNLOCK(ev2raw_mutex)
+ }
+ 
+ static inline void mean23_interpolate(diso_workspace_t * ws, struct raw_info raw_info, uint32_t * raw_buffer_32, uint32_t* dark, uint32_t* bright, int black, int white, int white_darkened, int * is_bright)
+ {
+     int h = raw_info.height;
+ #ifndef STDOUT_SILENT
+     printf("Interpolation   : mean23\n");
+ #endif
+     /* for fast EV - raw conversion */
+     int * raw2ev;
+     int * ev2raw;
+     get_ev_luts(ws, black, white, &raw2ev, &ev2raw);
+     
+     mean23_job job = { raw_info, raw_buffer_32, is_bright, dark, bright, white_darkened, raw2ev, ev2raw };
+     parallel_for(2, h-2, DISO_ROW_GRAIN, mean23_interpolate_rows, &job);
  }
  
  static inline void border_interpolate(struct raw_info raw_info, uint32_t * raw_buffer_32, uint32_t* dark, uint32_t* bright, int * is_bright)
@@ -1345,18 +1746,27 @@
      }
  }
  
- static inline void fullres_reconstruction(struct raw_info raw_info, uint32_t * fullres, uint32_t* dark, uint32_t* bright, uint32_t white_darkened, int * is_bright)
+ typedef struct
  {
-     int w = raw_info.width;
-     int h = raw_info.height;
+     uint32_t * fullres;
+     uint32_t * dark;
+     uint32_t * bright;
+     uint32_t white_darkened;
+     int * is_bright;
+     int w;
+ } fullres_job;
+ 
+ static void fullres_reconstruction_rows(void * arg, int y1, int y2)
+ {
+     fullres_job * job = (fullres_job *)arg;
+     uint32_t * fullres = job->fullres;
+     uint32_t * dark = job->dark;
+     uint32_t * bright = job->bright;
+     uint32_t white_darkened = job->white_darkened;
+     int * is_bright = job->is_bright;
+     int w = job->w;
      
-     /* reconstruct a full-resolution image (discard interpolated fields whenever possible) */
-     /* this has full detail and lowest possible aliasing, but it has high shadow noise and color artifacts when high-iso starts clipping */
- #ifndef STDOUT_SILENT
-     printf("Full-res reconstruction...\n");
- #endif
-     //#pragma omp parallel for collapse(2)
-     for (int y = 0; y < h; y ++)
+     for (int y = y1; y < y2; y ++)
      {
          for (int x = 0; x < w; x ++)
          {
@@ -1374,24 +1784,46 @@
      }
  }
  
- static inline void build_alias_map(struct raw_info raw_info, uint16_t* alias_map, uint32_t* fullres_smooth, uint32_t* halfres_smooth, uint32_t* bright, int dark_noise, int black, int * raw2ev)
+ static inline void fullres_reconstruction(struct raw_info raw_info, uint32_t * fullres, uint32_t* dark, uint32_t* bright, uint32_t white_darkened, int * is_bright)
  {
-     if(!alias_map) return;
-     
      int w = raw_info.width;
      int h = raw_info.height;
      
-     double * fullres_curve = build_fullres_curve(black);
+     /* reconstruct a full-resolution image (discard interpolated fields whenever possible) */
+     /* this has full detail and lowest possible aliasing, but it has high shadow noise and color artifacts when high-iso starts clipping */
  #ifndef STDOUT_SILENT
-     printf("Building alias map...\n");
+     printf("Full-res reconstruction...\n");
  #endif
-     uint16_t* alias_aux = malloc(w * h * sizeof(uint16_t));
-     
-     /* build the aliasing maps (where it's likely to get aliasing) */
-     /* do this by comparing fullres and halfres images */
-     /* if the difference is small, we'll prefer halfres for less noise, otherwise fullres for less aliasing */
-     //#pragma omp parallel for collapse(2)
-     for (int y = 0; y < h; y ++)
+     fullres_job job = { fullres, dark, bright, white_darkened, is_bright, w };
+     parallel_for(0, h, DISO_ROW_GRAIN, fullres_reconstruction_rows, &job);
+ }
+ 
+ typedef struct
+ {
+     uint16_t * alias_map;
+     uint16_t * alias_aux;
+     uint32_t * fullres_smooth;
+     uint32_t * halfres_smooth;
+     uint32_t * bright;
+     double * fullres_curve;
+     int * raw2ev;
+     int dark_noise;
+     int w;
+ } alias_map_job;
+ 
+ static void alias_map_rows(void * arg, int y1, int y2)
+ {
+     alias_map_job * job = (alias_map_job *)arg;
+     uint16_t * alias_map = job->alias_map;
+     uint32_t * fullres_smooth = job->fullres_smooth;
+     uint32_t * halfres_smooth = job->halfres_smooth;
+     uint32_t * bright = job->bright;
+     double * fullres_curve = job->fullres_curve;
+     int * raw2ev = job->raw2ev;
+     int dark_noise = job->dark_noise;
+     int w = job->w;
+     
+     for (int y = y1; y < y2; y ++)
      {
          for (int x = 0; x < w; x ++)
          {
@@ -1409,13 +1841,18 @@
              alias_map[x + y*w] = MIN(MIN(e_lin/2, e_log/16), 65530);
          }
      }
+ }
+ 
+ static void alias_map_filter_rows(void * arg, int y1, int y2)
+ {
+     alias_map_job * job = (alias_map_job *)arg;
+     uint16_t * alias_map = job->alias_map;
+     uint16_t * alias_aux = job->alias_aux;
+     uint32_t * bright = job->bright;
+     double * fullres_curve = job->fullres_curve;
+     int w = job->w;
      
-     memcpy(alias_aux, alias_map, w * h * sizeof(uint16_t));
- #ifndef STDOUT_SILENT
-     printf("Filtering alias map...\n");
- #endif
-     //#pragma omp parallel for collapse(2)
-     for (int y = 6; y < h-6; y ++)
+     for (int y = y1; y < y2; y ++)
      {
          for (int x = 6; x < w-6; x ++)
          {
@@ -1436,12 +1873,18 @@
              alias_aux[x + y * w] = -kth_smallest_int(neighbours, COUNT(neighbours), 5);
          }
      }
- #ifndef STDOUT_SILENT
-     printf("Smoothing alias map...\n");
- #endif
-     /* gaussian blur */
-     //#pragma omp parallel for collapse(2)
-     for (int y = 6; y < h-6; y ++)
+ }
+ 
+ static void alias_map_blur_rows(void * arg, int y1, int y2)
+ {
+     alias_map_job * job = (alias_map_job *)arg;
+     uint16_t * alias_map = job->alias_map;
+     uint16_t * alias_aux = job->alias_aux;
+     uint32_t * bright = job->bright;
+     double * fullres_curve = job->fullres_curve;
+     int w = job->w;
+     
+     for (int y = y1; y < y2; y ++)
      {
          for (int x = 6; x < w-6; x ++)
          {
@@ -1462,10 +1905,15 @@
              alias_map[x + y * w] = c;
          }
      }
+ }
+ 
+ static void alias_map_gray_rows(void * arg, int k1, int k2)
+ {
+     alias_map_job * job = (alias_map_job *)arg;
+     uint16_t * alias_map = job->alias_map;
+     int w = job->w;
      
-     /* make it grayscale */
-     //#pragma omp parallel for collapse(2)
-     for (int y = 2; y < h-2; y += 2)
+     for (int y = 2 + 2*k1; y < 2 + 2*k2; y += 2)
      {
          for (int x = 2; x < w-2; x += 2)
          {
@@ -1483,8 +1931,40 @@
              alias_map[x+1 + (y+1) * w] = C;
          }
      }
+ }
+ 
+ static inline void build_alias_map(diso_workspace_t * ws, struct raw_info raw_info, uint16_t* alias_map, uint32_t* fullres_smooth, uint32_t* halfres_smooth, uint32_t* bright, int dark_noise, int black, int * raw2ev)
+ {
+     if(!alias_map) return;
+     
+     int w = raw_info.width;
+     int h = raw_info.height;
+     
+     double * fullres_curve = build_fullres_curve(ws, black);
+ #ifndef STDOUT_SILENT
+     printf("Building alias map...\n");
+ #endif
+     uint16_t* alias_aux = ws_buffer(ws, WS_ALIAS_AUX, w * h * sizeof(uint16_t));
+     
+     /* build the aliasing maps (where it's likely to get aliasing) */
+     /* do this by comparing fullres and halfres images */
+     /* if the difference is small, we'll prefer halfres for less noise, otherwise fullres for less aliasing */
+     alias_map_job job = { alias_map, alias_aux, fullres_smooth, halfres_smooth, bright, fullres_curve, raw2ev, dark_noise, w };
+     parallel_for(0, h, DISO_ROW_GRAIN, alias_map_rows, &job);
      
-     free(alias_aux);
+     memcpy(alias_aux, alias_map, w * h * sizeof(uint16_t));
+ #ifndef STDOUT_SILENT
+     printf("Filtering alias map...\n");
+ #endif
+     parallel_for(6, h-6, DISO_ROW_GRAIN, alias_map_filter_rows, &job);
+ #ifndef STDOUT_SILENT
+     printf("Smoothing alias map...\n");
+ #endif
+     /* gaussian blur */
+     parallel_for(6, h-6, DISO_ROW_GRAIN, alias_map_blur_rows, &job);
+     
+     /* make it grayscale */
+     parallel_for(0, (h-4 + 1) / 2, DISO_ROW_GRAIN, alias_map_gray_rows, &job);
  }
  
  #define CHROMA_SMOOTH_TYPE uint32_t
@@ -1501,6 +1981,26 @@
  #include "chroma_smooth.inline"
  #undef CHROMA_SMOOTH_5X5
  
+ typedef struct
+ {
+     void (*smooth)(int w, int h, int y1, int y2, uint32_t * inp, uint32_t * out, int * raw2ev, int * ev2raw, int black, int white);
+     uint32_t * input;
+     uint32_t * output;
+     int * raw2ev;
+     int * ev2raw;
+     int w;
+     int h;
+     int black;
+     int white;
+ } hdr_chroma_smooth_job;
+ 
+ /* the filter works on RG/GB cells, the ranges are counted in row pairs */
+ static void hdr_chroma_smooth_rows(void * arg, int k1, int k2)
+ {
+     hdr_chroma_smooth_job * job = (hdr_chroma_smooth_job *)arg;
+     job->smooth(job->w, job->h, 2*k1, MIN(2*k2, job->h), job->input, job->output, job->raw2ev, job->ev2raw, job->black, job->white);
+ }
+ 
  static inline void hdr_chroma_smooth(struct raw_info raw_info, uint32_t * input, uint32_t * output, int method, int * raw2ev, int * ev2raw)
  {
      int w = raw_info.width;
@@ -1508,26 +2008,172 @@
      int black = raw_info.black_level;
      int white = raw_info.white_level;
      
+     hdr_chroma_smooth_job job = { NULL, input, output, raw2ev, ev2raw, w, h, black, white };
      switch (method) {
          case 2:
-             chroma_smooth_2x2(w, h, input, output, raw2ev, ev2raw, black, white);
+             job.smooth = chroma_smooth_2x2;
              break;
          case 3:
-             chroma_smooth_3x3(w, h, input, output, raw2ev, ev2raw, black, white);
+             job.smooth = chroma_smooth_3x3;
              break;
          case 5:
-             chroma_smooth_5x5(w, h, input, output, raw2ev, ev2raw, black, white);
+             job.smooth = chroma_smooth_5x5;
              break;
              
          default:
  #ifndef STDOUT_SILENT
              err_printf("Unsupported chroma smooth method\n");
  #endif
-             break;
+             return;
      }
+     parallel_for(0, (h + 1) / 2, DISO_ROW_GRAIN / 2, hdr_chroma_smooth_rows, &job);
  }
  
- static inline int mix_images(struct raw_info raw_info, uint32_t* fullres, uint32_t* fullres_smooth, uint32_t* halfres, uint32_t* halfres_smooth, uint16_t* alias_map, uint32_t* dark, uint32_t* bright, uint16_t * overexposed, int dark_noise, uint32_t white_darkened, double corr_ev, double lowiso_dr, uint32_t black, uint32_t white, int chroma_smooth_method)
+ typedef struct
+ {
+     double * curve;
+     int black;
+     double corr_ev;
+     double overlap;
+     double max_ev;
+ } mix_curve_job;
+ 
+ static void mix_curve_block(void * arg, int begin, int end)
+ {
+     mix_curve_job * job = (mix_curve_job *)arg;
+     double * mix_curve = job->curve;
+     int black = job->black;
+     double corr_ev = job->corr_ev;
+     double overlap = job->overlap;
+     double max_ev = job->max_ev;
+     
+     for (int i = begin; i < end; i++)
+     {
+         double ev = log2(MAX(i/64.0 - black/64.0, 1)) + corr_ev;
+         double c = -cos(MAX(MIN(ev-(max_ev-overlap),overlap),0)*M_PI/overlap);
+         double k = (c+1) / 2;
+         mix_curve[i] = k;
+     }
+ }
+ 
+ static inline double * build_mix_curve(diso_workspace_t * ws, int black, int white, double corr_ev, double overlap)
+ {
+     if (!ws->mix_curve)
+         ws->mix_curve = malloc((1<<20) * sizeof(double));
+     
+     double * mix_curve = ws->mix_curve;
+     if (ws->mix_black == black && ws->mix_white == white && ws->mix_corr_ev == corr_ev && ws->mix_overlap == overlap)
+         return mix_curve;
+     
+     ws->mix_black = black;
+     ws->mix_white = white;
+     ws->mix_corr_ev = corr_ev;
+     ws->mix_overlap = overlap;
+     
+     double max_ev = log2(white/64 - black/64);
+     
+     mix_curve_job job = { mix_curve, black, corr_ev, overlap, max_ev };
+     parallel_for(0, 1<<20, DISO_LUT_GRAIN, mix_curve_block, &job);
+     
+     return mix_curve;
+ }
+ 
+ typedef struct
+ {
+     uint32_t * halfres;
+     uint32_t * dark;
+     uint32_t * bright;
+     uint16_t * overexposed;
+     uint16_t * over_aux;
+     double * mix_curve;
+     int * raw2ev;
+     int * ev2raw;
+     uint32_t white_darkened;
+     uint32_t white;
+     int w;
+ } mix_job;
+ 
+ static void mix_halfres_rows(void * arg, int y1, int y2)
+ {
+     mix_job * job = (mix_job *)arg;
+     uint32_t * halfres = job->halfres;
+     uint32_t * dark = job->dark;
+     uint32_t * bright = job->bright;
+     double * mix_curve = job->mix_curve;
+     int * raw2ev = job->raw2ev;
+     int * ev2raw = job->ev2raw;
+     int w = job->w;
+     
+     for (int y = y1; y < y2; y ++)
+     {
+         for (int x = 0; x < w; x ++)
+         {
+             /* bright and dark source pixels  */
+             /* they may be real or interpolated */
+             /* they both have the same brightness (they were adjusted before this loop), so we are ready to mix them */
+             int b = bright[x + y*w];
+             int d = dark[x + y*w];
+             
+             /* go from linear to EV space */
+             int bev = raw2ev[b];
+             int dev = raw2ev[d];
+             
+             /* blending factor */
+             double k = COERCE(mix_curve[b & 0xFFFFF], 0, 1);
+             
+             /* mix bright and dark exposures */
+             int mixed = bev * (1-k) + dev * k;
+             halfres[x + y*w] = ev2raw[mixed];
+         }
+     }
+ }
+ 
+ static void mix_overexposed_rows(void * arg, int y1, int y2)
+ {
+     mix_job * job = (mix_job *)arg;
+     uint32_t * dark = job->dark;
+     uint32_t * bright = job->bright;
+     uint16_t * overexposed = job->overexposed;
+     uint32_t white_darkened = job->white_darkened;
+     uint32_t white = job->white;
+     int w = job->w;
+     
+     for (int y = y1; y < y2; y ++)
+     {
+         for (int x = 0; x < w; x ++)
+         {
+             overexposed[x + y * w] = bright[x + y * w] >= white_darkened || dark[x + y * w] >= white ? 100 : 0;
+         }
+     }
+ }
+ 
+ static void mix_overexposed_blur_rows(void * arg, int y1, int y2)
+ {
+     mix_job * job = (mix_job *)arg;
+     uint16_t * overexposed = job->overexposed;
+     uint16_t * over_aux = job->over_aux;
+     int w = job->w;
+     
+     for (int y = y1; y < y2; y ++)
+     {
+         for (int x = 3; x < w-3; x ++)
+         {
+             overexposed[x + y * w] =
+             (over_aux[x+0 + (y+0) * w])+
+             (over_aux[x+0 + (y-1) * w] + over_aux[x-1 + (y+0) * w] + over_aux[x+1 + (y+0) * w] + over_aux[x+0 + (y+1) * w]) * 820 / 1024 +
+             (over_aux[x-1 + (y-1) * w] + over_aux[x+1 + (y-1) * w] + over_aux[x-1 + (y+1) * w] + over_aux[x+1 + (y+1) * w]) * 657 / 1024 +
+             //~ (over_aux[x+0 + (y-2) * w] + over_aux[x-2 + (y+0) * w] + over_aux[x+2 + (y+0) * w] + over_aux[x+0 + (y+2) * w]) * 421 / 1024 +
+             //~ (over_aux[x-1 + (y-2) * w] + over_aux[x+1 + (y-2) * w] + over_aux[x-2 + (y-1) * w] + over_aux[x+2 + (y-1) * w] + over_aux[x-2 + (y+1) * w] + over_aux[x+2 + (y+1) * w] + over_aux[x-1 + (y+2) * w] + over_aux[x+1 + (y+2) * w]) * 337 / 1024 +
+             //~ (over_aux[x-2 + (y-2) * w] + over_aux[x+2 + (y-2) * w] + over_aux[x-2 + (y+2) * w] + over_aux[x+2 + (y+2) * w]) * 173 / 1024 +
+             //~ (over_aux[x+0 + (y-3) * w] + over_aux[x-3 + (y+0) * w] + over_aux[x+3 + (y+0) * w] + over_aux[x+0 + (y+3) * w]) * 139 / 1024 +
+             //~ (over_aux[x-1 + (y-3) * w] + over_aux[x+1 + (y-3) * w] + over_aux[x-3 + (y-1) * w] + over_aux[x+3 + (y-1) * w] + over_aux[x-3 + (y+1) * w] + over_aux[x+3 + (y+1) * w] + over_aux[x-1 + (y+3) * w] + over_aux[x+1 + (y+3) * w]) * 111 / 1024 +
+             //~ (over_aux[x-2 + (y-3) * w] + over_aux[x+2 + (y-3) * w] + over_aux[x-3 + (y-2) * w] + over_aux[x+3 + (y-2) * w] + over_aux[x-3 + (y+2) * w] + over_aux[x+3 + (y+2) * w] + over_aux[x-2 + (y+3) * w] + over_aux[x+2 + (y+3) * w]) * 57 / 1024;
+             0;
+         }
+     }
+ }
+ 
+ static inline int mix_images(diso_workspace_t * ws, struct raw_info raw_info, uint32_t* fullres, uint32_t* fullres_smooth, uint32_t* halfres, uint32_t* halfres_smooth, uint16_t* alias_map, uint32_t* dark, uint32_t* bright, uint16_t * overexposed, int dark_noise, uint32_t white_darkened, double corr_ev, double lowiso_dr, uint32_t black, uint32_t white, int chroma_smooth_method)
  {
      int w = raw_info.width;
      int h = raw_info.height;
@@ -1568,237 +2214,299 @@
  #ifndef STDOUT_SILENT
      printf("Half-res blending...\n");
  #endif
-     /* mixing curve */
-     double max_ev = log2(white/64 - black/64);
-     double * mix_curve = malloc((1<<20) * sizeof(double));
-     
-     //#pragma omp parallel for
-     for (int i = 0; i < 1<<20; i++)
-     {
-         double ev = log2(MAX(i/64.0 - black/64.0, 1)) + corr_ev;
-         double c = -cos(MAX(MIN(ev-(max_ev-overlap),overlap),0)*M_PI/overlap);
-         double k = (c+1) / 2;
-         mix_curve[i] = k;
-     }
- 
+     /* mixing curve, only rebuilt when the levels or the exposure matching change */
+     double * mix_curve = build_mix_curve(ws, black, white, corr_ev, overlap);
  
      /* for fast EV - raw conversion */
-     static int raw2ev[1<<20];   /* EV x EV_RESOLUTION */
-     static int ev2raw_0[24*EV_RESOLUTION];
-     static uint32_t previous_black = -1;
-     
-     /* handle sub-black values (negative EV) */
-     int* ev2raw = ev2raw_0 + 10*EV_RESOLUTION;
+     int * raw2ev;
+     int * ev2raw;
+     get_ev_luts(ws, black, white, &raw2ev, &ev2raw);
      
-     LOCK(ev2raw_mutex)
+     mix_job job = { halfres, dark, bright, overexposed, NULL, mix_curve, raw2ev, ev2raw, white_darkened, white, w };
+     parallel_for(0, h, DISO_ROW_GRAIN, mix_halfres_rows, &job);
+     if (chroma_smooth_method)
      {
-         if(black != previous_black)
-         {
-             build_ev2raw_lut(raw2ev, ev2raw_0, black, white);
-             previous_black = black;
-         }
-         
-         //#pragma omp parallel for collapse(2)
-         for (int y = 0; y < h; y ++)
-         {
-             for (int x = 0; x < w; x ++)
-             {
-                 /* bright and dark source pixels  */
-                 /* they may be real or interpolated */
-                 /* they both have the same brightness (they were adjusted before this loop), so we are ready to mix them */
-                 int b = bright[x + y*w];
-                 int d = dark[x + y*w];
-                 
-                 /* go from linear to EV space */
-                 int bev = raw2ev[b];
-                 int dev = raw2ev[d];
-                 
-                 /* blending factor */
-                 double k = COERCE(mix_curve[b & 0xFFFFF], 0, 1);
-                 
-                 /* mix bright and dark exposures */
-                 int mixed = bev * (1-k) + dev * k;
-                 halfres[x + y*w] = ev2raw[mixed];
-             }
-         }
-         if (chroma_smooth_method)
-         {
  #ifndef STDOUT_SILENT
-             printf("Chroma smoothing...\n");
+         printf("Chroma smoothing...\n");
  #endif
-             memcpy(fullres_smooth, fullres, w * h * sizeof(uint32_t));
-             memcpy(halfres_smooth, halfres, w * h * sizeof(uint32_t));
-             hdr_chroma_smooth(raw_info, fullres, fullres_smooth, chroma_smooth_method, raw2ev, ev2raw);
-             hdr_chroma_smooth(raw_info, halfres, halfres_smooth, chroma_smooth_method, raw2ev, ev2raw);
-         }
-         if(alias_map)
-         {
-             build_alias_map(raw_info, alias_map, fullres_smooth, halfres_smooth, bright, dark_noise, black, raw2ev);
-         }
+         if (fullres_smooth != fullres) memcpy(fullres_smooth, fullres, w * h * sizeof(uint32_t));
+         memcpy(halfres_smooth, halfres, w * h * sizeof(uint32_t));
+         hdr_chroma_smooth(raw_info, fullres, fullres_smooth, chroma_smooth_method, raw2ev, ev2raw);
+         hdr_chroma_smooth(raw_info, halfres, halfres_smooth, chroma_smooth_method, raw2ev, ev2raw);
      }
-     UNLOCK(ev2raw_mutex)
-     
-     //#pragma omp parallel for collapse(2)
-     for (int y = 0; y < h; y ++)
+     if(alias_map)
      {
-         for (int x = 0; x < w; x ++)
-         {
-             overexposed[x + y * w] = bright[x + y * w] >= white_darkened || dark[x + y * w] >= white ? 100 : 0;
-         }
+         build_alias_map(ws, raw_info, alias_map, fullres_smooth, halfres_smooth, bright, dark_noise, black, raw2ev);
      }
      
+     parallel_for(0, h, DISO_ROW_GRAIN, mix_overexposed_rows, &job);
+     
      /* "blur" the overexposed map */
-     uint16_t* over_aux = malloc(w * h * sizeof(uint16_t));
+     uint16_t* over_aux = ws_buffer(ws, WS_OVER_AUX, w * h * sizeof(uint16_t));
      memcpy(over_aux, overexposed, w * h * sizeof(uint16_t));
      
-     //#pragma omp parallel for collapse(2)
-     for (int y = 3; y < h-3; y ++)
+     job.over_aux = over_aux;
+     parallel_for(3, h-3, DISO_ROW_GRAIN, mix_overexposed_blur_rows, &job);
+     
+     return 1;
+ }
+ 
+ typedef struct
+ {
+     struct raw_info raw_info;
+     uint32_t * raw_buffer_32;
+     uint32_t * fullres;
+     uint32_t * fullres_smooth;
+     uint32_t * halfres_smooth;
+     uint32_t * dark;
+     uint32_t * bright;
+     uint16_t * overexposed;
+     uint16_t * alias_map;
+     double * fullres_curve;
+     int * raw2ev;
+     int * ev2raw;
+     int black;
+     int dark_noise;
+ } final_blend_job;
+ 
+ static void final_blend_rows(void * arg, int y1, int y2)
+ {
+     final_blend_job * job = (final_blend_job *)arg;
+     struct raw_info raw_info = job->raw_info;
+     uint32_t * raw_buffer_32 = job->raw_buffer_32;
+     uint32_t * fullres = job->fullres;
+     uint32_t * fullres_smooth = job->fullres_smooth;
+     uint32_t * halfres_smooth = job->halfres_smooth;
+     uint32_t * dark = job->dark;
+     uint32_t * bright = job->bright;
+     uint16_t * overexposed = job->overexposed;
+     uint16_t * alias_map = job->alias_map;
+     double * fullres_curve = job->fullres_curve;
+     int * raw2ev = job->raw2ev;
+     int * ev2raw = job->ev2raw;
+     int black = job->black;
+     int dark_noise = job->dark_noise;
+     int w = raw_info.width;
+     
+     for (int y = y1; y < y2; y ++)
      {
-         for (int x = 3; x < w-3; x ++)
+         for (int x = 0; x < w; x ++)
          {
-             overexposed[x + y * w] =
-             (over_aux[x+0 + (y+0) * w])+
-             (over_aux[x+0 + (y-1) * w] + over_aux[x-1 + (y+0) * w] + over_aux[x+1 + (y+0) * w] + over_aux[x+0 + (y+1) * w]) * 820 / 1024 +
-             (over_aux[x-1 + (y-1) * w] + over_aux[x+1 + (y-1) * w] + over_aux[x-1 + (y+1) * w] + over_aux[x+1 + (y+1) * w]) * 657 / 1024 +
-             //~ (over_aux[x+0 + (y-2) * w] + over_aux[x-2 + (y+0) * w] + over_aux[x+2 + (y+0) * w] + over_aux[x+0 + (y+2) * w]) * 421 / 1024 +
-             //~ (over_aux[x-1 + (y-2) * w] + over_aux[x+1 + (y-2) * w] + over_aux[x-2 + (y-1) * w] + over_aux[x+2 + (y-1) * w] + over_aux[x-2 + (y+1) * w] + over_aux[x+2 + (y+1) * w] + over_aux[x-1 + (y+2) * w] + over_aux[x+1 + (y+2) * w]) * 337 / 1024 +
-             //~ (over_aux[x-2 + (y-2) * w] + over_aux[x+2 + (y-2) * w] + over_aux[x-2 + (y+2) * w] + over_aux[x+2 + (y+2) * w]) * 173 / 1024 +
-             //~ (over_aux[x+0 + (y-3) * w] + over_aux[x-3 + (y+0) * w] + over_aux[x+3 + (y+0) * w] + over_aux[x+0 + (y+3) * w]) * 139 / 1024 +
-             //~ (over_aux[x-1 + (y-3) * w] + over_aux[x+1 + (y-3) * w] + over_aux[x-3 + (y-1) * w] + over_aux[x+3 + (y-1) * w] + over_aux[x-3 + (y+1) * w] + over_aux[x+3 + (y+1) * w] + over_aux[x-1 + (y+3) * w] + over_aux[x+1 + (y+3) * w]) * 111 / 1024 +
-             //~ (over_aux[x-2 + (y-3) * w] + over_aux[x+2 + (y-3) * w] + over_aux[x-3 + (y-2) * w] + over_aux[x+3 + (y-2) * w] + over_aux[x-3 + (y+2) * w] + over_aux[x+3 + (y+2) * w] + over_aux[x-2 + (y+3) * w] + over_aux[x+2 + (y+3) * w]) * 57 / 1024;
-             0;
+             /* high-iso image (for measuring signal level) */
+             int b = bright[x + y*w];
+             
+             /* half-res image (interpolated and chroma filtered, best for low-contrast shadows) */
+             int hr = halfres_smooth[x + y*w];
+             
+             /* full-res image (non-interpolated, except where one ISO is blown out) */
+             int fr = fullres[x + y*w];
+             
+             /* full res with some smoothing applied to hide aliasing artifacts */
+             int frs = fullres_smooth[x + y*w];
+             
+             /* go from linear to EV space */
+             int hrev = raw2ev[hr];
+             int frev = raw2ev[fr];
+             int frsev = raw2ev[frs];
+             
+             int output = 0;
+             
+             /* blending factor */
+             double f = fullres_curve[b & 0xFFFFF];
+             
+             double c = 0;
+             
+             if (alias_map)
+             {
+                 int co = alias_map[x + y*w];
+                 c = COERCE(co / (double) ALIAS_MAP_MAX, 0, 1);
+             }
+             
+             double ovf = COERCE(overexposed[x + y*w] / 200.0, 0, 1);
+             c = MAX(c, ovf);
+             
+             double noisy_or_overexposed = MAX(ovf, 1-f);
+             
+             /* use data from both ISOs in high-detail areas, even if it's noisier (less aliasing) */
+             f = MAX(f, c);
+             
+             /* use smoothing in noisy near-overexposed areas to hide color artifacts */
+             double fev = noisy_or_overexposed * frsev + (1-noisy_or_overexposed) * frev;
+             
+             /* limit the use of fullres in dark areas (fixes some black spots, but may increase aliasing) */
+             int sig = (dark[x + y*w] + bright[x + y*w]) / 2;
+             f = MAX(0, MIN(f, (double)(sig - black) / (4*dark_noise)));
+             
+             /* blend "half-res" and "full-res" images smoothly to avoid banding*/
+             output = hrev * (1-f) + fev * f;
+             
+             /* show full-res map (for debugging) */
+             //~ output = f * 14*EV_RESOLUTION;
+             
+             /* show alias map (for debugging) */
+             //~ output = c * 14*EV_RESOLUTION;
+             
+             //~ output = hotpixel[x+y*w] ? 14*EV_RESOLUTION : 0;
+             //~ output = raw2ev[dark[x+y*w]];
+             /* safeguard */
+             output = COERCE(output, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1);
+             
+             
+             /* back to linear space and commit */
+             raw_set_pixel32(x, y, ev2raw[output]);
          }
      }
-     
-     free(over_aux); over_aux = 0;
-     free(mix_curve);
-     
-     return 1;
  }
  
- static inline void final_blend(struct raw_info raw_info, uint32_t* raw_buffer_32, uint32_t* fullres, uint32_t* fullres_smooth, uint32_t* halfres_smooth, uint32_t* dark, uint32_t* bright, uint16_t* overexposed, uint16_t* alias_map, int black, int white, int dark_noise)
+ static inline void final_blend(diso_workspace_t * ws, struct raw_info raw_info, uint32_t* raw_buffer_32, uint32_t* fullres, uint32_t* fullres_smooth, uint32_t* halfres_smooth, uint32_t* dark, uint32_t* bright, uint16_t* overexposed, uint16_t* alias_map, int black, int white, int dark_noise)
  {
      /* fullres mixing curve */
-     double * fullres_curve = build_fullres_curve(black);
+     double * fullres_curve = build_fullres_curve(ws, black);
      
-     int w = raw_info.width;
      int h = raw_info.height;
      
      /* for fast EV - raw conversion */
-     static int raw2ev[1<<20];   /* EV x EV_RESOLUTION */
-     static int ev2raw_0[24*EV_RESOLUTION];
-     static int previous_black = -1;
+     int * raw2ev;
+     int * ev2raw;
+     get_ev_luts(ws, black, white, &raw2ev, &ev2raw);
      
-     /* handle sub-black values (negative EV) */
-     int* ev2raw = ev2raw_0 + 10*EV_RESOLUTION;
-     
-     LOCK(ev2raw_mutex)
-     {
-         if(black != previous_black)
-         {
-             build_ev2raw_lut(raw2ev, ev2raw_0, black, white);
-             previous_black = black;
-         }
  #ifndef STDOUT_SILENT
-         printf("Final blending...\n");
+     printf("Final blending...\n");
  #endif
-         //#pragma omp parallel for collapse(2)
-         for (int y = 0; y < h; y ++)
-         {
-             for (int x = 0; x < w; x ++)
-             {
-                 /* high-iso image (for measuring signal level) */
-                 int b = bright[x + y*w];
-                 
-                 /* half-res image (interpolated and chroma filtered, best for low-contrast shadows) */
-                 int hr = halfres_smooth[x + y*w];
-                 
-                 /* full-res image (non-interpolated, except where one ISO is blown out) */
-                 int fr = fullres[x + y*w];
-                 
-                 /* full res with some smoothing applied to hide aliasing artifacts */
-                 int frs = fullres_smooth[x + y*w];
-                 
-                 /* go from linear to EV space */
-                 int hrev = raw2ev[hr];
-                 int frev = raw2ev[fr];
-                 int frsev = raw2ev[frs];
-                 
-                 int output = 0;
-                 
-                 /* blending factor */
-                 double f = fullres_curve[b & 0xFFFFF];
-                 
-                 double c = 0;
-                 
-                 if (alias_map)
-                 {
-                     int co = alias_map[x + y*w];
-                     c = COERCE(co / (double) ALIAS_MAP_MAX, 0, 1);
-                 }
-                 
-                 double ovf = COERCE(overexposed[x + y*w] / 200.0, 0, 1);
-                 c = MAX(c, ovf);
-                 
-                 double noisy_or_overexposed = MAX(ovf, 1-f);
-                 
-                 /* use data from both ISOs in high-detail areas, even if it's noisier (less aliasing) */
-                 f = MAX(f, c);
-                 
-                 /* use smoothing in noisy near-overexposed areas to hide color artifacts */
-                 double fev = noisy_or_overexposed * frsev + (1-noisy_or_overexposed) * frev;
-                 
-                 /* limit the use of fullres in dark areas (fixes some black spots, but may increase aliasing) */
-                 int sig = (dark[x + y*w] + bright[x + y*w]) / 2;
-                 f = MAX(0, MIN(f, (double)(sig - black) / (4*dark_noise)));
-                 
-                 /* blend "half-res" and "full-res" images smoothly to avoid banding*/
-                 output = hrev * (1-f) + fev * f;
-                 
-                 /* show full-res map (for debugging) */
-                 //~ output = f * 14*EV_RESOLUTION;
-                 
-                 /* show alias map (for debugging) */
-                 //~ output = c * 14*EV_RESOLUTION;
-                 
-                 //~ output = hotpixel[x+y*w] ? 14*EV_RESOLUTION : 0;
-                 //~ output = raw2ev[dark[x+y*w]];
-                 /* safeguard */
-                 output = COERCE(output, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1);
-                 
-                 
-                 /* back to linear space and commit */
-                 raw_set_pixel32(x, y, ev2raw[output]);
-             }
-         }
-     }
-     UNLOCK(ev2raw_mutex)
+     final_blend_job job = { raw_info, raw_buffer_32, fullres, fullres_smooth, halfres_smooth, dark, bright, overexposed, alias_map, fullres_curve, raw2ev, ev2raw, black, dark_noise };
+     parallel_for(0, h, DISO_ROW_GRAIN, final_blend_rows, &job);
  }
  
- static inline void convert_20_to_16bit(struct raw_info raw_info, uint16_t * image_data, uint32_t * raw_buffer_32)
+ static void convert_20_to_16bit_rows(void * arg, int y1, int y2)
  {
+     convert_bits_job * job = (convert_bits_job *)arg;
+     struct raw_info raw_info = job->raw_info;
+     uint16_t * image_data = job->image_data;
+     uint32_t * raw_buffer_32 = job->raw_buffer_32;
      int w = raw_info.width;
+     
+     for (int y = y1; y < y2; y++)
+         for (int x = 0; x < w; x++)
+             raw_set_pixel_20to16_rand(x, y, raw_buffer_32[x + y*w]);
+ }
+ 
+ static inline void convert_20_to_16bit(struct raw_info raw_info, uint16_t * image_data, uint32_t * raw_buffer_32)
+ {
      int h = raw_info.height;
      /* go back from 20-bit to 16-bit output */
      //raw_info.buffer = raw_buffer_16;
      raw_info.black_level /= 16;
      raw_info.white_level /= 16;
      
-     //#pragma omp parallel for collapse(2)
-     for (int y = 0; y < h; y++)
-         for (int x = 0; x < w; x++)
-             raw_set_pixel_20to16_rand(x, y, raw_buffer_32[x + y*w]);
+     convert_bits_job job = { raw_info, image_data, raw_buffer_32 };
+     parallel_for(0, h, DISO_ROW_GRAIN, convert_20_to_16bit_rows, &job);
+ }
+ 
+ int diso_calibrate(diso_workspace_t * ws, struct raw_info raw_info, uint16_t * image_data, diso_calibration_t * calib)
+ {
+     memset(calib, 0, sizeof(diso_calibration_t));
+     
+     if (raw_info.width <= 0 || raw_info.height <= 0) return 0;
+     
+     /* no workspace: buffers for this frame only */
+     if (!ws)
+     {
+         diso_workspace_t * frame_ws = diso_workspace_create();
+         int ret = diso_calibrate(frame_ws, raw_info, image_data, calib);
+         diso_workspace_free(frame_ws);
+         return ret;
+     }
+     
+     /* RGGB or GBRG? */
+     calib->rggb = identify_rggb_or_gbrg(raw_info, image_data);
+     
+     if (!calib->rggb) /* this code assumes RGGB, so we need to skip one line */
+     {
+         image_data += raw_info.pitch;
+         raw_info.active_area.y1++;
+         raw_info.active_area.y2--;
+         raw_info.height--;
+     }
+     
+     if (!identify_bright_and_dark_fields(raw_info, image_data, calib->rggb, calib->is_bright)) return 0;
+     
+     /* measured on the 20-bit data, like the processing */
+     raw_info.black_level *= 64;
+     
+     white_detect(ws, raw_info, image_data, &calib->white, &calib->white_bright, calib->is_bright);
+     raw_info.white_level = calib->white * 64;
+     
+     compute_noise(raw_info, image_data, calib->noise_std);
+     
+     /* estimate ISO difference between bright and dark exposures */
+     uint32_t * raw_buffer_32 = convert_to_20bit(ws, raw_info, image_data);
+     calib->matched = match_exposures(ws, raw_info, raw_buffer_32, calib->white_bright * 64, calib->is_bright, &calib->a, &calib->b);
+     calib->frames = 1;
+     
+     return 1;
  }
  
- int diso_get_full20bit(struct raw_info raw_info, uint16_t * image_data, int interp_method, int use_alias_map, int use_fullres, int chroma_smooth_method)
+ int diso_calibration_mix(diso_calibration_t * calib, const diso_calibration_t * frame, double weight)
+ {
+     if (!frame->frames) return 0;
+     
+     if (!calib->frames)
+     {
+         *calib = *frame;
+         return 1;
+     }
+     
+     if (calib->rggb != frame->rggb || memcmp(calib->is_bright, frame->is_bright, sizeof(calib->is_bright))) return 0;
+     
+ #define MIX(field) (calib->field * (1 - weight) + frame->field * weight)
+     calib->white = (int)round(MIX(white));
+     calib->white_bright = (int)round(MIX(white_bright));
+     for (int i = 0; i < 4; i++)
+         calib->noise_std[i] = MIX(noise_std[i]);
+     
+     /* exposures not matched are not worth averaging, the ISO difference is averaged in EV */
+     if (calib->matched && frame->matched)
+     {
+         calib->a = pow(2, log2(calib->a) * (1 - weight) + log2(frame->a) * weight);
+         calib->b = MIX(b);
+     }
+     else if (frame->matched)
+     {
+         calib->a = frame->a;
+         calib->b = frame->b;
+         calib->matched = 1;
+     }
+ #undef MIX
+     
+     calib->frames += frame->frames;
+     return 1;
+ }
+ 
+ int diso_get_full20bit(diso_workspace_t * ws, const diso_calibration_t * calib, struct raw_info raw_info, uint16_t * image_data, int interp_method, int use_alias_map, int use_fullres, int chroma_smooth_method)
  {
      int w = raw_info.width;
      int h = raw_info.height;
      
      if (w <= 0 || h <= 0) return 0;
- 
-     /* RGGB or GBRG? */
-     int rggb = identify_rggb_or_gbrg(raw_info, image_data);
+     
+     /* no workspace: buffers and LUTs for this frame only */
+     if (!ws)
+     {
+         diso_workspace_t * frame_ws = diso_workspace_create();
+         int ret = diso_get_full20bit(frame_ws, calib, raw_info, image_data, interp_method, use_alias_map, use_fullres, chroma_smooth_method);
+         diso_workspace_free(frame_ws);
+         return ret;
+     }
+     
+     /* no calibration of the clip: measure this frame */
+     diso_calibration_t frame_calib;
+     if (!calib || !calib->frames)
+     {
+         if (!diso_calibrate(ws, raw_info, image_data, &frame_calib)) return 0;
+         calib = &frame_calib;
+     }
+     
+     int rggb = calib->rggb;
      
      if (!rggb) /* this code assumes RGGB, so we need to skip one line */
      {
@@ -1810,30 +2518,26 @@
      }
      
      int is_bright[4];
-     
-     if (!identify_bright_and_dark_fields(raw_info, image_data, rggb, is_bright)) return 0;
+     memcpy(is_bright, calib->is_bright, sizeof(is_bright));
      
      int ret = 0;
      
      /* will use 20-bit processing and 16-bit output, instead of 14 */
      raw_info.black_level *= 64;
-     raw_info.white_level *= 64;
      
      int black = raw_info.black_level;
-     int white = raw_info.white_level;
-     
-     int white_bright = white;
-     white_detect(raw_info, image_data, &white, &white_bright, is_bright);
-     white *= 64;
-     white_bright *= 64;
+     int white = calib->white * 64;
+     int white_bright = calib->white_bright * 64;
      raw_info.white_level = white;
      
-     double noise_std[4];
-     double dark_noise, bright_noise, dark_noise_ev, bright_noise_ev;
-     double noise_avg = compute_noise(raw_info, image_data, noise_std, &dark_noise, &bright_noise, &dark_noise_ev, &bright_noise_ev);
+     const double * noise_std = calib->noise_std;
+     double dark_noise = MIN(MIN(noise_std[0], noise_std[1]), MIN(noise_std[2], noise_std[3]));
+     double bright_noise = MAX(MAX(noise_std[0], noise_std[1]), MAX(noise_std[2], noise_std[3]));
+     double dark_noise_ev = log2(dark_noise);
+     double bright_noise_ev = log2(bright_noise);
      
      /* promote from 14 to 20 bits (original raw buffer holds 14-bit values stored as uint16_t) */
-     uint32_t * raw_buffer_32 = convert_to_20bit(raw_info, image_data);
+     uint32_t * raw_buffer_32 = convert_to_20bit(ws, raw_info, image_data);
      
      /* we have now switched to 20-bit, update noise numbers */
      dark_noise *= 64;
@@ -1842,49 +2546,40 @@
      bright_noise_ev += 6;
      
      /* dark and bright exposures, interpolated */
-     uint32_t* dark   = malloc(w * h * sizeof(uint32_t));
-     uint32_t* bright = malloc(w * h * sizeof(uint32_t));
-     memset(dark, 0, w * h * sizeof(uint32_t));
-     memset(bright, 0, w * h * sizeof(uint32_t));
+     uint32_t* dark   = ws_zeroed(ws, WS_DARK, w * h * sizeof(uint32_t));
+     uint32_t* bright = ws_zeroed(ws, WS_BRIGHT, w * h * sizeof(uint32_t));
      
      /* fullres image (minimizes aliasing) */
-     uint32_t* fullres = malloc(w * h * sizeof(uint32_t));
-     memset(fullres, 0, w * h * sizeof(uint32_t));
+     uint32_t* fullres = ws_zeroed(ws, WS_FULLRES, w * h * sizeof(uint32_t));
      uint32_t* fullres_smooth = fullres;
      
-     /* halfres image (minimizes noise and banding) */
-     uint32_t* halfres = malloc(w * h * sizeof(uint32_t));
-     memset(halfres, 0, w * h * sizeof(uint32_t));
+     /* halfres image (minimizes noise and banding), fully written by mix_images */
+     uint32_t* halfres = ws_buffer(ws, WS_HALFRES, w * h * sizeof(uint32_t));
      uint32_t* halfres_smooth = halfres;
      
      if (chroma_smooth_method)
      {
          if (use_fullres)
          {
-             fullres_smooth = malloc(w * h * sizeof(uint32_t));
+             fullres_smooth = ws_buffer(ws, WS_FULLRES_SMOOTH, w * h * sizeof(uint32_t));
          }
-         halfres_smooth = malloc(w * h * sizeof(uint32_t));
+         halfres_smooth = ws_buffer(ws, WS_HALFRES_SMOOTH, w * h * sizeof(uint32_t));
      }
      
-     /* overexposure map */
-     uint16_t * overexposed = malloc(w * h * sizeof(uint16_t));
-     memset(overexposed, 0, w * h * sizeof(uint16_t));
+     /* overexposure map, fully written by mix_images */
+     uint16_t * overexposed = ws_buffer(ws, WS_OVEREXPOSED, w * h * sizeof(uint16_t));
      
      uint16_t* alias_map = NULL;
      if(use_alias_map)
      {
-         alias_map = malloc(w * h * sizeof(uint16_t));
-         memset(alias_map, 0, w * h * sizeof(uint16_t));
+         alias_map = ws_zeroed(ws, WS_ALIAS_MAP, w * h * sizeof(uint16_t));
      }
      
-     //~ printf("Exposure matching...\n");
-     /* estimate ISO difference between bright and dark exposures */
-     double corr_ev = 0;
-     int white_darkened = white_bright;
- 
-     int expo_matched = match_exposures(raw_info, raw_buffer_32, &corr_ev, &white_darkened, is_bright);
+     /* match the bright exposure to the dark one */
+     int white_darkened = apply_exposures(raw_info, raw_buffer_32, white_bright, is_bright, calib->a, calib->b);
+     double corr_ev = calib->matched ? log2(1 / calib->a) : 0;
  #ifndef STDOUT_SILENT
-     if(expo_matched)
+     if(calib->matched)
      {
          printf("Exposures matched");
      }
@@ -1908,35 +2603,35 @@
  
      if(interp_method == 0)
      {
-         amaze_interpolate(raw_info, raw_buffer_32, dark, bright, black, white, white_darkened, is_bright);
+         amaze_interpolate(ws, raw_info, raw_buffer_32, dark, bright, black, white, white_darkened, is_bright);
      }
      else
      {
-         mean23_interpolate(raw_info, raw_buffer_32, dark, bright, black, white, white_darkened, is_bright);
+         mean23_interpolate(ws, raw_info, raw_buffer_32, dark, bright, black, white, white_darkened, is_bright);
      }
  
      border_interpolate(raw_info, raw_buffer_32, dark, bright, is_bright);
  
      if (use_fullres) fullres_reconstruction(raw_info, fullres, dark, bright, white_darkened, is_bright);
  
-     if(mix_images(raw_info, fullres, fullres_smooth, halfres, halfres_smooth, alias_map, dark, bright, overexposed, dark_noise, white_darkened, corr_ev, lowiso_dr, black, white, chroma_smooth_method))
+     if(mix_images(ws, raw_info, fullres, fullres_smooth, halfres, halfres_smooth, alias_map, dark, bright, overexposed, dark_noise, white_darkened, corr_ev, lowiso_dr, black, white, chroma_smooth_method))
      {
+ #ifndef STDOUT_SILENT
          /* let's check the ideal noise levels (on the halfres image, which in black areas is identical to the bright one) */
-         //#pragma omp parallel for collapse(2)
+         /* statistics only, final_blend writes the whole buffer again */
+         double noise_avg, ideal_noise_std, final_noise_std;
          for (int y = 3; y < h-2; y ++)
              for (int x = 2; x < w-2; x ++)
                  raw_set_pixel32(x, y, bright[x + y*w]);
-         compute_black_noise(raw_info, image_data, 8, raw_info.active_area.x1 - 8, raw_info.active_area.y1 + 20, raw_info.active_area.y2 - 20, 1, 1, &noise_avg, &noise_std[0]);
- #ifndef STDOUT_SILENT
-         double ideal_noise_std = noise_std[0];
+         compute_black_noise(raw_info, image_data, 8, raw_info.active_area.x1 - 8, raw_info.active_area.y1 + 20, raw_info.active_area.y2 - 20, 1, 1, &noise_avg, &ideal_noise_std);
  #endif
-         final_blend(raw_info, raw_buffer_32, fullres, fullres_smooth, halfres_smooth, dark, bright, overexposed, alias_map, black, white, dark_noise);
+         final_blend(ws, raw_info, raw_buffer_32, fullres, fullres_smooth, halfres_smooth, dark, bright, overexposed, alias_map, black, white, dark_noise);
  
-         /* let's see how much dynamic range we actually got */
-         compute_black_noise(raw_info, image_data, 8, raw_info.active_area.x1 - 8, raw_info.active_area.y1 + 20, raw_info.active_area.y2 - 20, 1, 1, &noise_avg, &noise_std[0]);
  #ifndef STDOUT_SILENT
-         printf("Noise level     : %.02f (20-bit), ideally %.02f\n", noise_std[0], ideal_noise_std);
-         printf("Dynamic range   : %.02f EV (cooked)\n", log2(white - black) - log2(noise_std[0]));
+         /* let's see how much dynamic range we actually got */
+         compute_black_noise(raw_info, image_data, 8, raw_info.active_area.x1 - 8, raw_info.active_area.y1 + 20, raw_info.active_area.y2 - 20, 1, 1, &noise_avg, &final_noise_std);
+         printf("Noise level     : %.02f (20-bit), ideally %.02f\n", final_noise_std, ideal_noise_std);
+         printf("Dynamic range   : %.02f EV (cooked)\n", log2(white - black) - log2(final_noise_std));
  #endif
          convert_20_to_16bit(raw_info, image_data, raw_buffer_32);
          ret = 1;
@@ -1950,15 +2645,6 @@
          h++;
      }
      
-     free(dark);
-     free(bright);
-     free(fullres);
-     free(halfres);
-     free(alias_map);
-     free(overexposed);
-     free(raw_buffer_32);
-     if (fullres_smooth && fullres_smooth != fullres) free(fullres_smooth);
-     if (halfres_smooth && halfres_smooth != halfres) free(halfres_smooth);
      return ret;
  }
  
\ No newline at end of file
@@ -25,7 +25,36 @@
  #include <sys/types.h>
  #include "../raw.h"
  
+ /* full frame buffers and LUTs of the 20bit processing, grown on demand and
+  * kept from frame to frame. One per reader, calls sharing one are not thread safe */
+ typedef struct diso_workspace diso_workspace_t;
+ 
+ diso_workspace_t * diso_workspace_create();
+ void diso_workspace_free(diso_workspace_t * ws);
+ 
+ /* what the 20bit processing measures on a frame before reconstructing it,
+  * stable over a clip so it can be measured once and averaged over a few frames */
+ typedef struct diso_calibration
+ {
+     int frames;             /* number of frames averaged, 0 = nothing measured */
+     int rggb;               /* 0 for GBRG, processed one line down */
+     int is_bright[4];       /* bright or dark exposure, by line % 4 */
+     int white;              /* 14bit white levels of the dark and bright exposures */
+     int white_bright;
+     double noise_std[4];    /* 14bit black noise, by line % 4 */
+     double a;               /* exposure matching, dark = bright * a + b (16bit) */
+     double b;
+     int matched;            /* a looks like an interlaced ISO difference */
+ } diso_calibration_t;
+ 
  int diso_get_preview(uint16_t * image_data, uint16_t width, uint16_t height, int32_t black, int32_t white, int diso_check);
- int diso_get_full20bit(struct raw_info raw_info, uint16_t * image_data, int interp_method, int use_alias_map, int use_fullres, int chroma_smooth_method);
+ /* measure the calibration of a frame, returns 0 if no dual iso line pattern is found */
+ int diso_calibrate(diso_workspace_t * ws, struct raw_info raw_info, uint16_t * image_data, diso_calibration_t * calib);
+ /* calib = calib * (1 - weight) + frame * weight, an empty calib takes the frame as is.
+  * Returns 0 without mixing if the line patterns differ */
+ int diso_calibration_mix(diso_calibration_t * calib, const diso_calibration_t * frame, double weight);
+ /* ws may be NULL, the buffers are then only allocated for this frame.
+  * calib may be NULL (or empty), the frame is then measured first */
+ int diso_get_full20bit(diso_workspace_t * ws, const diso_calibration_t * calib, struct raw_info raw_info, uint16_t * image_data, int interp_method, int use_alias_map, int use_fullres, int chroma_smooth_method);
  
  #endif
\ No newline at end of file
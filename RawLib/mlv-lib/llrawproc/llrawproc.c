@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "pixelproc.h"
 #include "darkframe.h"
@@ -32,12 +33,25 @@
 #include "patternnoise.h"
 #include "pixelproc.h"
 #include "stripes.h"
+#include "sharedcache.h"
 #include "llrawproc.h"
+#include "../parallel.h"
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
 #define COERCE(x,lo,hi) MAX(MIN((x),(hi)),(lo))
 #define ABS(a) ((a) > 0 ? (a) : -(a))
 
+/* frames the dual iso calibration of a clip is measured on */
+#define DISO_CALIBRATION_FRAMES 5
+/* share of the frame measurement in the running per frame calibration,
+   the rest is the estimate of the previous frames */
+#define DISO_FRAME_WEIGHT 0.25
+/* frames further than this from the last one measured (a seek) restart
+   the running calibration from the clip one */
+#define DISO_FRAME_GAP 2
+
+extern int getMlvRawFrameUint16(mlvObject_t * video, uint64_t frameIndex, uint16_t * unpackedFrame);
+
 
 /* this is DNG feature only */
 static void deflicker(mlvObject_t * video, uint16_t * raw_image_buff, size_t raw_image_size)
@@ -53,38 +67,153 @@ static void deflicker(mlvObject_t * video, uint16_t * raw_image_buff, size_t raw
     video->RAWI.raw_info.exposure_bias[1] = 10000;
 }
 
-/* convert uncompressed 10/12bit raw data to 14bit for subsequent processing */
-static void make_14bit(uint16_t * raw_image_buff, size_t raw_image_size, struct raw_info * raw_info)
+/* convert levels of uncompressed 10/12bit raw data to 14bit for subsequent processing,
+   returns the shift to apply to the raw values */
+static int make_14bit(struct raw_info * raw_info)
 {
-    uint32_t pixel_count = raw_image_size / 2;
     int bits_shift = 14 - raw_info->bits_per_pixel;
     raw_info->black_level <<= bits_shift;
     raw_info->white_level <<= bits_shift;
     raw_info->bits_per_pixel = 14;
     raw_info->frame_size = raw_info->width * raw_info->height * 14 / 8;
-
-    #pragma omp parallel for
-    for(uint32_t i = 0; i < pixel_count; ++i)
-    {
-        raw_image_buff[i] <<= bits_shift;
-    }
+    return bits_shift;
 }
 
 /* undo 14bit conversion to initial bit depth with rounding error minimizing */
-static void undo_14bit(uint16_t * raw_image_buff, size_t raw_image_size, uint32_t bpp)
+static void undo_14bit_range(uint16_t * raw_image_buff, uint32_t begin, uint32_t end, int bits_shift)
 {
-    uint32_t pixel_count = raw_image_size / 2;
-    int bits_shift = 14 - bpp;
     /* calculate rounding number to be added to the raw value before shifting right to minimize rounding error */
     uint32_t rounding_number = (uint32_t)pow(2, bits_shift - 1);
 
-    #pragma omp parallel for
-    for(uint32_t i = 0; i < pixel_count; ++i)
+    for(uint32_t i = begin; i < end; ++i)
     {
         raw_image_buff[i] = (raw_image_buff[i] + rounding_number) >> bits_shift;
     }
 }
 
+typedef struct
+{
+    uint16_t * raw_image_buff;
+    int bits_shift;
+} undo_14bit_job;
+
+static void undo_14bit_block(void * arg, int begin, int end)
+{
+    undo_14bit_job * job = arg;
+    undo_14bit_range(job->raw_image_buff, begin, end, job->bits_shift);
+}
+
+static void undo_14bit(uint16_t * raw_image_buff, size_t raw_image_size, uint32_t bpp)
+{
+    undo_14bit_job job = { raw_image_buff, 14 - bpp };
+    parallel_for(0, raw_image_size / 2, 65536, undo_14bit_block, &job);
+}
+
+/* Per pixel stages (dark frame subtraction, 14bit scaling, vertical stripes
+ * and the final rounding back to the initial bit depth) are fused and run
+ * band by band, so every band is read and written once while it stays in
+ * cache instead of streaming the whole frame once per stage. The stripes
+ * need the maximum of the whole frame, so the stages run in two sweeps */
+#define LLRP_BAND_ROWS 16
+
+typedef struct
+{
+    mlvObject_t * video;
+    uint16_t * image;
+    int width;
+    int height;
+    int dark_frame;                 // subtract dark frame
+    int shift;                      // shift to 14bit, 0 = none
+    stripes_correction * stripes;   // correction to apply or NULL
+    int32_t black;                  // 14bit black level
+    int32_t white;                  // exact white level for the stripes
+    int undo_shift;                 // shift back to the initial bit depth, 0 = none
+    uint16_t * band_max;            // maximum of every band, first sweep
+} point_stages;
+
+static void point_stages_in_bands(void * arg, int first, int last)
+{
+    point_stages * st = arg;
+
+    for(int band = first; band < last; band++)
+    {
+        uint32_t begin = (uint32_t)band * LLRP_BAND_ROWS * st->width;
+        uint32_t end = (uint32_t)MIN((band + 1) * LLRP_BAND_ROWS, st->height) * st->width;
+        uint16_t * raw = st->image;
+        uint16_t max = 0;
+
+        if(st->dark_frame) df_subtract_range(st->video, raw, begin, end);
+        if(st->shift)
+        {
+            for(uint32_t i = begin; i < end; ++i)
+            {
+                raw[i] <<= st->shift;
+                max = MAX(max, raw[i]);
+            }
+        }
+        else
+        {
+            for(uint32_t i = begin; i < end; ++i) max = MAX(max, raw[i]);
+        }
+        st->band_max[band] = max;
+    }
+}
+
+/* first sweep: dark frame and 14bit scaling, returns the frame maximum */
+static uint16_t point_stages_in(point_stages * st)
+{
+    int bands = (st->height + LLRP_BAND_ROWS - 1) / LLRP_BAND_ROWS;
+    st->band_max = calloc(bands, sizeof(uint16_t));
+    if(!st->band_max) return 0;
+
+    parallel_for(0, bands, 1, point_stages_in_bands, st);
+
+    uint16_t max = 0;
+    for(int band = 0; band < bands; band++) max = MAX(max, st->band_max[band]);
+    free(st->band_max);
+    st->band_max = NULL;
+    return max;
+}
+
+static void point_stages_out_bands(void * arg, int first, int last)
+{
+    point_stages * st = arg;
+
+    for(int band = first; band < last; band++)
+    {
+        int y1 = band * LLRP_BAND_ROWS;
+        int y2 = MIN(y1 + LLRP_BAND_ROWS, st->height);
+
+        if(st->stripes) apply_vertical_stripes_rows(st->stripes, st->image, st->black, st->white, st->width, y1, y2);
+        if(st->undo_shift) undo_14bit_range(st->image, (uint32_t)y1 * st->width, (uint32_t)y2 * st->width, st->undo_shift);
+    }
+}
+
+/* second sweep: vertical stripes and rounding back to the initial bit depth */
+static void point_stages_out(point_stages * st)
+{
+    int bands = (st->height + LLRP_BAND_ROWS - 1) / LLRP_BAND_ROWS;
+    parallel_for(0, bands, 1, point_stages_out_bands, st);
+}
+
+typedef struct
+{
+    uint16_t * image_data;
+    int32_t black_level;
+    double scale_ratio;
+} scale_range_job;
+
+static void scale_restricted_block(void * arg, int begin, int end)
+{
+    scale_range_job * job = arg;
+    uint16_t * image_data = job->image_data;
+
+    for(int i = begin; i < end; ++i)
+    {
+        image_data[i] = MIN( (uint16_t)((double)((image_data[i] - job->black_level) * job->scale_ratio + job->black_level) + 0.5), 16383);
+    }
+}
+
 /* rescale restricted to imaginary 10-12bit levels of lossless raw data to about real 14bit range */
 static void scale_restricted_range(struct raw_info * raw_info, uint16_t * image_data)
 {
@@ -107,11 +236,8 @@ static void scale_restricted_range(struct raw_info * raw_info, uint16_t * image_
     double scale_ratio = (double)(scaled_white_level - raw_info->black_level) / (double)(raw_info->white_level - raw_info->black_level);
     raw_info->white_level = scaled_white_level;
 
-#pragma omp parallel for
-    for(uint32_t i = 0; i < pixel_count; ++i)
-    {
-        image_data[i] = MIN( (uint16_t)((double)((image_data[i] - raw_info->black_level) * scale_ratio + raw_info->black_level) + 0.5), 16383);
-    }
+    scale_range_job job = { image_data, raw_info->black_level, scale_ratio };
+    parallel_for(0, pixel_count, 65536, scale_restricted_block, &job);
 }
 
 /* initialise low level raw processing struct */
@@ -137,19 +263,61 @@ llrawprocObject_t * initLLRawProcObject()
     llrawproc->diso_averaging = 0;
     llrawproc->diso_alias_map = 0;
     llrawproc->diso_frblending = 0;
+    llrawproc->diso_calibration = DISOC_CLIP;
     llrawproc->dark_frame = 0;
+    llrawproc->device_stages = 0;
 
     llrawproc->dark_frame_filename = NULL;
     llrawproc->dark_frame_data = NULL;
     llrawproc->dark_frame_size = 0;
+    llrawproc->dark_frame_shared = NULL;
 
     llrawproc->raw2ev = NULL;
     llrawproc->ev2raw = NULL;
 
+    llrawproc->diso_workspace = NULL;
+    llrawproc->diso_clip_state = NULL;
+
     llrawproc->focus_pixel_map.type = PIX_FOCUS;
     llrawproc->focus_pixel_map.pixels = NULL;
+    llrawproc->focus_pixel_map.shared = NULL;
     llrawproc->bad_pixel_map.type = PIX_BAD;
     llrawproc->bad_pixel_map.pixels = NULL;
+    llrawproc->bad_pixel_map.shared = NULL;
+
+    return llrawproc;
+}
+
+/* Copy the settings and clip state of a processing object, without its buffers,
+ * maps and LUTs which the copy loads again on first use. Lets every reader of
+ * a clip process frames independently */
+llrawprocObject_t * copyLLRawProcObject(llrawprocObject_t * source)
+{
+    llrawprocObject_t * llrawproc = malloc(sizeof(llrawprocObject_t));
+    memcpy(llrawproc, source, sizeof(llrawprocObject_t));
+
+    llrawproc->first_time = 1;
+    llrawproc->fpm_status = 0;
+    llrawproc->bpm_status = 0;
+
+    llrawproc->dark_frame_filename = NULL;
+    llrawproc->dark_frame_data = NULL;
+    llrawproc->dark_frame_size = 0;
+    llrawproc->dark_frame_shared = NULL;
+
+    llrawproc->raw2ev = NULL;
+    llrawproc->ev2raw = NULL;
+
+    llrawproc->diso_workspace = NULL;
+    llrawproc->diso_clip_state = NULL;
+
+    memset(&llrawproc->focus_pixel_map, 0, sizeof(pixel_map));
+    llrawproc->focus_pixel_map.type = PIX_FOCUS;
+    memset(&llrawproc->bad_pixel_map, 0, sizeof(pixel_map));
+    llrawproc->bad_pixel_map.type = PIX_BAD;
+
+    memset(&llrawproc->stripe_corrections, 0, sizeof(stripes_correction));
+    memset(&llrawproc->device_frame, 0, sizeof(llrp_device_frame));
 
     return llrawproc;
 }
@@ -159,71 +327,307 @@ void freeLLRawProcObject(mlvObject_t * video)
     df_free_filename(video);
     df_free(video);
     free_luts(video->llrawproc->raw2ev, video->llrawproc->ev2raw);
+    diso_workspace_free(video->llrawproc->diso_workspace);
+    if(video->llrawproc->diso_clip_state) sc_release(video->llrawproc->diso_clip_state);
     free_pixel_maps(&(video->llrawproc->focus_pixel_map), &(video->llrawproc->bad_pixel_map));
     free(video->llrawproc);
 }
 
+/* black/white levels and LUTs, set up with the 14bit levels of the clip */
+static void llrp_first_time(mlvObject_t * video, struct raw_info * raw_info)
+{
+    if(!video->llrawproc->first_time) return;
+
+    /* initialize dual iso black and white levels */
+    llrpResetDngBWLevels(video);
+
+    /* initialise LUTs */
+    video->llrawproc->raw2ev = get_raw2ev(raw_info->black_level);
+    video->llrawproc->ev2raw = get_ev2raw(raw_info->black_level);
+
+    video->llrawproc->first_time = 0;
+}
+
+/* frame geometry of the dual iso processing, returns 1 if lossless raw data
+   is restricted to imaginary 8-12bit levels and has to be scaled first */
+static int llrp_diso_raw_info(mlvObject_t * video, struct raw_info * raw_info)
+{
+    raw_info->width = video->RAWI.xRes;
+    raw_info->height = video->RAWI.yRes;
+    raw_info->pitch = video->RAWI.xRes;
+    raw_info->active_area.x1 = 0;
+    raw_info->active_area.y1 = 0;
+    raw_info->active_area.x2 = raw_info->width;
+    raw_info->active_area.y2 = raw_info->height;
+    return (video->MLVI.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92) && raw_info->white_level < 15000;
+}
+
+/* dual iso calibration shared by the readers of a clip */
+struct diso_clip_state
+{
+    diso_calibration_t clip;        /* measured on frames spread over the clip */
+    pthread_mutex_t mutex;          /* guards the running estimate */
+    diso_calibration_t running;     /* per frame mode, average of the frames measured before */
+    int64_t last_frame;             /* frame number running was last updated with, -1 for none */
+};
+
+static void llrp_diso_clip_state_free(void * value)
+{
+    struct diso_clip_state * state = value;
+    pthread_mutex_destroy(&state->mutex);
+    free(state);
+}
+
+/* measure the dual iso calibration on frames spread over the clip, read without
+   the pixel fixes which hardly change it. Called by sc_acquire for a missing key,
+   an empty calibration is cached too and makes every frame measure its own */
+static void * llrp_diso_calibrate_clip(void * arg)
+{
+    mlvObject_t * video = arg;
+    uint32_t pixel_count = video->RAWI.xRes * video->RAWI.yRes;
+    struct diso_clip_state * state = calloc(1, sizeof(struct diso_clip_state));
+    uint16_t * frame = malloc(pixel_count * sizeof(uint16_t));
+    if(!state || !frame)
+    {
+        /* nothing cached, frames are processed without calibration */
+        free(state);
+        free(frame);
+        return NULL;
+    }
+    diso_calibration_t * calib = &state->clip;
+    int bpp = video->RAWI.raw_info.bits_per_pixel;
+
+    /* reading a frame replaces the header of the one being processed */
+    mlv_vidf_hdr_t vidf = video->VIDF;
+
+    uint32_t samples = MIN(DISO_CALIBRATION_FRAMES, video->frames);
+    for(uint32_t k = 0; k < samples; ++k)
+    {
+        uint64_t frame_index = (uint64_t)(2 * k + 1) * video->frames / (2 * samples);
+        if(getMlvRawFrameUint16(video, frame_index, frame)) continue;
+
+        struct raw_info raw_info = video->RAWI.raw_info;
+        if(bpp < 14)
+        {
+            int shift = make_14bit(&raw_info);
+            for(uint32_t i = 0; i < pixel_count; ++i) frame[i] <<= shift;
+        }
+        if(llrp_diso_raw_info(video, &raw_info))
+        {
+            scale_restricted_range(&raw_info, frame);
+        }
+
+        diso_calibration_t frame_calib;
+        if(diso_calibrate(video->llrawproc->diso_workspace, raw_info, frame, &frame_calib) && frame_calib.matched)
+        {
+            diso_calibration_mix(calib, &frame_calib, 1.0 / (calib->frames + 1));
+        }
+    }
+#ifndef STDOUT_SILENT
+    printf("Dual iso calibration: %d of %u frames\n", calib->frames, samples);
+#endif
+
+    video->VIDF = vidf;
+    free(frame);
+
+    pthread_mutex_init(&state->mutex, NULL);
+    state->last_frame = -1;
+    return state;
+}
+
+/* calibration the 20bit processing of this frame uses, NULL to measure the frame alone */
+static const diso_calibration_t * llrp_diso_calibration(mlvObject_t * video, struct raw_info raw_info, uint16_t * raw_image_buff, diso_calibration_t * frame_calib)
+{
+    if(!video->llrawproc->diso_clip_state)
+    {
+        char key[1100];
+        sc_file_key("diso", video->path, key, sizeof(key));
+        video->llrawproc->diso_clip_state = sc_acquire(key, llrp_diso_calibrate_clip, llrp_diso_clip_state_free, video);
+    }
+
+    struct diso_clip_state * state = video->llrawproc->diso_clip_state;
+    if(!state || !state->clip.frames) return NULL;
+    if(video->llrawproc->diso_calibration != DISOC_FRAME) return &state->clip;
+
+    /* measure this frame outside of the lock, frames not looking like dual iso keep the running one */
+    diso_calibration_t measured;
+    int matched = diso_calibrate(video->llrawproc->diso_workspace, raw_info, raw_image_buff, &measured) && measured.matched;
+    int64_t frame_number = video->VIDF.frameNumber;
+
+    pthread_mutex_lock(&state->mutex);
+    if(state->last_frame < 0 || ABS(frame_number - state->last_frame) > DISO_FRAME_GAP)
+    {
+        /* first frame or seek, start over from the clip measurement */
+        state->running = state->clip;
+    }
+    if(matched)
+    {
+        diso_calibration_mix(&state->running, &measured, DISO_FRAME_WEIGHT);
+    }
+    state->last_frame = frame_number;
+    *frame_calib = state->running;
+    pthread_mutex_unlock(&state->mutex);
+
+    return frame_calib;
+}
+
+/* parameters of the focus pixel map */
+static void llrp_focus_mode(mlvObject_t * video, int * crop_rec, int * unified_mode)
+{
+    /* detect crop_rec mode */
+    *crop_rec = (llrpDetectFocusDotFixMode(video) == 2) ? 1 : (video->llrawproc->focus_pixels == 2);
+    /* if raw data is lossless set unified mode */
+    *unified_mode = (video->MLVI.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92) ? 5 : 0;
+}
+
+/* The device runs its stages after the host, so it can only take the last
+ * active stages: walking back from the end, stop at the first active stage
+ * it does not support */
+static int llrp_device_tail(mlvObject_t * video, int dark_frame, int fix_focus, int host_only, int smooth)
+{
+    int allowed = video->llrawproc->device_stages;
+    int tail = 0;
+
+    if(smooth)
+    {
+        if(!(allowed & LLRP_DEVICE_CHROMA_SMOOTH)) return tail;
+        tail |= LLRP_DEVICE_CHROMA_SMOOTH;
+    }
+    /* bad pixels, pattern noise and dual iso */
+    if(host_only) return tail;
+    if(fix_focus)
+    {
+        /* the first frame loads the map on the host, dual iso clips use another interpolation */
+        if(!(allowed & LLRP_DEVICE_FOCUS_PIXELS) || video->llrawproc->fpi_method != FPI_MLVFS ||
+           video->llrawproc->fpm_status != 2 || video->llrawproc->dual_iso) return tail;
+        tail |= LLRP_DEVICE_FOCUS_PIXELS;
+    }
+    if(video->llrawproc->vertical_stripes) return tail;
+    if(dark_frame && (allowed & LLRP_DEVICE_DARK_FRAME))
+    {
+        tail |= LLRP_DEVICE_DARK_FRAME;
+    }
+    return tail;
+}
+
 /* all low level raw processing takes place here */
 void applyLLRawProcObject(mlvObject_t * video, uint16_t * raw_image_buff, size_t raw_image_size)
 {
     /* if 'fix_raw == false' skip raw processing alltogether */
     if(!video->llrawproc->fix_raw) return;
 
+    /* make copy of 'RAWI.raw_info' struct for subsequent modification */
+    struct raw_info raw_info = video->RAWI.raw_info;
+    uint32_t bpp = video->RAWI.raw_info.bits_per_pixel;
+
+    point_stages stages = { 0 };
+    stages.video = video;
+    stages.image = raw_image_buff;
+    stages.width = video->RAWI.xRes;
+    stages.height = (raw_image_size / 2) / video->RAWI.xRes;
+
     /* subtruct dark frame if Ext or Int mode specified and df_init is successful */
     if (video->llrawproc->dark_frame_data)//!df_init(video))
     {
+        stages.dark_frame = !df_check(video, raw_image_size);
 #ifndef STDOUT_SILENT
-        printf("Subtracting Dark Frame... ");
-#endif
-        df_subtract(video, raw_image_buff, raw_image_size);
-#ifndef STDOUT_SILENT
-        printf("Done\n\n");
+        if(stages.dark_frame) printf("Subtracting Dark Frame...\n\n");
 #endif
     }
 
-    /* make copy of 'RAWI.raw_info' struct for subsequent modification */
-    struct raw_info raw_info = video->RAWI.raw_info;
-
     /* convert uncompressed 10/12bit raw data to 14bits for correct processing */
-    if(video->RAWI.raw_info.bits_per_pixel < 14)
+    if(bpp < 14)
     {
-        make_14bit(raw_image_buff, raw_image_size, &raw_info);
+        stages.shift = make_14bit(&raw_info);
     }
 
     /* do one time stuff */
-    if(video->llrawproc->first_time)
+    llrp_first_time(video, &raw_info);
+
+    int fix_focus = video->llrawproc->focus_pixels && video->llrawproc->fpm_status < 3;
+    int fix_bad = video->llrawproc->bad_pixels && video->llrawproc->bpm_status < 3;
+    int fix_pattern = !video->llrawproc->diso_validity && video->llrawproc->pattern_noise;
+    int fix_dual_iso = video->llrawproc->diso_validity && video->llrawproc->dual_iso;
+    int smooth = video->llrawproc->chroma_smooth && video->llrawproc->dual_iso != 1;
+    /* undo 14bit conversion of uncompressed 10/12bit raw data, except when 20bit dual iso processing is active */
+    int undo = (bpp < 14) && video->llrawproc->dual_iso != 1;
+    /* the rounding back can join the per pixel stages if nothing else needs 14bit data */
+    int undo_fused = undo && !(fix_focus || fix_bad || fix_pattern || fix_dual_iso || smooth);
+
+    /* without stripes, shifting to 14bit and back is a no-op */
+    if(undo_fused && !video->llrawproc->vertical_stripes)
     {
-        /* initialize dual iso black and white levels */
-        llrpResetDngBWLevels(video);
+        stages.shift = 0;
+        undo = undo_fused = 0;
+    }
 
-        /* initialise LUTs */
-        video->llrawproc->raw2ev = get_raw2ev(raw_info.black_level);
-        video->llrawproc->ev2raw = get_ev2raw(raw_info.black_level);
+    /* leave the last stages to the device if the caller can run them */
+    llrp_device_frame * device = &video->llrawproc->device_frame;
+    memset(device, 0, sizeof(llrp_device_frame));
+    if(video->llrawproc->device_stages)
+    {
+        device->stages = llrp_device_tail(video, stages.dark_frame, fix_focus, fix_bad || fix_pattern || fix_dual_iso, smooth);
+    }
+    if(device->stages)
+    {
+        if(device->stages & LLRP_DEVICE_DARK_FRAME)
+        {
+            /* the 14bit scaling follows the subtraction */
+            stages.dark_frame = 0;
+            device->shift_in = stages.shift;
+            stages.shift = 0;
+        }
+        /* rounding back to the initial bit depth is left out, the device
+           keeps the 14bit precision and scales the levels instead */
+        if(undo)
+        {
+            device->shift_out = 14 - bpp;
+            undo = undo_fused = 0;
+        }
+        device->crop_x = (video->VIDF.panPosX + 7) & ~7;
+        device->crop_y = video->VIDF.panPosY & ~1;
+        if(device->stages & LLRP_DEVICE_FOCUS_PIXELS) fix_focus = 0;
+        if(device->stages & LLRP_DEVICE_CHROMA_SMOOTH) smooth = 0;
+    }
 
-        video->llrawproc->first_time = 0;
+    if(stages.dark_frame || stages.shift || video->llrawproc->vertical_stripes)
+    {
+        uint16_t max = point_stages_in(&stages);
+
+        /* fix vertical stripes */
+        if (video->llrawproc->vertical_stripes)
+        {
+            detect_vertical_stripes(&video->llrawproc->stripe_corrections,
+                                    raw_image_buff,
+                                    raw_info.black_level,
+                                    raw_info.white_level,
+                                    raw_info.frame_size,
+                                    video->RAWI.xRes,
+                                    video->RAWI.yRes,
+                                    video->llrawproc->vertical_stripes,
+                                    &video->llrawproc->compute_stripes);
+            stages.stripes = &video->llrawproc->stripe_corrections;
+            stages.black = raw_info.black_level;
+            stages.white = MAX(raw_info.white_level * 2 / 3, max);
+        }
     }
 
-    /* fix vertical stripes */
-    if (video->llrawproc->vertical_stripes)
+    if(undo_fused)
     {
-        fix_vertical_stripes(&video->llrawproc->stripe_corrections,
-                             raw_image_buff,
-                             raw_info.black_level,
-                             raw_info.white_level,
-                             raw_info.frame_size,
-                             video->RAWI.xRes,
-                             video->RAWI.yRes,
-                             video->llrawproc->vertical_stripes,
-                             &video->llrawproc->compute_stripes);
+        stages.undo_shift = 14 - bpp;
+        undo = 0;
+    }
+
+    if(stages.stripes || stages.undo_shift)
+    {
+        point_stages_out(&stages);
     }
 
     /* fix focus pixels */
-    if (video->llrawproc->focus_pixels && video->llrawproc->fpm_status < 3)
+    if (fix_focus)
     {
-        /* detect crop_rec mode */
-        int crop_rec = (llrpDetectFocusDotFixMode(video) == 2) ? 1 : (video->llrawproc->focus_pixels == 2);
-        /* if raw data is lossless set unified mode */
-        int unified_mode = (video->MLVI.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92) ? 5 : 0;
+        int crop_rec, unified_mode;
+        llrp_focus_mode(video, &crop_rec, &unified_mode);
         fix_focus_pixels(&video->llrawproc->focus_pixel_map,
                          &video->llrawproc->fpm_status,
                          raw_image_buff,
@@ -243,7 +647,7 @@ void applyLLRawProcObject(mlvObject_t * video, uint16_t * raw_image_buff, size_t
     }
 
     /* fix bad pixels */
-    if (video->llrawproc->bad_pixels && video->llrawproc->bpm_status < 3)
+    if (fix_bad)
     {
         fix_bad_pixels(&video->llrawproc->bad_pixel_map,
                        &video->llrawproc->bpm_status,
@@ -265,7 +669,7 @@ void applyLLRawProcObject(mlvObject_t * video, uint16_t * raw_image_buff, size_t
     }
 
     /* fix pattern noise */
-    if (!video->llrawproc->diso_validity && video->llrawproc->pattern_noise)
+    if (fix_pattern)
     {
 #ifndef STDOUT_SILENT
         printf("Fixing pattern noise... ");
@@ -277,17 +681,10 @@ void applyLLRawProcObject(mlvObject_t * video, uint16_t * raw_image_buff, size_t
     }
 
     /* if dual iso valid/forced and processing is turned on */
-    if(video->llrawproc->diso_validity && video->llrawproc->dual_iso)
-    {
-        raw_info.width = video->RAWI.xRes;
-        raw_info.height = video->RAWI.yRes;
-        raw_info.pitch = video->RAWI.xRes;
-        raw_info.active_area.x1 = 0;
-        raw_info.active_area.y1 = 0;
-        raw_info.active_area.x2 = raw_info.width;
-        raw_info.active_area.y2 = raw_info.height;
+    if(fix_dual_iso)
+    {
         /* detect if lossless raw data is restricted to imaginary 8-12bit levels */
-        int restricted_lossless = (video->MLVI.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92) && raw_info.white_level < 15000;
+        int restricted_lossless = llrp_diso_raw_info(video, &raw_info);
         if(restricted_lossless)
         {
 #ifndef STDOUT_SILENT
@@ -309,7 +706,15 @@ void applyLLRawProcObject(mlvObject_t * video, uint16_t * raw_image_buff, size_t
         /* dual iso processing */
         if (video->llrawproc->dual_iso == 1) // Full 20bit processing mode
         {
-            diso_get_full20bit(raw_info,
+            if (!video->llrawproc->diso_workspace)
+            {
+                video->llrawproc->diso_workspace = diso_workspace_create();
+            }
+
+            diso_calibration_t frame_calib;
+            diso_get_full20bit(video->llrawproc->diso_workspace,
+                               llrp_diso_calibration(video, raw_info, raw_image_buff, &frame_calib),
+                               raw_info,
                                raw_image_buff,
                                video->llrawproc->diso_averaging,
                                video->llrawproc->diso_alias_map,
@@ -334,7 +739,7 @@ void applyLLRawProcObject(mlvObject_t * video, uint16_t * raw_image_buff, size_t
     }
 
     /* do chroma smoothing */
-    if (video->llrawproc->chroma_smooth && video->llrawproc->dual_iso != 1) // do not smooth 20bit dualiso raw
+    if (smooth) // do not smooth 20bit dualiso raw
     {
 #ifndef STDOUT_SILENT
             printf("\nUsing chroma smooth method: '%dx%d'\n\n", video->llrawproc->chroma_smooth, video->llrawproc->chroma_smooth);
@@ -349,10 +754,10 @@ void applyLLRawProcObject(mlvObject_t * video, uint16_t * raw_image_buff, size_t
                       video->llrawproc->ev2raw);
     }
 
-    /* undo 14bit conversion of uncompressed 10/12bit raw data, except when 20bit dual iso processing is active */
-    if(video->RAWI.raw_info.bits_per_pixel < 14 && video->llrawproc->dual_iso != 1)
+    /* undo 14bit conversion if not done with the per pixel stages */
+    if(undo)
     {
-        undo_14bit(raw_image_buff, raw_image_size, video->RAWI.raw_info.bits_per_pixel);
+        undo_14bit(raw_image_buff, raw_image_size, bpp);
     }
 
     /* deflicker RAW data by changing 'tcBaselineExposure' tag in the exported DNG */
@@ -542,6 +947,16 @@ void llrpSetDualIsoFullResBlendingMode(mlvObject_t * video, int value)
     video->llrawproc->diso_frblending = value;
 }
 
+int llrpGetDualIsoCalibrationMode(mlvObject_t * video)
+{
+    return video->llrawproc->diso_calibration;
+}
+
+void llrpSetDualIsoCalibrationMode(mlvObject_t * video, int value)
+{
+    video->llrawproc->diso_calibration = value;
+}
+
 int llrpGetDualIsoValidity(mlvObject_t * video)
 {
     return video->llrawproc->diso_validity;
@@ -623,3 +1038,64 @@ int llrpValidateExtDarkFrame(mlvObject_t * video, const char * df_filename, char
 {
     return df_validate(video, df_filename, error_message);
 }
+
+void llrpFreeDarkFrame(mlvObject_t * video)
+{
+    df_free(video);
+}
+
+void llrpInvalidateExtDarkFrame(const char * df_filename)
+{
+    df_invalidate(df_filename);
+}
+
+/* device stages */
+void llrpSetDeviceStages(mlvObject_t * video, int stages)
+{
+    video->llrawproc->device_stages = stages;
+}
+
+llrp_device_frame llrpGetDeviceFrame(mlvObject_t * video)
+{
+    return video->llrawproc->device_frame;
+}
+
+int llrpGetDeviceData(mlvObject_t * video, llrp_device_data * data)
+{
+    memset(data, 0, sizeof(llrp_device_data));
+
+    struct raw_info raw_info = video->RAWI.raw_info;
+    if(raw_info.bits_per_pixel < 14) make_14bit(&raw_info);
+    llrp_first_time(video, &raw_info);
+    if(!video->llrawproc->raw2ev) return 1;
+
+    data->width = video->RAWI.xRes;
+    data->height = video->RAWI.yRes;
+    data->black = raw_info.black_level;
+    data->white = raw_info.white_level;
+    data->raw2ev = video->llrawproc->raw2ev;
+    data->ev2raw = video->llrawproc->ev2raw - 10 * 65536;
+    data->chroma_smooth = video->llrawproc->chroma_smooth;
+
+    if(video->llrawproc->dark_frame_data && video->llrawproc->dark_frame_size == (uint32_t)data->width * data->height * 2)
+    {
+        data->dark_frame = video->llrawproc->dark_frame_data;
+        data->dark_frame_black = video->llrawproc->dark_frame_hdr.black_level;
+        data->dark_frame_white = (1 << video->RAWI.raw_info.bits_per_pixel) - 1;
+    }
+
+    if(video->llrawproc->focus_pixels)
+    {
+        int crop_rec, unified_mode;
+        llrp_focus_mode(video, &crop_rec, &unified_mode);
+        if(load_focus_pixel_map(&video->llrawproc->focus_pixel_map, &video->llrawproc->fpm_status,
+                                video->IDNT.cameraModel, video->RAWI.raw_info.width, video->RAWI.raw_info.height,
+                                crop_rec, unified_mode))
+        {
+            data->focus_pixels = (const int *)video->llrawproc->focus_pixel_map.pixels;
+            data->focus_pixel_count = video->llrawproc->focus_pixel_map.count;
+        }
+    }
+
+    return 0;
+}
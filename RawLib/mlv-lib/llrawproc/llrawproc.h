@@ -25,6 +25,7 @@
 #include "../mlv_object.h"
 
 llrawprocObject_t * initLLRawProcObject();
+llrawprocObject_t * copyLLRawProcObject(llrawprocObject_t * source);
 void freeLLRawProcObject(mlvObject_t * video);
 
 /* all low level raw processing takes place here */
@@ -90,6 +91,13 @@ void llrpSetDualIsoAliasMapMode(mlvObject_t * video, int value);
 int llrpGetDualIsoFullResBlendingMode(mlvObject_t * video);
 void llrpSetDualIsoFullResBlendingMode(mlvObject_t * video, int value);
 
+/* the 20bit levels and exposure matching are measured once on frames spread
+   over the clip, or on every frame and averaged with the previous frames so
+   exposure and ISO changes along the clip are followed */
+enum { DISOC_CLIP, DISOC_FRAME };
+int llrpGetDualIsoCalibrationMode(mlvObject_t * video);
+void llrpSetDualIsoCalibrationMode(mlvObject_t * video, int value);
+
 enum { DISO_INVALID, DISO_FORCED, DISO_VALID }; // Return values
 int llrpGetDualIsoValidity(mlvObject_t * video);
 void llrpSetDualIsoValidity(mlvObject_t * video, int diso_force);
@@ -113,5 +121,35 @@ int llrpGetDarkFrameExtStatus(mlvObject_t * video);
 int llrpGetDarkFrameIntStatus(mlvObject_t * video);
 
 int llrpValidateExtDarkFrame(mlvObject_t * video, const char * df_filename, char * error_message);
+/* release the dark frame buffer, shared external dark frames are only freed by their last user */
+void llrpFreeDarkFrame(mlvObject_t * video);
+/* to be called after rewriting an external dark frame file */
+void llrpInvalidateExtDarkFrame(const char * df_filename);
+
+/* Stages run on a device (OpenCL) instead of the host. applyLLRawProcObject
+   only leaves them when every active stage after them is one of them too,
+   llrpGetDeviceFrame tells which ones the last frame needs */
+void llrpSetDeviceStages(mlvObject_t * video, int stages);
+llrp_device_frame llrpGetDeviceFrame(mlvObject_t * video);
+
+/* clip data of the device stages, valid as long as the processing settings */
+typedef struct
+{
+    int width;
+    int height;
+    int black;                  // 14bit levels
+    int white;
+    const int * raw2ev;         // 65536 entries
+    const int * ev2raw;         // 24 * 65536 entries, from -10 to 14 EV
+    int chroma_smooth;          // 2, 3 or 5
+    const uint16_t * dark_frame; // NULL without a usable dark frame
+    int dark_frame_black;
+    int dark_frame_white;       // clamp of the subtraction
+    const int * focus_pixels;   // x, y pairs, NULL without map
+    size_t focus_pixel_count;
+} llrp_device_data;
+
+/* loads LUTs and maps if needed, returns 0 on success */
+int llrpGetDeviceData(mlvObject_t * video, llrp_device_data * data);
 
 #endif
@@ -28,6 +28,19 @@
 #include "pixelproc.h"
 #include "stripes.h"
 
+/* stages a device (OpenCL) can run after the host processing of a frame */
+enum { LLRP_DEVICE_DARK_FRAME = 1, LLRP_DEVICE_FOCUS_PIXELS = 2, LLRP_DEVICE_CHROMA_SMOOTH = 4 };
+
+/* what the host processing of a frame left to the device */
+typedef struct
+{
+    int stages;           // LLRP_DEVICE_* to run, in the order of the enum
+    int shift_in;         // shift to 14bit the device applies after the dark frame subtraction
+    int shift_out;        // the device output stays 14bit, its levels are the DNG ones shifted by this
+    int crop_x;           // offset of the focus pixel map for this frame
+    int crop_y;
+} llrp_device_frame;
+
 /* Low level raw processing object */
 typedef struct
 {
@@ -54,7 +67,10 @@ typedef struct
     int diso_averaging;   // dual iso interpolation method, 0 - amaze-edge, 1 - mean23
     int diso_alias_map;   // flag for Alias Map switchin on/off
     int diso_frblending;  // flag for Fullres Blending switching on/off
+    int diso_calibration; // dual iso calibration, 0 - once per clip, 1 - every frame, running average over the previous frames
     int dark_frame;       // flag for Dark Frame subtraction mode 0 = off, 1 = ext, 2 = int
+    int device_stages;    // LLRP_DEVICE_* stages the caller runs on a device when possible
+    llrp_device_frame device_frame; // stages the last processed frame left to the device
 
     /* cDNG bit depth and black/white levels */
     int dng_bit_depth;
@@ -68,11 +84,19 @@ typedef struct
     /* external dark frame buffer pointer and its size */
     uint16_t * dark_frame_data;
     uint32_t dark_frame_size;
+    /* shared cache entry owning dark_frame_data, NULL if the buffer is owned */
+    void * dark_frame_shared;
 
     /* LUTs */
     int * raw2ev;
     int * ev2raw;
 
+    /* dual iso 20bit buffers and LUTs, created on the first dual iso frame */
+    struct diso_workspace * diso_workspace;
+    /* dual iso calibration of the clip and running per frame estimate, a shared cache entry,
+       created on the first dual iso frame */
+    struct diso_clip_state * diso_clip_state;
+
     /* pixel maps */
     pixel_map focus_pixel_map;
     pixel_map bad_pixel_map;
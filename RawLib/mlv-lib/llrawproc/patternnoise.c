@@ -26,6 +26,7 @@
 #include "math.h"
 
 #include "wirth.h"
+#include "../parallel.h"
 #include "patternnoise.h"
 
 static int g_debug_flags;
@@ -47,46 +48,91 @@ _a > _b ? _a : _b; })
 #define COERCE(x,lo,hi) MAX(MIN((x),(hi)),(lo))
 #define COUNT(x)        ((int)(sizeof(x)/sizeof((x)[0])))
 
-/* out = a - b */
-static void subtract(int16_t * a, int16_t * b, int16_t * out, int w, int h)
+/* pixels and rows processed by one task */
+#define PN_PIXEL_GRAIN 16384
+#define PN_ROW_GRAIN 16
+
+/* arguments of the loops below, each one uses a few of them */
+typedef struct
 {
-    #pragma omp parallel for
-    for (int i = 0; i < w*h; i++)
+    int16_t * in;
+    int16_t * in2;
+    int16_t * out;
+    int w;
+    int h;
+    int dx;
+    int dy;
+    int white;
+    int offset;
+    int * col_offsets;
+} pn_job;
+
+static void subtract_block(void * arg, int begin, int end)
+{
+    pn_job * job = (pn_job *)arg;
+    for (int i = begin; i < end; i++)
     {
-        out[i] = a[i] - b[i];
+        job->out[i] = job->in[i] - job->in2[i];
     }
 }
 
-/* out = (a + b) / 2 */
-static void average(int16_t * a, int16_t * b, int16_t * out, int w, int h)
+static void average_block(void * arg, int begin, int end)
 {
-    #pragma omp parallel for
-    for (int i = 0; i < w*h; i++)
+    pn_job * job = (pn_job *)arg;
+    for (int i = begin; i < end; i++)
     {
-        out[i] = ((int)a[i] + (int)b[i]) / 2;
+        job->out[i] = ((int)job->in[i] + (int)job->in2[i]) / 2;
     }
 }
 
-/* w and h are the size of input buffer; the output buffer will have the dimensions swapped */
-static void transpose(int16_t * in, int16_t * out, int w, int h)
+static void transpose_rows(void * arg, int y1, int y2)
 {
-    #pragma omp parallel for collapse(2)
-    for (int y = 0; y < h; y++)
+    pn_job * job = (pn_job *)arg;
+    int w = job->w;
+    int h = job->h;
+    for (int y = y1; y < y2; y++)
     {
         for (int x = 0; x < w; x++)
         {
-            out[y + x*h] = in[x + y*w];
+            job->out[y + x*h] = job->in[x + y*w];
         }
     }
 }
 
-static void horizontal_gradient(int16_t * in, int16_t * out, int w, int h)
+static void horizontal_gradient_block(void * arg, int begin, int end)
 {
-    #pragma omp parallel for
-    for (int i = 2; i < w*h-2; i++)
+    pn_job * job = (pn_job *)arg;
+    for (int i = begin; i < end; i++)
     {
-        out[i] = in[i-2] - in[i+2];
+        job->out[i] = job->in[i-2] - job->in[i+2];
     }
+}
+
+/* out = a - b */
+static void subtract(int16_t * a, int16_t * b, int16_t * out, int w, int h)
+{
+    pn_job job = { .in = a, .in2 = b, .out = out };
+    parallel_for(0, w*h, PN_PIXEL_GRAIN, subtract_block, &job);
+}
+
+/* out = (a + b) / 2 */
+static void average(int16_t * a, int16_t * b, int16_t * out, int w, int h)
+{
+    pn_job job = { .in = a, .in2 = b, .out = out };
+    parallel_for(0, w*h, PN_PIXEL_GRAIN, average_block, &job);
+}
+
+/* w and h are the size of input buffer; the output buffer will have the dimensions swapped */
+static void transpose(int16_t * in, int16_t * out, int w, int h)
+{
+    pn_job job = { .in = in, .out = out, .w = w, .h = h };
+    parallel_for(0, h, PN_ROW_GRAIN, transpose_rows, &job);
+}
+
+static void horizontal_gradient(int16_t * in, int16_t * out, int w, int h)
+{
+    pn_job job = { .in = in, .out = out };
+    parallel_for(2, w*h-2, PN_PIXEL_GRAIN, horizontal_gradient_block, &job);
     
     out[0] = out[1] = out[w*h-1] = out[w*h-2] = 0;
 }
@@ -187,6 +233,47 @@ static void horizontal_edge_aware_blur_rggb(
     free(dif_bg);
 }
 
+static void column_noise_mask_rows(void * arg, int y1, int y2)
+{
+    pn_job * job = (pn_job *)arg;
+    int w = job->w;
+    for (int y = y1; y < y2; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            int pixel = job->in[x + y*w];
+            int hgradient = abs(job->in2[x + y*w]);
+            
+            job->out[x + y*w] =
+            (hgradient > 500) ||   /* mask out pixels on a strong edge, that is clearly not pattern noise */
+            (pixel >= job->white); /* mask out bright pixels (caveat: you really need to set the correct white level for this to work) */
+        }
+    }
+}
+
+static void column_offsets_rows(void * arg, int y1, int y2)
+{
+    pn_job * job = (pn_job *)arg;
+    int w = job->w;
+    for (int y = y1; y < y2; y++)
+    {
+        for (int x = 0; x < w; x++)
+        {
+            job->out[x + y*w] = COERCE((int)job->out[x + y*w] + job->col_offsets[x], -32767, 32767);
+        }
+    }
+}
+
+static void remove_offset_block(void * arg, int begin, int end)
+{
+    pn_job * job = (pn_job *)arg;
+    for (int i = begin; i < end; i++)
+    {
+        /* FIXME: clamping to 32766 causes overflow */
+        job->out[i] = COERCE((int)job->out[i] - job->offset, 0, 32760);
+    }
+}
+
 /* Find and apply a scalar offset to each column, to reduce pattern noise */
 /* original: input and output */
 /* denoised: input only */
@@ -207,19 +294,8 @@ static void fix_column_noise(int16_t * original, int16_t * denoised, int w, int
     
     horizontal_gradient(original, hgrad, w, h);
 
-    #pragma omp parallel for collapse(2)
-    for (int y = 0; y < h; y++)
-    {
-        for (int x = 0; x < w; x++)
-        {
-            int pixel = original[x + y*w];
-            int hgradient = abs(hgrad[x + y*w]);
-            
-            mask[x + y*w] =
-            (hgradient > 500) ||   /* mask out pixels on a strong edge, that is clearly not pattern noise */
-            (pixel >= white);      /* mask out bright pixels (caveat: you really need to set the correct white level for this to work) */
-        }
-    }
+    pn_job mask_job = { .in = original, .in2 = hgrad, .out = mask, .w = w, .white = white };
+    parallel_for(0, h, PN_ROW_GRAIN, column_noise_mask_rows, &mask_job);
     
     if (g_debug_flags & FIXPN_DBG_DENOISED)
     {
@@ -264,25 +340,15 @@ static void fix_column_noise(int16_t * original, int16_t * denoised, int w, int
     }
     
     /* almost done, now apply the offsets */
-    #pragma omp parallel for collapse(2)
-    for (int y = 0; y < h; y++)
-    {
-        for (int x = 0; x < w; x++)
-        {
-            original[x + y*w] = COERCE((int)original[x + y*w] + col_offsets[x], -32767, 32767);
-        }
-    }
+    pn_job offsets_job = { .out = original, .w = w, .col_offsets = col_offsets };
+    parallel_for(0, h, PN_ROW_GRAIN, column_offsets_rows, &offsets_job);
     
     /* remove median from offsets, to prevent color cast */
     /* note: median modifies the array, so we do this after applying the offsets to the image */
     int mc = median_int_wirth(col_offsets, w);
 
-    #pragma omp parallel for
-    for (int i = 0; i < w*h; i++)
-    {
-        /* FIXME: clamping to 32766 causes overflow */
-        original[i] = COERCE((int)original[i] - mc, 0, 32760);
-    }
+    pn_job median_job = { .out = original, .offset = mc };
+    parallel_for(0, w*h, PN_PIXEL_GRAIN, remove_offset_block, &median_job);
     
 end:
     free(noise);
@@ -295,33 +361,47 @@ end:
 /* extract a color channel from a Bayer image */
 /* w and h are the size of the input buffer; output will be half-res */
 /* dx and dy can be 0 or 1 */
-static void extract_channel(int16_t * in, int16_t * out, int w, int h, int dx, int dy)
+static void extract_channel_rows(void * arg, int k1, int k2)
 {
-    #pragma omp parallel for collapse(2)
-    for (int y = dy; y < h; y += 2)
+    pn_job * job = (pn_job *)arg;
+    int w = job->w;
+    for (int y = job->dy + 2*k1; y < job->dy + 2*k2; y += 2)
     {
-        for (int x = dx; x < w; x += 2)
+        for (int x = job->dx; x < w; x += 2)
         {
-            out[(x/2) + (y/2)*(w/2)] = in[x + y*w];
+            job->out[(x/2) + (y/2)*(w/2)] = job->in[x + y*w];
         }
     }
 }
 
+static void extract_channel(int16_t * in, int16_t * out, int w, int h, int dx, int dy)
+{
+    pn_job job = { .in = in, .out = out, .w = w, .dx = dx, .dy = dy };
+    parallel_for(0, (h - dy + 1) / 2, PN_ROW_GRAIN, extract_channel_rows, &job);
+}
+
 /* set a color channel into a Bayer image */
 /* w and h are the size of the output buffer (full-size image); input will be half-res */
 /* dx and dy can be 0 or 1 */
-static void set_channel(int16_t * out, int16_t * in, int w, int h, int dx, int dy)
+static void set_channel_rows(void * arg, int k1, int k2)
 {
-    #pragma omp parallel for collapse(2)
-    for (int y = dy; y < h; y += 2)
+    pn_job * job = (pn_job *)arg;
+    int w = job->w;
+    for (int y = job->dy + 2*k1; y < job->dy + 2*k2; y += 2)
     {
-        for (int x = dx; x < w; x += 2)
+        for (int x = job->dx; x < w; x += 2)
         {
-            out[x + y*w] = in[(x/2) + (y/2)*(w/2)];
+            job->out[x + y*w] = job->in[(x/2) + (y/2)*(w/2)];
         }
     }
 }
 
+static void set_channel(int16_t * out, int16_t * in, int w, int h, int dx, int dy)
+{
+    pn_job job = { .in = in, .out = out, .w = w, .dx = dx, .dy = dy };
+    parallel_for(0, (h - dy + 1) / 2, PN_ROW_GRAIN, set_channel_rows, &job);
+}
+
 static void fix_column_noise_rggb(int16_t * raw, int w, int h, int white)
 {
     /* assume Bayer order [RGGB] */
@@ -21,6 +21,7 @@
 
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -31,6 +32,8 @@
 #include "wirth.h"
 #include "raw.h"
 #include "pixelproc.h"
+#include "sharedcache.h"
+#include "../parallel.h"
 
 char FOCUSPIXELMAP_DIRECTORY[256];
 int  FOCUSPIXELMAP_OK = 0;
@@ -60,17 +63,40 @@ int  FOCUSPIXELMAP_OK = 0;
 #define FMT_SIZE "%zu"
 #endif
 
+/* LUT entries computed by one task */
+#define LUT_GRAIN 4096
+
+typedef struct
+{
+    int * lut;
+    int black;
+} lut_job;
+
+static void raw2ev_block(void * arg, int begin, int end)
+{
+    lut_job * job = (lut_job *)arg;
+    for (int i = begin; i < end; i++)
+    {
+        job->lut[i] = log2(MAX(1, i - job->black)) * EV_RESOLUTION;
+    }
+}
+
+static void ev2raw_block(void * arg, int begin, int end)
+{
+    lut_job * job = (lut_job *)arg;
+    for (int i = begin; i < end; i++)
+    {
+        job->lut[i] = job->black + pow(2, (float)i / EV_RESOLUTION);
+    }
+}
+
 int * get_raw2ev(int black)
 {
     int * raw2ev = (int *)malloc(EV_RESOLUTION*sizeof(int));
     
     memset(raw2ev, 0, EV_RESOLUTION * sizeof(int));
-    int i;
-    #pragma omp parallel for
-    for (i = 0; i < EV_RESOLUTION; i++)
-    {
-        raw2ev[i] = log2(MAX(1, i - black)) * EV_RESOLUTION;
-    }
+    lut_job job = { raw2ev, black };
+    parallel_for(0, EV_RESOLUTION, LUT_GRAIN, raw2ev_block, &job);
 
     return raw2ev;
 }
@@ -80,12 +106,8 @@ int * get_ev2raw(int black)
     int * _ev2raw = (int *)malloc(24*EV_RESOLUTION*sizeof(int));
     int* ev2raw = _ev2raw + 10*EV_RESOLUTION;
 
-    int i;
-    #pragma omp parallel for
-    for (i = -10*EV_RESOLUTION; i < 14*EV_RESOLUTION; i++)
-    {
-        ev2raw[i] = black + pow(2, (float)i / EV_RESOLUTION);
-    }
+    lut_job job = { ev2raw, black };
+    parallel_for(-10*EV_RESOLUTION, 14*EV_RESOLUTION, LUT_GRAIN, ev2raw_block, &job);
 
     return ev2raw;
 }
@@ -105,36 +127,134 @@ void free_luts(int * raw2ev, int * ev2raw)
     }
 }
 
-void chroma_smooth(int method, uint16_t * image_data, int width, int height, int black, int white, int * raw2ev, int * ev2raw)
+/* rows filtered at once from the scratch buffer and rows handled by one thread */
+#define CHROMA_SMOOTH_BAND 16
+#define CHROMA_SMOOTH_SLAB 128
+
+typedef void (*chroma_smooth_func)(int w, int h, int y1, int y2, uint16_t * inp, uint16_t * out, int * raw2ev, int * ev2raw, int black, int white);
+
+typedef struct
 {
-    if(raw2ev == NULL) return;
-    
-    uint16_t * buf = (uint16_t *)malloc(width*height*sizeof(uint16_t));
-    if (!buf)
+    chroma_smooth_func smooth;
+    uint16_t * image_data;
+    uint16_t * edges;
+    int width;
+    int height;
+    int black;
+    int white;
+    int * raw2ev;
+    int * ev2raw;
+} chroma_smooth_job;
+
+/* saves the halo rows around the slabs [first, last) */
+static void chroma_smooth_save_edges(void * arg, int first, int last)
+{
+    chroma_smooth_job * job = (chroma_smooth_job *)arg;
+    const int halo = CHROMA_SMOOTH_HALO;
+    int width = job->width;
+    int height = job->height;
+    size_t row_size = width * sizeof(uint16_t);
+
+    for (int s = first; s < last; s++)
     {
-        return;
+        int s0 = s * CHROMA_SMOOTH_SLAB;
+        int s1 = MIN(s0 + CHROMA_SMOOTH_SLAB, height);
+        uint16_t * top = job->edges + (size_t)s * 2 * halo * width;
+        uint16_t * bottom = top + (size_t)halo * width;
+        for (int r = 0; r < halo; r++)
+        {
+            if (s0 - halo + r >= 0) memcpy(top + (size_t)r * width, job->image_data + (size_t)(s0 - halo + r) * width, row_size);
+            if (s1 + r < height) memcpy(bottom + (size_t)r * width, job->image_data + (size_t)(s1 + r) * width, row_size);
+        }
     }
-    memcpy(buf, image_data, width*height*sizeof(uint16_t));
+}
+
+/* filters the slabs [first, last) */
+static void chroma_smooth_slabs(void * arg, int first, int last)
+{
+    chroma_smooth_job * job = (chroma_smooth_job *)arg;
+    const int halo = CHROMA_SMOOTH_HALO;
+    int width = job->width;
+    int height = job->height;
+    uint16_t * image_data = job->image_data;
+    size_t row_size = width * sizeof(uint16_t);
+
+    uint16_t * band = (uint16_t *)malloc((CHROMA_SMOOTH_BAND + 2 * halo) * row_size);
+    if (!band) return;
+
+    for (int s = first; s < last; s++)
+    {
+        int s0 = s * CHROMA_SMOOTH_SLAB;
+        int s1 = MIN(s0 + CHROMA_SMOOTH_SLAB, height);
+        uint16_t * top = job->edges + (size_t)s * 2 * halo * width;
+        uint16_t * bottom = top + (size_t)halo * width;
+
+        for (int b0 = s0; b0 < s1; b0 += CHROMA_SMOOTH_BAND)
+        {
+            int b1 = MIN(b0 + CHROMA_SMOOTH_BAND, s1);
+            /* scratch row i holds frame row b0 - halo + i, the rows around b0
+               are still in the scratch from the previous band */
+            int r = b0 - halo;
+            if (b0 > s0)
+            {
+                memmove(band, band + (size_t)CHROMA_SMOOTH_BAND * width, 2 * halo * row_size);
+                r = b0 + halo;
+            }
+            for (; r < b1 + halo; r++)
+            {
+                if (r < 0 || r >= height) continue;
+                const uint16_t * src = (r < s0) ? top + (size_t)(r - s0 + halo) * width
+                                     : (r >= s1) ? bottom + (size_t)(r - s1) * width
+                                     : image_data + (size_t)r * width;
+                memcpy(band + (size_t)(r - b0 + halo) * width, src, row_size);
+            }
+            job->smooth(width, height, b0, b1, band - (ptrdiff_t)(b0 - halo) * width, image_data, job->raw2ev, job->ev2raw, job->black, job->white);
+        }
+    }
+    free(band);
+}
+
+void chroma_smooth(int method, uint16_t * image_data, int width, int height, int black, int white, int * raw2ev, int * ev2raw)
+{
+    if(raw2ev == NULL) return;
     
+    chroma_smooth_func smooth = NULL;
     switch (method) {
         case 2:
-            chroma_smooth_2x2(width, height, buf, image_data, raw2ev, ev2raw, black, white);
+            smooth = chroma_smooth_2x2;
             break;
         case 3:
-            chroma_smooth_3x3(width, height, buf, image_data, raw2ev, ev2raw, black, white);
+            smooth = chroma_smooth_3x3;
             break;
         case 5:
-            chroma_smooth_5x5(width, height, buf, image_data, raw2ev, ev2raw, black, white);
+            smooth = chroma_smooth_5x5;
             break;
             
         default:
 #ifndef STDOUT_SILENT
             err_printf("Unsupported chroma smooth method\n");
 #endif
-            break;
+            return;
     }
-    
-    free(buf);
+
+    /* The filter needs the original values around the pixels it replaces.
+     * Instead of copying the whole frame, each slab of rows is filtered band
+     * by band from a small scratch buffer holding the band and its halo, so
+     * the copy stays in cache. Only the halo rows shared with the neighbour
+     * slabs, which another thread may be writing, are saved beforehand */
+    size_t row_size = width * sizeof(uint16_t);
+    int slabs = (height + CHROMA_SMOOTH_SLAB - 1) / CHROMA_SMOOTH_SLAB;
+    uint16_t * edges = (uint16_t *)malloc(slabs * 2 * CHROMA_SMOOTH_HALO * row_size);
+    if (!edges)
+    {
+        return;
+    }
+
+    chroma_smooth_job job = { smooth, image_data, edges, width, height, black, white, raw2ev, ev2raw };
+    parallel_for(0, slabs, 1, chroma_smooth_save_edges, &job);
+    parallel_for(0, slabs, 1, chroma_smooth_slabs, &job);
+
+    free(edges);
 }
 
 /* find color of the raw pixel */
@@ -324,6 +444,85 @@ static inline void interpolate_around(uint16_t * image_data, int i, int w, int *
     }
 }
 
+/* map pixels interpolated by one task */
+#define FIX_PIXELS_GRAIN 1024
+
+typedef struct
+{
+    pixel_map * map;
+    uint16_t * image_data;
+    int w;
+    int h;
+    int cropX;
+    int cropY;
+    int average_method;
+    int dual_iso;
+    int * raw2ev;
+    int * ev2raw;
+} fix_pixels_job;
+
+/* interpolates the pixels [first, last) of a focus or bad pixel map */
+static void fix_pixels_block(void * arg, int first, int last)
+{
+    fix_pixels_job * job = (fix_pixels_job *)arg;
+    uint16_t * image_data = job->image_data;
+    int w = job->w;
+    int h = job->h;
+    int dual_iso = job->dual_iso;
+    int * raw2ev = job->raw2ev;
+    int * ev2raw = job->ev2raw;
+
+    for (int m = first; m < last; m++)
+    {
+        int x = job->map->pixels[m].x - job->cropX;
+        int y = job->map->pixels[m].y - job->cropY;
+
+        int i = x + y*w;
+        if (x > 2 && x < w - 3 && y > 2 && y < h - 3)
+        {
+            if(dual_iso)
+            {
+                interpolate_horizontal(image_data, i, raw2ev, ev2raw);
+            }
+            else if(job->average_method == 1) // 1 = raw2dng
+            {
+                interpolate_pixel(image_data, x, y, w, h);
+            }
+            else if(job->average_method == 2) // 2 = method from @rewind
+            {
+                interpolate_rewind(image_data, x, y, w, h);
+            }
+            else // 0 = mlvfs
+            {
+                interpolate_around(image_data, i, w, raw2ev, ev2raw);
+            }
+        }
+        else if(i > 0 && i < w * h)
+        {
+            // handle edge pixels
+            int horizontal_edge = (x >= w - 3 && x < w) || (x >= 0 && x <= 3);
+            int vertical_edge = (y >= h - 3 && y < h) || (y >= 0 && y <= 3);
+
+            if (horizontal_edge && !vertical_edge && !dual_iso)
+            {
+                interpolate_vertical(image_data, i, w, raw2ev, ev2raw);
+            }
+            else if (vertical_edge && !horizontal_edge)
+            {
+                interpolate_horizontal(image_data, i, raw2ev, ev2raw);
+            }
+            else if(x >= 0 && x <= 3)
+            {
+                image_data[i] = image_data[i + 2];
+            }
+            else if(x >= w - 3 && x < w)
+            {
+                image_data[i] = image_data[i - 2];
+            }
+        }
+    }
+}
+
 /* following code is for bad/focus pixel processing **********************************************/
 enum pattern { PATTERN_NONE = 0,
                PATTERN_EOSM = 331,
@@ -1043,145 +1242,228 @@ static int fpm_get_video_mode(int32_t raw_width, int32_t raw_height, int crop_re
     }
 }
 
-void fix_focus_pixels(pixel_map * focus_pixel_map,
-                      int * fpm_status,
-                      uint16_t * image_data,
-                      uint32_t camera_id,
-                      uint16_t width,
-                      uint16_t height,
-                      uint16_t pan_x,
-                      uint16_t pan_y,
-                      int32_t raw_width,
-                      int32_t raw_height,
-                      int crop_rec,
-                      int unified_mode,
-                      int average_method,
-                      int dual_iso,
-                      int * raw2ev,
-                      int * ev2raw)
+/* generate the focus pixel pattern of the camera and video mode, the map stays empty if unsupported */
+static void fpm_generate(pixel_map * focus_pixel_map, uint32_t camera_id, int32_t raw_width, int32_t raw_height, int crop_rec, int unified_mode)
 {
-    int w = width;
-    int h = height;
-    int cropX = (pan_x + 7) & ~7;
-    int cropY = pan_y & ~1;
+    enum pattern pattern = fpm_get_pattern(camera_id);
+    if(pattern == PATTERN_NONE) return;
 
-    if(raw2ev == NULL)
-    {
+    enum video_mode video_mode = fpm_get_video_mode(raw_width, raw_height, crop_rec, unified_mode);
 #ifndef STDOUT_SILENT
-        err_printf("raw2ev LUT error\n");
+    printf("\nGenerating focus pixel map for ");
 #endif
-        return;
-    }
-
-fpm_check:
-    // fpm_status: 0 = not loaded, 1 = not exists (generate), 2 = loaded/generated (interpolate), 3 = no focus pixel map is generated (unsupported camera)
-    switch(*fpm_status)
+    switch(video_mode)
     {
-        case 0: // load fpm
-        {
-            if(load_pixel_map(focus_pixel_map, camera_id, raw_width, raw_height))
-            {
-                *fpm_status = 2;
-            }
-            else
-            {
-                *fpm_status = 1;
-            }
-            goto fpm_check;
-        }
-        case 1: // generate pixel pattern
-        {
-            enum pattern pattern = fpm_get_pattern(camera_id);
-            if(pattern == PATTERN_NONE)
-            {
-                *fpm_status = 3;
-            }
-            else
-            {
-                enum video_mode video_mode = fpm_get_video_mode(raw_width, raw_height, crop_rec, unified_mode);
+        case MV_720:
 #ifndef STDOUT_SILENT
-                printf("\nGenerating focus pixel map for ");
+            printf("'mv720' mode\n");
 #endif
-                switch(video_mode)
-                {
-                    case MV_720:
+            fpm_mv720(focus_pixel_map, pattern, raw_width);
+            break;
+
+        case MV_1080:
 #ifndef STDOUT_SILENT
-                        printf("'mv720' mode\n");
+            printf("'mv1080' mode\n");
 #endif
-                        fpm_mv720(focus_pixel_map, pattern, raw_width);
-                        break;
+            fpm_mv1080(focus_pixel_map, pattern, raw_width);
+            break;
 
-                    case MV_1080:
+        case MV_1080CROP:
 #ifndef STDOUT_SILENT
-                        printf("'mv1080' mode\n");
+            printf("'mv1080crop' mode\n");
 #endif
-                        fpm_mv1080(focus_pixel_map, pattern, raw_width);
-                        break;
+            fpm_mv1080crop(focus_pixel_map, pattern, raw_width);
+            break;
 
-                    case MV_1080CROP:
+        case MV_ZOOM:
 #ifndef STDOUT_SILENT
-                        printf("'mv1080crop' mode\n");
+            printf("'mvZoom' mode\n");
 #endif
-                        fpm_mv1080crop(focus_pixel_map, pattern, raw_width);
-                        break;
+            fpm_zoom(focus_pixel_map, pattern, raw_width, raw_height);
+            break;
 
-                    case MV_ZOOM:
+        case MV_CROPREC:
 #ifndef STDOUT_SILENT
-                        printf("'mvZoom' mode\n");
+            printf("'mvCrop_rec' mode\n");
 #endif
-                        fpm_zoom(focus_pixel_map, pattern, raw_width, raw_height);
-                        break;
+            fpm_crop_rec(focus_pixel_map, pattern, raw_width);
+            break;
 
-                    case MV_CROPREC:
+        case MV_720_U:
 #ifndef STDOUT_SILENT
-                        printf("'mvCrop_rec' mode\n");
+            printf("'mv720' unified mode\n");
 #endif
-                        fpm_crop_rec(focus_pixel_map, pattern, raw_width);
-                        break;
+            fpm_mv720_u(focus_pixel_map, pattern, raw_width);
+            break;
 
-                    case MV_720_U:
+        case MV_1080_U:
 #ifndef STDOUT_SILENT
-                        printf("'mv720' unified mode\n");
+            printf("'mv1080' unified mode\n");
 #endif
-                        fpm_mv720_u(focus_pixel_map, pattern, raw_width);
-                        break;
+            fpm_mv1080_u(focus_pixel_map, pattern, raw_width);
+            break;
 
-                    case MV_1080_U:
+        case MV_1080CROP_U:
 #ifndef STDOUT_SILENT
-                        printf("'mv1080' unified mode\n");
+            printf("'mv1080crop' unified mode\n");
 #endif
-                        fpm_mv1080_u(focus_pixel_map, pattern, raw_width);
-                        break;
+            fpm_mv1080crop_u(focus_pixel_map, pattern, raw_width);
+            break;
 
-                    case MV_1080CROP_U:
+        case MV_ZOOM_U:
 #ifndef STDOUT_SILENT
-                        printf("'mv1080crop' unified mode\n");
+            printf("'mvZoom' unified mode\n");
 #endif
-                        fpm_mv1080crop_u(focus_pixel_map, pattern, raw_width);
-                        break;
+            fpm_zoom_u(focus_pixel_map, pattern, raw_width, raw_height);
+            break;
 
-                    case MV_ZOOM_U:
+        case MV_CROPREC_U:
 #ifndef STDOUT_SILENT
-                        printf("'mvZoom' unified mode\n");
+            printf("'mvCrop_rec' unified mode\n");
 #endif
-                        fpm_zoom_u(focus_pixel_map, pattern, raw_width, raw_height);
-                        break;
+            fpm_crop_rec_u(focus_pixel_map, pattern, raw_width);
+            break;
 
-                    case MV_CROPREC_U:
+        default:
+            break;
+    }
 #ifndef STDOUT_SILENT
-                        printf("'mvCrop_rec' unified mode\n");
+    printf(""FMT_SIZE" pixels generated\n", focus_pixel_map->count);
 #endif
-                        fpm_crop_rec_u(focus_pixel_map, pattern, raw_width);
-                        break;
+}
 
-                    default:
-                        break;
-                }
+/* pixel map as stored in the shared cache */
+typedef struct
+{
+    pixel_map map;
+    int from_file;      /* loaded from a .fpm/.bpm file rather than generated */
+} shared_pixel_map;
+
+typedef struct
+{
+    int type;
+    uint32_t camera_id;
+    int32_t raw_width;
+    int32_t raw_height;
+    int crop_rec;
+    int unified_mode;
+} pixel_map_key;
+
+static void free_shared_pixel_map(void * value)
+{
+    shared_pixel_map * shared = value;
+    if(shared->map.pixels) free(shared->map.pixels);
+    free(shared);
+}
+
+/* load the map file of the camera and resolution, focus maps fall back to the
+   generated pattern. Called by sc_acquire for a missing key */
+static void * load_shared_pixel_map(void * arg)
+{
+    pixel_map_key * key = arg;
+    shared_pixel_map * shared = calloc(1, sizeof(shared_pixel_map));
+    if(!shared) return NULL;
+
+    shared->map.type = key->type;
+    shared->from_file = load_pixel_map(&shared->map, key->camera_id, key->raw_width, key->raw_height);
+    if(!shared->from_file && key->type == PIX_FOCUS)
+    {
+        fpm_generate(&shared->map, key->camera_id, key->raw_width, key->raw_height, key->crop_rec, key->unified_mode);
+    }
+    return shared;
+}
+
+/* drop the pixels of a map, shared ones are only released */
+static void release_pixel_map(pixel_map * map)
+{
+    if(map->shared)
+    {
+        sc_release(map->shared);
+    }
+    else if(map->pixels)
+    {
+        free(map->pixels);
+    }
+    map->shared = NULL;
+    map->pixels = NULL;
+    map->count = 0;
+    map->capacity = 0;
+}
+
+/* point map to the pixels shared by all clips with the same key, returns the pixel count */
+static size_t acquire_pixel_map(pixel_map * map, pixel_map_key * key)
+{
+    char name[128];
+    snprintf(name, sizeof(name), "%s:%x:%dx%d:%d:%d", key->type ? "bpm" : "fpm", key->camera_id, key->raw_width, key->raw_height, key->crop_rec, key->unified_mode);
+
+    release_pixel_map(map);
+    shared_pixel_map * shared = sc_acquire(name, load_shared_pixel_map, free_shared_pixel_map, key);
+    if(!shared) return 0;
+
+    FOCUSPIXELMAP_OK = shared->from_file;
+    map->pixels = shared->map.pixels;
+    map->count = shared->map.count;
+    /* a shared map is never grown, add_pixel_to_map only sees owned maps */
+    map->capacity = shared->map.count;
+    map->shared = shared;
+    return map->count;
+}
+
+int load_focus_pixel_map(pixel_map * focus_pixel_map,
+                         int * fpm_status,
+                         uint32_t camera_id,
+                         int32_t raw_width,
+                         int32_t raw_height,
+                         int crop_rec,
+                         int unified_mode)
+{
+    // fpm_status: 0 = not loaded, 2 = loaded/generated (interpolate), 3 = no focus pixel map is generated (unsupported camera)
+    if(*fpm_status == 0)
+    {
+        // shared by all clips of the same camera and video mode
+        pixel_map_key key = { PIX_FOCUS, camera_id, raw_width, raw_height, crop_rec, unified_mode };
+        *fpm_status = acquire_pixel_map(focus_pixel_map, &key) ? 2 : 3;
+    }
+    return *fpm_status == 2;
+}
+
+void fix_focus_pixels(pixel_map * focus_pixel_map,
+                      int * fpm_status,
+                      uint16_t * image_data,
+                      uint32_t camera_id,
+                      uint16_t width,
+                      uint16_t height,
+                      uint16_t pan_x,
+                      uint16_t pan_y,
+                      int32_t raw_width,
+                      int32_t raw_height,
+                      int crop_rec,
+                      int unified_mode,
+                      int average_method,
+                      int dual_iso,
+                      int * raw2ev,
+                      int * ev2raw)
+{
+    int w = width;
+    int h = height;
+    int cropX = (pan_x + 7) & ~7;
+    int cropY = pan_y & ~1;
+
+    if(raw2ev == NULL)
+    {
 #ifndef STDOUT_SILENT
-                printf(""FMT_SIZE" pixels generated\n", focus_pixel_map->count);
+        err_printf("raw2ev LUT error\n");
 #endif
-                *fpm_status = (focus_pixel_map->count) ? 2 : 3;
-            }
+        return;
+    }
+
+fpm_check:
+    // fpm_status: 0 = not loaded, 2 = loaded/generated (interpolate), 3 = no focus pixel map is generated (unsupported camera)
+    switch(*fpm_status)
+    {
+        case 0: // load or generate fpm
+        {
+            load_focus_pixel_map(focus_pixel_map, fpm_status, camera_id, raw_width, raw_height, crop_rec, unified_mode);
             goto fpm_check;
         }
         case 2: // interpolate pixels
@@ -1204,56 +1486,8 @@ fpm_check:
                 printf("Using fpi method: 'MLVFS'\n");
             }
 #endif
-            #pragma omp parallel for
-            for (size_t m = 0; m < focus_pixel_map->count; m++)
-            {
-                int x = focus_pixel_map->pixels[m].x - cropX;
-                int y = focus_pixel_map->pixels[m].y - cropY;
-
-                int i = x + y*w;
-                if (x > 2 && x < w - 3 && y > 2 && y < h - 3)
-                {
-                    if(dual_iso)
-                    {
-                        interpolate_horizontal(image_data, i, raw2ev, ev2raw);
-                    }
-                    else if(average_method == 1) // 1 = raw2dng
-                    {
-                        interpolate_pixel(image_data, x, y, w, h);
-                    }
-                    else if(average_method == 2) // 2 = method from @rewind
-                    {
-                        interpolate_rewind(image_data, x, y, w, h);
-                    }
-                    else // 0 = mlvfs
-                    {
-                        interpolate_around(image_data, i, w, raw2ev, ev2raw);
-                    }
-                }
-                else if(i > 0 && i < w * h)
-                {
-                    // handle edge pixels
-                    int horizontal_edge = (x >= w - 3 && x < w) || (x >= 0 && x <= 3);
-                    int vertical_edge = (y >= h - 3 && y < h) || (y >= 0 && y <= 3);
-                    
-                    if (horizontal_edge && !vertical_edge && !dual_iso)
-                    {
-                        interpolate_vertical(image_data, i, w, raw2ev, ev2raw);
-                    }
-                    else if (vertical_edge && !horizontal_edge)
-                    {
-                        interpolate_horizontal(image_data, i, raw2ev, ev2raw);
-                    }
-                    else if(x >= 0 && x <= 3)
-                    {
-                        image_data[i] = image_data[i + 2];
-                    }
-                    else if(x >= w - 3 && x < w)
-                    {
-                        image_data[i] = image_data[i - 2];
-                    }
-                }
-            }
+            fix_pixels_job job = { focus_pixel_map, image_data, w, h, cropX, cropY, average_method, dual_iso, raw2ev, ev2raw };
+            parallel_for(0, (int)focus_pixel_map->count, FIX_PIXELS_GRAIN, fix_pixels_block, &job);
             break;
         }
         default:
@@ -1310,8 +1544,9 @@ bpm_check:
                 }
                 case 3: // Map mode
                 {
-                    // load .bpm
-                    load_pixel_map(bad_pixel_map, camera_id, raw_width, raw_height);
+                    // load .bpm, shared by all clips of the same camera and resolution
+                    pixel_map_key key = { PIX_BAD, camera_id, raw_width, raw_height, 0, 0 };
+                    acquire_pixel_map(bad_pixel_map, &key);
                     *bpm_status = 2; // interpolate no matter map is loaded or not
                     break;
                 }
@@ -1325,6 +1560,8 @@ bpm_check:
         }
         case 1: // search for bad pixels
         {
+            /* found pixels go to a map of its own */
+            if(bad_pixel_map->shared) release_pixel_map(bad_pixel_map);
 #ifndef STDOUT_SILENT
             const char * method = NULL;
             if (search_method == 1)
@@ -1430,65 +1667,8 @@ mem_err:
                 printf("Using bpi method: 'MLVFS'\n");
             }
 #endif
-            #pragma omp parallel for
-            for (size_t m = 0; m < bad_pixel_map->count; m++)
-            {
-                int x = bad_pixel_map->pixels[m].x - cropX;
-                int y = bad_pixel_map->pixels[m].y - cropY;
-
-                int i = x + y*w;
-                if (x > 2 && x < w - 3 && y > 2 && y < h - 3)
-                {
-                    if(dual_iso)
-                    {
-                        interpolate_horizontal(image_data, i, raw2ev, ev2raw);
-                    }
-                    else if(average_method == 1)
-                    {
-                        interpolate_pixel(image_data, x, y, w, h);
-                    }
-                    else if(average_method == 2)
-                    {
-                        interpolate_rewind(image_data, x, y, w, h);
-                    }
-                    else
-                    {
-                        interpolate_around(image_data, i, w, raw2ev, ev2raw);
-                    }
-                }
-                else if(i > 0 && i < w * h)
-                {
-                    // handle edge pixels
-                    int horizontal_edge = (x >= w - 3 && x < w) || (x >= 0 && x <= 3);
-                    int vertical_edge = (y >= h - 3 && y < h) || (y >= 0 && y <= 3);
-
-                    if (horizontal_edge && !vertical_edge && !dual_iso)
-                    {
-                        interpolate_vertical(image_data, i, w, raw2ev, ev2raw);
-                    }
-                    else if (vertical_edge && !horizontal_edge)
-                    {
-                        interpolate_horizontal(image_data, i, raw2ev, ev2raw);
-                    }
-                    else if(x >= 0 && x <= 3)
-                    {
-                        image_data[i] = image_data[i + 2];
-                    }
-                    else if(x >= w - 3 && x < w)
-                    {
-                        image_data[i] = image_data[i - 2];
-                    }
-                }
-            }
-
-            if(bpm_mode == 2)
-            {
-                *bpm_status = 1;
-                bad_pixel_map->count = 0;
-#ifndef STDOUT_SILENT
-                printf("Searching bad pixels for every frame\n");
-#endif
-            }
+            fix_pixels_job job = { bad_pixel_map, image_data, w, h, cropX, cropY, average_method, dual_iso, raw2ev, ev2raw };
+            parallel_for(0, (int)bad_pixel_map->count, FIX_PIXELS_GRAIN, fix_pixels_block, &job);
             break;
         }
         default:
@@ -1500,39 +1680,18 @@ void reset_fpm_status(pixel_map * focus_pixel_map, int * fpm_status)
 {
     if( !focus_pixel_map ) return;
     *fpm_status = 0;
-    focus_pixel_map->count = 0;
-    focus_pixel_map->capacity = 0;
-    if(focus_pixel_map->pixels)
-    {
-        free(focus_pixel_map->pixels);
-        focus_pixel_map->pixels = NULL;
-    }
+    release_pixel_map(focus_pixel_map);
 }
 
 void reset_bpm_status(pixel_map * bad_pixel_map, int * bpm_status)
 {
     if( !bad_pixel_map ) return;
     *bpm_status = 0;
-    bad_pixel_map->count = 0;
-    bad_pixel_map->capacity = 0;
-    if(bad_pixel_map->pixels)
-    {
-        free(bad_pixel_map->pixels);
-        bad_pixel_map->pixels = NULL;
-    }
+    release_pixel_map(bad_pixel_map);
 }
 
 void free_pixel_maps(pixel_map * focus_pixel_map, pixel_map * bad_pixel_map)
 {
-    if(focus_pixel_map->pixels)
-    {
-        free(focus_pixel_map->pixels);
-        focus_pixel_map->pixels = NULL;
-    }
-
-    if(bad_pixel_map->pixels)
-    {
-        free(bad_pixel_map->pixels);
-        bad_pixel_map->pixels = NULL;
-    }
+    release_pixel_map(focus_pixel_map);
+    release_pixel_map(bad_pixel_map);
 }
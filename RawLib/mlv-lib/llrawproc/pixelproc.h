@@ -36,6 +36,7 @@ typedef struct {
     size_t count;
     size_t capacity;
     pixel_xy * pixels;
+    void * shared;    /* shared cache entry owning pixels, NULL if they are owned */
 } pixel_map;
 
 /* initialize LUTs */
@@ -47,6 +48,15 @@ void free_luts(int * raw2ev, int * ev2raw);
 /* do chroma smoothing with methods: 2x2, 3x3 and 5x5 */
 void chroma_smooth(int method, uint16_t * image_data, int width, int height, int black, int white, int * raw2ev, int * ev2raw);
 
+/* load or generate the focus pixel map if not done yet, returns 1 if a map is available */
+int load_focus_pixel_map(pixel_map * focus_pixel_map,
+                         int * fpm_status,
+                         uint32_t camera_id,
+                         int32_t raw_width,
+                         int32_t raw_height,
+                         int crop_rec,
+                         int unified_mode);
+
 /* fix focus raw pixels */
 void fix_focus_pixels(pixel_map * focus_pixel_map,
                       int * fpm_status,
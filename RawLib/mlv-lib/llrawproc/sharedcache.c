@@ -0,0 +1,171 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "sharedcache.h"
+
+/* A comp holds a handful of dark frames and pixel maps, a list is enough */
+typedef struct sc_entry
+{
+    struct sc_entry * next;
+    char * key;             /* NULL once invalidated, the entry only waits for its last release */
+    void * value;
+    sc_free_func free_value;
+    int refs;
+    int loading;            /* value is being loaded, outside of the lock */
+} sc_entry;
+
+static pthread_mutex_t sc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sc_loaded = PTHREAD_COND_INITIALIZER;
+static sc_entry * sc_entries = NULL;
+
+void * sc_acquire(const char * key, sc_load_func load, sc_free_func free_value, void * arg)
+{
+    pthread_mutex_lock(&sc_mutex);
+
+    sc_entry * entry;
+    for(;;)
+    {
+        for(entry = sc_entries; entry; entry = entry->next)
+        {
+            if(entry->key && !strcmp(entry->key, key)) break;
+        }
+        if(!entry || !entry->loading) break;
+        /* another thread loads it, look again once it is done */
+        pthread_cond_wait(&sc_loaded, &sc_mutex);
+    }
+
+    if(entry)
+    {
+        entry->refs++;
+        pthread_mutex_unlock(&sc_mutex);
+        return entry->value;
+    }
+
+    /* pending entry, the load runs without the lock */
+    entry = calloc(1, sizeof(sc_entry));
+    if(entry) entry->key = strdup(key);
+    if(!entry || !entry->key)
+    {
+        free(entry);
+        pthread_mutex_unlock(&sc_mutex);
+        return NULL;
+    }
+    entry->free_value = free_value;
+    entry->refs = 1;
+    entry->loading = 1;
+    entry->next = sc_entries;
+    sc_entries = entry;
+    pthread_mutex_unlock(&sc_mutex);
+
+    void * value = load(arg);
+
+    pthread_mutex_lock(&sc_mutex);
+    if(value)
+    {
+        entry->value = value;
+        entry->loading = 0;
+    }
+    else
+    {
+        /* nothing is cached, the next lookup loads again */
+        for(sc_entry ** link = &sc_entries; *link; link = &(*link)->next)
+        {
+            if(*link == entry)
+            {
+                *link = entry->next;
+                break;
+            }
+        }
+        free(entry->key);
+        free(entry);
+    }
+    pthread_cond_broadcast(&sc_loaded);
+    pthread_mutex_unlock(&sc_mutex);
+
+    return value;
+}
+
+void sc_release(void * value)
+{
+    if(!value) return;
+
+    sc_entry * found = NULL;
+    pthread_mutex_lock(&sc_mutex);
+    for(sc_entry ** link = &sc_entries; *link; link = &(*link)->next)
+    {
+        sc_entry * entry = *link;
+        if(entry->value == value)
+        {
+            if(--entry->refs == 0)
+            {
+                *link = entry->next;
+                found = entry;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sc_mutex);
+
+    /* free outside of the lock, big dark frames take a while */
+    if(found)
+    {
+        found->free_value(found->value);
+        free(found->key);
+        free(found);
+    }
+}
+
+void sc_invalidate(const char * prefix)
+{
+    size_t prefix_size = strlen(prefix);
+
+    pthread_mutex_lock(&sc_mutex);
+    for(sc_entry * entry = sc_entries; entry; entry = entry->next)
+    {
+        if(entry->key && !strncmp(entry->key, prefix, prefix_size))
+        {
+            free(entry->key);
+            entry->key = NULL;
+        }
+    }
+    pthread_mutex_unlock(&sc_mutex);
+}
+
+void sc_file_key(const char * type, const char * filename, char * key, size_t key_size)
+{
+    struct stat st;
+    if(stat(filename, &st))
+    {
+        /* the load fails and reports it, nothing gets cached */
+        snprintf(key, key_size, "%s:%s:", type, filename);
+        return;
+    }
+    long nsec = 0;
+#if defined(__linux__)
+    nsec = st.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+    nsec = st.st_mtimespec.tv_nsec;
+#endif
+    snprintf(key, key_size, "%s:%s:%lld.%09ld:%lld", type, filename, (long long)st.st_mtime, nsec, (long long)st.st_size);
+}
@@ -0,0 +1,44 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _sharedcache_h
+#define _sharedcache_h
+
+#include <stddef.h>
+
+/* Process wide cache of the immutable data llrawproc loads for a clip:
+   external dark frames and focus/bad pixel maps. Values are reference counted
+   and shared by every clip (and every reader of a clip) asking for the same
+   key, the last release frees them. */
+
+/* builds the value of a missing key, returns NULL on failure (nothing is cached) */
+typedef void * (*sc_load_func)(void * arg);
+typedef void (*sc_free_func)(void * value);
+
+/* value stored under key, loaded with load(arg) if there is none yet.
+   A key is loaded once, lookups of it wait for the load while other keys go on */
+void * sc_acquire(const char * key, sc_load_func load, sc_free_func free_value, void * arg);
+/* drop a reference to a value returned by sc_acquire */
+void sc_release(void * value);
+/* forget the keys starting with prefix, the values stay valid until released */
+void sc_invalidate(const char * prefix);
+/* key of data loaded from a file, "<type>:<filename>:<signature>". The modification
+   time and size give a rewritten file a new key, "<type>:<filename>:" prefixes them all */
+void sc_file_key(const char * type, const char * filename, char * key, size_t key_size);
+
+#endif
@@ -274,47 +274,31 @@ static void detect_vertical_stripes_coeffs(stripes_correction * correction,
     }
 }
 
-static void apply_vertical_stripes_correction(stripes_correction * correction,
-                                              uint16_t * image_data,
-                                              int32_t black_level,
-                                              int32_t white_level,
-                                              uint16_t width,
-                                              uint16_t height)
+/* highest raw value of the rows [y1, y2) */
+uint16_t vertical_stripes_max(uint16_t * image_data, uint16_t width, int y1, int y2)
 {
-    /**
-     * inexact white level will result in banding in highlights, especially if some channels are clipped
-     * 
-     * so... we'll try to use a better estimation of white level *for this particular purpose*
-     * start with a gross under-estimation, then consider white = max(all pixels)
-     * just in case the exif one is way off
-     * reason: 
-     *   - if there are no pixels above the true white level, it shouldn't hurt;
-     *     worst case, the brightest pixel(s) will be underexposed by 0.1 EV or so
-     *   - if there are, we will choose the true white level
-     */
-     
-    int white = white_level * 2 / 3;
-    int pitch = width * 2;
-
-    struct raw_8pixels * row;
-    for (row = (void*)image_data; (void*)row < (void*)image_data + pitch * height; row += pitch / sizeof(struct raw_8pixels))
+    uint16_t max = 0;
+    uint16_t * end = image_data + (size_t)width * y2;
+    for (uint16_t * p = image_data + (size_t)width * y1; p < end; p++)
     {
-        struct raw_8pixels * p;
-        for (p = row; (void*)p < (void*)row + pitch; p++)
-        {
-            white = MAX(white, PA);
-            white = MAX(white, PB);
-            white = MAX(white, PC);
-            white = MAX(white, PD);
-            white = MAX(white, PE);
-            white = MAX(white, PF);
-            white = MAX(white, PG);
-            white = MAX(white, PH);
-        }
+        if (*p > max) max = *p;
     }
-    
+    return max;
+}
+
+void apply_vertical_stripes_rows(stripes_correction * correction,
+                                 uint16_t * image_data,
+                                 int32_t black_level,
+                                 int32_t white,
+                                 uint16_t width,
+                                 int y1,
+                                 int y2)
+{
     int black = black_level;
-    for (row = (void*)image_data; (void*)row < (void*)image_data + pitch * height; row += pitch / sizeof(struct raw_8pixels))
+    int pitch = width * 2;
+
+    struct raw_8pixels * row;
+    for (row = (void*)image_data + pitch * y1; (void*)row < (void*)image_data + pitch * y2; row += pitch / sizeof(struct raw_8pixels))
     {
         struct raw_8pixels * p;
         for (p = row; (void*)p < (void*)row + pitch; p++)
@@ -347,15 +331,38 @@ static void apply_vertical_stripes_correction(stripes_correction * correction,
     }
 }
 
-void fix_vertical_stripes(stripes_correction * correction,
-                          uint16_t * image_data,
-                          int32_t black_level,
-                          int32_t white_level,
-                          int32_t raw_info_frame_size,
-                          uint16_t width,
-                          uint16_t height,
-                          int vertical_stripes,
-                          int * compute_stripes)
+static void apply_vertical_stripes_correction(stripes_correction * correction,
+                                              uint16_t * image_data,
+                                              int32_t black_level,
+                                              int32_t white_level,
+                                              uint16_t width,
+                                              uint16_t height)
+{
+    /**
+     * inexact white level will result in banding in highlights, especially if some channels are clipped
+     * 
+     * so... we'll try to use a better estimation of white level *for this particular purpose*
+     * start with a gross under-estimation, then consider white = max(all pixels)
+     * just in case the exif one is way off
+     * reason: 
+     *   - if there are no pixels above the true white level, it shouldn't hurt;
+     *     worst case, the brightest pixel(s) will be underexposed by 0.1 EV or so
+     *   - if there are, we will choose the true white level
+     */
+     
+    int white = MAX(white_level * 2 / 3, vertical_stripes_max(image_data, width, 0, height));
+    apply_vertical_stripes_rows(correction, image_data, black_level, white, width, 0, height);
+}
+
+void detect_vertical_stripes(stripes_correction * correction,
+                             uint16_t * image_data,
+                             int32_t black_level,
+                             int32_t white_level,
+                             int32_t raw_info_frame_size,
+                             uint16_t width,
+                             uint16_t height,
+                             int vertical_stripes,
+                             int * compute_stripes)
 {
     /* for speed: only detect correction factors from the first frame if not forced */
     if (*compute_stripes || vertical_stripes == 2)
@@ -387,6 +394,18 @@ void fix_vertical_stripes(stripes_correction * correction,
 #endif
         *compute_stripes = 0;
     }
+}
 
+void fix_vertical_stripes(stripes_correction * correction,
+                          uint16_t * image_data,
+                          int32_t black_level,
+                          int32_t white_level,
+                          int32_t raw_info_frame_size,
+                          uint16_t width,
+                          uint16_t height,
+                          int vertical_stripes,
+                          int * compute_stripes)
+{
+    detect_vertical_stripes(correction, image_data, black_level, white_level, raw_info_frame_size, width, height, vertical_stripes, compute_stripes);
     apply_vertical_stripes_correction(correction, image_data, black_level, white_level, width, height);
 }
@@ -41,4 +41,25 @@ void fix_vertical_stripes(stripes_correction * correction,
                           uint16_t height,
                           int vertical_stripes,
                           int * compute_stripes);
+
+/* Pieces of fix_vertical_stripes for callers processing the frame in bands:
+   detect the correction factors on the whole frame when needed, then apply
+   them to rows [y1, y2) with white = MAX(white_level * 2 / 3, frame maximum) */
+void detect_vertical_stripes(stripes_correction * correction,
+                             uint16_t * image_data,
+                             int32_t black_level,
+                             int32_t white_level,
+                             int32_t raw_info_frame_size,
+                             uint16_t width,
+                             uint16_t height,
+                             int vertical_stripes,
+                             int * compute_stripes);
+uint16_t vertical_stripes_max(uint16_t * image_data, uint16_t width, int y1, int y2);
+void apply_vertical_stripes_rows(stripes_correction * correction,
+                                 uint16_t * image_data,
+                                 int32_t black_level,
+                                 int32_t white,
+                                 uint16_t width,
+                                 int y1,
+                                 int y2);
 #endif
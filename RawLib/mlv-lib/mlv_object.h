@@ -19,8 +19,10 @@ typedef struct
     uint64_t block_offset;   /* Offset to the start of the block header */
 } frame_index_t;
 
-/* MLV App map file header (.MAPP) */
-#define MAPP_VERSION 3
+/* Block index sidecar header (.MAPP), written next to the clip after the
+ * first full scan and mapped on later opens. Followed by one mapp_chunk_t
+ * per chunk, the MLV headers and the video/audio/VERS frame indexes */
+#define MAPP_VERSION 4
 typedef struct {
     uint8_t     fileMagic[4];  /* MAPP */
     uint64_t    mapp_size;     /* total MAPP file size */
@@ -31,8 +33,22 @@ typedef struct {
     uint32_t    vers_blocks;   /* total VERS blocks */
     uint64_t    audio_size;    /* total size of audio data in bytes */
     uint64_t    df_offset;     /* offset to the dark frame location */
+    uint32_t    file_num;      /* number of chunks the index was built from */
+    uint32_t    headers_size;  /* size of the stored MLV headers */
 } mapp_header_t;
 
+/* Chunk signature, the index is rebuilt if any chunk changed */
+typedef struct {
+    uint64_t    file_size;     /* chunk size in bytes */
+    int64_t     file_mtime;    /* chunk modification time */
+} mapp_chunk_t;
+
+/* Read only mapping of one MLV chunk */
+typedef struct {
+    uint8_t * data;
+    uint64_t length;
+} mlv_chunk_map_t;
+
 /* Struct for MLV handling */
 typedef struct {
 
@@ -47,6 +63,10 @@ typedef struct {
     FILE ** file;
     char * path;
 
+    /* Optional mappings of the chunks (mapMlvChunks), shared by copies of the object */
+    mlv_chunk_map_t * chunk_map;
+    int map_direction; /* Playback direction the mappings were last advised for */
+
     /* For access to MLV headers */
     mlv_file_hdr_t    MLVI;
     mlv_rawi_hdr_t    RAWI;
@@ -96,6 +116,10 @@ typedef struct {
 
     /* Restricted lossless raw data bit depth */
     int lossless_bpp;
+
+    /* Block index sidecar the indexes point into, NULL if they were scanned */
+    void * mapp_data;
+    uint64_t mapp_length;
 } mlvObject_t;
 
 #endif
@@ -0,0 +1,221 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#if defined(__WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "parallel.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+/* A loop is cut in ranges of grain iterations, every thread running it claims
+ * the next range left until there is none. Idle pool threads join the oldest
+ * loop still having ranges, so a slow range never holds up the others */
+typedef struct pf_loop
+{
+    struct pf_loop * next;
+    parallel_body body;
+    void * arg;
+    int begin;
+    int end;
+    int grain;
+    int ranges;
+    int claimed;            /* ranges handed out, atomic */
+    int helpers;            /* pool threads it still takes */
+    int running;            /* pool threads working on it */
+} pf_loop;
+
+/* set while a loop body runs on this thread, nested loops run on it */
+static __thread int pf_nested = 0;
+/* loops running, they share the CPUs */
+static int pf_loops = 0;
+
+static pthread_mutex_t pf_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static parallel_host_suite pf_host;
+static int pf_host_set = 0;
+
+static pthread_once_t pf_pool_once = PTHREAD_ONCE_INIT;
+static pthread_cond_t pf_work = PTHREAD_COND_INITIALIZER;   /* a loop takes helpers */
+static pthread_cond_t pf_done = PTHREAD_COND_INITIALIZER;   /* a helper left its loop */
+static pf_loop * pf_queue = NULL;
+static unsigned int pf_pool_cpus = 1;
+
+void parallel_set_host_suite(const parallel_host_suite * suite)
+{
+    pthread_mutex_lock(&pf_mutex);
+    if(!pf_host_set && suite && suite->multiThread)
+    {
+        pf_host = *suite;
+        __atomic_store_n(&pf_host_set, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&pf_mutex);
+}
+
+static void pf_run_ranges(pf_loop * loop)
+{
+    int nested = pf_nested;
+    pf_nested = 1;
+
+    for(int range = __atomic_fetch_add(&loop->claimed, 1, __ATOMIC_RELAXED);
+        range < loop->ranges;
+        range = __atomic_fetch_add(&loop->claimed, 1, __ATOMIC_RELAXED))
+    {
+        int begin = loop->begin + range * loop->grain;
+        loop->body(loop->arg, begin, MIN(begin + loop->grain, loop->end));
+    }
+
+    pf_nested = nested;
+}
+
+static void pf_host_thread(unsigned int thread_index, unsigned int thread_max, void * arg)
+{
+    (void)thread_index; (void)thread_max;
+    pf_run_ranges(arg);
+}
+
+static void * pf_pool_thread(void * arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&pf_mutex);
+    for(;;)
+    {
+        pf_loop * loop = pf_queue;
+        while(loop && (!loop->helpers || __atomic_load_n(&loop->claimed, __ATOMIC_RELAXED) >= loop->ranges))
+        {
+            loop = loop->next;
+        }
+        if(!loop)
+        {
+            pthread_cond_wait(&pf_work, &pf_mutex);
+            continue;
+        }
+
+        loop->helpers--;
+        loop->running++;
+        pthread_mutex_unlock(&pf_mutex);
+
+        pf_run_ranges(loop);
+
+        pthread_mutex_lock(&pf_mutex);
+        if(!--loop->running) pthread_cond_broadcast(&pf_done);
+    }
+    return NULL;
+}
+
+static unsigned int pf_system_cpus()
+{
+#if defined(__WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (unsigned int)cpus : 1;
+#endif
+}
+
+/* one thread per CPU, the thread starting a loop is one of them */
+static void pf_start_pool()
+{
+    unsigned int cpus = pf_system_cpus();
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for(unsigned int i = 1; i < cpus; ++i)
+    {
+        pthread_t thread;
+        if(pthread_create(&thread, &attr, pf_pool_thread, NULL)) break;
+        pf_pool_cpus++;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+static void pf_run_pool(pf_loop * loop)
+{
+    pthread_mutex_lock(&pf_mutex);
+    pf_loop ** tail = &pf_queue;
+    while(*tail) tail = &(*tail)->next;
+    *tail = loop;
+    pthread_cond_broadcast(&pf_work);
+    pthread_mutex_unlock(&pf_mutex);
+
+    pf_run_ranges(loop);
+
+    /* no more helpers once it is out of the queue, wait for the ones running */
+    pthread_mutex_lock(&pf_mutex);
+    for(tail = &pf_queue; *tail != loop; tail = &(*tail)->next);
+    *tail = loop->next;
+    while(loop->running) pthread_cond_wait(&pf_done, &pf_mutex);
+    pthread_mutex_unlock(&pf_mutex);
+}
+
+void parallel_for(int begin, int end, int grain, parallel_body body, void * arg)
+{
+    if(end <= begin) return;
+    if(grain < 1) grain = 1;
+
+    int ranges = (int)(((long long)end - begin + grain - 1) / grain);
+    int host = __atomic_load_n(&pf_host_set, __ATOMIC_ACQUIRE);
+
+    if(ranges == 1 || pf_nested || (host && pf_host.multiThreadIsSpawnedThread && pf_host.multiThreadIsSpawnedThread()))
+    {
+        body(arg, begin, end);
+        return;
+    }
+
+    unsigned int cpus = 0;
+    if(host)
+    {
+        if(!pf_host.multiThreadNumCPUs || pf_host.multiThreadNumCPUs(&cpus) || !cpus) cpus = 1;
+    }
+    else
+    {
+        pthread_once(&pf_pool_once, pf_start_pool);
+        cpus = pf_pool_cpus;
+    }
+
+    /* frame threaded hosts run a loop per frame, they split the CPUs */
+    int loops = __atomic_add_fetch(&pf_loops, 1, __ATOMIC_RELAXED);
+    int threads = MIN(ranges, MAX(1, (int)cpus / loops));
+
+    pf_loop loop = { NULL, body, arg, begin, end, grain, ranges, 0, threads - 1, 0 };
+    if(threads == 1)
+    {
+        pf_run_ranges(&loop);
+    }
+    else if(host)
+    {
+        /* whatever the host did not run (it failed) runs here */
+        pf_host.multiThread(pf_host_thread, threads, &loop);
+        pf_run_ranges(&loop);
+    }
+    else
+    {
+        pf_run_pool(&loop);
+    }
+
+    __atomic_sub_fetch(&pf_loops, 1, __ATOMIC_RELAXED);
+}
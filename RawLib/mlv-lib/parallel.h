@@ -0,0 +1,45 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _parallel_h
+#define _parallel_h
+
+/* Parallel loops of mlv-lib. They run on the host threads once a host thread
+   suite is set, on a pool of threads started on first use otherwise.
+   The host usually renders several frames at once: loops started meanwhile
+   share the CPUs instead of each taking all of them, and loops started from
+   a loop body (or from a host spawned thread) run on the calling thread. */
+
+/* runs body(arg, begin, end) on consecutive ranges of about grain iterations
+   covering [begin, end), possibly at the same time, returns when all are done */
+typedef void (*parallel_body)(void * arg, int begin, int end);
+void parallel_for(int begin, int end, int grain, parallel_body body, void * arg);
+
+/* the functions of OfxMultiThreadSuiteV1 used to run loops on the host threads */
+typedef void parallel_thread_func(unsigned int thread_index, unsigned int thread_max, void * arg);
+typedef struct
+{
+    int (*multiThread)(parallel_thread_func * func, unsigned int nThreads, void * arg);
+    int (*multiThreadNumCPUs)(unsigned int * nCPUs);
+    int (*multiThreadIsSpawnedThread)(void);
+} parallel_host_suite;
+
+/* a host has one suite for the process, the first one set is kept */
+void parallel_set_host_suite(const parallel_host_suite * suite);
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/* dng_pack_image_bits against a bit by bit packer, and dng_unpack_image_bits
+   of its output, over frame sizes leaving a partial last word */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "dng.h"
+
+/* pixels MSB first in 16 bit words, complete words byte swapped for big endian,
+   the partial last word left aligned in native order */
+static void reference_pack(uint16_t * out, const uint16_t * in, uint32_t count, uint32_t bpp, int big_endian)
+{
+    uint32_t words = (count * bpp + 15) / 16;
+    memset(out, 0, words * sizeof(uint16_t));
+    for (uint32_t i = 0; i < count; ++i)
+        for (uint32_t b = 0; b < bpp; ++b)
+        {
+            uint32_t bit = i * bpp + b;
+            if (in[i] & (1 << (bpp - 1 - b))) out[bit / 16] |= 0x8000 >> (bit % 16);
+        }
+    if (!big_endian) return;
+    for (uint32_t w = 0; w < (count * bpp) / 16; ++w)
+        out[w] = (uint16_t)(out[w] << 8 | out[w] >> 8);
+}
+
+static int check(int width, int height, uint32_t bpp)
+{
+    uint32_t count = width * height;
+    uint32_t words = (count * bpp + 15) / 16;
+    /* the scalar unpacker reads 32 bits at a time */
+    uint16_t * image = malloc(count * sizeof(uint16_t));
+    uint16_t * packed = calloc(words + 2, sizeof(uint16_t));
+    uint16_t * expected = calloc(words + 2, sizeof(uint16_t));
+    uint16_t * unpacked = calloc(count, sizeof(uint16_t));
+    int failed = 0;
+
+    for (uint32_t i = 0; i < count; ++i)
+        image[i] = (uint16_t)((i * 2654435761u) >> 7) & ((1 << bpp) - 1);
+
+    for (int big_endian = 0; big_endian < 2; ++big_endian)
+    {
+        reference_pack(expected, image, count, bpp, big_endian);
+        dng_pack_image_bits(packed, image, width, height, bpp, big_endian);
+        if (memcmp(packed, expected, words * sizeof(uint16_t)))
+        {
+            printf("%dx%d %ubit %s: packed data differs\n", width, height, bpp, big_endian ? "big endian" : "little endian");
+            failed = 1;
+        }
+    }
+
+    /* MLV payloads are little endian */
+    dng_pack_image_bits(packed, image, width, height, bpp, 0);
+    dng_unpack_image_bits(unpacked, packed, width, height, bpp);
+    if (memcmp(unpacked, image, count * sizeof(uint16_t)))
+    {
+        printf("%dx%d %ubit: unpacked data differs\n", width, height, bpp);
+        failed = 1;
+    }
+
+    free(image);
+    free(packed);
+    free(expected);
+    free(unpacked);
+    return failed;
+}
+
+int main()
+{
+    static const int sizes[][2] = { {1, 1}, {3, 1}, {5, 7}, {17, 3}, {64, 32}, {333, 77} };
+    static const uint32_t depths[] = { 10, 12, 14 };
+    int failures = 0;
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+        for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); ++d)
+            failures += check(sizes[s][0], sizes[s][1], depths[d]);
+
+    printf("dng bit packing: %d failure(s)\n", failures);
+    return failures ? 1 : 0;
+}
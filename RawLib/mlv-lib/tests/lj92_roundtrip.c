@@ -0,0 +1,102 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/* lj92_encode output decoded back by lj92_decode, over odd and full HD sizes */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "lj92.h"
+
+static uint32_t rng_state = 12345;
+
+static uint32_t rng()
+{
+    rng_state = rng_state * 1664525 + 1013904223;
+    return rng_state >> 8;
+}
+
+static int roundtrip(int width, int height, int bits)
+{
+    size_t count = (size_t)width * height;
+    uint16_t * image = malloc(count * sizeof(uint16_t));
+    uint16_t * decoded = calloc(count, sizeof(uint16_t));
+    uint32_t max = (1u << bits) - 1;
+
+    /* smooth gradient and noise, a mix of short and long codes */
+    for (int y = 0; y < height; ++y)
+        for (int x = 0; x < width; ++x)
+        {
+            uint32_t value = (uint32_t)(x * 7 + y * 3) + rng() % 64;
+            if (rng() % 97 == 0) value = rng();
+            image[(size_t)y * width + x] = value & max;
+        }
+
+    uint8_t * encoded = NULL;
+    int encoded_size = 0;
+    int ret = lj92_encode(image, width, height, bits, width, 0, NULL, 0, &encoded, &encoded_size);
+    if (ret != LJ92_ERROR_NONE)
+    {
+        printf("%dx%d %dbit: encode failed (%d)\n", width, height, bits, ret);
+        free(image);
+        free(decoded);
+        return 1;
+    }
+
+    int failed = 1;
+    lj92 lj;
+    int w, h, b, comps;
+    ret = lj92_open(&lj, encoded, encoded_size, &w, &h, &b, &comps);
+    if (ret != LJ92_ERROR_NONE)
+    {
+        printf("%dx%d %dbit: open failed (%d)\n", width, height, bits, ret);
+    }
+    else
+    {
+        ret = lj92_decode(lj, decoded, width, 0, NULL, 0);
+        if (ret != LJ92_ERROR_NONE)
+            printf("%dx%d %dbit: decode failed (%d)\n", width, height, bits, ret);
+        else if (w != width || h != height || b != bits || comps != 1)
+            printf("%dx%d %dbit: header mismatch %dx%d %dbit %d components\n", width, height, bits, w, h, b, comps);
+        else if (memcmp(image, decoded, count * sizeof(uint16_t)))
+            printf("%dx%d %dbit: samples differ\n", width, height, bits);
+        else
+            failed = 0;
+        lj92_close(lj);
+    }
+
+    free(encoded);
+    free(image);
+    free(decoded);
+    return failed;
+}
+
+int main()
+{
+    static const int sizes[][2] = { {1, 1}, {5, 7}, {17, 3}, {64, 32}, {333, 77}, {1920, 1080} };
+    static const int depths[] = { 10, 12, 14, 16 };
+    int failures = 0;
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+        for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); ++d)
+            failures += roundtrip(sizes[s][0], sizes[s][1], depths[d]);
+
+    printf("lj92 round trip: %d failure(s)\n", failures);
+    return failures ? 1 : 0;
+}
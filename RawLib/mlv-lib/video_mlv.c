@@ -7,9 +7,20 @@
 #include <math.h>
 #include <time.h>
 #include <inttypes.h>
+#include <errno.h>
 
 #include "camid/camera_id.h"
 
+#include <sys/stat.h>
+#if defined(__WIN32)
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #if defined(__linux)
 #include <alloca.h>
 extern int usleep (__useconds_t __useconds);
@@ -32,7 +43,6 @@ extern int usleep (__useconds_t __useconds);
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
-#define ROR32(v,a) ((v) >> (a) | (v) << (32-(a)))
 
 static uint64_t file_set_pos(FILE *stream, uint64_t offset, int whence)
 {
@@ -166,6 +176,165 @@ static void close_all_chunks(FILE ** files, int entries)
     if(files) free(files);
 }
 
+/* Release a block index sidecar loaded by openMlvClip */
+static void unmap_mapp(void * mapp_data, uint64_t mapp_length)
+{
+#if defined(__WIN32)
+    (void)mapp_length;
+    free(mapp_data);
+#else
+    munmap(mapp_data, mapp_length);
+#endif
+}
+
+/* Size and mtime of an opened chunk */
+static int mapp_chunk_signature(FILE * file, mapp_chunk_t * chunk)
+{
+#if defined(__WIN32)
+    struct __stat64 st;
+    if(_fstat64(_fileno(file), &st)) return 0;
+#else
+    struct stat st;
+    if(fstat(fileno(file), &st)) return 0;
+#endif
+    chunk->file_size = st.st_size;
+    chunk->file_mtime = st.st_mtime;
+    return 1;
+}
+
+/* Unpackers may read a few bytes past the payload, the fread buffers carry
+ * the same slack. Ranges that could run off the mapping are not handed out */
+#define MLV_MAP_SLACK 64
+
+int mapMlvChunks(mlvObject_t * video)
+{
+    if(video->chunk_map) return 0;
+    if(!video->file || video->filenum <= 0) return 1;
+
+    mlv_chunk_map_t * chunk_map = calloc(video->filenum, sizeof(mlv_chunk_map_t));
+    if(!chunk_map) return 1;
+    video->chunk_map = chunk_map;
+    video->map_direction = 0;
+
+    for(int i = 0; i < video->filenum; i++)
+    {
+        mapp_chunk_t chunk;
+        void * data = NULL;
+        if(mapp_chunk_signature(video->file[i], &chunk) && chunk.file_size)
+        {
+#if defined(__WIN32)
+            HANDLE mapping = CreateFileMapping((HANDLE)_get_osfhandle(_fileno(video->file[i])), NULL, PAGE_READONLY, 0, 0, NULL);
+            if(mapping)
+            {
+                data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                CloseHandle(mapping);
+            }
+#else
+            data = mmap(NULL, chunk.file_size, PROT_READ, MAP_SHARED, fileno(video->file[i]), 0);
+            if(data == MAP_FAILED) data = NULL;
+#endif
+        }
+        if(!data)
+        {
+            DEBUG( printf("Could not map chunk %d of %s, using file reads\n", i, video->path); )
+            unmapMlvChunks(video);
+            return 1;
+        }
+        chunk_map[i].data = data;
+        chunk_map[i].length = chunk.file_size;
+    }
+
+    return 0;
+}
+
+void unmapMlvChunks(mlvObject_t * video)
+{
+    if(!video->chunk_map) return;
+    for(int i = 0; i < video->filenum; i++)
+    {
+        if(!video->chunk_map[i].data) continue;
+#if defined(__WIN32)
+        UnmapViewOfFile(video->chunk_map[i].data);
+#else
+        munmap(video->chunk_map[i].data, video->chunk_map[i].length);
+#endif
+    }
+    free(video->chunk_map);
+    video->chunk_map = NULL;
+}
+
+const uint8_t * getMlvChunkData(mlvObject_t * video, int chunk, uint64_t offset, uint64_t size)
+{
+    if(!video->chunk_map || chunk >= video->filenum) return NULL;
+    if(offset + size + MLV_MAP_SLACK > video->chunk_map[chunk].length) return NULL;
+    return video->chunk_map[chunk].data + offset;
+}
+
+int readMlvChunkData(mlvObject_t * video, int chunk, uint64_t offset, uint64_t size, void * buffer)
+{
+    uint8_t * dst = buffer;
+#if defined(__WIN32)
+    HANDLE handle = (HANDLE)_get_osfhandle(_fileno(video->file[chunk]));
+    while(size)
+    {
+        OVERLAPPED overlapped = { 0 };
+        overlapped.Offset = (DWORD)offset;
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD read_size = 0;
+        if(!ReadFile(handle, dst, (DWORD)MIN(size, 0x40000000), &read_size, &overlapped) || !read_size) return 1;
+        dst += read_size;
+        offset += read_size;
+        size -= read_size;
+    }
+#else
+    int fd = fileno(video->file[chunk]);
+    while(size)
+    {
+        ssize_t read_size = pread(fd, dst, size, offset);
+        if(read_size < 0 && errno == EINTR) continue;
+        if(read_size <= 0) return 1;
+        dst += read_size;
+        offset += read_size;
+        size -= read_size;
+    }
+#endif
+    return 0;
+}
+
+void setMlvReadAhead(mlvObject_t * video, uint64_t frameIndex, int direction, int frames)
+{
+#if !defined(__WIN32)
+    if(!video->chunk_map) return;
+    direction = (direction < 0) ? -1 : 1;
+
+    /* Kernel read-around only ever looks forward, when playing backwards
+     * it would read the wrong side, so leave prefetching to WILLNEED below */
+    if(direction != video->map_direction)
+    {
+        for(int i = 0; i < video->filenum; i++)
+        {
+            madvise(video->chunk_map[i].data, video->chunk_map[i].length, (direction > 0) ? MADV_SEQUENTIAL : MADV_RANDOM);
+        }
+        video->map_direction = direction;
+    }
+
+    uint64_t page_mask = (uint64_t)sysconf(_SC_PAGESIZE) - 1;
+    for(int k = 1; k <= frames; k++)
+    {
+        int64_t index = (int64_t)frameIndex + k * direction;
+        if(index < 0 || index >= video->frames) break;
+
+        frame_index_t * frame = &video->video_index[index];
+        mlv_chunk_map_t * map = &video->chunk_map[frame->chunk_num];
+        uint64_t start = frame->block_offset & ~page_mask;
+        uint64_t end = MIN(frame->frame_offset + frame->frame_size, map->length);
+        if(start < end) madvise(map->data + start, end - start, MADV_WILLNEED);
+    }
+#else
+    (void)video; (void)frameIndex; (void)direction; (void)frames;
+#endif
+}
+
 static void frame_index_sort(frame_index_t *frame_index, uint32_t entries)
 {
     if (!entries) return;
@@ -194,7 +363,6 @@ int getMlvRawFrameUint16(mlvObject_t * video, uint64_t frameIndex, uint16_t * un
     int bitdepth = video->RAWI.raw_info.bits_per_pixel;
     int width = video->RAWI.xRes;
     int height = video->RAWI.yRes;
-    int pixels_count = width * height;
 
     int chunk = video->video_index[frameIndex].chunk_num;
     uint32_t frame_size = video->video_index[frameIndex].frame_size;
@@ -203,32 +371,40 @@ int getMlvRawFrameUint16(mlvObject_t * video, uint64_t frameIndex, uint16_t * un
 
     /* How many bytes is RAW frame */
     int raw_frame_size = (width * height * bitdepth) / 8;
-    /* Memory buffer for original RAW data */
-    uint8_t * raw_frame = (uint8_t *)malloc(raw_frame_size + 4); // additional 4 bytes for safety
-
-    FILE * file = video->file[chunk];
+    int lossless = video->MLVI.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92;
+    uint32_t read_size = lossless ? frame_size : raw_frame_size;
+    /* Memory buffer for original RAW data, only needed if the chunk is not mapped */
+    uint8_t * raw_frame = NULL;
 
-    file_set_pos(file, frame_header_offset, SEEK_SET);
-    if(fread(&video->VIDF, sizeof(mlv_vidf_hdr_t), 1, file) != 1)
+    const uint8_t * vidf = getMlvChunkData(video, chunk, frame_header_offset, sizeof(mlv_vidf_hdr_t));
+    if(vidf)
+    {
+        memcpy(&video->VIDF, vidf, sizeof(mlv_vidf_hdr_t));
+    }
+    else if(readMlvChunkData(video, chunk, frame_header_offset, sizeof(mlv_vidf_hdr_t), &video->VIDF))
     {
         DEBUG( printf("Frame header read error\n"); )
-        free(raw_frame);
         return 1;
     }
 
-    file_set_pos(file, frame_offset, SEEK_SET);
-    if (video->MLVI.videoClass & MLV_VIDEO_CLASS_FLAG_LJ92)
+    uint8_t * payload = (uint8_t *)getMlvChunkData(video, chunk, frame_offset, read_size);
+    if(!payload)
     {
-        if(fread(raw_frame, frame_size, 1, file) != 1)
+        raw_frame = (uint8_t *)malloc(raw_frame_size + 4); // additional 4 bytes for safety
+        if(readMlvChunkData(video, chunk, frame_offset, read_size, raw_frame))
         {
             DEBUG( printf("Frame data read error\n"); )
             free(raw_frame);
             return 1;
         }
+        payload = raw_frame;
+    }
 
+    if (lossless)
+    {
         int components = 1;
         lj92 decoder_object;
-        int ret = lj92_open(&decoder_object, raw_frame, frame_size, &width, &height, &bitdepth, &components);
+        int ret = lj92_open(&decoder_object, payload, frame_size, &width, &height, &bitdepth, &components);
         if(ret != LJ92_ERROR_NONE)
         {
             DEBUG( printf("LJ92 decoder: Failed with error code (%d)\n", ret); )
@@ -249,25 +425,7 @@ int getMlvRawFrameUint16(mlvObject_t * video, uint64_t frameIndex, uint16_t * un
     }
     else /* If not compressed just unpack to 16bit */
     {
-        if(fread(raw_frame, raw_frame_size, 1, file) != 1)
-        {
-            DEBUG( printf("Frame data read error\n"); )
-            free(raw_frame);
-            return 1;
-        }
-
-        uint32_t mask = (1 << bitdepth) - 1;
-        #pragma omp parallel for
-        for (int i = 0; i < pixels_count; ++i)
-        {
-            uint32_t bits_offset = i * bitdepth;
-            uint32_t bits_address = bits_offset / 16;
-            uint32_t bits_shift = bits_offset % 16;
-            uint32_t rotate_value = 16 + ((32 - bitdepth) - bits_shift);
-            uint32_t uncorrected_data = *((uint32_t *)&((uint16_t *)raw_frame)[bits_address]);
-            uint32_t data = ROR32(uncorrected_data, rotate_value);
-            unpackedFrame[i] = ((uint16_t)(data & mask));
-        }
+        dng_unpack_image_bits(unpackedFrame, (uint16_t *)payload, width, height, bitdepth);
     }
 
     free(raw_frame);
@@ -350,12 +508,22 @@ void freeMlvObject(mlvObject_t * video, int shared)
 {
     isMlvActive(video) = 0;
 
+    /* A shared object is a reader copy: files, mappings, indexes and audio
+     * belong to the original, only its low level processing state is its own */
+    if(video->chunk_map && !shared) unmapMlvChunks(video);
     /* Close all MLV file chunks */
-    if(video->file) close_all_chunks(video->file, video->filenum);
-    /* Free all memory */
-    if(video->video_index && !shared) free(video->video_index);
-    if(video->audio_index && !shared) free(video->audio_index);
-    if(video->vers_index && !shared) free(video->vers_index);
+    if(video->file && !shared) close_all_chunks(video->file, video->filenum);
+    /* Free all memory, indexes loaded from the sidecar live in its mapping */
+    if(video->mapp_data && !shared)
+    {
+        unmap_mapp(video->mapp_data, video->mapp_length);
+    }
+    else if(!shared)
+    {
+        if(video->video_index) free(video->video_index);
+        if(video->audio_index) free(video->audio_index);
+        if(video->vers_index) free(video->vers_index);
+    }
 
     /* Free audio buffer */
     if(video->audio_data && !shared)
@@ -364,8 +532,8 @@ void freeMlvObject(mlvObject_t * video, int shared)
         video->audio_data = NULL;
     }
 
-    if(video->path) free(video->path);
-    if (!shared) freeLLRawProcObject(video);
+    if(video->path && !shared) free(video->path);
+    freeLLRawProcObject(video);
 
     /* Main 1 */
     free(video);
@@ -943,6 +1111,180 @@ void initMlvFiles(const char* path, mlvObject_t * videodest)
     videodest->file = load_all_chunks(path, &videodest->filenum); 
 }
 
+/* Block index sidecar (.MAPP)
+ * Layout: mapp_header_t, one mapp_chunk_t per chunk, MLV headers,
+ * video index, audio index, VERS index (indexes 8 byte aligned) */
+#define MAPP_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+#define MAPP_HEADERS(X) X(MLVI) X(RAWI) X(RAWC) X(IDNT) X(EXPO) X(LENS) X(ELNS) X(RTCI) \
+                        X(WBAL) X(WAVI) X(DISO) X(INFO) X(STYL) X(VERS) X(DARK) X(VIDF) \
+                        X(AUDF) X(INFO_STRING)
+#define MAPP_HEADER_SIZE(h) + sizeof(((mlvObject_t *)0)->h)
+#define MAPP_HEADER_LOAD(h) memcpy(&video->h, ptr, sizeof(video->h)); ptr += sizeof(video->h);
+#define MAPP_HEADER_STORE(h) memcpy(ptr, &video->h, sizeof(video->h)); ptr += sizeof(video->h);
+
+static void mapp_file_name(mlvObject_t * video, char * mapp_path)
+{
+    sprintf(mapp_path, "%s.MAPP", video->path);
+}
+
+static uint64_t mapp_layout(mapp_header_t * mapp, uint64_t * headers_offset, uint64_t * video_offset, uint64_t * audio_offset, uint64_t * vers_offset)
+{
+    *headers_offset = MAPP_ALIGN(sizeof(mapp_header_t)) + (uint64_t)mapp->file_num * sizeof(mapp_chunk_t);
+    *video_offset = MAPP_ALIGN(*headers_offset + mapp->headers_size);
+    *audio_offset = *video_offset + (uint64_t)mapp->video_frames * sizeof(frame_index_t);
+    *vers_offset = *audio_offset + (uint64_t)mapp->audio_frames * sizeof(frame_index_t);
+    return *vers_offset + (uint64_t)mapp->vers_blocks * sizeof(frame_index_t);
+}
+
+/* Map the sidecar and point the frame indexes into it.
+ * Returns 1 if it is valid for the opened chunks, 0 if a full scan is needed */
+static int load_mapp(mlvObject_t * video)
+{
+    char * mapp_path = alloca(strlen(video->path) + 8);
+    mapp_file_name(video, mapp_path);
+
+    uint8_t * data = NULL;
+    uint64_t length = 0;
+#if defined(__WIN32)
+    /* No mmap, a single read of the sidecar is still far cheaper than the scan */
+    FILE * mapp_file = fopen(mapp_path, "rb");
+    if(!mapp_file) return 0;
+    file_set_pos(mapp_file, 0, SEEK_END);
+    length = file_get_pos(mapp_file);
+    file_set_pos(mapp_file, 0, SEEK_SET);
+    if(length >= sizeof(mapp_header_t)) data = malloc(length);
+    if(data && fread(data, length, 1, mapp_file) != 1)
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(mapp_file);
+#else
+    int fd = open(mapp_path, O_RDONLY);
+    if(fd < 0) return 0;
+    struct stat st;
+    if(!fstat(fd, &st) && st.st_size >= (off_t)sizeof(mapp_header_t))
+    {
+        length = st.st_size;
+        /* Private writable mapping, the indexes are plain frame_index_t pointers */
+        data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if(data == MAP_FAILED) data = NULL;
+    }
+    close(fd);
+#endif
+    if(!data) return 0;
+
+    mapp_header_t * mapp = (mapp_header_t *)data;
+    uint64_t headers_offset, video_offset, audio_offset, vers_offset;
+    int valid = memcmp(mapp->fileMagic, "MAPP", 4) == 0
+             && mapp->mapp_version == MAPP_VERSION
+             && mapp->mapp_size == length
+             && mapp->file_num == (uint32_t)video->filenum
+             && mapp->headers_size == 0 MAPP_HEADERS(MAPP_HEADER_SIZE)
+             && mapp->video_frames
+             && mapp_layout(mapp, &headers_offset, &video_offset, &audio_offset, &vers_offset) == length;
+
+    /* Any chunk resized or rewritten invalidates the index */
+    mapp_chunk_t * chunks = (mapp_chunk_t *)(data + MAPP_ALIGN(sizeof(mapp_header_t)));
+    for(int i = 0; valid && i < video->filenum; i++)
+    {
+        mapp_chunk_t chunk;
+        valid = mapp_chunk_signature(video->file[i], &chunk)
+             && chunk.file_size == chunks[i].file_size
+             && chunk.file_mtime == chunks[i].file_mtime;
+    }
+
+    if(!valid)
+    {
+        DEBUG( printf("Block index %s is stale or invalid, rescanning\n", mapp_path); )
+        unmap_mapp(data, length);
+        return 0;
+    }
+
+    uint8_t * ptr = data + headers_offset;
+    MAPP_HEADERS(MAPP_HEADER_LOAD)
+
+    video->video_index = (frame_index_t *)(data + video_offset);
+    video->audio_index = mapp->audio_frames ? (frame_index_t *)(data + audio_offset) : NULL;
+    video->vers_index = mapp->vers_blocks ? (frame_index_t *)(data + vers_offset) : NULL;
+    video->frames = mapp->video_frames;
+    video->audios = mapp->audio_frames;
+    video->vers_blocks = mapp->vers_blocks;
+    video->block_num = mapp->block_num;
+    video->dark_frame_offset = mapp->df_offset;
+
+    video->mapp_data = data;
+    video->mapp_length = length;
+
+    DEBUG( printf("Block index loaded from %s\n", mapp_path); )
+    return 1;
+}
+
+/* Write the sidecar after a full scan. Failures are not errors,
+ * the clip may live on a read only volume */
+static void save_mapp(mlvObject_t * video)
+{
+    mapp_header_t mapp = { 0 };
+    memcpy(mapp.fileMagic, "MAPP", 4);
+    mapp.mapp_version = MAPP_VERSION;
+    mapp.block_num = video->block_num;
+    mapp.video_frames = video->frames;
+    mapp.audio_frames = video->audios;
+    mapp.vers_blocks = video->vers_blocks;
+    mapp.audio_size = video->audio_size;
+    mapp.df_offset = video->dark_frame_offset;
+    mapp.file_num = video->filenum;
+    mapp.headers_size = 0 MAPP_HEADERS(MAPP_HEADER_SIZE);
+
+    uint64_t headers_offset, video_offset, audio_offset, vers_offset;
+    mapp.mapp_size = mapp_layout(&mapp, &headers_offset, &video_offset, &audio_offset, &vers_offset);
+
+    uint8_t * data = calloc(mapp.mapp_size, 1);
+    if(!data) return;
+
+    memcpy(data, &mapp, sizeof(mapp_header_t));
+    mapp_chunk_t * chunks = (mapp_chunk_t *)(data + MAPP_ALIGN(sizeof(mapp_header_t)));
+    for(int i = 0; i < video->filenum; i++)
+    {
+        if(!mapp_chunk_signature(video->file[i], &chunks[i]))
+        {
+            free(data);
+            return;
+        }
+    }
+
+    uint8_t * ptr = data + headers_offset;
+    MAPP_HEADERS(MAPP_HEADER_STORE)
+
+    memcpy(data + video_offset, video->video_index, (uint64_t)video->frames * sizeof(frame_index_t));
+    if(video->audios) memcpy(data + audio_offset, video->audio_index, (uint64_t)video->audios * sizeof(frame_index_t));
+    if(video->vers_blocks) memcpy(data + vers_offset, video->vers_index, (uint64_t)video->vers_blocks * sizeof(frame_index_t));
+
+    /* Write to a temporary file first so a concurrent open never maps a partial index */
+    char * mapp_path = alloca(strlen(video->path) + 8);
+    char * temp_path = alloca(strlen(video->path) + 12);
+    mapp_file_name(video, mapp_path);
+    sprintf(temp_path, "%s.tmp", mapp_path);
+
+    FILE * mapp_file = fopen(temp_path, "wb");
+    if(mapp_file)
+    {
+        int write_ok = fwrite(data, mapp.mapp_size, 1, mapp_file) == 1;
+        write_ok &= fclose(mapp_file) == 0;
+#if defined(__WIN32)
+        if(write_ok) remove(mapp_path);
+#endif
+        if(!write_ok || rename(temp_path, mapp_path))
+        {
+            DEBUG( printf("Could not write block index %s\n", mapp_path); )
+            remove(temp_path);
+        }
+    }
+
+    free(data);
+}
+
 /* Reads an MLV file in to a mlv object(mlvObject_t struct) 
  * only puts metadata in to the mlvObject_t, 
  * no debayering or bit unpacking */
@@ -975,6 +1317,9 @@ int openMlvClip(mlvObject_t * video, const char * mlvPath, char * error_message)
     int styl_read = 0; /* Flips to 1 if 1st STYL block was read */
     int fread_err = 1;
 
+    /* Reuse the block index of a previous open if the chunks did not change */
+    if(load_mapp(video)) goto short_cut;
+
     for(int i = 0; i < video->filenum; i++)
     {
         /* Getting size of file in bytes */
@@ -1303,6 +1648,9 @@ int openMlvClip(mlvObject_t * video, const char * mlvPath, char * error_message)
     /* Set VERS block count in video object */
     video->vers_blocks = vers_blocks;
 
+    /* Persist the index so the next open can skip the scan */
+    save_mapp(video);
+
     /* Reads MLV audio into buffer (video->audio_data) and sync it,
      * set full audio buffer size (video->audio_buffer_size) and
      * aligned usable audio data size (video->audio_size) */
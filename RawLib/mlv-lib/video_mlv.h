@@ -29,7 +29,23 @@ enum export_mode { MLV_FAST_PASS, MLV_COMPRESS, MLV_DECOMPRESS, MLV_AVERAGED_FRA
 /* from darkframe.c */
 extern int df_init(mlvObject_t * video);
 
-/* Frees all memory and closes file */
+/* Map all chunks read only, frame reads then come straight from the mapping
+ * instead of fseek + fread. Optional, returns 0 on success. On failure the
+ * clip keeps using its FILE*s */
+int mapMlvChunks(mlvObject_t * video);
+void unmapMlvChunks(mlvObject_t * video);
+/* Pointer to size bytes at offset of a mapped chunk, NULL if the chunk is not
+ * mapped (caller reads from video->file[chunk] instead) */
+const uint8_t * getMlvChunkData(mlvObject_t * video, int chunk, uint64_t offset, uint64_t size);
+/* Positional read of size bytes at offset of a chunk into buffer, does not
+ * move the FILE* position so readers can share the chunks. Returns 0 on success */
+int readMlvChunkData(mlvObject_t * video, int chunk, uint64_t offset, uint64_t size, void * buffer);
+/* Advise the kernel about upcoming reads: direction is 1 forward, -1 backward,
+ * the next frames in that direction are prefetched. No-op if not mapped */
+void setMlvReadAhead(mlvObject_t * video, uint64_t frameIndex, int direction, int frames);
+
+/* Frees all memory and closes file
+ * shared: object is a copy reading the files of another one, which is freed last */
 void freeMlvObject(mlvObject_t * video, int shared);
 
 /* Unpacks the bits of a frame to get a bayer B&W image (without black level correction)
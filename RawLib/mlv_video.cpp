@@ -3,7 +3,9 @@ extern "C"{
 	#include "video_mlv.h"
 	#include "dng/dng.h"
 	#include "llrawproc/llrawproc.h"
+	#include "llrawproc/sharedcache.h"
 	#include "audio_mlv.h"
+	#include "parallel.h"
 	#include <camid/camera_id.h>
 }
 #include <string.h>
@@ -12,6 +14,7 @@ extern "C"{
 #include <iostream>
 #include "lens_id.h"
 #include "dng_convert.h"
+#include "darkframe.h"
 
 struct mlv_imp
 {
@@ -28,6 +31,34 @@ std::string get_map_name(mlvObject_t* mvl_object)
 }
 
 
+uint64_t Mlv_video::RawInfo::settings_hash() const
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	auto add = [&hash](const void* data, size_t size){
+		const uint8_t* bytes = (const uint8_t*)data;
+		for (size_t i = 0; i < size; ++i){
+			hash = (hash ^ bytes[i]) * 1099511628211ULL;
+		}
+	};
+	int32_t values[] = {dualiso_fullres_blending, dualiso_aliasmap, dual_iso_mode, dualisointerpolation, dualiso_calibration,
+						fix_focuspixels, chroma_smooth, darkframe_enable, device_stages};
+	add(values, sizeof(values));
+	if (darkframe_enable && !darkframe_file.empty()){
+		// File signature, a regenerated dark frame never matches older frames
+		char key[1024];
+		sc_file_key("df", darkframe_file.c_str(), key, sizeof(key));
+		add(key, strlen(key));
+	}
+	return hash;
+}
+
+void Mlv_video::set_thread_suite(const ThreadSuite& suite)
+{
+	parallel_host_suite host = {suite.multiThread, suite.multiThreadNumCPUs, suite.multiThreadIsSpawnedThread};
+	parallel_set_host_suite(&host);
+}
+
 Mlv_video::Mlv_video(std::string filename)
 {
 	_shared = false;
@@ -49,12 +80,17 @@ Mlv_video::Mlv_video(std::string filename)
 
 	_valid = true;
 
+	// Frames are read from the mapping when it succeeds, copies share it
+	mapMlvChunks(_imp->mlv_object);
+
 	int par[4] = {1,1,1,1};
 	_imp->dng_object = initDngObject(_imp->mlv_object, UNCOMPRESSED_RAW, getMlvFramerateOrig(_imp->mlv_object), par, -1, -1);
 }
 
 Mlv_video::Mlv_video(const Mlv_video& mlv)
 {
+	// A copy is a reader of the same clip: files, mappings and indexes are
+	// shared (reads are positional), decode buffers and llrawproc state are its own
 	_shared = true;
 	_imp = new mlv_imp;
 	_imp->mlvfilename = mlv._imp->mlvfilename;
@@ -62,7 +98,7 @@ Mlv_video::Mlv_video(const Mlv_video& mlv)
 	_imp->mlv_object = (mlvObject_t*)malloc(sizeof(mlvObject_t));
 
 	memcpy(_imp->mlv_object, mlv._imp->mlv_object, sizeof(mlvObject_t));
-	initMlvFiles(_imp->mlvfilename.c_str(), _imp->mlv_object);
+	_imp->mlv_object->llrawproc = copyLLRawProcObject(mlv._imp->mlv_object->llrawproc);
 
 	_imp->dng_object = NULL;
 	_valid = true;
@@ -148,146 +184,23 @@ void Mlv_video::get_baseline_exposure(int32_t& min, int32_t& max)
 
 bool Mlv_video::generate_darkframe(const char* path, int frame_in, int frame_out)
 {
-	char error_message[256] = { 0 };
-	FILE* mlv_file = fopen(path, "wb");
-	mlvObject_t* video = _imp->mlv_object;
-
-	printf("Averaging frames %d to %d from MLV file: %s\n", frame_in, frame_out, video->path);
-
- 	uint64_t* avg_buf = (uint64_t *)calloc( video->RAWI.xRes * video->RAWI.yRes * sizeof( uint64_t ), 1 );
-
-    mlv_vidf_hdr_t vidf_hdr = { 0 };
-
-    uint32_t pixel_count = video->RAWI.xRes * video->RAWI.yRes;
-    uint32_t frame_size_packed = (uint32_t)(pixel_count * video->RAWI.raw_info.bits_per_pixel / 8);
-    uint32_t frame_size_unpacked = pixel_count * 2;
-    uint32_t max_frame_number = frame_out - frame_in + 1;
-
-	uint16_t * frame_buf_unpacked = (uint16_t*)calloc(frame_size_unpacked, 1);
-	if(!frame_buf_unpacked)
-	{
-		sprintf(error_message, "Averaging: could not allocate memory for unpacked frame");
-		printf("\n%s\n", error_message);
-		free(avg_buf);
+	DarkFrameBuilder builder(this);
+	if (!builder.start(path, frame_in, frame_out, DarkFrameBuilder::Options())){
 		return false;
 	}
+	builder.wait();
+	return builder.succeeded();
+}
 
-	/* for safety allocate max possible size buffer for VIDF block, calculated for 16bits per pixel */
-	uint8_t * block_buf = (uint8_t*)calloc(sizeof(mlv_vidf_hdr_t) + frame_size_unpacked, 1);
-	if(!block_buf)
-	{
-		sprintf(error_message, "Could not allocate memory for VIDF block");
-		printf("\n%s\n", error_message);
-		free(frame_buf_unpacked);
-		free(avg_buf);
-		return false;
-	}
-	/* for safety allocate max possible size buffer for image data, calculated for 16bits per pixel */
-	uint8_t * frame_buf = (uint8_t*)calloc(frame_size_unpacked, 1);
-	if(!frame_buf)
-	{
-		sprintf(error_message, "Could not allocate memory for VIDF frame");
-		printf("\n%s\n", error_message);
-		free(block_buf);
-		return false;
-	}
-
-	saveMlvHeaders(video, mlv_file, 0, MLV_AVERAGED_FRAME, frame_in, frame_out, "1.0", error_message);
-
-	for (int i = frame_in; i < frame_out; ++i){
-    	int chunk = video->video_index[i].chunk_num;
-		uint32_t frame_size = video->video_index[i].frame_size;
-		uint64_t frame_offset = video->video_index[i].frame_offset;
-		uint64_t block_offset = video->video_index[i].block_offset;
-		/* read VIDF block header */
-		fseek(video->file[chunk], block_offset, SEEK_SET);
-		if(fread(&vidf_hdr, sizeof(mlv_vidf_hdr_t), 1, video->file[chunk]) != 1)
-		{
-			sprintf(error_message, "Could not read VIDF block header from:  %s", video->path);
-			printf("\n%s\n", error_message);
-			free(frame_buf);
-			free(block_buf);
-			free(frame_buf_unpacked);
-			free(avg_buf);
-			return false;
-		}
-
-		vidf_hdr.blockSize -= vidf_hdr.frameSpace;
-		vidf_hdr.frameSpace = 0;
-
-
-		/* read frame buffer */
-		fseek(video->file[chunk], frame_offset, SEEK_SET);
-		if(fread(frame_buf, frame_size, 1, video->file[chunk]) != 1)
-		{
-			sprintf(error_message, "Could not read VIDF image data from:  %s", video->path);
-			printf("\n%s\n", error_message);
-			free(frame_buf);
-			free(block_buf);
-			free(frame_buf_unpacked);
-			free(avg_buf);
-			return false;
-		}
-
-		{
-			if(isMlvCompressed(video))
-			{
-				int ret = dng_decompress_image(frame_buf_unpacked, (uint16_t*)frame_buf, frame_size, video->RAWI.xRes, video->RAWI.yRes, video->RAWI.raw_info.bits_per_pixel);
-				if(ret != 0)
-				{
-					sprintf(error_message, "Averaging: could not decompress frame:  LJ92_ERROR %u", ret);
-					printf("\n%s\n", error_message);
-					free(frame_buf_unpacked);
-					free(frame_buf);
-					free(block_buf);
-					free(avg_buf);
-					return false;
-				}
-			}
-			else
-			{
-				dng_unpack_image_bits(frame_buf_unpacked, (uint16_t*)frame_buf, video->RAWI.xRes, video->RAWI.yRes, video->RAWI.raw_info.bits_per_pixel);
-			}
-			for(uint32_t i = 0; i < pixel_count; i++)
-			{
-				avg_buf[i] += frame_buf_unpacked[i];
-			}
-
-		}
-	}
-
-	for(uint32_t i = 0; i < pixel_count; i++)
-	{
-		frame_buf_unpacked[i] = avg_buf[i] / max_frame_number;
-	}
-	dng_pack_image_bits((uint16_t *)frame_buf, frame_buf_unpacked, video->RAWI.xRes, video->RAWI.yRes, video->RAWI.raw_info.bits_per_pixel, 0);
-
-	vidf_hdr.frameNumber = max_frame_number;
-	vidf_hdr.blockSize = sizeof(mlv_vidf_hdr_t) + frame_size_packed;
-	memcpy(block_buf, &vidf_hdr, sizeof(mlv_vidf_hdr_t));
-	memcpy((block_buf + sizeof(mlv_vidf_hdr_t)), frame_buf, frame_size_packed);
-
-	if(fwrite(block_buf, vidf_hdr.blockSize, 1, mlv_file) != 1)
-	{
-		sprintf(error_message, "Could not write darkvideo frame");
-	}
-	fclose(mlv_file);
-
-	free(frame_buf_unpacked);
-	free(avg_buf);
-	free(frame_buf);
-	free(block_buf);
-	return true;
+void Mlv_video::read_ahead(uint32_t frame, int direction, int frames)
+{
+	setMlvReadAhead(_imp->mlv_object, frame, direction, frames);
 }
 
 void Mlv_video::destroy_darkframe_data()
 {
-	mlvObject_t* mlv = _imp->mlv_object;
-	if (mlv->llrawproc->dark_frame_data != NULL)
-	{
-		free(mlv->llrawproc->dark_frame_data);
-		mlv->llrawproc->dark_frame_data = NULL;
-	}
+	// Shared dark frames are only freed by their last user
+	llrpFreeDarkFrame(_imp->mlv_object);
 }
 
 void Mlv_video::write_audio(std::string path)
@@ -356,12 +269,14 @@ void Mlv_video::low_level_process(RawInfo& ri)
 	
 	llrpSetFixRawMode(&mlvob, 1);
 	llrpSetChromaSmoothMode(&mlvob, cs);
+	llrpSetDeviceStages(&mlvob, ri.device_stages);
 	llrpResetDngBWLevels(&mlvob);
 
 	llrpSetDualIsoMode(&mlvob, ri.dual_iso_mode);
 	llrpSetDualIsoAliasMapMode(&mlvob, (int)ri.dualiso_aliasmap);
 	llrpSetDualIsoFullResBlendingMode(&mlvob, (int)ri.dualiso_fullres_blending);
 	llrpSetDualIsoInterpolationMethod(&mlvob, ri.dualisointerpolation);
+	llrpSetDualIsoCalibrationMode(&mlvob, ri.dualiso_calibration);
 
 	char error_msg[128];
 	if (ri.darkframe_enable){
@@ -377,10 +292,7 @@ void Mlv_video::low_level_process(RawInfo& ri)
 				ri.darkframe_error = error_msg;
 			} else {
 				llrpSetDarkFrameMode(&mlvob, 0);
-				if (mlvob.llrawproc->dark_frame_data != NULL){
-					free(mlvob.llrawproc->dark_frame_data);
-					mlvob.llrawproc->dark_frame_data = NULL;
-				}
+				llrpFreeDarkFrame(&mlvob);
 				if(mlvob.llrawproc->dark_frame_filename) free(mlvob.llrawproc->dark_frame_filename);
     			mlvob.llrawproc->dark_frame_filename = NULL;
 				ri.darkframe_ok = false;
@@ -389,10 +301,7 @@ void Mlv_video::low_level_process(RawInfo& ri)
 		}
 	} else {
 		llrpSetDarkFrameMode(&mlvob, 0);
-		if (mlvob.llrawproc->dark_frame_data != NULL){
-			free(mlvob.llrawproc->dark_frame_data);
-			mlvob.llrawproc->dark_frame_data = NULL;
-		}
+		llrpFreeDarkFrame(&mlvob);
 		ri.darkframe_error.clear();        
 	}
 
@@ -406,6 +315,39 @@ void Mlv_video::low_level_process(RawInfo& ri)
 	}
 }
 
+Mlv_video::DeviceFrame Mlv_video::device_frame()
+{
+	llrp_device_frame frame = llrpGetDeviceFrame(_imp->mlv_object);
+	DeviceFrame result;
+	result.stages = frame.stages;
+	result.shift_in = frame.shift_in;
+	result.shift_out = frame.shift_out;
+	result.crop_x = frame.crop_x;
+	result.crop_y = frame.crop_y;
+	return result;
+}
+
+bool Mlv_video::device_data(DeviceData& data)
+{
+	llrp_device_data llrp_data;
+	if (llrpGetDeviceData(_imp->mlv_object, &llrp_data) != 0){
+		return false;
+	}
+	data.width = llrp_data.width;
+	data.height = llrp_data.height;
+	data.black = llrp_data.black;
+	data.white = llrp_data.white;
+	data.raw2ev = llrp_data.raw2ev;
+	data.ev2raw = llrp_data.ev2raw;
+	data.chroma_smooth = llrp_data.chroma_smooth;
+	data.dark_frame = llrp_data.dark_frame;
+	data.dark_frame_black = llrp_data.dark_frame_black;
+	data.dark_frame_white = llrp_data.dark_frame_white;
+	data.focus_pixels = llrp_data.focus_pixels;
+	data.focus_pixel_count = llrp_data.focus_pixel_count;
+	return true;
+}
+
 uint16_t* Mlv_video::get_dng_buffer(uint32_t frame, int& dng_size, bool no_buffer)
 {
 	mlvObject_t mlvob = *_imp->mlv_object;
@@ -428,6 +370,22 @@ uint16_t* Mlv_video::get_dng_buffer(uint32_t frame, int& dng_size, bool no_buffe
 	return (uint16_t*)buffer;
 }
 
+uint16_t* Mlv_video::get_raw_buffer(uint32_t frame)
+{
+	mlvObject_t mlvob = *_imp->mlv_object;
+
+	if (frame >= mlvob.frames){
+		frame = mlvob.frames - 1;
+	}
+
+	// Unpacked + low level processed bayer data, no DNG round trip
+	if (getDngUnpackedFrame(&mlvob, _imp->dng_object, frame) != 0){
+		return nullptr;
+	}
+
+	return _imp->dng_object->image_buf_unpacked;
+}
+
 void Mlv_video::set_dng_raw_levels(int black, int white)
 {
 	mlvObject_t mlvob = *_imp->mlv_object;
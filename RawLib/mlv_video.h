@@ -2,6 +2,7 @@
 
 #include <string>
 #include <cstdint>
+#include <atomic>
 struct mlv_imp;
 
 
@@ -13,6 +14,7 @@ public:
 		bool dualiso_aliasmap = false;
 		int dual_iso_mode = false;
 		int dualisointerpolation = 0;
+		int dualiso_calibration = 0;
 		bool fix_focuspixels = true;
 		int32_t chroma_smooth = 0;
 		float crop_factor = 1.0f;
@@ -23,11 +25,58 @@ public:
 		std::string darkframe_error;
 		int color_aberration_correction = 0;
 		int color_aberration_radius = 0;
+		// DEVICE_* stages the caller runs with OpenCL when the llrawproc stage order allows it
+		int device_stages = 0;
+
+		// Hash of the settings changing the low level processed raw data
+		uint64_t settings_hash() const;
+	};
+	// Low level stages an OpenCL pipeline can run after the host processing
+	enum {
+		DEVICE_DARK_FRAME = 1,
+		DEVICE_FOCUS_PIXELS = 2,
+		DEVICE_CHROMA_SMOOTH = 4
 	};
+
+	// Stages the host processing of a frame left to the device
+	struct DeviceFrame {
+		int stages = 0;
+		int shift_in = 0;	// shift to 14bit after the dark frame subtraction
+		int shift_out = 0;	// the result is 14bit, levels have to be shifted by this
+		int crop_x = 0;		// focus pixel map offset
+		int crop_y = 0;
+	};
+
+	// Clip data of the device stages, valid while the video is locked and its settings unchanged
+	struct DeviceData {
+		int width = 0;
+		int height = 0;
+		int black = 0;		// 14bit levels
+		int white = 0;
+		const int* raw2ev = nullptr;	// 65536 entries
+		const int* ev2raw = nullptr;	// 24 * 65536 entries, from -10 to 14 EV
+		int chroma_smooth = 0;
+		const uint16_t* dark_frame = nullptr;
+		int dark_frame_black = 0;
+		int dark_frame_white = 0;
+		const int* focus_pixels = nullptr;	// x, y pairs
+		size_t focus_pixel_count = 0;
+	};
+
+	// Threads of the host (OfxMultiThreadSuiteV1) running the mlv-lib loops,
+	// without them the loops use a thread pool of their own
+	struct ThreadSuite {
+		int (*multiThread)(void (*func)(unsigned int threadIndex, unsigned int threadMax, void* arg), unsigned int nThreads, void* arg);
+		int (*multiThreadNumCPUs)(unsigned int* nCPUs);
+		int (*multiThreadIsSpawnedThread)();
+	};
+	// Once per process, before the first frame is processed
+	static void set_thread_suite(const ThreadSuite& suite);
+
 	mlv_imp* _imp = NULL;
 private:
 	bool _valid = false;
-	bool _locked = false;
+	std::atomic<bool> _locked{false};
 	bool _shared = false;
 
 public:
@@ -45,10 +94,16 @@ public:
 	void* get_mlv_object();
 
 	void low_level_process(RawInfo& ri);
+	// Of the last frame returned by get_raw_buffer
+	DeviceFrame device_frame();
+	bool device_data(DeviceData& data);
 	uint16_t* get_dng_buffer(uint32_t frame, int& dng_size, bool no_buffer);
+	uint16_t* get_raw_buffer(uint32_t frame);
 	uint32_t get_dng_header_size();
 	uint16_t* get_raw_image();
 	uint16_t* postprocecessed_raw_buffer();
+	// Prefetch the next frames in the playback direction (1 or -1)
+	void read_ahead(uint32_t frame, int direction, int frames);
 
 	void destroy_darkframe_data();
 
@@ -97,6 +152,7 @@ public:
 	void sensor_resolulion(int& x, int& y);
 	void get_baseline_exposure(int32_t& min, int32_t& max);
 
+	// Mean of frames in to out (inclusive), see DarkFrameBuilder for the other modes
 	bool generate_darkframe(const char* path, int in, int out);
 	void write_audio(std::string path);
 };
@@ -16,6 +16,8 @@
     along with darktable.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+// Adapted to work with MLV openfx reader
+
 #define NORM_MIN 1.52587890625e-05f // norm can't be < to 2^(-16)
 
 
@@ -382,4 +384,57 @@ clip_and_zoom_demosaic_third_size_xtrans(read_only image2d_t in, write_only imag
   col[2] /= (num * 2);
 
   write_imagef(out, (int2)(x, y), (float4)(col[0], col[1], col[2], 0.0f));
-}
\ No newline at end of file
+}
+
+/**
+ * normalized and white balanced sensor data for the vng kernels.
+ * in (uint) -> out (float)
+ */
+kernel void
+vng_prepare_raw(read_only image2d_t in, write_only image2d_t out, const int width, const int height,
+                const unsigned int filters, const unsigned int black_level, const unsigned int white_level,
+                const float rmult, const float bmult, const float clip_value)
+{
+  const int x = get_global_id(0);
+  const int y = get_global_id(1);
+
+  if(x >= width || y >= height) return;
+
+  const float scale = white_level - black_level;
+  unsigned int val = read_imageui(in, sampleri, (int2)(x, y)).x;
+  float o = fmax(0.0f, (float)val - (float)black_level) / scale;
+
+  const int f = FC(y, x, filters);
+  if     (f == 0) o *= rmult;
+  else if(f == 2) o *= bmult;
+
+  write_imagef(out, (int2)(x, y), (float4)(fmin(o, clip_value), 0.0f, 0.0f, 0.0f));
+}
+
+/**
+ * mix the two greens, then camera matrix and headroom like ppg_demosaic_redblue.
+ * in (float4) -> out (float4), vertically flipped
+ */
+kernel void
+vng_color_output(read_only image2d_t in, write_only image2d_t out, const int width, const int height,
+                 constant float *cameraMatrix, const float headroom)
+{
+  const int x = get_global_id(0);
+  const int y = get_global_id(1);
+
+  if(x >= width || y >= height) return;
+
+  float4 color = read_imagef(in, sampleri, (int2)(x, y));
+  color.y = (color.y + color.w) * 0.5f;
+
+  float4 tmp;
+  tmp.x = cameraMatrix[0]*color.x + cameraMatrix[1]*color.y + cameraMatrix[2]*color.z;
+  tmp.y = cameraMatrix[3]*color.x + cameraMatrix[4]*color.y + cameraMatrix[5]*color.z;
+  tmp.z = cameraMatrix[6]*color.x + cameraMatrix[7]*color.y + cameraMatrix[8]*color.z;
+
+  color = tmp * headroom;
+
+  color.w = 1.f;
+
+  write_imagef (out, (int2)(x,  height - 1 - y), fmax(color, 0.0f));
+}
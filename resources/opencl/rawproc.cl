@@ -0,0 +1,292 @@
+// Low level raw processing stages llrawproc leaves to the device
+// (dark frame, focus pixels, chroma smoothing) and the color aberration
+// correction of the demosaiced image. Ports of the host code in
+// RawLib/mlv-lib/llrawproc and RawLib/color_aberration
+
+#define EV_RESOLUTION 65536
+
+constant sampler_t sampleri =  CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+// Raw value at a linear index, like the host code addressing the frame as an array
+static inline int
+raw_at (read_only image2d_t in, int i, int width)
+{
+    return read_imageui(in, sampleri, (int2)(i % width, i / width)).x;
+}
+
+static inline int
+ev_to_raw (global const int *ev2raw, int ev)
+{
+    return ev2raw[clamp(ev, 0, 14*EV_RESOLUTION-1) + 10*EV_RESOLUTION];
+}
+
+static inline int
+median_int (int *values, int count)
+{
+    for (int i = 1; i < count; i++){
+        int v = values[i];
+        int j = i - 1;
+        for (; j >= 0 && values[j] > v; j--){
+            values[j + 1] = values[j];
+        }
+        values[j + 1] = v;
+    }
+    return values[count / 2];
+}
+
+kernel void
+raw_darkframe (read_only image2d_t in, read_only image2d_t dark, write_only image2d_t out, int width, int height,
+               int dark_black, int dark_white, int shift)
+{
+    const int2 xy = (int2)(get_global_id(0), get_global_id(1));
+    if (xy.x >= width || xy.y >= height){
+        return;
+    }
+
+    int raw = read_imageui(in, sampleri, xy).x;
+    int dark_val = read_imageui(dark, sampleri, xy).x;
+    uint val = clamp(raw - dark_val + dark_black, 0, dark_white) << shift;
+    write_imageui(out, xy, (uint4)(val, 0, 0, 0));
+}
+
+// One work item per pixel of the map, out holds a copy of in.
+// Same as fix_focus_pixels with the mlvfs interpolation
+kernel void
+raw_focus_pixels (read_only image2d_t in, write_only image2d_t out, global const int2 *pixels, int count,
+                  int crop_x, int crop_y, int w, int h, global const int *raw2ev, global const int *ev2raw)
+{
+    const int m = get_global_id(0);
+    if (m >= count){
+        return;
+    }
+
+    int x = pixels[m].x - crop_x;
+    int y = pixels[m].y - crop_y;
+    int i = x + y*w;
+    int val;
+
+    if (x > 2 && x < w - 3 && y > 2 && y < h - 3){
+        int dv1 = abs(raw2ev[raw_at(in, i + w * 3, w)] - raw2ev[raw_at(in, i + w, w)]);
+        int dv2 = abs(raw2ev[raw_at(in, i - w, w)] - raw2ev[raw_at(in, i - w * 3, w)]);
+        int dh1 = abs(raw2ev[raw_at(in, i + 3, w)] - raw2ev[raw_at(in, i + 1, w)]);
+        int dh2 = abs(raw2ev[raw_at(in, i - 1, w)] - raw2ev[raw_at(in, i - 3, w)]);
+        int sum = dh1 + dh2 + dv1 + dv2;
+        if (sum == 0){
+            val = raw_at(in, i + 2, w);
+        } else {
+            int cv1 = ((sum - dv1) << 8) / (3 * sum);
+            int cv2 = ((sum - dv2) << 8) / (3 * sum);
+            int ch1 = ((sum - dh1) << 8) / (3 * sum);
+            int ch2 = ((sum - dh2) << 8) / (3 * sum);
+            int ev_corr = ((raw2ev[raw_at(in, i + w * 2, w)] * cv1) >> 8) +
+                          ((raw2ev[raw_at(in, i - w * 2, w)] * cv2) >> 8) +
+                          ((raw2ev[raw_at(in, i + 2, w)] * ch1) >> 8) +
+                          ((raw2ev[raw_at(in, i - 2, w)] * ch2) >> 8);
+            val = ev_to_raw(ev2raw, ev_corr);
+        }
+    } else if (i > 0 && i < w * h){
+        int horizontal_edge = (x >= w - 3 && x < w) || (x >= 0 && x <= 3);
+        int vertical_edge = (y >= h - 3 && y < h) || (y >= 0 && y <= 3);
+        int step;
+        if (horizontal_edge && !vertical_edge){
+            step = w;
+        } else if (vertical_edge && !horizontal_edge){
+            step = 1;
+        } else if (x >= 0 && x <= 3){
+            step = 0;
+            val = raw_at(in, i + 2, w);
+        } else if (x >= w - 3 && x < w){
+            step = 0;
+            val = raw_at(in, i - 2, w);
+        } else {
+            return;
+        }
+
+        if (step){
+            int d1 = abs(raw2ev[raw_at(in, i + step * 3, w)] - raw2ev[raw_at(in, i + step, w)]);
+            int d2 = abs(raw2ev[raw_at(in, i - step, w)] - raw2ev[raw_at(in, i - step * 3, w)]);
+            int sum = d1 + d2;
+            if (sum == 0){
+                val = raw_at(in, i + step * 2, w);
+            } else {
+                int c1 = ((sum - d1) << 8) / sum;
+                int c2 = ((sum - d2) << 8) / sum;
+                int ev_corr = ((raw2ev[raw_at(in, i + step * 2, w)] * c1) >> 8) + ((raw2ev[raw_at(in, i - step * 2, w)] * c2) >> 8);
+                val = ev_to_raw(ev2raw, ev_corr);
+            }
+        }
+    } else {
+        return;
+    }
+
+    write_imageui(out, (int2)(i % w, i / w), (uint4)(val, 0, 0, 0));
+}
+
+// One work item per RG/GB cell, out holds a copy of in.
+// Same as chroma_smooth.inline, method is 2, 3 or 5
+kernel void
+raw_chroma_smooth (read_only image2d_t in, write_only image2d_t out, int w, int h, int method,
+                   int black, int white, global const int *raw2ev, global const int *ev2raw)
+{
+    const int x = get_global_id(0) * 2;
+    const int y = get_global_id(1) * 2;
+    const int r = method == 5 ? 4 : 2;
+
+    if (x < 2 + r || x >= w - 2 - r || y < 2 + r || y >= h - 3 - r){
+        return;
+    }
+
+    int med_r[25];
+    int med_b[25];
+    int k = 0;
+
+#define RAW(xx, yy) ((int)read_imageui(in, sampleri, (int2)((xx), (yy))).x)
+
+    // first try to interpolate in horizontal direction
+    int eh = 0;
+    for (int i = -r; i <= r; i += 2){
+        for (int j = -r; j <= r; j += 2){
+            if (method == 2 && abs(i) + abs(j) == 4){
+                continue;
+            }
+            int g1 = raw2ev[RAW(x+i+1, y+j)];
+            int g2 = raw2ev[RAW(x+i, y+j+1)];
+            int g3 = raw2ev[RAW(x+i-1, y+j)];
+            int g5 = raw2ev[RAW(x+i+2, y+j+1)];
+            eh += abs(g1-g3) + abs(g2-g5);
+            med_r[k] = raw2ev[RAW(x+i, y+j)] - (g1+g3)/2;
+            med_b[k] = raw2ev[RAW(x+i+1, y+j+1)] - (g2+g5)/2;
+            k++;
+        }
+    }
+    int drh = median_int(med_r, k);
+    int dbh = median_int(med_b, k);
+
+    // next, try to interpolate in vertical direction
+    int ev = 0;
+    k = 0;
+    for (int i = -r; i <= r; i += 2){
+        for (int j = -r; j <= r; j += 2){
+            if (method == 2 && abs(i) + abs(j) == 4){
+                continue;
+            }
+            int g1 = raw2ev[RAW(x+i+1, y+j)];
+            int g2 = raw2ev[RAW(x+i, y+j+1)];
+            int g4 = raw2ev[RAW(x+i, y+j-1)];
+            int g6 = raw2ev[RAW(x+i+1, y+j+2)];
+            ev += abs(g2-g4) + abs(g1-g6);
+            med_r[k] = raw2ev[RAW(x+i, y+j)] - (g2+g4)/2;
+            med_b[k] = raw2ev[RAW(x+i+1, y+j+1)] - (g1+g6)/2;
+            k++;
+        }
+    }
+    int drv = median_int(med_r, k);
+    int dbv = median_int(med_b, k);
+
+    // back to the filtered pixels of the cell
+    int g1 = raw2ev[RAW(x+1, y)];
+    int g2 = raw2ev[RAW(x, y+1)];
+    int g3 = raw2ev[RAW(x-1, y)];
+    int g4 = raw2ev[RAW(x, y-1)];
+    int g5 = raw2ev[RAW(x+2, y+1)];
+    int g6 = raw2ev[RAW(x+1, y+2)];
+
+    int grv = (g2+g4)/2;
+    int grh = (g1+g3)/2;
+    int gbv = (g1+g6)/2;
+    int gbh = (g2+g5)/2;
+    int gr = ev < eh ? grv : grh;
+    int gb = ev < eh ? gbv : gbh;
+    int dr = ev < eh ? drv : drh;
+    int db = ev < eh ? dbv : dbh;
+
+    int r0 = RAW(x, y);
+    int b0 = RAW(x+1, y+1);
+
+#undef RAW
+
+    // close to the noise floor, use both directions
+    int thr = 64;
+    if (r0 < black+thr || b0 < black+thr || abs(drv - drh) < thr || abs(grv-grh) < thr || abs(gbv-gbh) < thr){
+        dr = (drv+drh)/2;
+        db = (dbv+dbh)/2;
+        gr = (g1+g2+g3+g4)/4;
+        gb = (g1+g2+g5+g6)/4;
+    }
+
+    // don't touch overexposed areas
+    if (r0 < white){
+        write_imageui(out, (int2)(x, y), (uint4)(ev2raw[clamp(gr + dr, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1) + 10*EV_RESOLUTION], 0, 0, 0));
+    }
+    if (b0 < white){
+        write_imageui(out, (int2)(x+1, y+1), (uint4)(ev2raw[clamp(gb + db, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1) + 10*EV_RESOLUTION], 0, 0, 0));
+    }
+}
+
+// Color aberration correction along one line of pixels per work item:
+// rows with (line_stride, step) = (width, 1), columns with (1, width).
+// Same as rmCA in ColorAberrationCorrection.c
+kernel void
+ca_correct_lines (global float4 *image, int lines, int length, int line_stride, int step, float threshold, int radius)
+{
+    const int line = get_global_id(0);
+    if (line >= lines){
+        return;
+    }
+
+    global float4 *p = image + line * line_stride;
+#define PIX(k) p[(k) * step]
+
+    for (int x = 2; x < length - 2; ++x){
+        // find the edge by finding green channel gradient bigger than threshold
+        float diff = PIX(x + 1).y - PIX(x - 1).y;
+        if (fabs(diff) < threshold){
+            continue;
+        }
+
+        float sign = diff > 0 ? 1.f : -1.f;
+
+        // search the boundary for correction range
+        int lpos = x - 1, rpos = x + 1;
+        for (; lpos > 1; --lpos){
+            float4 grad = (PIX(lpos + 1) - PIX(lpos - 1)) * sign;
+            if (x - lpos >= radius){
+                break;
+            }
+            if (fmax(fmax(grad.z, grad.y), grad.x) < threshold){
+                break;
+            }
+        }
+        lpos -= 1;
+        for (; rpos < length - 2; ++rpos){
+            float4 grad = (PIX(rpos + 1) - PIX(rpos - 1)) * sign;
+            if (rpos - x >= radius){
+                break;
+            }
+            if (fmax(fmax(grad.z, grad.y), grad.x) < threshold){
+                break;
+            }
+        }
+        rpos += 1;
+
+        // maximum and minimum color difference between R&G and B&G of range boundary
+        float4 left = PIX(lpos);
+        float4 right = PIX(rpos);
+        float bgmax = fmax(left.z - left.y, right.z - right.y);
+        float bgmin = fmin(left.z - left.y, right.z - right.y);
+        float rgmax = fmax(left.x - left.y, right.x - right.y);
+        float rgmin = fmin(left.x - left.y, right.x - right.y);
+
+        for (int k = lpos; k <= rpos; ++k){
+            float4 pix = PIX(k);
+            float bdiff = pix.z - pix.y;
+            float rdiff = pix.x - pix.y;
+            pix.z = bdiff > bgmax ? bgmax + pix.y : (bdiff < bgmin ? bgmin + pix.y : pix.z);
+            pix.x = rdiff > rgmax ? rgmax + pix.y : (rdiff < rgmin ? rgmin + pix.y : pix.x);
+            PIX(k) = pix;
+        }
+        x = rpos - 2;
+    }
+
+#undef PIX
+}
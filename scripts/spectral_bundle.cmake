@@ -0,0 +1,99 @@
+# Compiles the spectral datasets of resources/data into a C++ header,
+# the plugin looks them up in memory instead of parsing JSON at runtime.
+#
+# cmake -DDATA_DIR=<resources/data> -DOUTPUT=<spectral_bundle_data.h> -P spectral_bundle.cmake
+#
+# Same rules as Spst::loadSpst() and Idt::loadTrainingData() :
+# 380nm to 780nm, 5nm increment, 81 samples and 190 training patches.
+
+cmake_minimum_required(VERSION 3.19)
+
+set(SAMPLES 81)
+set(PATCHES 190)
+
+# Values as written by string(JSON), 17 significant digits round trip exactly
+function(json_row row out)
+  string(REGEX REPLACE "[][ \n]" "" row "${row}")
+  string(REPLACE "," ", " row "${row}")
+  set(${out} "${row}" PARENT_SCOPE)
+endfunction()
+
+file(GLOB CAMERA_FILES "${DATA_DIR}/camera/*.json")
+list(SORT CAMERA_FILES)
+
+set(CAMERAS "")
+foreach(FILE ${CAMERA_FILES})
+  file(READ ${FILE} JSON)
+  string(JSON MAKE GET "${JSON}" header manufacturer)
+  string(JSON MODEL GET "${JSON}" header model)
+  string(JSON MAIN GET "${JSON}" spectral_data data main)
+  string(JSON COUNT LENGTH "${MAIN}")
+  math(EXPR LAST "${COUNT} - 1")
+
+  set(ROWS "")
+  set(NUM_ROWS 0)
+  set(PREV_WL "")
+  set(INC "")
+  foreach(I RANGE ${LAST})
+    string(JSON WL MEMBER "${MAIN}" ${I})
+    if(NOT PREV_WL STREQUAL "")
+      math(EXPR STEP "${WL} - ${PREV_WL}")
+      if(INC STREQUAL "")
+        set(INC ${STEP})
+      elseif(NOT STEP EQUAL INC)
+        message(FATAL_ERROR "${FILE} : the increment should be uniform from 380nm to 780nm")
+      endif()
+    endif()
+    set(PREV_WL ${WL})
+
+    math(EXPR MOD "${WL} % 5")
+    if(WL LESS 380 OR NOT MOD EQUAL 0)
+      continue()
+    elseif(WL GREATER 780)
+      break()
+    endif()
+
+    string(JSON ROW GET "${MAIN}" ${WL})
+    json_row("${ROW}" ROW)
+    string(APPEND ROWS "            { ${ROW} },\n")
+    math(EXPR NUM_ROWS "${NUM_ROWS} + 1")
+  endforeach()
+
+  if(NOT NUM_ROWS EQUAL SAMPLES)
+    message(FATAL_ERROR "${FILE} : ${NUM_ROWS} samples, expected ${SAMPLES} from 380nm to 780nm")
+  endif()
+
+  string(APPEND CAMERAS "    {\n        \"${MAKE}\", \"${MODEL}\", ${INC},\n        {\n${ROWS}        }\n    },\n")
+endforeach()
+
+file(READ "${DATA_DIR}/training/training_spectral.json" JSON)
+string(JSON MAIN GET "${JSON}" spectral_data data main)
+string(JSON COUNT LENGTH "${MAIN}")
+if(NOT COUNT EQUAL SAMPLES)
+  message(FATAL_ERROR "training_spectral.json : ${COUNT} samples, expected ${SAMPLES}")
+endif()
+math(EXPR LAST "${COUNT} - 1")
+
+set(TRAINING "")
+foreach(I RANGE ${LAST})
+  string(JSON WL MEMBER "${MAIN}" ${I})
+  string(JSON ROW GET "${MAIN}" ${WL})
+  string(JSON NUM_PATCHES LENGTH "${ROW}")
+  if(NOT NUM_PATCHES EQUAL PATCHES)
+    message(FATAL_ERROR "training_spectral.json : ${NUM_PATCHES} patches at ${WL}nm, expected ${PATCHES}")
+  endif()
+  json_row("${ROW}" ROW)
+  string(APPEND TRAINING "    { ${WL}, { ${ROW} } },\n")
+endforeach()
+
+set(CONTENT "// Generated by scripts/spectral_bundle.cmake from resources/data, do not edit
+#pragma once
+
+static const SSIDT::SpectralBundle::Camera spectral_bundle_cameras[] = {
+${CAMERAS}};
+
+static const SSIDT::SpectralBundle::Training spectral_bundle_training[] = {
+${TRAINING}};
+")
+
+file(WRITE "${OUTPUT}" "${CONTENT}")